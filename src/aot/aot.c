@@ -0,0 +1,94 @@
+// dis_aot: compile Dis modules ahead of time.
+//
+//     dis_aot [-o image] module.dis...
+//
+// Each module is compiled as far as the JIT can compile it, and its compiled
+// image is written next to it, as `module.dis.aot`, where loading the module
+// finds it; `-o` names the image instead, for a single module. An image is
+// only used while the object file it was compiled from is unchanged, so
+// modules have to be compiled again when they are rebuilt.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../instructions.h"
+#include "../jit.h"
+
+/// Compile a module and write its image.
+///
+/// \return Whether the image was written.
+static bool compile_module(const char *path, const char *output)
+{
+    const char *error = NULL;
+    Module *module = module_read(path, &error);
+    if (module == NULL) {
+        fprintf(stderr, "dis_aot: %s: %s\n", path, error);
+        return false;
+    }
+    if (module_code(module) == NULL) {
+        fprintf(stderr, "dis_aot: %s: %s\n", path, module->code_error);
+        module_free(module);
+        return false;
+    }
+    if (module->native == NULL) {
+        fprintf(stderr, "dis_aot: %s: the module must not be compiled\n", path);
+        module_free(module);
+        return false;
+    }
+
+    jit_compile_all(module);
+    word compiled = 0;
+    for (word pc = 0; pc < module->ninstructions; pc++) {
+        compiled += module->code[pc].opcode == IN_XJIT;
+    }
+
+    char *image = NULL;
+    if (output == NULL) {
+        uptr length = strlen(path);
+        image = malloc(length + sizeof JIT_IMAGE_SUFFIX);
+        if (image == NULL) {
+            fprintf(stderr, "dis_aot: %s: out of memory\n", path);
+            module_free(module);
+            return false;
+        }
+        memcpy(image, path, length);
+        memcpy(image + length, JIT_IMAGE_SUFFIX, sizeof JIT_IMAGE_SUFFIX);
+        output = image;
+    }
+    bool saved = jit_save(module, output);
+    if (saved) {
+        printf("%s: %d of %d instructions compiled to %s\n", path, compiled,
+               module->ninstructions, output);
+    } else {
+        fprintf(stderr, "dis_aot: cannot write %s\n", output);
+    }
+    free(image);
+    module_free(module);
+    return saved;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = NULL;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+        first = 3;
+    }
+    if (first >= argc || (output != NULL && argc - first != 1)) {
+        fprintf(stderr, "usage: dis_aot [-o image] module.dis...\n");
+        return 2;
+    }
+
+    // Compile whatever the environment says, since that only decides how
+    // modules are run.
+    jit_set_mode(JIT_AUTO);
+    int status = 0;
+    for (int i = first; i < argc; i++) {
+        if (!compile_module(argv[i], output)) {
+            status = 1;
+        }
+    }
+    return status;
+}
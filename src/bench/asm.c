@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../module.h"
+#include "asm.h"
+
+static void put(Buffer *buffer, const void *p, uptr n)
+{
+    if (n == 0) {
+        return;
+    }
+    if (buffer->size + n > buffer->capacity) {
+        buffer->capacity = (buffer->size + n) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, p, n);
+    buffer->size += n;
+}
+
+static void put_byte(Buffer *buffer, byte b)
+{
+    put(buffer, &b, 1);
+}
+
+/// Append a variable-length operand, in the shortest encoding that holds it.
+static void put_operand(Buffer *buffer, word v)
+{
+    if (v >= -64 && v <= 63) {
+        put_byte(buffer, v & 0x7F);
+    } else if (v >= -8192 && v <= 8191) {
+        put_byte(buffer, 0x80 | ((v >> 8) & 0x3F));
+        put_byte(buffer, v & 0xFF);
+    } else {
+        put_byte(buffer, 0xC0 | ((v >> 24) & 0x3F));
+        put_byte(buffer, (v >> 16) & 0xFF);
+        put_byte(buffer, (v >> 8) & 0xFF);
+        put_byte(buffer, v & 0xFF);
+    }
+}
+
+static void put_word(Buffer *buffer, word v)
+{
+    put_byte(buffer, (v >> 24) & 0xFF);
+    put_byte(buffer, (v >> 16) & 0xFF);
+    put_byte(buffer, (v >> 8) & 0xFF);
+    put_byte(buffer, v & 0xFF);
+}
+
+static void put_arg(Buffer *buffer, Arg arg)
+{
+    if (arg.mode == AXXX) {
+        return;
+    }
+    put_operand(buffer, arg.offset);
+    if (arg.mode & AIND) {
+        put_operand(buffer, arg.indirect);
+    }
+}
+
+word asm_inst(Assembler *a, byte opcode, Arg s, Arg m, Arg d)
+{
+    byte mode = (byte) (s.mode << 3 | d.mode);
+    switch (m.mode) {
+        case AIMM:
+            mode |= AXIMM;
+            break;
+        case AFP:
+            mode |= AXINF;
+            break;
+        case AMP:
+            mode |= AXINM;
+            break;
+        default:
+            break;
+    }
+    put_byte(&a->code, opcode);
+    put_byte(&a->code, mode);
+    put_arg(&a->code, m);
+    put_arg(&a->code, s);
+    put_arg(&a->code, d);
+    return a->ninstructions++;
+}
+
+word asm_type(Assembler *a, word size, word np, const byte *map)
+{
+    put_operand(&a->types, a->ntypes);
+    put_operand(&a->types, size);
+    put_operand(&a->types, np);
+    put(&a->types, map, np);
+    return a->ntypes++;
+}
+
+void asm_words(Assembler *a, word offset, word count, const word *words)
+{
+    // DEFW items hold up to 15 words with the count in the item byte, and
+    // any number with the count as a following operand.
+    if (count < 16) {
+        put_byte(&a->data, (byte) (2 << 4 | count));
+    } else {
+        put_byte(&a->data, 2 << 4);
+        put_operand(&a->data, count);
+    }
+    put_operand(&a->data, offset);
+    for (word i = 0; i < count; i++) {
+        put_word(&a->data, words[i]);
+    }
+}
+
+void asm_string(Assembler *a, word offset, const char *utf8)
+{
+    word size = (word) strlen(utf8);
+    if (size < 16) {
+        put_byte(&a->data, (byte) (3 << 4 | size));
+    } else {
+        put_byte(&a->data, 3 << 4);
+        put_operand(&a->data, size);
+    }
+    put_operand(&a->data, offset);
+    put(&a->data, utf8, size);
+}
+
+// The count of DEFA, DIND and DAPOP items means nothing, but must not be 0,
+// which would make it a following operand.
+void asm_array(Assembler *a, word offset, word type, word len)
+{
+    put_byte(&a->data, 5 << 4 | 1);
+    put_operand(&a->data, offset);
+    put_word(&a->data, type);
+    put_word(&a->data, len);
+}
+
+void asm_index(Assembler *a, word offset, word index)
+{
+    put_byte(&a->data, 6 << 4 | 1);
+    put_operand(&a->data, offset);
+    put_word(&a->data, index);
+}
+
+void asm_pop(Assembler *a)
+{
+    put_byte(&a->data, 7 << 4 | 1);
+    put_operand(&a->data, 0);
+}
+
+void asm_export(Assembler *a, word pc, word type, word sig, const char *name)
+{
+    put_operand(&a->links, pc);
+    put_operand(&a->links, type);
+    put_word(&a->links, sig);
+    put(&a->links, name, strlen(name) + 1);
+    a->nlinks++;
+}
+
+byte *asm_finish(Assembler *a, const char *name, word data_size,
+                 word entry_pc, word entry_type, uptr *size)
+{
+    Buffer out = {0};
+    put_operand(&out, XMAGIC);
+    put_operand(&out, 0);
+    put_operand(&out, 0);
+    put_operand(&out, a->ninstructions);
+    put_operand(&out, data_size);
+    put_operand(&out, a->ntypes);
+    put_operand(&out, a->nlinks);
+    put_operand(&out, entry_pc);
+    put_operand(&out, entry_type);
+    put(&out, a->code.data, a->code.size);
+    put(&out, a->types.data, a->types.size);
+    put(&out, a->data.data, a->data.size);
+    put_byte(&out, 0);
+    put(&out, name, strlen(name) + 1);
+    put(&out, a->links.data, a->links.size);
+
+    free(a->code.data);
+    free(a->types.data);
+    free(a->data.data);
+    free(a->links.data);
+    *a = (Assembler) {0};
+    *size = out.size;
+    return out.data;
+}
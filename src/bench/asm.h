@@ -0,0 +1,122 @@
+#ifndef DIS_BENCH_ASM_H
+#define DIS_BENCH_ASM_H
+
+// A minimal assembler for building Dis object files in memory, so that the
+// benchmarks and tests can hand-assemble the programs they run.
+
+#include "../execution.h"
+
+/// A growable byte buffer.
+typedef struct Buffer {
+    byte *data;
+    uptr size;
+    uptr capacity;
+} Buffer;
+
+/// An operand of an assembled instruction.
+typedef struct Arg {
+    /// An addressing mode, as in `Operand::mode`.
+    byte mode;
+    word offset;
+    word indirect;
+} Arg;
+
+#define NONE ((Arg) {.mode = AXXX})
+#define FP(o) ((Arg) {.mode = AFP, .offset = (o)})
+#define MP(o) ((Arg) {.mode = AMP, .offset = (o)})
+#define IMM(v) ((Arg) {.mode = AIMM, .offset = (v)})
+#define IFP(o, i) ((Arg) {.mode = AIND | AFP, .offset = (o), .indirect = (i)})
+#define IMP(o, i) ((Arg) {.mode = AIND | AMP, .offset = (o), .indirect = (i)})
+
+/// An object file being assembled. Zero-initialise before use.
+typedef struct Assembler {
+    Buffer code;
+    Buffer types;
+    Buffer data;
+    Buffer links;
+    word ninstructions;
+    word ntypes;
+    word nlinks;
+} Assembler;
+
+/// Append an instruction.
+///
+/// \param a The assembler.
+/// \param opcode An `Instruction`.
+/// \param s The source operand, or `NONE`.
+/// \param m The middle operand, or `NONE`. Only `AIMM`, `AFP` and `AMP` are
+/// valid middle operands.
+/// \param d The destination operand, or `NONE`.
+/// \return The program counter of the instruction.
+word asm_inst(Assembler *a, byte opcode, Arg s, Arg m, Arg d);
+
+/// Append a type descriptor.
+///
+/// \param a The assembler.
+/// \param size Size in bytes of the described memory.
+/// \param np The number of bytes in `map`.
+/// \param map Pointer map.
+/// \return The number of the type descriptor.
+word asm_type(Assembler *a, word size, word np, const byte *map);
+
+/// Initialise words of the module data.
+///
+/// \param a The assembler.
+/// \param offset Offset of the first word in the module data.
+/// \param count The number of words.
+/// \param words The values to store.
+void asm_words(Assembler *a, word offset, word count, const word *words);
+
+/// Initialise a pointer in the module data with a string literal.
+///
+/// \param a The assembler.
+/// \param offset Offset of the pointer in the module data.
+/// \param utf8 The string, encoded in UTF-8.
+void asm_string(Assembler *a, word offset, const char *utf8);
+
+/// Initialise a pointer with a new array, whose elements are zero until items
+/// are put in them.
+///
+/// \param a The assembler.
+/// \param offset Offset of the pointer where items are being put.
+/// \param type Type descriptor of the elements.
+/// \param len The number of elements.
+void asm_array(Assembler *a, word offset, word type, word len);
+
+/// Put the items that follow, until `asm_pop()`, in the elements of an array
+/// from one of them on, rather than where they are being put.
+///
+/// \param a The assembler.
+/// \param offset Offset of the pointer to the array where items are being
+/// put.
+/// \param index Index of the first element items are put in.
+void asm_index(Assembler *a, word offset, word index);
+
+/// Go back to putting items where they were put before the last
+/// `asm_index()`.
+///
+/// \param a The assembler.
+void asm_pop(Assembler *a);
+
+/// Export a function.
+///
+/// \param a The assembler.
+/// \param pc Entry point of the function.
+/// \param type Type descriptor of the function's frame.
+/// \param sig Signature hash of the function.
+/// \param name Name of the function.
+void asm_export(Assembler *a, word pc, word type, word sig, const char *name);
+
+/// Produce the object file, and free the assembler's buffers.
+///
+/// \param a The assembler.
+/// \param name Name of the module.
+/// \param data_size Size of the module data in bytes.
+/// \param entry_pc Entry point of the module, or -1.
+/// \param entry_type Type descriptor of the entry point's frame, or -1.
+/// \param size Location to store the size of the object file in.
+/// \return The object file, to be freed with `free()`.
+byte *asm_finish(Assembler *a, const char *name, word data_size,
+                 word entry_pc, word entry_type, uptr *size);
+
+#endif //DIS_BENCH_ASM_H
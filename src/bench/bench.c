@@ -0,0 +1,1719 @@
+// Benchmarks for the virtual machine.
+//
+// Usage: dis_bench [--json] [--list] [benchmark...]
+//
+// With no benchmarks named every one is run. Each measurement is printed as
+// the time per operation and the operations per second; with `--json` it is
+// printed instead as a JSON object on a line of its own, with the members
+// `benchmark`, `case`, `unit`, `count`, `seconds`, `ns_per_op` and
+// `ops_per_second`, and nothing else is printed.
+//
+// There are microbenchmarks of each family of instructions, and macro
+// workloads, in `workloads.c`, that mix them as programs do. Every timing is
+// the best of several rounds, so that noise from other processes inflates
+// as few of them as possible.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../heap.h"
+#include "../instructions.h"
+#include "../module.h"
+#include "../scheduler.h"
+#include "../snapshot.h"
+#if DIS_JIT
+#include "../jit.h"
+#endif
+#if DIS_PROFILE
+#include "../profile.h"
+#endif
+#include "asm.h"
+#include "bench.h"
+
+/// Whether to print JSON rather than text.
+static bool json;
+
+/// The name of the benchmark running.
+static const char *benchmark;
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+double run(const byte *image, uptr size, Array *array)
+{
+    const char *error = NULL;
+    Module *module = module_decode(image, size, "bench", &error);
+    if (module == NULL) {
+        fprintf(stderr, "cannot decode benchmark: %s\n", error);
+        return -1;
+    }
+    ModuleLink *ml = module_link(module, NULL);
+    if (array != NULL) {
+        *(Array **) ml->mp = array;
+    }
+
+    ExecutionContext context;
+    execution_init(&context, ml);
+    double start = now();
+    ExecutionStatus status = execute(&context);
+    double elapsed = now() - start;
+    if (status != EXEC_EXITED) {
+        fprintf(stderr, "benchmark failed: %s\n", context.error);
+        elapsed = -1;
+    }
+    execution_free(&context);
+    module_unlink(ml);
+    return elapsed;
+}
+
+double schedule(byte *image, uptr size, word *result)
+{
+    const char *error = NULL;
+    Module *module = module_decode(image, size, "bench", &error);
+    free(image);
+    if (module == NULL) {
+        fprintf(stderr, "cannot decode benchmark: %s\n", error);
+        return -1;
+    }
+    ModuleLink *ml = module_link(module, NULL);
+
+    scheduler_start(0);
+    double best = -1;
+    for (int round = 0; round < 5; round++) {
+        double start = now();
+        scheduler_spawn_module(ml);
+        scheduler_wait();
+        double elapsed = now() - start;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    scheduler_stop();
+    if (result != NULL) {
+        *result = *(word *) ml->mp;
+    }
+    module_unlink(ml);
+    return best;
+}
+
+void report(const char *name, const char *unit, double count, double seconds)
+{
+    if (!(seconds > 0)) {
+        fprintf(stderr, "%s %s: too quick to measure\n", benchmark, name);
+        return;
+    }
+    double rate = count / seconds;
+    if (json) {
+        printf("{\"benchmark\":\"%s\",\"case\":\"%s\",\"unit\":\"%s\",\"count\":%.0f,"
+               "\"seconds\":%.9g,\"ns_per_op\":%.6g,\"ops_per_second\":%.6g}\n",
+               benchmark, name, unit, count, seconds, seconds / count * 1e9, rate);
+        return;
+    }
+    static const char *const prefixes[] = {"", "k", "M", "G"};
+    int prefix = 0;
+    while (prefix < 3 && rate >= 1000) {
+        rate /= 1000;
+        prefix++;
+    }
+    printf("  %-20s %10.2f ns each %10.2f %1s %s/s\n", name, seconds / count * 1e9, rate,
+           prefixes[prefix], unit);
+}
+
+void note(const char *format, ...)
+{
+    if (json) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    printf("  ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
+
+/// An instruction repeated through the body of a loop. One without a
+/// destination is a branch, and goes to the instruction after it, so that it
+/// is taken or not to the same place.
+typedef struct Kernel {
+    byte opcode;
+    Arg s;
+    Arg m;
+    Arg d;
+} Kernel;
+
+/// Time a loop whose body repeats some instructions in turn, and take away
+/// the time the loop takes with nothing in its body.
+///
+/// The loop's frame holds operands for each kind of instruction: 40 and 44
+/// the words 3 and 1000, 56 and 64 the same as bigs, 80 and 88 as reals, 104
+/// and 112 two strings that differ in their last character, and 48, 72 and
+/// 96 somewhere for word, big and real results.
+///
+/// \param kernel The instructions, or `NULL` for an empty body.
+/// \param n The number of instructions.
+/// \param reps The number of times to run the body.
+/// \param length The number of instructions in the body.
+/// \return Seconds taken by the best of five runs, or a negative number on
+/// failure.
+static double time_kernel(const Kernel *kernel, int n, word reps, word length)
+{
+    static const byte data_map[] = {0xc0};
+    static const byte frame_map[] = {0x00, 0x06};
+    Assembler a = {0};
+    asm_type(&a, 16, sizeof data_map, data_map);
+    word entry = asm_type(&a, 128, sizeof frame_map, frame_map);
+    asm_string(&a, 0, "a string to compare, a");
+    asm_string(&a, 8, "a string to compare, b");
+    asm_inst(&a, IN_MOVW, IMM(3), NONE, FP(40));
+    asm_inst(&a, IN_MOVW, IMM(1000), NONE, FP(44));
+    asm_inst(&a, IN_CVTWL, FP(40), NONE, FP(56));
+    asm_inst(&a, IN_CVTWL, FP(44), NONE, FP(64));
+    asm_inst(&a, IN_CVTWF, FP(40), NONE, FP(80));
+    asm_inst(&a, IN_CVTWF, FP(44), NONE, FP(88));
+    asm_inst(&a, IN_MOVP, MP(0), NONE, FP(104));
+    asm_inst(&a, IN_MOVP, MP(8), NONE, FP(112));
+    word loop = asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(120)) + 1;
+    for (word i = 0; kernel != NULL && i < length; i++) {
+        const Kernel *k = &kernel[i % n];
+        asm_inst(&a, k->opcode, k->s, k->m, k->d.mode == AXXX ? IMM(loop + i + 1) : k->d);
+    }
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(120));
+    asm_inst(&a, IN_BLTW, FP(120), IMM(reps), IMM(loop));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Kernel", 16, 0, entry, &size);
+
+    double best = -1;
+    for (int round = 0; round < 5; round++) {
+        double elapsed = run(image, size, NULL);
+        if (elapsed < 0) {
+            best = -1;
+            break;
+        }
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    free(image);
+    return best;
+}
+
+/// Time each kernel, less the loop around it, and report the time per
+/// instruction.
+///
+/// \param names The names of the kernels.
+/// \param kernels The kernels, each of up to eight instructions.
+/// \param lengths The number of instructions in each kernel.
+/// \param n The number of kernels.
+/// \param unit What an instruction of the kernels does.
+static void report_kernels(const char *const *names, const Kernel (*kernels)[8],
+                           const int *lengths, int n, const char *unit)
+{
+    enum { REPS = 1000000, LENGTH = 16 };
+
+    double loop = time_kernel(NULL, 0, REPS, LENGTH);
+    if (loop < 0) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        double elapsed = time_kernel(kernels[i], lengths[i], REPS, LENGTH);
+        if (elapsed < 0) {
+            return;
+        }
+        report(names[i], unit, (double) REPS * LENGTH, elapsed - loop);
+    }
+}
+
+/// Do word, big and real arithmetic, and convert between them.
+static void bench_arith(void)
+{
+    static const char *const names[] = {
+        "word", "word divide", "big", "big divide", "real", "convert",
+    };
+    const Kernel kernels[][8] = {
+        {
+            {IN_ADDW, FP(40), FP(44), FP(48)}, {IN_SUBW, FP(40), FP(44), FP(48)},
+            {IN_MULW, FP(40), FP(44), FP(48)}, {IN_ANDW, FP(40), FP(44), FP(48)},
+            {IN_ORW, FP(40), FP(44), FP(48)}, {IN_XORW, FP(40), FP(44), FP(48)},
+            {IN_SHLW, FP(40), FP(44), FP(48)}, {IN_SHRW, FP(40), FP(44), FP(48)},
+        },
+        {{IN_DIVW, FP(40), FP(44), FP(48)}, {IN_MODW, FP(40), FP(44), FP(48)}},
+        {
+            {IN_ADDL, FP(56), FP(64), FP(72)}, {IN_SUBL, FP(56), FP(64), FP(72)},
+            {IN_MULL, FP(56), FP(64), FP(72)}, {IN_ANDL, FP(56), FP(64), FP(72)},
+            {IN_ORL, FP(56), FP(64), FP(72)}, {IN_XORL, FP(56), FP(64), FP(72)},
+            {IN_SHLL, FP(40), FP(64), FP(72)}, {IN_SHRL, FP(40), FP(64), FP(72)},
+        },
+        {{IN_DIVL, FP(56), FP(64), FP(72)}, {IN_MODL, FP(56), FP(64), FP(72)}},
+        {
+            {IN_ADDF, FP(80), FP(88), FP(96)}, {IN_SUBF, FP(80), FP(88), FP(96)},
+            {IN_MULF, FP(80), FP(88), FP(96)}, {IN_DIVF, FP(80), FP(88), FP(96)},
+        },
+        {
+            {IN_CVTWL, FP(40), NONE, FP(72)}, {IN_CVTLW, FP(56), NONE, FP(48)},
+            {IN_CVTWF, FP(40), NONE, FP(96)}, {IN_CVTFW, FP(80), NONE, FP(48)},
+        },
+    };
+    static const int lengths[] = {8, 2, 8, 2, 4, 4};
+    report_kernels(names, kernels, lengths, sizeof lengths / sizeof *lengths, "instructions");
+}
+
+/// Branch on words, bigs, reals and strings, and jump.
+static void bench_branch(void)
+{
+    static const char *const names[] = {
+        "jmp", "word taken", "word not taken", "big taken", "real taken", "string taken",
+    };
+    const Kernel kernels[][8] = {
+        {{IN_JMP, NONE, NONE, NONE}},
+        {{IN_BNEW, FP(40), FP(44), NONE}},
+        {{IN_BEQW, FP(40), FP(44), NONE}},
+        {{IN_BNEL, FP(56), FP(64), NONE}},
+        {{IN_BNEF, FP(80), FP(88), NONE}},
+        {{IN_BNEC, FP(104), FP(112), NONE}},
+    };
+    static const int lengths[] = {1, 1, 1, 1, 1, 1};
+    report_kernels(names, kernels, lengths, sizeof lengths / sizeof *lengths, "branches");
+}
+
+/// Sum a word array repeatedly, with and without superinstructions.
+///
+/// The loop is made of the idioms the loader fuses: a `lena`/`bgew` loop
+/// header, an `indw`/`movw` array load, `movw`/`addw` arithmetic through a
+/// temporary and an `addw`/`bltw` loop latch.
+static void bench_fusion(void)
+{
+    enum { LENGTH = 1000, REPS = 20000 };
+
+    // Module data: 0 array, 8 sum. Frame: 40 i, 44 n, 48 element address,
+    // 56 element, 60 repetition, 64 temporary.
+    Assembler a = {0};
+    word frame = asm_type(&a, 72, 0, NULL);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(60));
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_LENA, MP(0), NONE, FP(44));
+    asm_inst(&a, IN_BGEW, FP(40), FP(44), IMM(11));
+    asm_inst(&a, IN_INDW, MP(0), FP(48), FP(40));
+    asm_inst(&a, IN_MOVW, IFP(48, 0), NONE, FP(56));
+    asm_inst(&a, IN_MOVW, MP(8), NONE, FP(64));
+    asm_inst(&a, IN_ADDW, FP(56), NONE, FP(64));
+    asm_inst(&a, IN_MOVW, FP(64), NONE, MP(8));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(2));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(60));
+    asm_inst(&a, IN_BLTW, FP(60), IMM(REPS), IMM(1));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Fusion", 16, 0, frame, &size);
+
+    static TypeDescriptor word_type = {.size = sizeof(word), .references = 1};
+    Array *array = heap_array(&word_type, LENGTH);
+    for (word i = 0; i < LENGTH; i++) {
+        ((word *) array->data)[i] = i;
+    }
+
+    // Nine instructions per element, five per repetition, and the first and
+    // last instructions of the program.
+    double instructions = 9.0 * LENGTH * REPS + 5.0 * REPS + 2;
+    // Alternate between the two modes and keep the fastest run of each, so
+    // that noise from other processes affects both alike.
+    double best[2] = {-1, -1};
+    for (int round = 0; round < 7; round++) {
+        for (int fused = 0; fused <= 1; fused++) {
+            module_set_fusion(fused);
+            double elapsed = run(image, size, array);
+            if (elapsed < 0) {
+                module_set_fusion(true);
+                goto done;
+            }
+            if (best[fused] < 0 || elapsed < best[fused]) {
+                best[fused] = elapsed;
+            }
+        }
+    }
+    module_set_fusion(true);
+
+    for (int fused = 0; fused <= 1; fused++) {
+        report(fused ? "on" : "off", "instructions", instructions, best[fused]);
+    }
+    note("speedup %.2fx", best[0] / best[1]);
+
+done:
+    heap_release(array);
+    free(image);
+}
+
+/// Run each instruction the interpreter quickens, over and over, with and
+/// without quickening: `mnewz` from another module, and `movm`, `headm` and `consm` of 16 bytes.
+static void bench_quicken(void)
+{
+    enum { REPS = 250000, UNROLL = 8 };
+
+    // Records of 16 bytes for `mnewz`, without and with a pointer.
+    static const byte pointer_map[] = {0x80};
+    Assembler types = {0};
+    word plain = asm_type(&types, 16, 0, NULL);
+    word pointers = asm_type(&types, 16, sizeof pointer_map, pointer_map);
+    uptr size;
+    byte *image = asm_finish(&types, "Types", 0, -1, -1, &size);
+    Module *module = module_decode(image, size, "types", NULL);
+    free(image);
+    if (module == NULL) {
+        fprintf(stderr, "cannot decode benchmark\n");
+        return;
+    }
+    ModuleLink *types_ml = module_link(module, NULL);
+
+    // Module data: 0 types link. Entry frame: 40 count, 48 record, 56 list,
+    // 64 nil, 72 and 88 blocks of 16 bytes.
+    static const byte frame_map[] = {0x03, 0x80};
+    static const struct {
+        const char *name;
+        byte opcode;
+        Arg s;
+        Arg m;
+        Arg d;
+    } workloads[] = {
+        {"mnewz", IN_MNEWZ, MP(0), IMM(0), FP(48)},
+        {"movm", IN_MOVM, FP(72), IMM(16), FP(88)},
+        {"headm", IN_HEADM, FP(56), IMM(16), FP(88)},
+        {"consm", IN_CONSM, FP(72), IMM(16), FP(56)},
+    };
+
+    for (uptr i = 0; i < sizeof workloads / sizeof *workloads; i++) {
+        Assembler a = {0};
+        asm_type(&a, sizeof(pointer), sizeof pointer_map, pointer_map);
+        word entry = asm_type(&a, 104, sizeof frame_map, frame_map);
+        asm_inst(&a, IN_CONSM, FP(72), IMM(16), FP(56));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        word loop = asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(44)) + 1;
+        Arg s = workloads[i].s;
+        Arg m = workloads[i].m;
+        if (workloads[i].opcode == IN_MNEWZ) {
+            m = IMM(m.offset == 0 ? plain : pointers);
+        }
+        for (int j = 0; j < UNROLL; j++) {
+            asm_inst(&a, workloads[i].opcode, s, m, workloads[i].d);
+        }
+        if (workloads[i].opcode == IN_CONSM) {
+            // Keep the list from growing without bound.
+            asm_inst(&a, IN_MOVP, FP(64), NONE, FP(56));
+        }
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+        asm_inst(&a, IN_BLTW, FP(40), IMM(REPS), IMM(loop));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        image = asm_finish(&a, "Quicken", sizeof(pointer), 0, entry, &size);
+
+        // Alternate between the two modes and keep the fastest run of each.
+        double best[2] = {-1, -1};
+        for (int round = 0; round < 10; round++) {
+            int quick = round & 1;
+            module_set_fusion(quick);
+            const char *error = NULL;
+            Module *program = module_decode(image, size, "quicken", &error);
+            module_set_fusion(true);
+            if (program == NULL) {
+                fprintf(stderr, "cannot decode benchmark: %s\n", error);
+                break;
+            }
+            ModuleLink *ml = module_link(program, NULL);
+            heap_retain(types_ml);
+            *(ModuleLink **) ml->mp = types_ml;
+
+            ExecutionContext context;
+            execution_init(&context, ml);
+            double start = now();
+            ExecutionStatus status = execute(&context);
+            double elapsed = now() - start;
+            if (status != EXEC_EXITED) {
+                fprintf(stderr, "benchmark failed: %s\n", context.error);
+                elapsed = -1;
+            }
+            execution_free(&context);
+            module_unlink(ml);
+            if (elapsed < 0) {
+                break;
+            }
+            if (best[quick] < 0 || elapsed < best[quick]) {
+                best[quick] = elapsed;
+            }
+        }
+        free(image);
+        if (best[0] < 0 || best[1] < 0) {
+            break;
+        }
+
+        char quick_name[16];
+        snprintf(quick_name, sizeof quick_name, "x%s", workloads[i].name);
+        report(workloads[i].name, "instructions", (double) REPS * UNROLL, best[0]);
+        report(quick_name, "instructions", (double) REPS * UNROLL, best[1]);
+        note("speedup %.2fx", best[0] / best[1]);
+    }
+    module_unlink(types_ml);
+}
+
+/// Make recursive calls, shallow and deep, to measure the cost of `frame`,
+/// `call` and `ret` and of growing the stack.
+static void bench_call(void)
+{
+    static const struct {
+        word depth;
+        word reps;
+    } shapes[] = {{1, 2000000}, {10000, 200}};
+
+    for (uptr i = 0; i < sizeof shapes / sizeof *shapes; i++) {
+        // Entry frame: 40 repetition, 48 callee frame. Recursive frame: 40
+        // depth, 48 callee frame.
+        Assembler a = {0};
+        word entry = asm_type(&a, 56, 0, NULL);
+        word rec = asm_type(&a, 56, 0, NULL);
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        asm_inst(&a, IN_FRAME, IMM(rec), NONE, FP(48));
+        asm_inst(&a, IN_MOVW, IMM(shapes[i].depth), NONE, IFP(48, 40));
+        asm_inst(&a, IN_CALL, FP(48), NONE, IMM(7));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+        asm_inst(&a, IN_BLTW, FP(40), IMM(shapes[i].reps), IMM(1));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        asm_inst(&a, IN_BEQW, FP(40), IMM(0), IMM(11));
+        asm_inst(&a, IN_FRAME, IMM(rec), NONE, FP(48));
+        asm_inst(&a, IN_SUBW, IMM(1), FP(40), IFP(48, 40));
+        asm_inst(&a, IN_CALL, FP(48), NONE, IMM(7));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Call", 0, 0, entry, &size);
+
+        StackStats before, after;
+        stack_stats(&before);
+        double best = -1;
+        for (int round = 0; round < 5; round++) {
+            double elapsed = run(image, size, NULL);
+            if (elapsed < 0) {
+                break;
+            }
+            if (best < 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        stack_stats(&after);
+        free(image);
+        if (best < 0) {
+            return;
+        }
+
+        double calls = (double) (shapes[i].depth + 1) * (double) shapes[i].reps;
+        char name[32];
+        snprintf(name, sizeof name, "depth %d", (int) shapes[i].depth);
+        report(name, "calls", calls, best);
+        note("%.1f stack segments allocated per round",
+             (double) (after.allocations - before.allocations) / 5);
+    }
+}
+
+/// Call a function in another module repeatedly, to measure the cost of
+/// `mframe`, `mcall` and `ret` against those of a local call.
+static void bench_mcall(void)
+{
+    enum { CALLS = 2000000 };
+
+    Assembler callee = {0};
+    word f = asm_type(&callee, 40, 0, NULL);
+    asm_export(&callee, asm_inst(&callee, IN_RET, NONE, NONE, NONE), f, 0, "f");
+    uptr size;
+    byte *image = asm_finish(&callee, "Callee", 0, -1, -1, &size);
+    Module *module = module_decode(image, size, "callee", NULL);
+    free(image);
+
+    // Module data: 0 callee link. Entry frame: 40 count, 48 callee frame.
+    static const byte link_map[] = {0x80};
+    Assembler caller = {0};
+    asm_type(&caller, sizeof(pointer), 1, link_map);
+    word entry = asm_type(&caller, 56, 0, NULL);
+    asm_inst(&caller, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&caller, IN_MFRAME, MP(0), IMM(0), FP(48));
+    asm_inst(&caller, IN_MCALL, FP(48), IMM(0), MP(0));
+    asm_inst(&caller, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&caller, IN_BLTW, FP(40), IMM(CALLS), IMM(1));
+    asm_inst(&caller, IN_RET, NONE, NONE, NONE);
+    image = asm_finish(&caller, "Caller", sizeof(pointer), 0, entry, &size);
+    const char *error = NULL;
+    Module *importer = module_decode(image, size, "caller", &error);
+    free(image);
+    if (module == NULL || importer == NULL) {
+        fprintf(stderr, "cannot decode benchmark: %s\n", error);
+        return;
+    }
+
+    static const struct {
+        int nentries;
+        struct {
+            int sig;
+            char name[4];
+        } entry[1];
+    } import = {1, {{0, "f"}}};
+    ModuleLink *callee_ml = module_link(module, (LinkageDescriptor *) &import);
+    ModuleLink *ml = module_link(importer, NULL);
+    // The module data takes over the reference to the callee.
+    *(ModuleLink **) ml->mp = callee_ml;
+
+    double best = -1;
+    for (int round = 0; round < 5; round++) {
+        ExecutionContext context;
+        execution_init(&context, ml);
+        double start = now();
+        ExecutionStatus status = execute(&context);
+        double elapsed = now() - start;
+        if (status != EXEC_EXITED) {
+            fprintf(stderr, "benchmark failed: %s\n", context.error);
+            execution_free(&context);
+            break;
+        }
+        execution_free(&context);
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    module_unlink(ml);
+    if (best > 0) {
+        report("mcall", "calls", CALLS, best);
+    }
+}
+
+#if DIS_JIT
+/// Assemble a program whose entry point calls a kernel of word, big and real
+/// arithmetic `reps` times.
+static byte *jit_module(word reps, uptr *size)
+{
+    enum { LENGTH = 1000 };
+
+    // Module data: 0 word sum, 8 big sum, 16 real sum. Entry frame: 40
+    // repetition, 48 callee frame. Kernel frame: 40 i, 44 temporary, 48 big
+    // temporary, 56 real temporary.
+    Assembler a = {0};
+    word entry = asm_type(&a, 56, 0, NULL);
+    word kernel = asm_type(&a, 64, 0, NULL);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_FRAME, IMM(kernel), NONE, FP(48));
+    asm_inst(&a, IN_CALL, FP(48), NONE, IMM(6));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(reps), IMM(1));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_MULW, FP(40), FP(40), FP(44));
+    asm_inst(&a, IN_XORW, IMM(0x5555), NONE, FP(44));
+    asm_inst(&a, IN_ADDW, FP(44), NONE, MP(0));
+    asm_inst(&a, IN_CVTWL, FP(44), NONE, FP(48));
+    asm_inst(&a, IN_MULL, FP(48), FP(48), FP(48));
+    asm_inst(&a, IN_ADDL, FP(48), NONE, MP(8));
+    asm_inst(&a, IN_CVTWF, FP(40), NONE, FP(56));
+    asm_inst(&a, IN_MULF, FP(56), NONE, FP(56));
+    asm_inst(&a, IN_ADDF, FP(56), NONE, MP(16));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(LENGTH), IMM(7));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    return asm_finish(&a, "Jit", 24, 0, entry, size);
+}
+
+/// Call an arithmetic kernel repeatedly, interpreted and compiled.
+///
+/// The kernel mixes word, big and real arithmetic in a counted loop, and
+/// becomes hot after `JIT_THRESHOLD` calls.
+static void bench_jit(void)
+{
+    enum { LENGTH = 1000, REPS = 5000 };
+
+    uptr size;
+    byte *image = jit_module(REPS, &size);
+
+    // Eleven instructions per iteration, three per call and five per
+    // repetition, and the first and last instructions of the program.
+    double instructions = (11.0 * LENGTH + 3 + 5) * REPS + 2;
+    double best[2] = {-1, -1};
+    for (int round = 0; round < 5; round++) {
+        for (int compiled = 0; compiled <= 1; compiled++) {
+            jit_set_mode(compiled ? JIT_AUTO : JIT_INTERPRET_ONLY);
+            double elapsed = run(image, size, NULL);
+            if (elapsed < 0) {
+                goto done;
+            }
+            if (best[compiled] < 0 || elapsed < best[compiled]) {
+                best[compiled] = elapsed;
+            }
+        }
+    }
+
+    for (int compiled = 0; compiled <= 1; compiled++) {
+        report(compiled ? "on" : "off", "instructions", instructions, best[compiled]);
+    }
+    note("speedup %.2fx", best[0] / best[1]);
+
+done:
+    jit_set_mode(JIT_AUTO);
+    free(image);
+}
+
+/// Read a module from a file and run its entry point, as a short-lived
+/// process does.
+///
+/// \return Seconds taken, or a negative number on failure.
+static double cold_run(const char *path)
+{
+    double start = now();
+    const char *error = NULL;
+    Module *module = module_read(path, &error);
+    if (module == NULL) {
+        fprintf(stderr, "cannot read benchmark module: %s\n", error);
+        return -1;
+    }
+    ModuleLink *ml = module_link(module, NULL);
+    ExecutionContext context;
+    execution_init(&context, ml);
+    ExecutionStatus status = execute(&context);
+    double elapsed = now() - start;
+    if (status != EXEC_EXITED) {
+        fprintf(stderr, "benchmark failed: %s\n", context.error);
+        elapsed = -1;
+    }
+    execution_free(&context);
+    module_unlink(ml);
+    return elapsed;
+}
+
+/// Start a short program from its object file interpreted, compiled as its
+/// functions get hot, and with a compiled image written ahead of time.
+static void bench_aot(void)
+{
+    enum { REPS = 200, ROUNDS = 5 };
+
+    uptr size;
+    byte *image = jit_module(REPS, &size);
+    char path[] = "/tmp/dis_benchXXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool written = file != NULL && fwrite(image, 1, size, file) == size;
+    if (file != NULL) {
+        written &= fclose(file) == 0;
+    }
+    free(image);
+    if (!written) {
+        fprintf(stderr, "cannot write benchmark module\n");
+        if (fd >= 0) {
+            remove(path);
+        }
+        return;
+    }
+    char compiled[sizeof path + sizeof JIT_IMAGE_SUFFIX];
+    snprintf(compiled, sizeof compiled, "%s%s", path, JIT_IMAGE_SUFFIX);
+
+    static const char *const modes[] = {"interpreted", "jit", "aot"};
+    for (int m = 0; m < 3; m++) {
+        jit_set_mode(m == 0 ? JIT_INTERPRET_ONLY : JIT_AUTO);
+        if (m == 2) {
+            Module *module = module_read(path, NULL);
+            bool saved = module != NULL && module_code(module) != NULL;
+            if (saved) {
+                jit_compile_all(module);
+                saved = jit_save(module, compiled);
+            }
+            if (module != NULL) {
+                module_free(module);
+            }
+            if (!saved) {
+                fprintf(stderr, "cannot write compiled image\n");
+                break;
+            }
+        }
+        double best = -1;
+        for (int round = 0; round < ROUNDS; round++) {
+            double elapsed = cold_run(path);
+            if (elapsed < 0) {
+                best = -1;
+                break;
+            }
+            if (best < 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        report(modes[m], "runs", 1, best);
+    }
+    jit_set_mode(JIT_AUTO);
+    remove(compiled);
+    remove(path);
+}
+#endif
+
+/// Spawn short-lived threads, as a server does for each request.
+static void bench_spawn(void)
+{
+    enum { THREADS = 100000, WORK = 100 };
+
+    // Entry frame: 40 thread count, 48 child frame. Child frame: 40 i.
+    Assembler a = {0};
+    word entry = asm_type(&a, 56, 0, NULL);
+    word child = asm_type(&a, 48, 0, NULL);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_FRAME, IMM(child), NONE, FP(48));
+    asm_inst(&a, IN_SPAWN, FP(48), NONE, IMM(6));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(THREADS), IMM(1));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(WORK), IMM(7));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Spawn", 8, 0, entry, &size);
+
+    double best = schedule(image, size, NULL);
+    if (best > 0) {
+        report("spawn", "threads", THREADS, best);
+    }
+}
+
+/// Stream words from a producer thread to a consumer over a channel, with
+/// and without a buffer.
+static void bench_channel(void)
+{
+    enum { MESSAGES = 1000000 };
+    static const word capacities[] = {0, 1, 64};
+
+    for (uptr i = 0; i < sizeof capacities / sizeof *capacities; i++) {
+        // Consumer frame: 40 channel, 48 producer frame, 56 count, 64 value.
+        // Producer frame: 40 channel, 48 value.
+        Assembler a = {0};
+        static const byte consumer_map[] = {0x04};
+        static const byte producer_map[] = {0x04};
+        word consumer = asm_type(&a, 72, sizeof consumer_map, consumer_map);
+        word producer = asm_type(&a, 56, sizeof producer_map, producer_map);
+        Arg capacity = capacities[i] > 0 ? IMM(capacities[i]) : NONE;
+        asm_inst(&a, IN_NEWCW, NONE, capacity, FP(40));
+        asm_inst(&a, IN_FRAME, IMM(producer), NONE, FP(48));
+        asm_inst(&a, IN_MOVP, FP(40), NONE, IFP(48, 40));
+        asm_inst(&a, IN_SPAWN, FP(48), NONE, IMM(9));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(56));
+        asm_inst(&a, IN_RECV, FP(40), NONE, FP(64));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(56));
+        asm_inst(&a, IN_BLTW, FP(56), IMM(MESSAGES), IMM(5));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(48));
+        asm_inst(&a, IN_SEND, FP(48), NONE, FP(40));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(48));
+        asm_inst(&a, IN_BLTW, FP(48), IMM(MESSAGES), IMM(10));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Channel", 8, 0, consumer, &size);
+
+        double best = schedule(image, size, NULL);
+        if (best > 0) {
+            char name[32];
+            snprintf(name, sizeof name, "buffer %d", (int) capacities[i]);
+            report(name, "messages", MESSAGES, best);
+        }
+    }
+}
+
+/// Pass values of memory down a chain of threads over buffered channels, as
+/// pipelines pass records and blocks of bytes: a block of bytes, and a
+/// record whose pointers share an object.
+static void bench_chain(void)
+{
+    enum { MESSAGES = 100000, STAGES = 4, CAPACITY = 16, VALUE = 88 };
+    static const struct {
+        const char *name;
+        word size;
+        word pointers;
+    } values[] = {{"bytes 1024", 1024, 0}, {"record 8 pointers", 128, 8}};
+
+    for (uptr i = 0; i < sizeof values / sizeof *values; i++) {
+        // Module data: 0 a string. Consumer frame: 40 first channel, 48 last
+        // channel, 56 child frame, 64 count, 80 a new channel. Stage frame:
+        // 40 channel in, 48 channel out, 64 count. Producer frame: 40
+        // channel, 64 count. Each has the value at `VALUE`.
+        word frame_size = VALUE + values[i].size;
+        byte consumer_map[(VALUE + 1024) / 64 + 1] = {0};
+        byte stage_map[sizeof consumer_map] = {0};
+        byte producer_map[sizeof consumer_map] = {0};
+        consumer_map[0] = 0x06;
+        consumer_map[1] = 0x20;
+        stage_map[0] = 0x06;
+        producer_map[0] = 0x04;
+        byte value_map[128 / 64] = {0};
+        for (word p = 0; p < values[i].pointers; p++) {
+            word slot = (VALUE + 8 * p) / 8;
+            consumer_map[slot / 8] |= 0x80 >> slot % 8;
+            stage_map[slot / 8] |= 0x80 >> slot % 8;
+            producer_map[slot / 8] |= 0x80 >> slot % 8;
+            value_map[p / 8] |= 0x80 >> p % 8;
+        }
+        word np = (frame_size / 8 + 7) / 8;
+        Assembler a = {0};
+        asm_type(&a, 8, 1, (const byte[]) {0x80});
+        word consumer = asm_type(&a, frame_size, np, consumer_map);
+        word stage = asm_type(&a, frame_size, np, stage_map);
+        word producer = asm_type(&a, frame_size, np, producer_map);
+        word value = asm_type(&a, values[i].size, sizeof value_map, value_map);
+        asm_string(&a, 0, "a string shared by every field");
+
+        byte newc = values[i].pointers > 0 ? IN_NEWCMP : IN_NEWCM;
+        Arg type = values[i].pointers > 0 ? IMM(value) : IMM(values[i].size);
+        word stage_pc = 6 * STAGES + 10, producer_pc = stage_pc + 6;
+        asm_inst(&a, newc, type, IMM(CAPACITY), FP(40));
+        asm_inst(&a, IN_MOVP, FP(40), NONE, FP(48));
+        for (word s = 0; s < STAGES; s++) {
+            asm_inst(&a, newc, type, IMM(CAPACITY), FP(80));
+            asm_inst(&a, IN_FRAME, IMM(stage), NONE, FP(56));
+            asm_inst(&a, IN_MOVP, FP(48), NONE, IFP(56, 40));
+            asm_inst(&a, IN_MOVP, FP(80), NONE, IFP(56, 48));
+            asm_inst(&a, IN_SPAWN, FP(56), NONE, IMM(stage_pc));
+            asm_inst(&a, IN_MOVP, FP(80), NONE, FP(48));
+        }
+        asm_inst(&a, IN_FRAME, IMM(producer), NONE, FP(56));
+        asm_inst(&a, IN_MOVP, FP(40), NONE, IFP(56, 40));
+        asm_inst(&a, IN_SPAWN, FP(56), NONE, IMM(producer_pc));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(64));
+        asm_inst(&a, IN_RECV, FP(48), NONE, FP(VALUE));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(64));
+        asm_inst(&a, IN_BLTW, FP(64), IMM(MESSAGES), IMM(stage_pc - 4));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        // A stage.
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(64));
+        asm_inst(&a, IN_RECV, FP(40), NONE, FP(VALUE));
+        asm_inst(&a, IN_SEND, FP(VALUE), NONE, FP(48));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(64));
+        asm_inst(&a, IN_BLTW, FP(64), IMM(MESSAGES), IMM(stage_pc + 1));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        // The producer, which fills in the record's pointers first.
+        for (word p = 0; p < values[i].pointers; p++) {
+            asm_inst(&a, IN_MOVP, MP(0), NONE, FP(VALUE + 8 * p));
+        }
+        word send = asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(64)) + 1;
+        asm_inst(&a, IN_SEND, FP(VALUE), NONE, FP(40));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(64));
+        asm_inst(&a, IN_BLTW, FP(64), IMM(MESSAGES), IMM(send));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Chain", 8, 0, consumer, &size);
+
+        double best = schedule(image, size, NULL);
+        if (best > 0) {
+            report(values[i].name, "hops", (double) MESSAGES * (STAGES + 1), best);
+        }
+    }
+}
+
+/// Fan messages in from several producer threads, each with a channel of its
+/// own, to a consumer that takes them with `alt`.
+static void bench_alt(void)
+{
+    enum { MESSAGES = 1000000, MAX_PRODUCERS = 8 };
+    static const word fan_ins[] = {2, MAX_PRODUCERS};
+
+    for (uptr i = 0; i < sizeof fan_ins / sizeof *fan_ins; i++) {
+        word producers = fan_ins[i];
+        word per_producer = MESSAGES / producers;
+
+        // Consumer frame: 40 count, 44 value, 48 producer frame, 56 the index
+        // chosen, 64 the alt's header, 72 its entries, of a channel and the
+        // address of the value each. Producer frame: 40 channel, 48 value.
+        byte consumer_map[(72 + 16 * MAX_PRODUCERS) / 8 / 8 + 1] = {0};
+        for (word p = 0; p < producers; p++) {
+            word slot = (72 + 16 * p) / 8;
+            consumer_map[slot / 8] |= 0x80 >> slot % 8;
+        }
+        static const byte producer_map[] = {0x04};
+        Assembler a = {0};
+        word frame_size = 72 + 16 * producers;
+        word consumer = asm_type(&a, frame_size, (frame_size / 8 + 7) / 8, consumer_map);
+        word producer = asm_type(&a, 56, sizeof producer_map, producer_map);
+        word produce = 5 * producers + 7;
+        for (word p = 0; p < producers; p++) {
+            asm_inst(&a, IN_NEWCW, NONE, NONE, FP(72 + 16 * p));
+            asm_inst(&a, IN_LEA, FP(44), NONE, FP(80 + 16 * p));
+            asm_inst(&a, IN_FRAME, IMM(producer), NONE, FP(48));
+            asm_inst(&a, IN_MOVP, FP(72 + 16 * p), NONE, IFP(48, 40));
+            asm_inst(&a, IN_SPAWN, FP(48), NONE, IMM(produce));
+        }
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(64));
+        asm_inst(&a, IN_MOVW, IMM(producers), NONE, FP(68));
+        word loop = asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40)) + 1;
+        asm_inst(&a, IN_ALT, FP(64), NONE, FP(56));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+        asm_inst(&a, IN_BLTW, FP(40), IMM(per_producer * producers), IMM(loop));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(48));
+        asm_inst(&a, IN_SEND, FP(48), NONE, FP(40));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(48));
+        asm_inst(&a, IN_BLTW, FP(48), IMM(per_producer), IMM(produce + 1));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Alt", 8, 0, consumer, &size);
+
+        double best = schedule(image, size, NULL);
+        if (best > 0) {
+            char name[32];
+            snprintf(name, sizeof name, "producers %d", (int) producers);
+            report(name, "messages", (double) per_producer * producers, best);
+        }
+    }
+}
+
+/// Allocate records and lists and drop them again, and make garbage cycles
+/// for the collector to find.
+static void bench_heap(void)
+{
+    enum { OBJECTS = 2000000, LENGTH = 1000, LISTS = 2000, CYCLES = 200000 };
+
+    // Entry frame: 40 count, 44 i, 48 record, 56 record, 64 list, 72 nil.
+    // Record: 0 pointer.
+    static const byte frame_map[] = {0x03, 0xc0};
+    static const byte record_map[] = {0x80};
+    static const struct {
+        const char *name;
+        const char *unit;
+        double count;
+    } workloads[] = {
+        {"alloc", "objects", OBJECTS},
+        {"list", "cells", (double) LENGTH * LISTS},
+        {"cycle", "cycles", CYCLES},
+    };
+
+    for (uptr i = 0; i < sizeof workloads / sizeof *workloads; i++) {
+        Assembler a = {0};
+        word entry = asm_type(&a, 80, sizeof frame_map, frame_map);
+        word record = asm_type(&a, 8, sizeof record_map, record_map);
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        switch (i) {
+        case 0:
+            // Each record frees the one before it.
+            asm_inst(&a, IN_NEW, IMM(record), NONE, FP(48));
+            asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+            asm_inst(&a, IN_BLTW, FP(40), IMM(OBJECTS), IMM(1));
+            break;
+        case 1:
+            asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(44));
+            asm_inst(&a, IN_CONSW, FP(44), NONE, FP(64));
+            asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(44));
+            asm_inst(&a, IN_BLTW, FP(44), IMM(LENGTH), IMM(2));
+            asm_inst(&a, IN_MOVP, FP(72), NONE, FP(64));
+            asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+            asm_inst(&a, IN_BLTW, FP(40), IMM(LISTS), IMM(1));
+            break;
+        default:
+            // Two records that point at each other, left for the collector
+            // when the next two replace them.
+            asm_inst(&a, IN_NEW, IMM(record), NONE, FP(48));
+            asm_inst(&a, IN_NEW, IMM(record), NONE, FP(56));
+            asm_inst(&a, IN_MOVP, FP(56), NONE, IFP(48, 0));
+            asm_inst(&a, IN_MOVP, FP(48), NONE, IFP(56, 0));
+            asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+            asm_inst(&a, IN_BLTW, FP(40), IMM(CYCLES), IMM(1));
+            break;
+        }
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Heap", 0, 0, entry, &size);
+
+        HeapStats before, after;
+        heap_collect();
+        heap_stats(&before);
+        double best = -1;
+        for (int round = 0; round < 5; round++) {
+            double elapsed = run(image, size, NULL);
+            if (elapsed < 0) {
+                break;
+            }
+            if (best < 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        heap_collect();
+        heap_stats(&after);
+        free(image);
+        if (best < 0) {
+            return;
+        }
+
+        report(workloads[i].name, workloads[i].unit, workloads[i].count, best);
+        note("%lu objects collected in %lu collections",
+             (unsigned long) (after.collected - before.collected),
+             (unsigned long) (after.collections - before.collections));
+    }
+}
+
+/// Build a string by appending to it in a loop, and then read it back a
+/// character at a time.
+static void bench_string(void)
+{
+    enum { APPENDS = 200000 };
+    static const char piece[] = "hello, world ";
+    const double chars = (double) APPENDS * (sizeof piece - 1);
+
+    double best[2] = {-1, -1};
+    for (int index = 0; index < 2; index++) {
+        // Module data: 8 the piece. Entry frame: 40 count, 44 character, 48
+        // the string, 56 index, 60 length, 64 sum.
+        static const byte data_map[] = {0x40};
+        static const byte frame_map[] = {0x02};
+        Assembler a = {0};
+        asm_type(&a, 16, 1, data_map);
+        word entry = asm_type(&a, 72, 1, frame_map);
+        asm_string(&a, 8, piece);
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        asm_inst(&a, IN_ADDC, MP(8), NONE, FP(48));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+        asm_inst(&a, IN_BLTW, FP(40), IMM(APPENDS), IMM(1));
+        if (index) {
+            asm_inst(&a, IN_LENC, FP(48), NONE, FP(60));
+            asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(56));
+            asm_inst(&a, IN_INDC, FP(48), FP(56), FP(44));
+            asm_inst(&a, IN_ADDW, FP(44), NONE, FP(64));
+            asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(56));
+            asm_inst(&a, IN_BLTW, FP(56), FP(60), IMM(6));
+        }
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "String", 16, 0, entry, &size);
+        for (int round = 0; round < 5; round++) {
+            double elapsed = run(image, size, NULL);
+            if (elapsed < 0) {
+                break;
+            }
+            if (best[index] < 0 || elapsed < best[index]) {
+                best[index] = elapsed;
+            }
+        }
+        free(image);
+        if (best[index] < 0) {
+            return;
+        }
+    }
+
+    double indexing = best[1] - best[0];
+    report("append", "appends", APPENDS, best[0]);
+    note("%.2f ns per character appended", best[0] / chars * 1e9);
+    report("indc", "chars", chars, indexing);
+}
+
+/// Dispatch on a word and on a string through `case` and `casec` tables of
+/// 64 entries, searching the tables and through the jump and hash tables the
+/// loader compiles them into.
+static void bench_case(void)
+{
+    enum { KEYS = 64, DISPATCHES = 2000000 };
+    // Module data: 0 the casec table, `strings` a literal the keys are
+    // sliced from, `words` the case table.
+    enum {
+        entries = sizeof(pointer),
+        strings = entries + KEYS * sizeof(StringCase) + sizeof(pointer),
+        words = strings + sizeof(pointer),
+        data_size = words + (2 + 3 * KEYS) * sizeof(word),
+    };
+    char literal[KEYS * 5 + 1];
+    for (int k = 0; k < KEYS; k++) {
+        snprintf(literal + k * 5, 6, "key%02d", k);
+    }
+    byte data_map[(data_size / sizeof(pointer) + 7) / 8] = {0};
+    for (uptr k = 0; k < 2 * KEYS + 1; k++) {
+        // Each entry's strings, then the literal.
+        uptr offset = entries + k / 2 * sizeof(StringCase) + k % 2 * sizeof(pointer);
+        uptr slot = (k < 2 * KEYS ? offset : strings) / sizeof(pointer);
+        data_map[slot / 8] |= 0x80 >> slot % 8;
+    }
+    static const byte frame_map[] = {0x02};
+
+    static const char *const names[] = {"case", "casec"};
+    for (int strings_case = 0; strings_case <= 1; strings_case++) {
+        // Entry frame: 40 i, 44 key, 48 array of keys, 56 address of a key,
+        // 64 start, 68 end.
+        Assembler a = {0};
+        asm_type(&a, data_size, sizeof data_map, data_map);
+        word entry = asm_type(&a, 72, sizeof frame_map, frame_map);
+        word key_type = asm_type(&a, sizeof(pointer), 1, (const byte[]) {0x80});
+        word loop = 10, latch = loop + 4 + KEYS, exit = latch + 2;
+        word table[1 + 3 * KEYS + 1] = {KEYS};
+        for (word k = 0; k < KEYS; k++) {
+            table[1 + 3 * k] = k;
+            table[2 + 3 * k] = k + 1;
+            table[3 + 3 * k] = loop + 4 + k;
+            char key[6] = {0};
+            memcpy(key, literal + k * 5, 5);
+            asm_string(&a, entries + k * (word) sizeof(StringCase), key);
+            asm_words(&a, entries + k * (word) sizeof(StringCase) + 2 * (word) sizeof(pointer),
+                      1, &table[3 + 3 * k]);
+        }
+        table[1 + 3 * KEYS] = exit;
+        asm_words(&a, 0, 1, table);
+        asm_words(&a, entries + KEYS * (word) sizeof(StringCase), 1, &table[1 + 3 * KEYS]);
+        asm_string(&a, strings, literal);
+        asm_words(&a, words, 2 + 3 * KEYS, table);
+
+        asm_inst(&a, IN_NEWA, IMM(KEYS), IMM(key_type), FP(48));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(44));
+        asm_inst(&a, IN_INDX, FP(48), FP(56), FP(44));
+        asm_inst(&a, IN_MULW, IMM(5), FP(44), FP(64));
+        asm_inst(&a, IN_ADDW, IMM(5), FP(64), FP(68));
+        asm_inst(&a, IN_MOVP, MP(strings), NONE, IFP(56, 0));
+        asm_inst(&a, IN_SLICEC, FP(64), FP(68), IFP(56, 0));
+        asm_inst(&a, IN_ADDW, IMM(1), FP(44), FP(44));
+        asm_inst(&a, IN_BLTW, FP(44), IMM(KEYS), IMM(2));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        // The values dispatched on are slices of a literal rather than
+        // literals, which are interned, as a key read from a message would
+        // not be.
+        // loop:
+        asm_inst(&a, IN_BGEW, FP(40), IMM(DISPATCHES), IMM(exit));
+        asm_inst(&a, IN_ANDW, IMM(KEYS - 1), FP(40), FP(44));
+        if (strings_case) {
+            asm_inst(&a, IN_INDX, FP(48), FP(56), FP(44));
+            asm_inst(&a, IN_CASEC, IFP(56, 0), NONE, MP(0));
+        } else {
+            asm_inst(&a, IN_NOP, NONE, NONE, NONE);
+            asm_inst(&a, IN_CASE, FP(44), NONE, MP(words));
+        }
+        for (word k = 0; k < KEYS; k++) {
+            asm_inst(&a, IN_JMP, NONE, NONE, IMM(latch));
+        }
+        // latch:
+        asm_inst(&a, IN_ADDW, IMM(1), FP(40), FP(40));
+        asm_inst(&a, IN_JMP, NONE, NONE, IMM(loop));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Case", data_size, 0, entry, &size);
+
+        double best[2] = {-1, -1};
+        for (int round = 0; round < 5; round++) {
+            for (int compiled = 0; compiled <= 1; compiled++) {
+                module_set_fusion(compiled);
+                double elapsed = run(image, size, NULL);
+                if (elapsed >= 0 && (best[compiled] < 0 || elapsed < best[compiled])) {
+                    best[compiled] = elapsed;
+                }
+            }
+        }
+        module_set_fusion(true);
+        free(image);
+        if (best[0] < 0 || best[1] < 0) {
+            return;
+        }
+        for (int compiled = 0; compiled <= 1; compiled++) {
+            char name[32];
+            snprintf(name, sizeof name, "%s %s", names[strings_case],
+                     compiled ? "compiled" : "search");
+            report(name, "dispatches", DISPATCHES, best[compiled]);
+        }
+    }
+}
+
+/// Convert a large byte array to a string and back, and copy slices of byte
+/// and pointer arrays over others.
+static void bench_bulk(void)
+{
+    enum { LENGTH = 1 << 16, POINTERS = 4096, REPS = 2000 };
+    static const char *const names[] = {"cvtac", "cvtca", "slicela bytes", "slicela pointers"};
+
+    // Mostly ASCII, as text is, with a two-byte character now and then.
+    static TypeDescriptor byte_type = {.size = 1, .references = 1};
+    Array *text = heap_array(&byte_type, LENGTH);
+    for (word i = 0; i < LENGTH; i++) {
+        text->data[i] = (byte) ("the quick brown fox jumps over the lazy dog "[i % 44]);
+        if (i % 1000 == 999) {
+            text->data[i - 1] = 0xC3;
+            text->data[i] = 0xA9;
+        }
+    }
+
+    double best[4] = {-1, -1, -1, -1};
+    for (int test = 0; test < 4; test++) {
+        // Module data: 0 the text. Entry frame: 40 i, 44 k, 48 string, 56
+        // byte array, 64, 72 and 96 pointer arrays, 80 address of an element.
+        static const byte data_map[] = {0x80};
+        static const byte frame_map[] = {0x03, 0xC8};
+        Assembler a = {0};
+        asm_type(&a, sizeof(pointer), 1, data_map);
+        word entry = asm_type(&a, 104, 2, frame_map);
+        word bytes = asm_type(&a, 1, 0, NULL);
+        word pointers = asm_type(&a, sizeof(pointer), 1, (const byte[]) {0x80});
+        asm_inst(&a, IN_NEWA, IMM(LENGTH), IMM(bytes), FP(56));
+        asm_inst(&a, IN_NEWA, IMM(POINTERS), IMM(pointers), FP(64));
+        asm_inst(&a, IN_NEWA, IMM(POINTERS), IMM(pointers), FP(72));
+        asm_inst(&a, IN_NEWA, IMM(POINTERS), IMM(pointers), FP(96));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(44));
+        asm_inst(&a, IN_INDX, FP(64), FP(80), FP(44));
+        asm_inst(&a, IN_CVTWC, FP(44), NONE, IFP(80, 0));
+        asm_inst(&a, IN_ADDW, IMM(1), FP(44), FP(44));
+        asm_inst(&a, IN_BLTW, FP(44), IMM(POINTERS), IMM(5));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        word loop = 10;
+        switch (test) {
+        case 0:
+            asm_inst(&a, IN_CVTAC, MP(0), NONE, FP(48));
+            break;
+        case 1:
+            asm_inst(&a, IN_CVTAC, MP(0), NONE, FP(48));
+            asm_inst(&a, IN_CVTCA, FP(48), NONE, FP(56));
+            break;
+        case 2:
+            asm_inst(&a, IN_SLICELA, MP(0), IMM(0), FP(56));
+            break;
+        default:
+            // Strings over nil, then nil over the strings, so that every
+            // element changes.
+            asm_inst(&a, IN_SLICELA, FP(64), IMM(0), FP(72));
+            asm_inst(&a, IN_SLICELA, FP(96), IMM(0), FP(72));
+            break;
+        }
+        asm_inst(&a, IN_ADDW, IMM(1), FP(40), FP(40));
+        asm_inst(&a, IN_BLTW, FP(40), IMM(REPS), IMM(loop));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        uptr size;
+        byte *image = asm_finish(&a, "Bulk", sizeof(pointer), 0, entry, &size);
+        for (int round = 0; round < 5; round++) {
+            // The module data's reference to the text goes with it.
+            heap_retain(text);
+            double elapsed = run(image, size, text);
+            if (elapsed < 0) {
+                break;
+            }
+            if (best[test] < 0 || elapsed < best[test]) {
+                best[test] = elapsed;
+            }
+        }
+        free(image);
+        if (best[test] < 0) {
+            heap_release(text);
+            return;
+        }
+    }
+
+    // Converting back is timed together with converting there.
+    best[1] -= best[0];
+    for (int test = 0; test < 4; test++) {
+        if (test < 3) {
+            report(names[test], "bytes", (double) LENGTH * REPS, best[test]);
+        } else {
+            report(names[test], "elements", 2.0 * POINTERS * REPS, best[test]);
+        }
+    }
+    heap_release(text);
+}
+
+/// Load a module from an object file repeatedly, importing every function it
+/// exports: reading it and decoding all of it, reading it without decoding
+/// the code that is never called, and through the module cache.
+static void bench_load(void)
+{
+    enum { FUNCTIONS = 256, LENGTH = 16, LOADS = 5000 };
+
+    Assembler a = {0};
+    word t = asm_type(&a, 48, 0, NULL);
+    // The linkage descriptor imports the functions in the reverse order.
+    LinkageDescriptor *linkage = malloc(sizeof(int) + FUNCTIONS * 16);
+    linkage->nentries = FUNCTIONS;
+    for (int f = 0; f < FUNCTIONS; f++) {
+        word pc = asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        for (int i = 0; i < LENGTH; i++) {
+            asm_inst(&a, IN_ADDW, IMM(i), FP(40), FP(40 + (i & 1) * 4));
+        }
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        char name[16];
+        snprintf(name, sizeof name, "f%d", f);
+        asm_export(&a, pc, t, f, name);
+    }
+    byte *entry = (byte *) linkage->entry;
+    for (int f = FUNCTIONS - 1; f >= 0; f--) {
+        int sig = f;
+        memcpy(entry, &sig, sizeof sig);
+        int length = snprintf((char *) entry + sizeof sig, 12, "f%d", f) + 1;
+        entry += sizeof sig + ((length + sizeof(int) - 1) & ~(sizeof(int) - 1));
+    }
+    uptr size;
+    byte *image = asm_finish(&a, "Load", 0, -1, -1, &size);
+
+    char path[] = "/tmp/dis_benchXXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool written = file != NULL && fwrite(image, 1, size, file) == size;
+    if (file != NULL) {
+        written &= fclose(file) == 0;
+    }
+    free(image);
+    if (!written) {
+        fprintf(stderr, "cannot write benchmark module\n");
+        if (fd >= 0) {
+            remove(path);
+        }
+        free(linkage);
+        return;
+    }
+
+    static const char *const modes[] = {"eager", "lazy", "cached"};
+    for (uptr m = 0; m < sizeof modes / sizeof *modes; m++) {
+        double start = now();
+        for (int i = 0; i < LOADS; i++) {
+            const char *error = NULL;
+            ModuleLink *ml;
+            if (m == 2) {
+                ml = module_load(path, linkage, &error);
+            } else {
+                Module *module = module_read(path, &error);
+                if (module != NULL && m == 0) {
+                    module_code(module);
+                }
+                ml = module != NULL ? module_link(module, linkage) : NULL;
+            }
+            if (ml == NULL) {
+                fprintf(stderr, "cannot load benchmark module: %s\n", error);
+                break;
+            }
+            module_unlink(ml);
+        }
+        double elapsed = now() - start;
+        report(modes[m], "loads", LOADS, elapsed);
+    }
+    module_cache_flush();
+    remove(path);
+    free(linkage);
+}
+
+/// Write an object file.
+///
+/// \return Whether the whole file was written.
+static bool write_module(const char *path, const byte *image, uptr size)
+{
+    FILE *file = fopen(path, "wb");
+    bool written = file != NULL && fwrite(image, 1, size, file) == size;
+    if (file != NULL) {
+        written &= fclose(file) == 0;
+    }
+    return written;
+}
+
+/// Start a program that loads libraries and has each of them build a table
+/// as it initialises, then restore a snapshot taken once it had.
+static void bench_snapshot(void)
+{
+    enum { LIBRARIES = 24, TABLE = 4096, ROUNDS = 5 };
+
+    char dir[] = "/tmp/dis_benchXXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "cannot make benchmark directory\n");
+        return;
+    }
+    char paths[LIBRARIES + 2][sizeof dir + 16];
+    for (int l = 0; l < LIBRARIES; l++) {
+        snprintf(paths[l], sizeof paths[l], "%s/lib%d.dis", dir, l);
+    }
+    char *main_path = paths[LIBRARIES];
+    char *snapshot_path = paths[LIBRARIES + 1];
+    snprintf(main_path, sizeof paths[0], "%s/main.dis", dir);
+    snprintf(snapshot_path, sizeof paths[0], "%s/main.snap", dir);
+
+    // Each library's data: 0 the table, 8 its name. Its init frame: 40 i,
+    // 48 element address. The table holds the squares.
+    bool written = true;
+    for (int l = 0; l < LIBRARIES && written; l++) {
+        static const byte data_map[] = {0xC0};
+        Assembler a = {0};
+        asm_type(&a, 16, 1, data_map);
+        word init = asm_type(&a, 56, 0, NULL);
+        word element = asm_type(&a, sizeof(word), 0, NULL);
+        asm_inst(&a, IN_NEWA, IMM(TABLE), IMM(element), MP(0));
+        asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+        asm_inst(&a, IN_INDW, MP(0), FP(48), FP(40));
+        asm_inst(&a, IN_MULW, FP(40), FP(40), IFP(48, 0));
+        asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+        asm_inst(&a, IN_BLTW, FP(40), IMM(TABLE), IMM(2));
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        asm_export(&a, 0, init, 0, "init");
+        char name[16];
+        snprintf(name, sizeof name, "library %d", l);
+        asm_string(&a, 8, name);
+        uptr size;
+        byte *image = asm_finish(&a, "Library", 16, -1, -1, &size);
+        written = write_module(paths[l], image, size);
+        free(image);
+    }
+
+    // The program's data: the module links, then the libraries' paths, then
+    // the linkage descriptor that imports init. Entry frame: 48 callee frame.
+    if (written) {
+        byte data_map[(2 * LIBRARIES + 7) / 8];
+        memset(data_map, 0xFF, sizeof data_map);
+        if (2 * LIBRARIES % 8 != 0) {
+            data_map[sizeof data_map - 1] = (byte) (0xFF << (8 - 2 * LIBRARIES % 8));
+        }
+        word linkage = 16 * LIBRARIES;
+        word descriptor[4] = {1, 0};
+        memcpy(&descriptor[2], "init", 4);
+        Assembler a = {0};
+        asm_type(&a, linkage + sizeof descriptor, sizeof data_map, data_map);
+        word entry = asm_type(&a, 56, 0, NULL);
+        for (int l = 0; l < LIBRARIES; l++) {
+            asm_inst(&a, IN_LOAD, MP(8 * LIBRARIES + 8 * l), MP(linkage), MP(8 * l));
+            asm_inst(&a, IN_MFRAME, MP(8 * l), IMM(0), FP(48));
+            asm_inst(&a, IN_MCALL, FP(48), IMM(0), MP(8 * l));
+            asm_string(&a, 8 * LIBRARIES + 8 * l, paths[l]);
+        }
+        asm_inst(&a, IN_RET, NONE, NONE, NONE);
+        asm_words(&a, linkage, 4, descriptor);
+        uptr size;
+        byte *image = asm_finish(&a, "Main", linkage + sizeof descriptor, 0, entry, &size);
+        written = write_module(main_path, image, size);
+        free(image);
+    }
+    if (!written) {
+        fprintf(stderr, "cannot write benchmark modules\n");
+        goto done;
+    }
+
+    // Starting afresh reads and decodes every module again, as a new process
+    // would.
+    double best[2] = {-1, -1};
+    for (int round = 0; round < ROUNDS; round++) {
+        module_cache_flush();
+        double start = now();
+        const char *error = NULL;
+        Module *module = module_read(main_path, &error);
+        if (module == NULL) {
+            fprintf(stderr, "cannot read benchmark module: %s\n", error);
+            goto done;
+        }
+        ModuleLink *ml = module_link(module, NULL);
+        ExecutionContext context;
+        execution_init(&context, ml);
+        ExecutionStatus status = execute(&context);
+        double elapsed = now() - start;
+        if (status != EXEC_EXITED) {
+            fprintf(stderr, "benchmark failed: %s\n", context.error);
+        }
+        execution_free(&context);
+        bool saved = status == EXEC_EXITED &&
+                     (round > 0 || snapshot_save(ml, snapshot_path, &error));
+        module_unlink(ml);
+        if (!saved) {
+            if (status == EXEC_EXITED) {
+                fprintf(stderr, "cannot save snapshot: %s\n", error);
+            }
+            goto done;
+        }
+        if (best[0] < 0 || elapsed < best[0]) {
+            best[0] = elapsed;
+        }
+    }
+    module_cache_flush();
+
+    for (int round = 0; round < ROUNDS; round++) {
+        double start = now();
+        const char *error = NULL;
+        ModuleLink *ml = snapshot_restore(snapshot_path, &error);
+        double elapsed = now() - start;
+        if (ml == NULL) {
+            fprintf(stderr, "cannot restore snapshot: %s\n", error);
+            goto done;
+        }
+        // The last library's table, restored as it was built.
+        ModuleLink *library = *(ModuleLink **) (ml->mp + 8 * (LIBRARIES - 1));
+        Array *table = *(Array **) library->mp;
+        bool intact = ((word *) table->data)[TABLE - 1] == (TABLE - 1) * (TABLE - 1);
+        module_unlink(ml);
+        if (!intact) {
+            fprintf(stderr, "snapshot restored wrongly\n");
+            goto done;
+        }
+        if (best[1] < 0 || elapsed < best[1]) {
+            best[1] = elapsed;
+        }
+    }
+
+    report("init", "starts", 1, best[0]);
+    report("restore", "starts", 1, best[1]);
+    note("speedup %.1fx", best[0] / best[1]);
+
+done:
+    module_cache_flush();
+    for (int l = 0; l < LIBRARIES + 2; l++) {
+        remove(paths[l]);
+    }
+    remove(dir);
+}
+
+#if DIS_PROFILE
+/// Call a function that sums a word array repeatedly, with and without the
+/// profiler, and show what the profiler found.
+static void bench_profile(void)
+{
+    enum { LENGTH = 1000, REPS = 10000 };
+
+    // Module data: 0 array, 8 sum. Entry frame: 40 repetition, 48 callee
+    // frame. Summing frame: 40 i, 44 n, 48 element address.
+    Assembler a = {0};
+    word entry = asm_type(&a, 56, 0, NULL);
+    word sum = asm_type(&a, 56, 0, NULL);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_FRAME, IMM(sum), NONE, FP(48));
+    asm_inst(&a, IN_CALL, FP(48), NONE, IMM(6));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(REPS), IMM(1));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    word start = asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_LENA, MP(0), NONE, FP(44));
+    asm_inst(&a, IN_BGEW, FP(40), FP(44), IMM(13));
+    asm_inst(&a, IN_INDW, MP(0), FP(48), FP(40));
+    asm_inst(&a, IN_ADDW, IFP(48, 0), NONE, MP(8));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(8));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    asm_export(&a, start, sum, 0, "sum");
+    uptr size;
+    byte *image = asm_finish(&a, "Profile", 16, 0, entry, &size);
+
+    static TypeDescriptor word_type = {.size = sizeof(word), .references = 1};
+    Array *array = heap_array(&word_type, LENGTH);
+    for (word i = 0; i < LENGTH; i++) {
+        ((word *) array->data)[i] = i;
+    }
+
+    // Five instructions per element, eight per call, and the first and last
+    // instructions of the program.
+    double instructions = 5.0 * LENGTH * REPS + 8.0 * REPS + 2;
+    double best[2] = {-1, -1};
+    for (int round = 0; round < 5; round++) {
+        for (int on = 0; on <= 1; on++) {
+            // Each run loads the module afresh, so only keep the last
+            // profile.
+            profile_reset();
+            profile_enable(on);
+            double elapsed = run(image, size, array);
+            if (elapsed < 0) {
+                profile_enable(false);
+                goto done;
+            }
+            if (best[on] < 0 || elapsed < best[on]) {
+                best[on] = elapsed;
+            }
+        }
+    }
+    profile_enable(false);
+
+    for (int on = 0; on <= 1; on++) {
+        report(on ? "on" : "off", "instructions", instructions, best[on]);
+    }
+    note("overhead %.1f%%", (best[1] / best[0] - 1) * 100);
+
+    // Show what the last run found: the common opcodes and every function.
+
+    ProfileOpcode opcodes[256];
+    profile_opcodes(opcodes);
+    for (int i = 0; i < 256; i++) {
+        if (opcodes[i].count * 100 > instructions * 5) {
+            note("opcode %-10s %12llu executed %6.2f ticks each",
+                 instruction_name((byte) i), (unsigned long long) opcodes[i].count,
+                 (double) opcodes[i].cycles / (double) opcodes[i].count);
+        }
+    }
+    uptr n;
+    ProfileFunction *functions = profile_functions(&n);
+    double total = 0;
+    for (uptr i = 0; i < n; i++) {
+        total += (double) functions[i].self_cycles;
+    }
+    for (uptr i = 0; i < n; i++) {
+        note("function %-14s %8llu calls %6.1f%% self %6.1f%% total",
+             functions[i].name, (unsigned long long) functions[i].calls,
+             100.0 * (double) functions[i].self_cycles / (total > 0 ? total : 1),
+             100.0 * (double) functions[i].total_cycles / (total > 0 ? total : 1));
+    }
+    free(functions);
+
+done:
+    profile_reset();
+    heap_release(array);
+    free(image);
+}
+#endif
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benchmarks[] = {
+    {"arith", bench_arith},
+    {"branch", bench_branch},
+    {"fusion", bench_fusion},
+    {"quicken", bench_quicken},
+    {"call", bench_call},
+    {"mcall", bench_mcall},
+    {"spawn", bench_spawn},
+    {"channel", bench_channel},
+    {"alt", bench_alt},
+    {"chain", bench_chain},
+    {"heap", bench_heap},
+    {"string", bench_string},
+    {"case", bench_case},
+    {"bulk", bench_bulk},
+    {"load", bench_load},
+    {"snapshot", bench_snapshot},
+    {"sieve", bench_sieve},
+    {"fib", bench_fib},
+    {"trees", bench_trees},
+    {"pipeline", bench_pipeline},
+#if DIS_JIT
+    {"jit", bench_jit},
+    {"aot", bench_aot},
+#endif
+#if DIS_PROFILE
+    {"profile", bench_profile},
+#endif
+};
+
+int main(int argc, char **argv)
+{
+    uptr n = sizeof benchmarks / sizeof *benchmarks;
+    bool any = false;
+    for (int j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "--json") == 0) {
+            json = true;
+            argv[j] = NULL;
+        } else if (strcmp(argv[j], "--list") == 0) {
+            for (uptr i = 0; i < n; i++) {
+                printf("%s\n", benchmarks[i].name);
+            }
+            return 0;
+        } else {
+            bool known = false;
+            for (uptr i = 0; i < n; i++) {
+                known |= strcmp(argv[j], benchmarks[i].name) == 0;
+            }
+            if (!known) {
+                fprintf(stderr, "usage: %s [--json] [--list] [benchmark...]\n", argv[0]);
+                return 2;
+            }
+            any = true;
+        }
+    }
+
+    for (uptr i = 0; i < n; i++) {
+        bool selected = !any;
+        for (int j = 1; j < argc; j++) {
+            selected |= argv[j] != NULL && strcmp(argv[j], benchmarks[i].name) == 0;
+        }
+        if (selected) {
+            benchmark = benchmarks[i].name;
+            if (!json) {
+                printf("%s\n", benchmark);
+            }
+            benchmarks[i].run();
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef DIS_BENCH_BENCH_H
+#define DIS_BENCH_BENCH_H
+
+// What the benchmarks share: running hand-assembled modules, and reporting
+// what they measured in a form people or scripts can read.
+
+#include "../heap.h"
+
+/// Read a monotonic clock.
+///
+/// \return The time in seconds since some fixed point.
+double now(void);
+
+/// Link a hand-assembled module and run its entry point to completion.
+///
+/// \param image The object file.
+/// \param size The size of the object file.
+/// \param array An array to store in the first pointer of the module data,
+/// which takes over the reference to it, or `NULL`.
+/// \return Seconds taken by `execute()`, or a negative number on failure.
+double run(const byte *image, uptr size, Array *array);
+
+/// Link a hand-assembled module and run its entry point as a Dis thread,
+/// until every thread it spawns has stopped too.
+///
+/// \param image The object file, which is freed.
+/// \param size The size of the object file.
+/// \param result Location to store the first word of the module data in
+/// after the last round, or `NULL`.
+/// \return Seconds taken by the best of five rounds, or a negative number on
+/// failure.
+double schedule(byte *image, uptr size, word *result);
+
+/// Report a measurement of the running benchmark.
+///
+/// \param name What was measured, unique within the benchmark.
+/// \param unit What was done, in the plural: "calls", "messages".
+/// \param count How many were done.
+/// \param seconds How long they took.
+void report(const char *name, const char *unit, double count, double seconds);
+
+/// Explain a measurement, in the text output only.
+///
+/// \param format A `printf()` format, for one line without its newline.
+void note(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/// Run the sieve of Eratosthenes over a byte array.
+void bench_sieve(void);
+
+/// Compute Fibonacci numbers by naive recursion.
+void bench_fib(void);
+
+/// Build complete binary trees of records, count their nodes and free them.
+void bench_trees(void);
+
+/// Find primes with a pipeline of filter threads joined by channels.
+void bench_pipeline(void);
+
+#endif //DIS_BENCH_BENCH_H
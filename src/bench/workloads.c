@@ -0,0 +1,263 @@
+// Macro workloads: small programs, hand-assembled, that mix instructions as
+// real programs do, so that a change which speeds up one instruction can be
+// weighed against what it costs the rest.
+//
+// Each program leaves an answer in the first word of its module data, which
+// is checked, so that a benchmark cannot get quicker by going wrong.
+//
+// As in Dis, a function that returns a value is passed the address to store
+// it at in the word of its frame after the header, at offset 32.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../instructions.h"
+#include "asm.h"
+#include "bench.h"
+
+/// Run a workload's module as a Dis thread, check its answer and report its
+/// best time.
+///
+/// \param image The object file, which is freed.
+/// \param size The size of the object file.
+/// \param expected The answer the module should leave.
+/// \param unit What the workload does.
+/// \param count How many it does in a round.
+static void measure(byte *image, uptr size, word expected, const char *unit, double count)
+{
+    word answer = 0;
+    double best = schedule(image, size, &answer);
+    if (best < 0) {
+        return;
+    }
+    if (answer != expected) {
+        fprintf(stderr, "wrong answer: %d, not %d\n", (int) answer, (int) expected);
+        return;
+    }
+    report("run", unit, count, best);
+}
+
+void bench_sieve(void)
+{
+    enum { LENGTH = 1 << 20, ROOT = 1 << 10, REPS = 10, PRIMES = 82025 };
+
+    // Entry frame: 40 i, 44 multiple of i, 48 array, 56 element address, 64
+    // count, 68 repetition, 72 element.
+    static const byte frame_map[] = {0x02};
+    Assembler a = {0};
+    word entry = asm_type(&a, 80, sizeof frame_map, frame_map);
+    word bytes = asm_type(&a, 1, 0, NULL);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(68));
+    asm_inst(&a, IN_NEWA, IMM(LENGTH), IMM(bytes), FP(48));
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(64));
+    asm_inst(&a, IN_MOVW, IMM(2), NONE, FP(40));
+    // Each number still 0 is prime, and marks its multiples.
+    asm_inst(&a, IN_BGEW, FP(40), IMM(LENGTH), IMM(18));
+    asm_inst(&a, IN_INDB, FP(48), FP(56), FP(40));
+    asm_inst(&a, IN_CVTBW, IFP(56, 0), NONE, FP(72));
+    asm_inst(&a, IN_BNEW, FP(72), IMM(0), IMM(16));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(64));
+    asm_inst(&a, IN_BGTW, FP(40), IMM(ROOT), IMM(16));
+    asm_inst(&a, IN_MULW, FP(40), FP(40), FP(44));
+    asm_inst(&a, IN_BGEW, FP(44), IMM(LENGTH), IMM(16));
+    asm_inst(&a, IN_INDB, FP(48), FP(56), FP(44));
+    asm_inst(&a, IN_MOVB, IMM(1), NONE, IFP(56, 0));
+    asm_inst(&a, IN_ADDW, FP(40), NONE, FP(44));
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(11));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(4));
+    asm_inst(&a, IN_MOVW, FP(64), NONE, MP(0));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(68));
+    asm_inst(&a, IN_BLTW, FP(68), IMM(REPS), IMM(1));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Sieve", 8, 0, entry, &size);
+
+    measure(image, size, PRIMES, "numbers", (double) LENGTH * REPS);
+}
+
+void bench_fib(void)
+{
+    enum { N = 27, REPS = 10, FIB = 196418, CALLS = 635621 };
+
+    // Entry frame: 40 repetition, 44 result, 48 callee frame. Fibonacci frame:
+    // 40 n, 44 and 48 the results of the calls, 56 callee frame.
+    Assembler a = {0};
+    word entry = asm_type(&a, 56, 0, NULL);
+    word fib = asm_type(&a, 64, 0, NULL);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_FRAME, IMM(fib), NONE, FP(48));
+    asm_inst(&a, IN_MOVW, IMM(N), NONE, IFP(48, 40));
+    asm_inst(&a, IN_LEA, FP(44), NONE, IFP(48, 32));
+    asm_inst(&a, IN_CALL, FP(48), NONE, IMM(9));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(REPS), IMM(1));
+    asm_inst(&a, IN_MOVW, FP(44), NONE, MP(0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    asm_inst(&a, IN_BLTW, FP(40), IMM(2), IMM(20));
+    asm_inst(&a, IN_FRAME, IMM(fib), NONE, FP(56));
+    asm_inst(&a, IN_SUBW, IMM(1), FP(40), IFP(56, 40));
+    asm_inst(&a, IN_LEA, FP(44), NONE, IFP(56, 32));
+    asm_inst(&a, IN_CALL, FP(56), NONE, IMM(9));
+    asm_inst(&a, IN_FRAME, IMM(fib), NONE, FP(56));
+    asm_inst(&a, IN_SUBW, IMM(2), FP(40), IFP(56, 40));
+    asm_inst(&a, IN_LEA, FP(48), NONE, IFP(56, 32));
+    asm_inst(&a, IN_CALL, FP(56), NONE, IMM(9));
+    asm_inst(&a, IN_ADDW, FP(44), FP(48), IFP(32, 0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    asm_inst(&a, IN_MOVW, FP(40), NONE, IFP(32, 0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Fib", 8, 0, entry, &size);
+
+    measure(image, size, FIB, "calls", (double) CALLS * REPS);
+}
+
+void bench_trees(void)
+{
+    enum { DEPTH = 16, REPS = 10, NODES = (2 << DEPTH) - 1 };
+
+    // Entry frame: 40 repetition, 44 count, 48 tree, 56 callee frame, 64 nil.
+    // Building frame: 40 depth, 48 node, 56 callee frame. Counting frame: 40
+    // node, 48 depth, 52 and 56 the counts of its subtrees, 64 callee frame.
+    // Node: 0 left, 8 right.
+    static const byte entry_map[] = {0x02, 0x80};
+    static const byte make_map[] = {0x02};
+    static const byte check_map[] = {0x04};
+    static const byte node_map[] = {0xc0};
+    Assembler a = {0};
+    word entry = asm_type(&a, 72, sizeof entry_map, entry_map);
+    word make = asm_type(&a, 64, sizeof make_map, make_map);
+    word check = asm_type(&a, 72, sizeof check_map, check_map);
+    word node = asm_type(&a, 16, sizeof node_map, node_map);
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(40));
+    asm_inst(&a, IN_FRAME, IMM(make), NONE, FP(56));
+    asm_inst(&a, IN_MOVW, IMM(DEPTH), NONE, IFP(56, 40));
+    asm_inst(&a, IN_LEA, FP(48), NONE, IFP(56, 32));
+    asm_inst(&a, IN_CALL, FP(56), NONE, IMM(15));
+    asm_inst(&a, IN_FRAME, IMM(check), NONE, FP(56));
+    asm_inst(&a, IN_MOVP, FP(48), NONE, IFP(56, 40));
+    asm_inst(&a, IN_MOVW, IMM(DEPTH), NONE, IFP(56, 48));
+    asm_inst(&a, IN_LEA, FP(44), NONE, IFP(56, 32));
+    asm_inst(&a, IN_CALL, FP(56), NONE, IMM(27));
+    asm_inst(&a, IN_MOVP, FP(64), NONE, FP(48));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(40));
+    asm_inst(&a, IN_BLTW, FP(40), IMM(REPS), IMM(1));
+    asm_inst(&a, IN_MOVW, FP(44), NONE, MP(0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    // Build a node, and build its subtrees straight into it.
+    asm_inst(&a, IN_NEW, IMM(node), NONE, FP(48));
+    asm_inst(&a, IN_BEQW, FP(40), IMM(0), IMM(25));
+    asm_inst(&a, IN_FRAME, IMM(make), NONE, FP(56));
+    asm_inst(&a, IN_SUBW, IMM(1), FP(40), IFP(56, 40));
+    asm_inst(&a, IN_LEA, IFP(48, 0), NONE, IFP(56, 32));
+    asm_inst(&a, IN_CALL, FP(56), NONE, IMM(15));
+    asm_inst(&a, IN_FRAME, IMM(make), NONE, FP(56));
+    asm_inst(&a, IN_SUBW, IMM(1), FP(40), IFP(56, 40));
+    asm_inst(&a, IN_LEA, IFP(48, 8), NONE, IFP(56, 32));
+    asm_inst(&a, IN_CALL, FP(56), NONE, IMM(15));
+    asm_inst(&a, IN_MOVP, FP(48), NONE, IFP(32, 0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    // Count a node and its subtrees.
+    asm_inst(&a, IN_BEQW, FP(48), IMM(0), IMM(41));
+    asm_inst(&a, IN_FRAME, IMM(check), NONE, FP(64));
+    asm_inst(&a, IN_MOVP, IFP(40, 0), NONE, IFP(64, 40));
+    asm_inst(&a, IN_SUBW, IMM(1), FP(48), IFP(64, 48));
+    asm_inst(&a, IN_LEA, FP(52), NONE, IFP(64, 32));
+    asm_inst(&a, IN_CALL, FP(64), NONE, IMM(27));
+    asm_inst(&a, IN_FRAME, IMM(check), NONE, FP(64));
+    asm_inst(&a, IN_MOVP, IFP(40, 8), NONE, IFP(64, 40));
+    asm_inst(&a, IN_SUBW, IMM(1), FP(48), IFP(64, 48));
+    asm_inst(&a, IN_LEA, FP(56), NONE, IFP(64, 32));
+    asm_inst(&a, IN_CALL, FP(64), NONE, IMM(27));
+    asm_inst(&a, IN_ADDW, FP(52), FP(56), FP(52));
+    asm_inst(&a, IN_ADDW, IMM(1), FP(52), IFP(32, 0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    asm_inst(&a, IN_MOVW, IMM(1), NONE, IFP(32, 0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Trees", 8, 0, entry, &size);
+
+    measure(image, size, NODES, "nodes", (double) NODES * REPS);
+}
+
+void bench_pipeline(void)
+{
+    enum { LIMIT = 5000 };
+
+    // Count the primes, and the messages sent: a number is sent by the
+    // generator, and passed on by the filter of each prime less than its
+    // smallest prime factor. The 0 that ends the run is passed on by all of
+    // them.
+    byte *composite = calloc(LIMIT + 1, 1);
+    word primes = 0;
+    double messages = 0;
+    for (word n = 2; n <= LIMIT; n++) {
+        if (composite[n]) {
+            continue;
+        }
+        // The numbers whose smallest prime factor is n are passed on by the
+        // filters of the primes before it.
+        for (word m = n; m <= LIMIT; m += n) {
+            if (!composite[m]) {
+                composite[m] = 1;
+                messages += 1 + primes;
+            }
+        }
+        primes++;
+    }
+    messages += 1 + primes;
+    free(composite);
+
+    // Entry frame: 40 channel from the last filter, 48 channel to the next
+    // one, 56 child frame, 64 prime, 68 count. Generator frame: 40 channel, 48
+    // number. Filter frame: 40 channel in, 48 channel out, 56 prime, 60
+    // number, 64 remainder.
+    static const byte entry_map[] = {0x06};
+    static const byte generator_map[] = {0x04};
+    static const byte filter_map[] = {0x06};
+    Assembler a = {0};
+    word entry = asm_type(&a, 72, sizeof entry_map, entry_map);
+    word generator = asm_type(&a, 56, sizeof generator_map, generator_map);
+    word filter = asm_type(&a, 72, sizeof filter_map, filter_map);
+    asm_inst(&a, IN_NEWCW, NONE, NONE, FP(40));
+    asm_inst(&a, IN_FRAME, IMM(generator), NONE, FP(56));
+    asm_inst(&a, IN_MOVP, FP(40), NONE, IFP(56, 40));
+    asm_inst(&a, IN_SPAWN, FP(56), NONE, IMM(18));
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(68));
+    // Each number to get this far is prime, and gets a filter of its own.
+    asm_inst(&a, IN_RECV, FP(40), NONE, FP(64));
+    asm_inst(&a, IN_BEQW, FP(64), IMM(0), IMM(16));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(68));
+    asm_inst(&a, IN_NEWCW, NONE, NONE, FP(48));
+    asm_inst(&a, IN_FRAME, IMM(filter), NONE, FP(56));
+    asm_inst(&a, IN_MOVP, FP(40), NONE, IFP(56, 40));
+    asm_inst(&a, IN_MOVP, FP(48), NONE, IFP(56, 48));
+    asm_inst(&a, IN_MOVW, FP(64), NONE, IFP(56, 56));
+    asm_inst(&a, IN_SPAWN, FP(56), NONE, IMM(25));
+    asm_inst(&a, IN_MOVP, FP(48), NONE, FP(40));
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(5));
+    asm_inst(&a, IN_MOVW, FP(68), NONE, MP(0));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    // Send 2 to the limit, then 0.
+    asm_inst(&a, IN_MOVW, IMM(2), NONE, FP(48));
+    asm_inst(&a, IN_SEND, FP(48), NONE, FP(40));
+    asm_inst(&a, IN_ADDW, IMM(1), NONE, FP(48));
+    asm_inst(&a, IN_BLEW, FP(48), IMM(LIMIT), IMM(19));
+    asm_inst(&a, IN_MOVW, IMM(0), NONE, FP(48));
+    asm_inst(&a, IN_SEND, FP(48), NONE, FP(40));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    // Pass on the numbers that are not multiples of the prime, and the 0.
+    asm_inst(&a, IN_RECV, FP(40), NONE, FP(60));
+    asm_inst(&a, IN_BEQW, FP(60), IMM(0), IMM(31));
+    asm_inst(&a, IN_MODW, FP(56), FP(60), FP(64));
+    asm_inst(&a, IN_BEQW, FP(64), IMM(0), IMM(25));
+    asm_inst(&a, IN_SEND, FP(60), NONE, FP(48));
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(25));
+    asm_inst(&a, IN_SEND, FP(60), NONE, FP(48));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Pipeline", 8, 0, entry, &size);
+
+    measure(image, size, primes, "messages", messages);
+}
@@ -0,0 +1,280 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "instructions.h"
+#include "module.h"
+#include "str.h"
+
+/// A jump table is made only if it has at most this many entries for each
+/// range in the `case` table, so that its size is in proportion to the table.
+#define JUMP_DENSITY 4
+
+/// The most entries a jump table may have, and the fewest ranges worth one:
+/// a binary search of two ranges is already as quick.
+#define JUMP_MAX 65536
+#define JUMP_MIN 3
+
+/// The most strings a hash table may have.
+#define HASH_MAX 65536
+
+/// The number of displacements tried for each bucket of a hash table before
+/// giving up on it.
+#define DISPLACEMENT_TRIES 65536
+
+/// Whether `size` bytes at `offset` lie within the module data.
+static bool in_data(const Module *module, word offset, uptr size)
+{
+    return offset >= 0 && (uptr) offset <= (uptr) module->data_size &&
+           size <= (uptr) module->data_size - (uptr) offset;
+}
+
+/// Whether a table's target is an instruction of the module, as a compiled
+/// table's targets must be: they are jumped to without checking.
+static bool is_target(const Module *module, word pc)
+{
+    return pc >= 0 && pc < module->ninstructions;
+}
+
+/// Whether the word at `offset` in the module data is a pointer.
+static bool is_pointer(const Module *module, uptr offset)
+{
+    const TypeDescriptor *t = module->data_type;
+    uptr slot = offset / sizeof(pointer);
+    return t != NULL && offset % sizeof(pointer) == 0 && slot / 8 < (uptr) t->np &&
+           t->map[slot / 8] & 0x80 >> slot % 8;
+}
+
+/// Compile a `case` table of `n` ranges into a jump table if it is dense.
+static bool compile_case(const Module *module, word offset, CaseTable *table)
+{
+    // The table is a count `n`, followed by `n` sorted (low, high, pc)
+    // triples with an exclusive upper bound, followed by the default pc.
+    if (offset % sizeof(word) != 0 || !in_data(module, offset, sizeof(word))) {
+        return false;
+    }
+    const word *t = (const word *) (module->data + offset);
+    word n = t[0];
+    if (n < JUMP_MIN || n > JUMP_MAX ||
+        !in_data(module, offset, (1 + 3 * (uptr) n + 1) * sizeof(word))) {
+        return false;
+    }
+    const word *entries = t + 1;
+    int64_t low = entries[0], high = entries[3 * (n - 1) + 1];
+    if (high - low > (int64_t) JUMP_DENSITY * n || high - low > JUMP_MAX) {
+        return false;
+    }
+    // The binary search relies on the ranges being sorted and disjoint, so a
+    // table that is not has no meaning to preserve. A table with a target
+    // outside the code is left to the search, which checks where it jumps.
+    for (word i = 0; i < n; i++) {
+        const word *e = entries + 3 * i;
+        if (e[0] > e[1] || (i > 0 && e[0] < e[-2]) || !is_target(module, e[2])) {
+            return false;
+        }
+    }
+    if (!is_target(module, entries[3 * n])) {
+        return false;
+    }
+
+    table->default_pc = entries[3 * n];
+    table->low = (word) low;
+    table->size = (word) (high - low);
+    table->pcs = malloc(((uptr) table->size ? (uptr) table->size : 1) * sizeof(word));
+    if (table->pcs == NULL) {
+        return false;
+    }
+    for (word i = 0; i < table->size; i++) {
+        table->pcs[i] = table->default_pc;
+    }
+    for (word i = 0; i < n; i++) {
+        const word *e = entries + 3 * i;
+        for (int64_t v = e[0]; v < e[1]; v++) {
+            table->pcs[v - low] = e[2];
+        }
+    }
+    return true;
+}
+
+/// A bucket of a hash table being built: the indexes of the strings in it.
+typedef struct Bucket {
+    word *keys;
+    word n;
+} Bucket;
+
+static int compare_buckets(const void *a, const void *b)
+{
+    return (int) (((const Bucket *) b)->n - ((const Bucket *) a)->n);
+}
+
+/// Find a displacement for every bucket that puts each string in a slot of
+/// its own, filling in the table's keys and pcs.
+static bool place_keys(CaseTable *table, const StringCase *entries,
+                       const uint32_t *hashes, word n)
+{
+    uint32_t nbuckets = table->bucket_mask + 1;
+    Bucket *buckets = calloc(nbuckets, sizeof(Bucket));
+    word *members = malloc(((uptr) n ? (uptr) n : 1) * sizeof(word));
+    word *slots = malloc(((uptr) n ? (uptr) n : 1) * sizeof(word));
+    if (buckets == NULL || members == NULL || slots == NULL) {
+        free(slots);
+        free(members);
+        free(buckets);
+        return false;
+    }
+    // Count the strings in each bucket, then give each its share of
+    // `members`.
+    for (word i = 0; i < n; i++) {
+        buckets[hashes[i] & table->bucket_mask].n++;
+    }
+    word used = 0;
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        buckets[b].keys = members + used;
+        used += buckets[b].n;
+        buckets[b].n = 0;
+    }
+    for (word i = 0; i < n; i++) {
+        Bucket *bucket = &buckets[hashes[i] & table->bucket_mask];
+        bucket->keys[bucket->n++] = i;
+    }
+    // Place the largest buckets first, while most slots are free.
+    qsort(buckets, nbuckets, sizeof(Bucket), compare_buckets);
+
+    bool placed = true;
+    for (uint32_t b = 0; b < nbuckets && placed && buckets[b].n > 0; b++) {
+        const Bucket *bucket = &buckets[b];
+        uint32_t index = hashes[bucket->keys[0]] & table->bucket_mask;
+        placed = false;
+        for (uint32_t d = 0; d < DISPLACEMENT_TRIES && !placed; d++) {
+            table->displacements[index] = d;
+            placed = true;
+            for (word k = 0; k < bucket->n && placed; k++) {
+                uint32_t slot = case_slot(table, hashes[bucket->keys[k]]);
+                placed = table->keys[slot] == H;
+                for (word j = 0; j < k && placed; j++) {
+                    placed = slots[j] != (word) slot;
+                }
+                slots[k] = (word) slot;
+            }
+        }
+        for (word k = 0; k < bucket->n && placed; k++) {
+            const StringCase *e = &entries[bucket->keys[k]];
+            table->keys[slots[k]] = e->low;
+            table->pcs[slots[k]] = e->pc;
+        }
+    }
+    free(slots);
+    free(members);
+    free(buckets);
+    return placed;
+}
+
+/// Compile a `casec` table into a perfect hash table if every entry in it is
+/// a single string.
+static bool compile_casec(const Module *module, word offset, CaseTable *table)
+{
+    // The table is a count `n`, padded to the size of a pointer, followed by
+    // `n` `StringCase`s, followed by the default pc.
+    if (offset % sizeof(pointer) != 0 || !in_data(module, offset, sizeof(pointer))) {
+        return false;
+    }
+    word n = *(const word *) (module->data + offset);
+    uptr start = (uptr) offset + sizeof(pointer);
+    if (n < 1 || n > HASH_MAX ||
+        !in_data(module, offset, sizeof(pointer) + (uptr) n * sizeof(StringCase) + sizeof(word))) {
+        return false;
+    }
+    const StringCase *entries = (const StringCase *) (module->data + start);
+    for (word i = 0; i < n; i++) {
+        uptr e = start + (uptr) i * sizeof(StringCase);
+        if (!is_pointer(module, e + offsetof(StringCase, low)) ||
+            !is_pointer(module, e + offsetof(StringCase, high)) ||
+            entries[i].high != H || (i > 0 && entries[i].low == H) ||
+            !is_target(module, entries[i].pc)) {
+            return false;
+        }
+    }
+    if (!is_target(module, *(const word *) (entries + n))) {
+        return false;
+    }
+
+    table->default_pc = *(const word *) (entries + n);
+    table->empty_pc = table->default_pc;
+    // The empty string sorts first.
+    if (entries[0].low == H) {
+        table->empty_pc = entries[0].pc;
+        entries++;
+        n--;
+    }
+    uint32_t nslots = 2;
+    while (nslots < 2 * (uint32_t) n) {
+        nslots *= 2;
+    }
+    uint32_t nbuckets = 1;
+    while (4 * nbuckets < (uint32_t) n) {
+        nbuckets *= 2;
+    }
+    table->bucket_mask = nbuckets - 1;
+    table->shift = 32;
+    for (uint32_t size = nslots; size > 1; size /= 2) {
+        table->shift--;
+    }
+    table->displacements = calloc(nbuckets, sizeof(uint32_t));
+    table->keys = calloc(nslots, sizeof(String *));
+    table->pcs = calloc(nslots, sizeof(word));
+
+    uint32_t *hashes = malloc(((uptr) n ? (uptr) n : 1) * sizeof(uint32_t));
+    bool placed = table->displacements != NULL && table->keys != NULL &&
+                  table->pcs != NULL && hashes != NULL;
+    for (word i = 0; placed && i < n; i++) {
+        hashes[i] = string_hash(entries[i].low);
+    }
+    placed = placed && place_keys(table, entries, hashes, n);
+    free(hashes);
+    if (!placed) {
+        free(table->displacements);
+        free(table->keys);
+        free(table->pcs);
+        return false;
+    }
+    for (uint32_t i = 0; i < nslots; i++) {
+        heap_retain(table->keys[i]);
+    }
+    return true;
+}
+
+void module_compile_cases(Module *module)
+{
+    word n = 0;
+    for (word i = 0; i < module->ninstructions; i++) {
+        byte opcode = module->code[i].opcode;
+        n += opcode == IN_CASE || opcode == IN_CASEC;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    // Without memory for the tables, every table is left to the search.
+    module->cases = calloc((uptr) n, sizeof(CaseTable));
+    if (module->cases == NULL) {
+        return;
+    }
+    for (word i = 0; i < module->ninstructions; i++) {
+        Inst *inst = &module->code[i];
+        // Only tables in the module data are known before the code runs.
+        if ((inst->opcode != IN_CASE && inst->opcode != IN_CASEC) ||
+            inst->d.mode != AMP) {
+            continue;
+        }
+        CaseTable *table = &module->cases[module->ncases];
+        *table = (CaseTable) {0};
+        bool compiled = inst->opcode == IN_CASE
+                            ? compile_case(module, inst->d.offset, table)
+                            : compile_casec(module, inst->d.offset, table);
+        if (compiled) {
+            inst->opcode = inst->opcode == IN_CASE ? IN_XCASE : IN_XCASEC;
+            inst->handler = execution_handler(inst->opcode);
+            inst->m = (Operand) {.mode = AIMM, .offset = module->ncases++};
+        }
+    }
+}
@@ -0,0 +1,671 @@
+#define _DEFAULT_SOURCE // sched_yield
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "heap.h"
+#include "scheduler.h"
+
+/// The number of times to spin waiting for another OS thread before giving
+/// up the processor, in case that thread has been preempted.
+#define SPINS 64
+
+/// Wait a moment for another OS thread, counting the times it has been
+/// waited for in `spins`.
+static void spin(int *spins)
+{
+    if (++*spins == SPINS) {
+        sched_yield();
+        *spins = 0;
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+static void channel_lock(Channel *c)
+{
+    int spins = 0;
+    while (atomic_exchange_explicit(&c->lock, true, memory_order_acquire)) {
+        while (atomic_load_explicit(&c->lock, memory_order_relaxed)) {
+            spin(&spins);
+        }
+    }
+}
+
+static void channel_unlock(Channel *c)
+{
+    atomic_store_explicit(&c->lock, false, memory_order_release);
+}
+
+static Cell *cell(Channel *c, uptr position)
+{
+    uptr capacity = (uptr) c->capacity;
+    uptr index = (capacity & (capacity - 1)) == 0 ? position & (capacity - 1)
+                                                   : position % capacity;
+    return (Cell *) (c->cells + index * c->stride);
+}
+
+/// Put a value in a channel's buffer, if there is room.
+static bool buffer_put(Channel *c, byte *val)
+{
+    uptr position = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    for (;;) {
+        Cell *slot = cell(c, position);
+        uptr sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t ready = (intptr_t) (sequence - 2 * position);
+        if (ready == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->tail, &position, position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                memcpy(slot->val, val, c->size);
+                if (c->t != NULL) {
+                    heap_retain_block(slot->val, c->t);
+                }
+                atomic_store_explicit(&slot->sequence, 2 * position + 1,
+                                      memory_order_release);
+                return true;
+            }
+        } else if (ready < 0) {
+            // The value from a lap ago has not been taken yet.
+            return false;
+        } else {
+            position = atomic_load_explicit(&c->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/// Take the oldest value from a channel's buffer, if there is one.
+static bool buffer_take(Channel *c, byte *val)
+{
+    uptr position = atomic_load_explicit(&c->head, memory_order_relaxed);
+    for (;;) {
+        Cell *slot = cell(c, position);
+        uptr sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t ready = (intptr_t) (sequence - (2 * position + 1));
+        if (ready == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->head, &position, position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                if (c->t != NULL) {
+                    // The cell hands its references over, so that it holds
+                    // none while it is empty.
+                    heap_transfer(val, slot->val, c->t);
+                } else {
+                    memcpy(val, slot->val, c->size);
+                }
+                atomic_store_explicit(&slot->sequence, 2 * (position + c->capacity),
+                                      memory_order_release);
+                return true;
+            }
+        } else if (ready < 0) {
+            // The value for this position has not been put yet.
+            return false;
+        } else {
+            position = atomic_load_explicit(&c->head, memory_order_relaxed);
+        }
+    }
+}
+
+/// Whether a channel's buffer has room for a value, as far as can be told
+/// without taking one.
+static bool buffer_room(Channel *c)
+{
+    uptr position = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    uptr sequence = atomic_load_explicit(&cell(c, position)->sequence, memory_order_relaxed);
+    return sequence == 2 * position;
+}
+
+/// Whether a channel's buffer holds a value, as far as can be told without
+/// taking one.
+static bool buffer_value(Channel *c)
+{
+    uptr position = atomic_load_explicit(&c->head, memory_order_relaxed);
+    uptr sequence = atomic_load_explicit(&cell(c, position)->sequence, memory_order_relaxed);
+    return sequence == 2 * position + 1;
+}
+
+static void enqueue(WaitQueue *q, Waiter *w)
+{
+    w->prev = q->tail;
+    w->next = NULL;
+    w->queued = true;
+    if (q->tail == NULL) {
+        atomic_store_explicit(&q->head, w, memory_order_relaxed);
+    } else {
+        q->tail->next = w;
+    }
+    q->tail = w;
+}
+
+static void unlink_waiter(WaitQueue *q, Waiter *w)
+{
+    if (w->prev == NULL) {
+        atomic_store_explicit(&q->head, w->next, memory_order_relaxed);
+    } else {
+        w->prev->next = w->next;
+    }
+    if (w->next == NULL) {
+        q->tail = w->prev;
+    } else {
+        w->next->prev = w->prev;
+    }
+    w->queued = false;
+}
+
+/// Wait until any claim on a thread is settled.
+///
+/// \return The thread's `selected`.
+static word settled(Thread *thread)
+{
+    int spins = 0;
+    word selected;
+    while ((selected = atomic_load_explicit(&thread->selected, memory_order_acquire))
+           == SELECT_BUSY) {
+        spin(&spins);
+    }
+    return selected;
+}
+
+/// Claim the longest-waiting thread of a queue whose owner has not been
+/// selected already, and take it out of the queue. The channel must be
+/// locked. Stale waiters are dropped on the way.
+///
+/// Two threads in `alt` that have each claimed themselves, and find the other
+/// busy, must not wait for each other. The one with the higher address backs
+/// off instead, so that the other can claim it.
+///
+/// \param q The queue.
+/// \param self The claiming thread, whose own waiters are skipped, or `NULL`.
+/// \param busy Whether `self` has claimed itself.
+/// \param backoff Where to store the thread to back off for, if `self` has
+/// to. May be `NULL` if `busy` is `false`.
+/// \return The waiter, or `NULL` if there is none to claim.
+static Waiter *claim(WaitQueue *q, Thread *self, bool busy, Thread **backoff)
+{
+    Waiter *w = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (w != NULL) {
+        Waiter *next = w->next;
+        if (w->thread == self) {
+            w = next;
+            continue;
+        }
+        word expected = SELECT_WAITING;
+        if (atomic_compare_exchange_strong_explicit(&w->thread->selected, &expected,
+                                                    w->index, memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            unlink_waiter(q, w);
+            return w;
+        }
+        if (expected == SELECT_BUSY) {
+            if (busy && (uptr) self > (uptr) w->thread) {
+                *backoff = w->thread;
+                return NULL;
+            }
+            settled(w->thread);
+            continue;
+        }
+        unlink_waiter(q, w);
+        w = next;
+    }
+    return NULL;
+}
+
+/// Claim a waiter to try to complete its communication through the buffer,
+/// marking its thread busy until the claim is settled with `selected`.
+///
+/// \return `false` if the thread has been selected already.
+static bool reserve(Waiter *w)
+{
+    for (;;) {
+        word expected = SELECT_WAITING;
+        if (atomic_compare_exchange_strong_explicit(&w->thread->selected, &expected,
+                                                    SELECT_BUSY, memory_order_acquire,
+                                                    memory_order_acquire)) {
+            return true;
+        }
+        if (expected != SELECT_BUSY) {
+            return false;
+        }
+        settled(w->thread);
+    }
+}
+
+static void select_as(Thread *thread, word selected)
+{
+    atomic_store_explicit(&thread->selected, selected, memory_order_release);
+}
+
+/// Move values from waiting senders into the buffer, and from the buffer to
+/// waiting receivers, for as long as that is possible. The channel must be
+/// locked.
+///
+/// \param c The channel.
+/// \param woken List, linked through `Waiter::next`, to add the waiters that
+/// are done to. They must be readied once the channel is unlocked.
+static void balance(Channel *c, Waiter **woken)
+{
+    bool progress;
+    do {
+        progress = false;
+        for (int send = 0; send < 2; send++) {
+            WaitQueue *q = send ? &c->senders : &c->receivers;
+            bool (*buffer)(Channel *, byte *) = send ? buffer_put : buffer_take;
+            Waiter *w;
+            while ((w = atomic_load_explicit(&q->head, memory_order_relaxed)) != NULL) {
+                if (!reserve(w)) {
+                    unlink_waiter(q, w);
+                    continue;
+                }
+                if (!buffer(c, w->val)) {
+                    select_as(w->thread, SELECT_WAITING);
+                    break;
+                }
+                select_as(w->thread, w->index);
+                unlink_waiter(q, w);
+                w->next = *woken;
+                *woken = w;
+                progress = true;
+            }
+        }
+    } while (progress);
+}
+
+static void ready_all(Waiter *woken)
+{
+    while (woken != NULL) {
+        // The thread reuses its waiter as soon as it runs.
+        Waiter *next = woken->next;
+        scheduler_ready(woken->thread);
+        woken = next;
+    }
+}
+
+/// Serve any threads waiting on a channel, after putting a value in its
+/// buffer or taking one out without the lock.
+static void settle(Channel *c)
+{
+    // Pairs with the fences in `communicate()` and `queue_alt()` after a
+    // thread queues itself: either this sees the thread waiting, or the
+    // thread sees the value or the room this left.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&c->senders.head, memory_order_relaxed) == NULL
+        && atomic_load_explicit(&c->receivers.head, memory_order_relaxed) == NULL) {
+        return;
+    }
+    Waiter *woken = NULL;
+    channel_lock(c);
+    balance(c, &woken);
+    channel_unlock(c);
+    ready_all(woken);
+}
+
+/// Copy a value between a thread and a waiting peer it has claimed.
+static void hand_over(Channel *c, byte *val, Waiter *peer, bool send)
+{
+    if (c->t != NULL) {
+        if (send) {
+            heap_copy(peer->val, val, c->t);
+        } else {
+            heap_copy(val, peer->val, c->t);
+        }
+    } else if (send) {
+        memcpy(peer->val, val, c->size);
+    } else {
+        memcpy(val, peer->val, c->size);
+    }
+}
+
+/// Whether a communication should go straight between the thread and a
+/// waiting peer, rather than through the buffer: always on an unbuffered
+/// channel, and when sending to a receiver waiting on an empty buffer, so
+/// that the value is copied once rather than into the buffer and out again.
+/// Only sends can skip the buffer, as a receiver has to take the values
+/// already in it first.
+static bool direct(Channel *c, bool send)
+{
+    if (c->capacity == 0) {
+        return true;
+    }
+    return send && atomic_load_explicit(&c->senders.head, memory_order_relaxed) == NULL
+           && atomic_load_explicit(&c->receivers.head, memory_order_relaxed) != NULL
+           && !buffer_value(c);
+}
+
+/// Communicate on a channel if that can be done without waiting, first
+/// trying the buffer without the lock.
+///
+/// \param c The channel.
+/// \param val The value to send, or where to put the value received.
+/// \param send Whether to send rather than receive.
+/// \param self The communicating thread, or `NULL`.
+/// \return Whether the communication is done.
+static bool communicate_now(Channel *c, byte *val, bool send, Thread *self)
+{
+    WaitQueue *own = send ? &c->senders : &c->receivers;
+    WaitQueue *peers = send ? &c->receivers : &c->senders;
+    bool (*buffer)(Channel *, byte *) = send ? buffer_put : buffer_take;
+
+    // Threads already waiting go first, so that they are served in order.
+    if (c->capacity == 0) {
+        if (atomic_load_explicit(&peers->head, memory_order_relaxed) == NULL) {
+            return false;
+        }
+    } else if (!direct(c, send) && atomic_load_explicit(&own->head, memory_order_relaxed) == NULL
+               && buffer(c, val)) {
+        settle(c);
+        return true;
+    }
+
+    bool done = false;
+    Waiter *woken = NULL;
+    channel_lock(c);
+    if (c->capacity > 0) {
+        // Stale waiters left by `alt` must not hold up the queue.
+        balance(c, &woken);
+    }
+    Waiter *peer = direct(c, send) ? claim(peers, self, false, NULL) : NULL;
+    if (peer != NULL) {
+        hand_over(c, val, peer, send);
+        peer->next = woken;
+        woken = peer;
+        done = true;
+    } else if (c->capacity > 0 && atomic_load_explicit(&own->head, memory_order_relaxed) == NULL
+               && buffer(c, val)) {
+        balance(c, &woken);
+        done = true;
+    }
+    channel_unlock(c);
+    ready_all(woken);
+    return done;
+}
+
+static void communicate(ExecutionContext *context, Channel *c, byte *val, bool send)
+{
+    WaitQueue *own = send ? &c->senders : &c->receivers;
+    WaitQueue *peers = send ? &c->receivers : &c->senders;
+    bool (*buffer)(Channel *, byte *) = send ? buffer_put : buffer_take;
+
+    // Threads already waiting go first, so that they are served in order.
+    if (c->capacity > 0 && !direct(c, send)
+        && atomic_load_explicit(&own->head, memory_order_relaxed) == NULL
+        && buffer(c, val)) {
+        settle(c);
+        return;
+    }
+
+    Thread *thread = scheduler_thread(context);
+    Waiter *woken = NULL;
+    channel_lock(c);
+    if (c->capacity > 0) {
+        // Stale waiters left by `alt` must not hold up the queue.
+        balance(c, &woken);
+    }
+    Waiter *peer = direct(c, send) ? claim(peers, thread, false, NULL) : NULL;
+    if (peer != NULL) {
+        channel_unlock(c);
+        hand_over(c, val, peer, send);
+        peer->next = woken;
+        ready_all(peer);
+        return;
+    }
+    if (c->capacity > 0 && atomic_load_explicit(&own->head, memory_order_relaxed) == NULL
+        && buffer(c, val)) {
+        goto done;
+    }
+
+    if (thread == NULL) {
+        execution_error(context, "channel would block outside the scheduler");
+        goto unlock;
+    }
+    Waiter *w = &thread->waiter;
+    w->thread = thread;
+    w->val = val;
+    w->index = 0;
+    atomic_store_explicit(&thread->selected, SELECT_WAITING, memory_order_relaxed);
+    enqueue(own, w);
+    if (c->capacity > 0) {
+        // Pairs with the fence in `settle()`. Nothing else can claim the
+        // waiter while the channel is locked.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&own->head, memory_order_relaxed) == w && buffer(c, val)) {
+            unlink_waiter(own, w);
+            goto done;
+        }
+    }
+    context->status = EXEC_BLOCKED;
+    goto unlock;
+
+done:
+    balance(c, &woken);
+unlock:
+    channel_unlock(c);
+    ready_all(woken);
+}
+
+/// Whether a channel looks ready to communicate without waiting.
+static bool ready_to(Channel *c, bool send)
+{
+    WaitQueue *peers = send ? &c->receivers : &c->senders;
+    if (c->capacity == 0) {
+        return atomic_load_explicit(&peers->head, memory_order_relaxed) != NULL;
+    }
+    return send ? buffer_room(c) : buffer_value(c);
+}
+
+/// Queue a thread blocking in `alt` on one of its channels, unless it can
+/// complete the communication straight away, or has been selected through a
+/// channel it queued on earlier.
+///
+/// \param c The channel, which must be locked.
+/// \param w The thread's waiter for the channel.
+/// \param send Whether to send rather than receive.
+/// \param woken List to add the waiters of peers that are done to.
+/// \return The thread's `selected`.
+static word queue_alt(Channel *c, Waiter *w, bool send, Waiter **woken)
+{
+    Thread *thread = w->thread;
+    WaitQueue *own = send ? &c->senders : &c->receivers;
+    WaitQueue *peers = send ? &c->receivers : &c->senders;
+    bool (*buffer)(Channel *, byte *) = send ? buffer_put : buffer_take;
+
+    if (c->capacity > 0) {
+        balance(c, woken);
+        enqueue(own, w);
+        // Pairs with the fence in `settle()`.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&own->head, memory_order_relaxed) != w || !reserve(w)) {
+            return settled(thread);
+        }
+        if (!buffer(c, w->val)) {
+            select_as(thread, SELECT_WAITING);
+            return SELECT_WAITING;
+        }
+        unlink_waiter(own, w);
+        select_as(thread, w->index);
+        balance(c, woken);
+        return w->index;
+    }
+
+    for (;;) {
+        if (!reserve(w)) {
+            return settled(thread);
+        }
+        Thread *backoff = NULL;
+        Waiter *peer = claim(peers, thread, true, &backoff);
+        if (peer != NULL) {
+            hand_over(c, w->val, peer, send);
+            select_as(thread, w->index);
+            peer->next = *woken;
+            *woken = peer;
+            return w->index;
+        }
+        select_as(thread, SELECT_WAITING);
+        if (backoff == NULL) {
+            enqueue(own, w);
+            return SELECT_WAITING;
+        }
+        // Give the busy thread the chance to claim this one.
+        settled(backoff);
+    }
+}
+
+/// Take the waiters of a thread that is done with an `alt` out of the
+/// queues they are still in.
+static void unqueue_alt(Thread *thread, Alt *a)
+{
+    for (word i = 0; i < thread->nqueued; i++) {
+        Channel *c = a->entry[i].c;
+        Waiter *w = &thread->alts[i];
+        channel_lock(c);
+        if (w->queued) {
+            unlink_waiter(i < a->nsend ? &c->senders : &c->receivers, w);
+        }
+        channel_unlock(c);
+    }
+    thread->nqueued = 0;
+}
+
+/// A random number for choosing between ready channels.
+static uint32_t alt_random(void)
+{
+    static _Thread_local uint32_t x;
+    if (x == 0) {
+        x = (uint32_t) (uptr) &x * 2654435761u | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+void channel_alt(ExecutionContext *context, Alt *a, word *dst, bool block)
+{
+    word n = a->nsend + a->nrecv;
+    Thread *thread = scheduler_thread(context);
+
+    // Back after blocking: the communication has been completed.
+    if (thread != NULL && thread->nqueued > 0) {
+        unqueue_alt(thread, a);
+        *dst = atomic_load_explicit(&thread->selected, memory_order_acquire);
+        scheduler_communicated(context, a->entry[*dst].c);
+        return;
+    }
+
+    for (word i = 0; i < n; i++) {
+        if (a->entry[i].c == H) {
+            execution_error(context, "dereference of nil");
+            return;
+        }
+    }
+
+    // Choose uniformly between the channels that look ready, by keeping the
+    // kth one found with probability 1/k. A channel can stop being ready
+    // before the communication is tried, so look again if it fails.
+    for (;;) {
+        word chosen = -1;
+        uint32_t nready = 0;
+        for (word i = 0; i < n; i++) {
+            if (ready_to(a->entry[i].c, i < a->nsend) && alt_random() % ++nready == 0) {
+                chosen = i;
+            }
+        }
+        if (chosen < 0) {
+            break;
+        }
+        if (communicate_now(a->entry[chosen].c, a->entry[chosen].val, chosen < a->nsend,
+                            thread)) {
+            *dst = chosen;
+            scheduler_communicated(context, a->entry[chosen].c);
+            return;
+        }
+    }
+
+    if (!block) {
+        *dst = n;
+        return;
+    }
+    if (thread == NULL) {
+        execution_error(context, "channel would block outside the scheduler");
+        return;
+    }
+
+    if (thread->nalts < n) {
+        free(thread->alts);
+        thread->alts = malloc(n * sizeof(Waiter));
+        thread->nalts = thread->alts != NULL ? n : 0;
+        if (thread->alts == NULL) {
+            execution_error(context, "out of memory");
+            return;
+        }
+    }
+    atomic_store_explicit(&thread->selected, SELECT_WAITING, memory_order_relaxed);
+    word selected = SELECT_WAITING;
+    bool blocked = true;
+    for (word i = 0; i < n && selected == SELECT_WAITING; i++) {
+        Channel *c = a->entry[i].c;
+        Waiter *w = &thread->alts[i];
+        *w = (Waiter) {.thread = thread, .val = a->entry[i].val, .index = i};
+        Waiter *woken = NULL;
+        channel_lock(c);
+        selected = queue_alt(c, w, i < a->nsend, &woken);
+        channel_unlock(c);
+        ready_all(woken);
+        thread->nqueued = i + 1;
+        // Having completed the communication itself, the thread will not be
+        // readied.
+        blocked = selected != i;
+    }
+
+    if (!blocked) {
+        unqueue_alt(thread, a);
+        *dst = selected;
+        scheduler_communicated(context, a->entry[selected].c);
+        return;
+    }
+    // Whoever selects the thread readies it, to execute the `alt` again.
+    context->program_counter--;
+    context->status = EXEC_BLOCKED;
+}
+
+Channel *channel_new(word size, TypeDescriptor *t, word capacity)
+{
+    word stride = (word) ((sizeof(Cell) + size + 7) & ~(uptr) 7);
+    uptr bytes = sizeof(Channel) + (uptr) capacity * stride;
+    Channel *c = heap_alloc(HEAP_CHANNEL, t, bytes);
+    if (c == NULL) {
+        return NULL;
+    }
+    c->size = size;
+    c->t = t;
+    c->capacity = capacity;
+    c->stride = stride;
+    c->home = scheduler_worker();
+    atomic_init(&c->lock, false);
+    atomic_init(&c->senders.head, NULL);
+    c->senders.tail = NULL;
+    atomic_init(&c->receivers.head, NULL);
+    c->receivers.tail = NULL;
+    atomic_init(&c->head, 0);
+    atomic_init(&c->tail, 0);
+    for (word i = 0; i < capacity; i++) {
+        atomic_init(&cell(c, i)->sequence, 2 * (uptr) i);
+    }
+    return c;
+}
+
+void channel_send(ExecutionContext *context, Channel *c, byte *val)
+{
+    communicate(context, c, val, true);
+    scheduler_communicated(context, c);
+}
+
+void channel_recv(ExecutionContext *context, Channel *c, byte *val)
+{
+    communicate(context, c, val, false);
+    scheduler_communicated(context, c);
+}
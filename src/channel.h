@@ -0,0 +1,141 @@
+#ifndef DIS_CHANNEL_H
+#define DIS_CHANNEL_H
+
+// Channels, as created by the `newc` instructions.
+//
+// A buffered channel keeps its values in a bounded multi-producer,
+// multi-consumer ring (Vyukov's), so sending to a channel with room and
+// receiving from one with values take no lock. Threads that have to wait
+// queue on the channel, and the thread that completes a communication copies
+// the value straight to or from the waiting thread and readies it. The queues
+// have a spin lock of their own, which is only taken when there are waiters,
+// or when a thread has to wait.
+//
+// Values of memory, as `newcm` and `newcmp` make channels of, can be large,
+// so they are copied as little as possible. A value sent while receivers
+// wait on an empty buffer goes straight to the first of them rather than
+// through the buffer, and a value taken from the buffer is moved out of it
+// with the references it holds, rather than copied and then cleared. The
+// references a value holds are taken and dropped in batches.
+//
+// An unbuffered channel has nowhere to keep a value, so every communication
+// goes through the queues: a sender hands its value directly to a queued
+// receiver, or queues itself for one to come along, and vice versa.
+//
+// A thread blocked in `alt` queues on every channel it selects between. The
+// first thread to complete a communication with it claims it by setting its
+// `Thread::selected`, so it is readied exactly once, and the others find its
+// remaining waiters stale and drop them. Finding out which channels are
+// ready takes no lock at all.
+//
+// A channel remembers the worker that allocated it, whose NUMA node its
+// buffer is in, for the scheduler to draw the threads using it to.
+
+#include "execution.h"
+
+/// `Thread::selected` while the thread is waiting to be selected.
+#define SELECT_WAITING (-1)
+/// `Thread::selected` while a thread that has claimed it tries to complete
+/// a communication through the buffer. The claim is settled, one way or the
+/// other, without taking a lock.
+#define SELECT_BUSY (-2)
+
+/// A thread waiting on a channel.
+typedef struct Waiter {
+    struct Thread *thread;
+    /// The value to send, or where to put the value received.
+    byte *val;
+    /// The alternative of an `alt` the waiter stands for, or 0 for `send` and
+    /// `recv`.
+    word index;
+    /// Whether the waiter is in a queue.
+    bool queued;
+    struct Waiter *prev;
+    struct Waiter *next;
+} Waiter;
+
+/// A queue of waiting threads, all sending or all receiving.
+typedef struct WaitQueue {
+    /// The longest-waiting thread. Only changed with the channel locked, but
+    /// read without the lock to tell whether anyone is waiting.
+    _Atomic(Waiter *) head;
+    Waiter *tail;
+} WaitQueue;
+
+/// One value in a channel's buffer.
+typedef struct Cell {
+    /// Twice the position the cell is ready to be written at, or one more
+    /// than twice the position it is ready to be read at. Doubling keeps the
+    /// two apart even when the buffer has a single cell.
+    _Atomic uptr sequence;
+    _Alignas(8) byte val[];
+} Cell;
+
+struct Channel {
+    /// Size of a value in bytes.
+    word size;
+    /// Type of the values if they contain pointers, otherwise `NULL`.
+    TypeDescriptor *t;
+    /// The number of values the buffer holds, or 0 if the channel is
+    /// unbuffered.
+    word capacity;
+    /// Distance between cells of the buffer in bytes.
+    word stride;
+    /// The worker that allocated the channel, plus one, or 0 if it was
+    /// allocated outside the workers.
+    word home;
+    _Atomic bool lock;
+    WaitQueue senders;
+    WaitQueue receivers;
+    /// Positions of the next values to be received and sent. They grow
+    /// without bound, and wrap around the buffer.
+    _Alignas(64) _Atomic uptr head;
+    _Alignas(64) _Atomic uptr tail;
+    _Alignas(64) byte cells[];
+};
+
+/// Create a channel, which is a heap object.
+///
+/// \param size Size of a value in bytes.
+/// \param t Type of the values if they contain pointers, otherwise `NULL`.
+/// \param capacity The number of values to buffer, or 0 for an unbuffered
+/// channel.
+/// \return The channel, with one reference to it, or `NULL` if there is no
+/// memory for it.
+Channel *channel_new(word size, TypeDescriptor *t, word capacity);
+
+/// Send a value on a channel.
+///
+/// If no receiver is waiting and the buffer is full, the thread blocks with
+/// `EXEC_BLOCKED`, and is readied by the thread that receives the value.
+///
+/// \param context The execution context of the sending thread.
+/// \param c The channel.
+/// \param val The value to send.
+void channel_send(ExecutionContext *context, Channel *c, byte *val);
+
+/// Receive a value from a channel.
+///
+/// If no sender is waiting and the buffer is empty, the thread blocks with
+/// `EXEC_BLOCKED`, and is readied by the thread that sends it a value.
+///
+/// \param context The execution context of the receiving thread.
+/// \param c The channel.
+/// \param val Where to put the value received.
+void channel_recv(ExecutionContext *context, Channel *c, byte *val);
+
+/// Communicate on whichever of a set of channels is ready, choosing at random
+/// between the ready ones.
+///
+/// If none is ready, the thread blocks with `EXEC_BLOCKED` and the program
+/// counter back at the `alt`, which finishes once the thread is readied and
+/// executes it again.
+///
+/// \param context The execution context of the selecting thread.
+/// \param a The channels, and the values to send or where to receive them.
+/// \param dst Where to store the index in `a` of the channel chosen.
+/// \param block Whether to wait for a channel to become ready. If not, and
+/// none is, `nsend + nrecv` is stored in `dst`.
+void channel_alt(ExecutionContext *context, Alt *a, word *dst, bool block);
+
+#endif //DIS_CHANNEL_H
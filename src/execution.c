@@ -2,4 +2,811 @@
 // Created by John on 21/06/2022.
 //
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "execution.h"
+#include "handlers.h"
+#include "heap.h"
+#include "instructions.h"
+#include "module.h"
+#if DIS_JIT
+#include "jit.h"
+#endif
+#if DIS_PROFILE
+#include "profile.h"
+#endif
+
+void execution_error(ExecutionContext *context, const char *message)
+{
+    context->status = EXEC_ERROR;
+    context->error = message;
+}
+
+// A stack's first segment is as big as its module asks for, and each one
+// after that twice the size of the last, within these bounds.
+#define STACK_SEGMENT_MIN 4096
+#define STACK_SEGMENT_MAX (1 << 20)
+
+static struct {
+    _Atomic uptr grows;
+    _Atomic uptr allocations;
+    _Atomic uptr segments;
+    _Atomic uptr bytes;
+} stack_counters;
+
+/// Free a segment and the ones after it.
+static void segments_free(StackSegment *s)
+{
+    while (s != NULL) {
+        StackSegment *next = s->next;
+        atomic_fetch_sub_explicit(&stack_counters.segments, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&stack_counters.bytes, (uptr) (s->limit - s->base),
+                                  memory_order_relaxed);
+        free(s);
+        s = next;
+    }
+}
+
+/// Move a thread's stack on to a segment with room for a frame, allocating
+/// one if the segment after the current one is missing or too small.
+///
+/// \param context The execution context of the thread.
+/// \param size The size of the frame in bytes.
+/// \return `false`, having stopped the thread with an error, if there is no
+/// memory for a segment.
+static bool stack_grow(ExecutionContext *context, uptr size)
+{
+    Stack *stack = &context->stack;
+    StackSegment *s = stack->segment;
+    StackSegment *next = NULL;
+    word requested = context->ml->module->stack_extent;
+    uptr extent = requested > 0 ? (uptr) requested : 0;
+    if (s != NULL) {
+        s->top = stack->top;
+        atomic_fetch_add_explicit(&stack_counters.grows, 1, memory_order_relaxed);
+        next = s->next;
+        extent = 2 * (uptr) (s->limit - s->base);
+    }
+    if (next != NULL && (uptr) (next->limit - next->base) < size) {
+        segments_free(next);
+        s->next = next = NULL;
+    }
+    if (next == NULL) {
+        extent = extent < STACK_SEGMENT_MIN ? STACK_SEGMENT_MIN : extent;
+        extent = extent > STACK_SEGMENT_MAX ? STACK_SEGMENT_MAX : extent;
+        extent = extent < size ? size : extent;
+        next = malloc(sizeof(StackSegment) + extent);
+        if (next == NULL) {
+            execution_error(context, "out of memory");
+            return false;
+        }
+        next->prev = s;
+        next->next = NULL;
+        next->limit = next->base + extent;
+        if (s != NULL) {
+            s->next = next;
+        }
+        atomic_fetch_add_explicit(&stack_counters.allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stack_counters.segments, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stack_counters.bytes, extent, memory_order_relaxed);
+    }
+    stack->segment = next;
+    stack->top = next->base;
+    stack->limit = next->limit;
+    return true;
+}
+
+/// The space a frame of type `t` takes on the stack.
+static uptr frame_size(const TypeDescriptor *t)
+{
+    uptr size = t->size > (word) sizeof(Frame) ? (uptr) t->size : sizeof(Frame);
+    // Keep every frame word-aligned.
+    return (size + 7) & ~(uptr) 7;
+}
+
+Frame *frame_alloc(ExecutionContext *context, TypeDescriptor *t)
+{
+    uptr size = frame_size(t);
+    Stack *stack = &context->stack;
+    if ((uptr) (stack->limit - stack->top) < size && !stack_grow(context, size)) {
+        return NULL;
+    }
+    Frame *f = (Frame *) stack->top;
+    stack->top += size;
+    memset(f, 0, size);
+    f->t = t;
+    return f;
+}
+
+/// Drop the references held by the frames on a stack from `p`, in segment
+/// `s`, up to the top.
+///
+/// \param links Whether to drop the module links saved by calls as well.
+static void frames_clear(Stack *stack, StackSegment *s, byte *p, bool links)
+{
+    for (;;) {
+        byte *end = s == stack->segment ? stack->top : s->top;
+        while (p < end) {
+            Frame *f = (Frame *) p;
+            p += frame_size(f->t);
+            if (links) {
+                heap_release(f->ml);
+            }
+            heap_clear((byte *) f, f->t);
+        }
+        if (s == stack->segment) {
+            return;
+        }
+        s = s->next;
+        p = s->base;
+    }
+}
+
+void frame_release(ExecutionContext *context, Frame *f)
+{
+    Stack *stack = &context->stack;
+    byte *p = (byte *) f;
+    // The frame is in the current segment, unless it was the first one in
+    // its segment and the frame after it went in the next.
+    StackSegment *s = stack->segment;
+    while (p < s->base || p >= s->limit) {
+        s = s->prev;
+    }
+    frames_clear(stack, s, p, false);
+    stack->segment = s;
+    stack->top = p;
+    stack->limit = s->limit;
+}
+
+void stack_reset(Stack *stack)
+{
+    StackSegment *s = stack->segment;
+    if (s == NULL) {
+        return;
+    }
+    while (s->prev != NULL) {
+        s = s->prev;
+    }
+    frames_clear(stack, s, s->base, true);
+    segments_free(s->next);
+    s->next = NULL;
+    stack->segment = s;
+    stack->top = s->base;
+    stack->limit = s->limit;
+}
+
+void stack_free(Stack *stack)
+{
+    stack_reset(stack);
+    segments_free(stack->segment);
+    *stack = (Stack) {0};
+}
+
+void stack_stats(StackStats *stats)
+{
+    *stats = (StackStats) {
+        .grows = atomic_load_explicit(&stack_counters.grows, memory_order_relaxed),
+        .allocations = atomic_load_explicit(&stack_counters.allocations, memory_order_relaxed),
+        .segments = atomic_load_explicit(&stack_counters.segments, memory_order_relaxed),
+        .bytes = atomic_load_explicit(&stack_counters.bytes, memory_order_relaxed),
+    };
+}
+
+bool execution_init(ExecutionContext *context, ModuleLink *ml)
+{
+    Module *module = ml->module;
+    Inst *code = module->entry_pc >= 0 ? module_code(module) : NULL;
+    if (code == NULL) {
+        return false;
+    }
+    *context = (ExecutionContext) {
+        .program_counter = module->entry_pc,
+        .code = code,
+        .mp = ml->mp,
+        .ml = ml,
+        .quantum = EXEC_UNLIMITED,
+    };
+    heap_retain(ml);
+    context->fp = (byte *) frame_alloc(context, module->entry_type);
+    if (context->fp == NULL) {
+        execution_free(context);
+        return false;
+    }
+    return true;
+}
+
+void execution_free(ExecutionContext *context)
+{
+    stack_free(&context->stack);
+    heap_release(context->ml);
+    context->ml = NULL;
+}
+
+// The operand fetch is expanded into every handler of the threaded
+// interpreter; make sure the compiler does not outline it.
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/// Compute the effective address of an operand of a decoded instruction.
+///
+/// Every instruction fetches three operands, so this selects the base
+/// register without branching; only double indirection, which is rare, takes
+/// a branch.
+static ALWAYS_INLINE byte *effective_address(ExecutionContext *context,
+                                             const Operand *operand)
+{
+    byte *base = operand->mode & AFP ? context->fp : context->mp;
+    byte *address = base + operand->offset;
+    if (operand->mode & AIND) {
+        address = *(byte **) address + operand->indirect;
+    }
+    return operand->mode == AIMM ? (byte *) &operand->offset : address;
+}
+
+/// Fetch the instruction at the program counter, leaving the effective
+/// addresses of its operands in the context and the program counter at the
+/// following instruction.
+static ALWAYS_INLINE const Inst *fetch(ExecutionContext *context)
+{
+    const Inst *inst = &context->code[context->program_counter++];
+    context->s = effective_address(context, &inst->s);
+    context->m = effective_address(context, &inst->m);
+    context->d = effective_address(context, &inst->d);
+    return inst;
+}
+
+// Every dispatch counts down the quantum, which `execute()` keeps in a local
+// so that it can live in a register.
+#if DIS_THREADED_DISPATCH
+#define OPCODE(op) label_##op:
+#define NEXT() \
+    do { \
+        if (--quantum == 0) goto yield; \
+        goto *(inst = fetch(context))->handler; \
+    } while (0)
+#else
+#define OPCODE(op) case op:
+#define NEXT() continue
+#endif
+
+/// Leave `execute()` with the thread's status.
+#if DIS_PROFILE
+#define STOP() \
+    do { \
+        if (profiler != NULL) profile_end(profiler, quantum); \
+        context->quantum = quantum + rest; \
+        return context->status; \
+    } while (0)
+#else
+#define STOP() \
+    do { \
+        context->quantum = quantum; \
+        return context->status; \
+    } while (0)
+#endif
+
+// Instructions that can stop the thread must be followed by a status check;
+// the rest dispatch the next instruction unconditionally.
+#define CHECKED(call) \
+    do { \
+        call; \
+        if (context->status != EXEC_RUNNING) STOP(); \
+    } while (0)
+
+#if DIS_THREADED_DISPATCH
+/// The threaded interpreter's handler for each opcode, published by the first
+/// call to `execute()`.
+static const void *const *handlers;
+static pthread_once_t handlers_once = PTHREAD_ONCE_INIT;
+
+static void publish_handlers(void)
+{
+    execute(NULL);
+}
+#endif
+
+const void *execution_handler(byte opcode)
+{
+#if DIS_THREADED_DISPATCH
+    // Modules may be loaded by several threads at once.
+    pthread_once(&handlers_once, publish_handlers);
+    return handlers[opcode];
+#else
+    (void) opcode;
+    return NULL;
+#endif
+}
+
+ExecutionStatus execute(ExecutionContext *context)
+{
+#if DIS_THREADED_DISPATCH
+    // Any opcode without a label of its own falls through to `unimplemented`.
+    static const void *const dispatch[256] = {
+        [0 ... 255] = &&unimplemented,
+        [IN_XEND] = &&overrun,
+        [IN_NOP] = &&label_IN_NOP,
+        [IN_ALT] = &&label_IN_ALT,
+        [IN_NBALT] = &&label_IN_NBALT,
+        [IN_GOTO] = &&label_IN_GOTO,
+        [IN_JMP] = &&label_IN_JMP,
+        [IN_CASE] = &&label_IN_CASE,
+        [IN_EXIT] = &&label_IN_EXIT,
+        [IN_LEA] = &&label_IN_LEA,
+        [IN_MOVPC] = &&label_IN_MOVPC,
+        [IN_FRAME] = &&label_IN_FRAME,
+        [IN_MFRAME] = &&label_IN_MFRAME,
+        [IN_CALL] = &&label_IN_CALL,
+        [IN_MCALL] = &&label_IN_MCALL,
+        [IN_SPAWN] = &&label_IN_SPAWN,
+        [IN_MSPAWN] = &&label_IN_MSPAWN,
+        [IN_RET] = &&label_IN_RET,
+        [IN_LOAD] = &&label_IN_LOAD,
+        [IN_NEW] = &&label_IN_NEW,
+        [IN_NEWZ] = &&label_IN_NEWZ,
+        [IN_MNEWZ] = &&label_IN_MNEWZ,
+        [IN_NEWA] = &&label_IN_NEWA,
+        [IN_NEWAZ] = &&label_IN_NEWAZ,
+        [IN_CONSB] = &&label_IN_CONSB,
+        [IN_CONSW] = &&label_IN_CONSW,
+        [IN_CONSF] = &&label_IN_CONSF,
+        [IN_CONSL] = &&label_IN_CONSL,
+        [IN_CONSP] = &&label_IN_CONSP,
+        [IN_CONSM] = &&label_IN_CONSM,
+        [IN_CONSMP] = &&label_IN_CONSMP,
+        [IN_HEADB] = &&label_IN_HEADB,
+        [IN_HEADW] = &&label_IN_HEADW,
+        [IN_HEADF] = &&label_IN_HEADF,
+        [IN_HEADL] = &&label_IN_HEADL,
+        [IN_HEADP] = &&label_IN_HEADP,
+        [IN_HEADM] = &&label_IN_HEADM,
+        [IN_HEADMP] = &&label_IN_HEADMP,
+        [IN_TAIL] = &&label_IN_TAIL,
+        [IN_LENL] = &&label_IN_LENL,
+        [IN_NEWCB] = &&label_IN_NEWCB,
+        [IN_NEWCW] = &&label_IN_NEWCW,
+        [IN_NEWCF] = &&label_IN_NEWCF,
+        [IN_NEWCL] = &&label_IN_NEWCL,
+        [IN_NEWCP] = &&label_IN_NEWCP,
+        [IN_NEWCM] = &&label_IN_NEWCM,
+        [IN_NEWCMP] = &&label_IN_NEWCMP,
+        [IN_SEND] = &&label_IN_SEND,
+        [IN_RECV] = &&label_IN_RECV,
+        [IN_LENC] = &&label_IN_LENC,
+        [IN_INDC] = &&label_IN_INDC,
+        [IN_INSC] = &&label_IN_INSC,
+        [IN_ADDC] = &&label_IN_ADDC,
+        [IN_SLICEA] = &&label_IN_SLICEA,
+        [IN_SLICELA] = &&label_IN_SLICELA,
+        [IN_SLICEC] = &&label_IN_SLICEC,
+        [IN_BEQC] = &&label_IN_BEQC,
+        [IN_BNEC] = &&label_IN_BNEC,
+        [IN_BLTC] = &&label_IN_BLTC,
+        [IN_BLEC] = &&label_IN_BLEC,
+        [IN_BGTC] = &&label_IN_BGTC,
+        [IN_BGEC] = &&label_IN_BGEC,
+        [IN_CASEC] = &&label_IN_CASEC,
+        [IN_CVTCA] = &&label_IN_CVTCA,
+        [IN_CVTAC] = &&label_IN_CVTAC,
+        [IN_CVTWC] = &&label_IN_CVTWC,
+        [IN_CVTCW] = &&label_IN_CVTCW,
+        [IN_CVTFC] = &&label_IN_CVTFC,
+        [IN_CVTCF] = &&label_IN_CVTCF,
+        [IN_CVTLC] = &&label_IN_CVTLC,
+        [IN_CVTCL] = &&label_IN_CVTCL,
+        [IN_LENA] = &&label_IN_LENA,
+        [IN_INDB] = &&label_IN_INDB,
+        [IN_INDW] = &&label_IN_INDW,
+        [IN_INDF] = &&label_IN_INDF,
+        [IN_INDL] = &&label_IN_INDL,
+        [IN_INDX] = &&label_IN_INDX,
+        [IN_MOVB] = &&label_IN_MOVB,
+        [IN_MOVW] = &&label_IN_MOVW,
+        [IN_MOVF] = &&label_IN_MOVF,
+        [IN_MOVL] = &&label_IN_MOVL,
+        [IN_MOVP] = &&label_IN_MOVP,
+        [IN_MOVM] = &&label_IN_MOVM,
+        [IN_MOVMP] = &&label_IN_MOVMP,
+        [IN_TCMP] = &&label_IN_TCMP,
+        [IN_CVTBW] = &&label_IN_CVTBW,
+        [IN_CVTWB] = &&label_IN_CVTWB,
+        [IN_CVTFW] = &&label_IN_CVTFW,
+        [IN_CVTWF] = &&label_IN_CVTWF,
+        [IN_CVTLF] = &&label_IN_CVTLF,
+        [IN_CVTFL] = &&label_IN_CVTFL,
+        [IN_CVTLW] = &&label_IN_CVTLW,
+        [IN_CVTWL] = &&label_IN_CVTWL,
+        [IN_CVTRF] = &&label_IN_CVTRF,
+        [IN_CVTFR] = &&label_IN_CVTFR,
+        [IN_CVTWS] = &&label_IN_CVTWS,
+        [IN_CVTSW] = &&label_IN_CVTSW,
+        [IN_ADDB] = &&label_IN_ADDB,
+        [IN_ADDW] = &&label_IN_ADDW,
+        [IN_ADDF] = &&label_IN_ADDF,
+        [IN_ADDL] = &&label_IN_ADDL,
+        [IN_SUBB] = &&label_IN_SUBB,
+        [IN_SUBW] = &&label_IN_SUBW,
+        [IN_SUBF] = &&label_IN_SUBF,
+        [IN_SUBL] = &&label_IN_SUBL,
+        [IN_MULB] = &&label_IN_MULB,
+        [IN_MULW] = &&label_IN_MULW,
+        [IN_MULF] = &&label_IN_MULF,
+        [IN_MULL] = &&label_IN_MULL,
+        [IN_DIVB] = &&label_IN_DIVB,
+        [IN_DIVW] = &&label_IN_DIVW,
+        [IN_DIVF] = &&label_IN_DIVF,
+        [IN_DIVL] = &&label_IN_DIVL,
+        [IN_MODB] = &&label_IN_MODB,
+        [IN_MODW] = &&label_IN_MODW,
+        [IN_MODL] = &&label_IN_MODL,
+        [IN_NEGF] = &&label_IN_NEGF,
+        [IN_ANDB] = &&label_IN_ANDB,
+        [IN_ANDW] = &&label_IN_ANDW,
+        [IN_ANDL] = &&label_IN_ANDL,
+        [IN_ORB] = &&label_IN_ORB,
+        [IN_ORW] = &&label_IN_ORW,
+        [IN_ORL] = &&label_IN_ORL,
+        [IN_XORB] = &&label_IN_XORB,
+        [IN_XORW] = &&label_IN_XORW,
+        [IN_XORL] = &&label_IN_XORL,
+        [IN_SHLB] = &&label_IN_SHLB,
+        [IN_SHLW] = &&label_IN_SHLW,
+        [IN_SHLL] = &&label_IN_SHLL,
+        [IN_SHRB] = &&label_IN_SHRB,
+        [IN_SHRW] = &&label_IN_SHRW,
+        [IN_SHRL] = &&label_IN_SHRL,
+        [IN_LSRW] = &&label_IN_LSRW,
+        [IN_LSRL] = &&label_IN_LSRL,
+        [IN_BEQB] = &&label_IN_BEQB,
+        [IN_BNEB] = &&label_IN_BNEB,
+        [IN_BLTB] = &&label_IN_BLTB,
+        [IN_BLEB] = &&label_IN_BLEB,
+        [IN_BGTB] = &&label_IN_BGTB,
+        [IN_BGEB] = &&label_IN_BGEB,
+        [IN_BEQW] = &&label_IN_BEQW,
+        [IN_BNEW] = &&label_IN_BNEW,
+        [IN_BLTW] = &&label_IN_BLTW,
+        [IN_BLEW] = &&label_IN_BLEW,
+        [IN_BGTW] = &&label_IN_BGTW,
+        [IN_BGEW] = &&label_IN_BGEW,
+        [IN_BEQF] = &&label_IN_BEQF,
+        [IN_BNEF] = &&label_IN_BNEF,
+        [IN_BLTF] = &&label_IN_BLTF,
+        [IN_BLEF] = &&label_IN_BLEF,
+        [IN_BGTF] = &&label_IN_BGTF,
+        [IN_BGEF] = &&label_IN_BGEF,
+        [IN_BEQL] = &&label_IN_BEQL,
+        [IN_BNEL] = &&label_IN_BNEL,
+        [IN_BLTL] = &&label_IN_BLTL,
+        [IN_BLEL] = &&label_IN_BLEL,
+        [IN_BGTL] = &&label_IN_BGTL,
+        [IN_BGEL] = &&label_IN_BGEL,
+        [IN_XMOVW_ADDW] = &&label_IN_XMOVW_ADDW,
+        [IN_XADDW_BLTW] = &&label_IN_XADDW_BLTW,
+        [IN_XLENA_BGEW] = &&label_IN_XLENA_BGEW,
+        [IN_XINDW_MOVW] = &&label_IN_XINDW_MOVW,
+        [IN_XCASE] = &&label_IN_XCASE,
+        [IN_XCASEC] = &&label_IN_XCASEC,
+        [IN_XMNEWZ] = &&label_IN_XMNEWZ,
+        [IN_XMNEWZP] = &&label_IN_XMNEWZP,
+        [IN_XMOVM] = &&label_IN_XMOVM,
+        [IN_XHEADM] = &&label_IN_XHEADM,
+        [IN_XCONSM] = &&label_IN_XCONSM,
+#if DIS_JIT
+        [IN_XJIT] = &&label_IN_XJIT,
+#endif
+    };
+
+    // Label addresses cannot leave the function that defines them other than
+    // as values, so the loader asks for them by calling with no context.
+    if (context == NULL) {
+        handlers = dispatch;
+        return EXEC_EXITED;
+    }
+#endif
+
+    context->status = EXEC_RUNNING;
+    context->error = NULL;
+    uptr quantum = context->quantum;
+    // The instruction dispatched, for the handlers that quicken it.
+    const Inst *inst = NULL;
+#if DIS_PROFILE
+    // The profiler samples when the quantum runs out, so while it is on the
+    // quantum is split into the instructions to count down to the next
+    // sample and the rest.
+    uptr rest = 0;
+    ProfileThread *profiler = profile_begin();
+    if (profiler != NULL) {
+        quantum = profile_arm(profiler, quantum, &rest);
+    }
+#endif
+
+#if DIS_THREADED_DISPATCH
+    NEXT();
+#else
+#if DIS_PROFILE
+resume:
+#endif
+    for (;;) {
+        if (--quantum == 0) {
+            goto yield;
+        }
+        switch ((inst = fetch(context))->opcode) {
+#endif
+
+    OPCODE(IN_NOP) NEXT();
+    OPCODE(IN_ALT)
+        CHECKED(alt(context, (Alt *) context->s, (word *) context->d));
+        NEXT();
+    OPCODE(IN_NBALT)
+        CHECKED(nbalt(context, (Alt *) context->s, (word *) context->d));
+        NEXT();
+    OPCODE(IN_GOTO) CHECKED(op_goto(context)); NEXT();
+    OPCODE(IN_JMP) op_jmp(context); NEXT();
+    OPCODE(IN_CASE) CHECKED(op_case(context)); NEXT();
+    OPCODE(IN_EXIT) op_exit(context); STOP();
+    OPCODE(IN_LEA) op_lea(context); NEXT();
+    OPCODE(IN_MOVPC) op_movpc(context); NEXT();
+
+    OPCODE(IN_FRAME)
+        CHECKED(frame(context, context->ml->module->types[W(s)], (Frame **) context->d));
+        NEXT();
+    OPCODE(IN_MFRAME)
+        CHECKED(mframe(context, *(ModuleLink **) context->s, W(m),
+                       (Frame **) context->d));
+        NEXT();
+    OPCODE(IN_CALL) call(context, *(Frame **) context->s, W(d)); NEXT();
+    OPCODE(IN_MCALL)
+        CHECKED(mcall(context, *(Frame **) context->s, W(m),
+                      *(ModuleLink **) context->d));
+        NEXT();
+    OPCODE(IN_SPAWN) CHECKED(spawn(context, *(Frame **) context->s, W(d))); NEXT();
+    OPCODE(IN_MSPAWN)
+        CHECKED(mspawn(context, *(Frame **) context->s, W(m),
+                       *(ModuleLink **) context->d));
+        NEXT();
+    OPCODE(IN_RET) CHECKED(ret(context)); NEXT();
+    OPCODE(IN_LOAD)
+        CHECKED(load(context, *(String **) context->s, (LinkageDescriptor *) context->m,
+                     (ModuleLink **) context->d));
+        NEXT();
+
+    OPCODE(IN_NEW) CHECKED(new_(context)); NEXT();
+    OPCODE(IN_NEWZ) CHECKED(newz(context)); NEXT();
+    OPCODE(IN_MNEWZ) CHECKED(mnewz(context, inst)); NEXT();
+    OPCODE(IN_NEWA) CHECKED(newa(context)); NEXT();
+    OPCODE(IN_NEWAZ) CHECKED(newaz(context)); NEXT();
+
+    OPCODE(IN_CONSB) CHECKED(consb(context)); NEXT();
+    OPCODE(IN_CONSW) CHECKED(consw(context)); NEXT();
+    OPCODE(IN_CONSF) CHECKED(consf(context)); NEXT();
+    OPCODE(IN_CONSL) CHECKED(consl(context)); NEXT();
+    OPCODE(IN_CONSP) CHECKED(consp(context)); NEXT();
+    OPCODE(IN_CONSM) CHECKED(consm(context, inst)); NEXT();
+    OPCODE(IN_CONSMP) CHECKED(consmp(context)); NEXT();
+    OPCODE(IN_HEADB) CHECKED(headb(context)); NEXT();
+    OPCODE(IN_HEADW) CHECKED(headw(context)); NEXT();
+    OPCODE(IN_HEADF) CHECKED(headf(context)); NEXT();
+    OPCODE(IN_HEADL) CHECKED(headl(context)); NEXT();
+    OPCODE(IN_HEADP) CHECKED(headp(context)); NEXT();
+    OPCODE(IN_HEADM) CHECKED(headm(context, inst)); NEXT();
+    OPCODE(IN_HEADMP) CHECKED(headmp(context)); NEXT();
+    OPCODE(IN_TAIL) CHECKED(tail(context)); NEXT();
+    OPCODE(IN_LENL) op_lenl(context); NEXT();
+
+    OPCODE(IN_NEWCB) CHECKED(newcb(context)); NEXT();
+    OPCODE(IN_NEWCW) CHECKED(newcw(context)); NEXT();
+    OPCODE(IN_NEWCF) CHECKED(newcf(context)); NEXT();
+    OPCODE(IN_NEWCL) CHECKED(newcl(context)); NEXT();
+    OPCODE(IN_NEWCP) CHECKED(newcp(context)); NEXT();
+    OPCODE(IN_NEWCM) CHECKED(newcm(context)); NEXT();
+    OPCODE(IN_NEWCMP) CHECKED(newcmp(context)); NEXT();
+    // A thread that blocks has its communication completed by another
+    // thread, so it resumes at the next instruction.
+    OPCODE(IN_SEND) CHECKED(send(context)); NEXT();
+    OPCODE(IN_RECV) CHECKED(recv(context)); NEXT();
+
+    OPCODE(IN_LENA) op_lena(context); NEXT();
+    OPCODE(IN_INDB) CHECKED(op_indb(context)); NEXT();
+    OPCODE(IN_INDW) CHECKED(op_indw(context)); NEXT();
+    OPCODE(IN_INDF) CHECKED(op_indf(context)); NEXT();
+    OPCODE(IN_INDL) CHECKED(op_indl(context)); NEXT();
+    OPCODE(IN_INDX) CHECKED(op_indx(context)); NEXT();
+
+    OPCODE(IN_MOVB) op_movb(context); NEXT();
+    OPCODE(IN_MOVW) op_movw(context); NEXT();
+    OPCODE(IN_MOVF) op_movf(context); NEXT();
+    OPCODE(IN_MOVL) op_movl(context); NEXT();
+    OPCODE(IN_MOVP) op_movp(context); NEXT();
+    OPCODE(IN_MOVM) CHECKED(op_movm(context, inst)); NEXT();
+    OPCODE(IN_MOVMP) movmp(context); NEXT();
+    OPCODE(IN_TCMP) CHECKED(tcmp(context)); NEXT();
+
+    OPCODE(IN_CVTBW) op_cvtbw(context); NEXT();
+    OPCODE(IN_CVTWB) op_cvtwb(context); NEXT();
+    OPCODE(IN_CVTFW) op_cvtfw(context); NEXT();
+    OPCODE(IN_CVTWF) op_cvtwf(context); NEXT();
+    OPCODE(IN_CVTLF) op_cvtlf(context); NEXT();
+    OPCODE(IN_CVTFL) op_cvtfl(context); NEXT();
+    OPCODE(IN_CVTLW) op_cvtlw(context); NEXT();
+    OPCODE(IN_CVTWL) op_cvtwl(context); NEXT();
+    OPCODE(IN_CVTRF) op_cvtrf(context); NEXT();
+    OPCODE(IN_CVTFR) op_cvtfr(context); NEXT();
+    OPCODE(IN_CVTWS) op_cvtws(context); NEXT();
+    OPCODE(IN_CVTSW) op_cvtsw(context); NEXT();
+
+    OPCODE(IN_ADDB) op_addb(context); NEXT();
+    OPCODE(IN_ADDW) op_addw(context); NEXT();
+    OPCODE(IN_ADDF) op_addf(context); NEXT();
+    OPCODE(IN_ADDL) op_addl(context); NEXT();
+    OPCODE(IN_SUBB) op_subb(context); NEXT();
+    OPCODE(IN_SUBW) op_subw(context); NEXT();
+    OPCODE(IN_SUBF) op_subf(context); NEXT();
+    OPCODE(IN_SUBL) op_subl(context); NEXT();
+    OPCODE(IN_MULB) op_mulb(context); NEXT();
+    OPCODE(IN_MULW) op_mulw(context); NEXT();
+    OPCODE(IN_MULF) op_mulf(context); NEXT();
+    OPCODE(IN_MULL) op_mull(context); NEXT();
+    OPCODE(IN_DIVB) CHECKED(op_divb(context)); NEXT();
+    OPCODE(IN_DIVW) CHECKED(op_divw(context)); NEXT();
+    OPCODE(IN_DIVF) op_divf(context); NEXT();
+    OPCODE(IN_DIVL) CHECKED(op_divl(context)); NEXT();
+    OPCODE(IN_MODB) CHECKED(op_modb(context)); NEXT();
+    OPCODE(IN_MODW) CHECKED(op_modw(context)); NEXT();
+    OPCODE(IN_MODL) CHECKED(op_modl(context)); NEXT();
+    OPCODE(IN_NEGF) op_negf(context); NEXT();
+
+    OPCODE(IN_ANDB) op_andb(context); NEXT();
+    OPCODE(IN_ANDW) op_andw(context); NEXT();
+    OPCODE(IN_ANDL) op_andl(context); NEXT();
+    OPCODE(IN_ORB) op_orb(context); NEXT();
+    OPCODE(IN_ORW) op_orw(context); NEXT();
+    OPCODE(IN_ORL) op_orl(context); NEXT();
+    OPCODE(IN_XORB) op_xorb(context); NEXT();
+    OPCODE(IN_XORW) op_xorw(context); NEXT();
+    OPCODE(IN_XORL) op_xorl(context); NEXT();
+    OPCODE(IN_SHLB) op_shlb(context); NEXT();
+    OPCODE(IN_SHLW) op_shlw(context); NEXT();
+    OPCODE(IN_SHLL) op_shll(context); NEXT();
+    OPCODE(IN_SHRB) op_shrb(context); NEXT();
+    OPCODE(IN_SHRW) op_shrw(context); NEXT();
+    OPCODE(IN_SHRL) op_shrl(context); NEXT();
+    OPCODE(IN_LSRW) op_lsrw(context); NEXT();
+    OPCODE(IN_LSRL) op_lsrl(context); NEXT();
+
+    OPCODE(IN_BEQB) op_beqb(context); NEXT();
+    OPCODE(IN_BNEB) op_bneb(context); NEXT();
+    OPCODE(IN_BLTB) op_bltb(context); NEXT();
+    OPCODE(IN_BLEB) op_bleb(context); NEXT();
+    OPCODE(IN_BGTB) op_bgtb(context); NEXT();
+    OPCODE(IN_BGEB) op_bgeb(context); NEXT();
+    OPCODE(IN_BEQW) op_beqw(context); NEXT();
+    OPCODE(IN_BNEW) op_bnew(context); NEXT();
+    OPCODE(IN_BLTW) op_bltw(context); NEXT();
+    OPCODE(IN_BLEW) op_blew(context); NEXT();
+    OPCODE(IN_BGTW) op_bgtw(context); NEXT();
+    OPCODE(IN_BGEW) op_bgew(context); NEXT();
+    OPCODE(IN_BEQF) op_beqf(context); NEXT();
+    OPCODE(IN_BNEF) op_bnef(context); NEXT();
+    OPCODE(IN_BLTF) op_bltf(context); NEXT();
+    OPCODE(IN_BLEF) op_blef(context); NEXT();
+    OPCODE(IN_BGTF) op_bgtf(context); NEXT();
+    OPCODE(IN_BGEF) op_bgef(context); NEXT();
+    OPCODE(IN_BEQL) op_beql(context); NEXT();
+    OPCODE(IN_BNEL) op_bnel(context); NEXT();
+    OPCODE(IN_BLTL) op_bltl(context); NEXT();
+    OPCODE(IN_BLEL) op_blel(context); NEXT();
+    OPCODE(IN_BGTL) op_bgtl(context); NEXT();
+    OPCODE(IN_BGEL) op_bgel(context); NEXT();
+
+    OPCODE(IN_LENC) op_lenc(context); NEXT();
+    OPCODE(IN_INDC) CHECKED(indc(context)); NEXT();
+    OPCODE(IN_INSC) CHECKED(insc(context)); NEXT();
+    OPCODE(IN_ADDC) CHECKED(addc(context)); NEXT();
+    OPCODE(IN_SLICEA) CHECKED(slicea(context)); NEXT();
+    OPCODE(IN_SLICELA) CHECKED(slicela(context)); NEXT();
+    OPCODE(IN_SLICEC) CHECKED(slicec(context)); NEXT();
+    OPCODE(IN_BEQC) beqc(context); NEXT();
+    OPCODE(IN_BNEC) bnec(context); NEXT();
+    OPCODE(IN_BLTC) bltc(context); NEXT();
+    OPCODE(IN_BLEC) blec(context); NEXT();
+    OPCODE(IN_BGTC) bgtc(context); NEXT();
+    OPCODE(IN_BGEC) bgec(context); NEXT();
+    OPCODE(IN_CASEC) CHECKED(casec(context)); NEXT();
+    OPCODE(IN_CVTCA) CHECKED(cvtca(context)); NEXT();
+    OPCODE(IN_CVTAC) CHECKED(cvtac(context)); NEXT();
+    OPCODE(IN_CVTWC) CHECKED(cvtwc(context)); NEXT();
+    OPCODE(IN_CVTCW) CHECKED(cvtcw(context)); NEXT();
+    OPCODE(IN_CVTFC) CHECKED(cvtfc(context)); NEXT();
+    OPCODE(IN_CVTCF) CHECKED(cvtcf(context)); NEXT();
+    OPCODE(IN_CVTLC) CHECKED(cvtlc(context)); NEXT();
+    OPCODE(IN_CVTCL) CHECKED(cvtcl(context)); NEXT();
+
+    // Superinstructions run the first half with the operands already fetched,
+    // then fetch the operands of the following instruction for the second.
+    OPCODE(IN_XMOVW_ADDW)
+        op_movw(context);
+        fetch(context);
+        op_addw(context);
+        NEXT();
+    OPCODE(IN_XADDW_BLTW)
+        op_addw(context);
+        fetch(context);
+        op_bltw(context);
+        NEXT();
+    OPCODE(IN_XLENA_BGEW)
+        op_lena(context);
+        fetch(context);
+        op_bgew(context);
+        NEXT();
+    OPCODE(IN_XINDW_MOVW)
+        CHECKED(op_indw(context));
+        fetch(context);
+        op_movw(context);
+        NEXT();
+    OPCODE(IN_XCASE) xcase(context); NEXT();
+    OPCODE(IN_XCASEC) xcasec(context); NEXT();
+
+    // Quickened instructions, which can run out of memory as the instructions
+    // they stand for can.
+    OPCODE(IN_XMNEWZ) CHECKED(xmnewz(context, inst)); NEXT();
+    OPCODE(IN_XMNEWZP) CHECKED(xmnewzp(context, inst)); NEXT();
+    OPCODE(IN_XMOVM) op_xmovm(context); NEXT();
+    OPCODE(IN_XHEADM) CHECKED(xheadm(context)); NEXT();
+    OPCODE(IN_XCONSM) CHECKED(xconsm(context)); NEXT();
+
+#if DIS_JIT
+    // Compiled code returns at the first instruction it leaves to the
+    // interpreter, when it stops the thread by dividing by zero, or when it
+    // uses up the quantum on a backward branch.
+    OPCODE(IN_XJIT)
+        context->quantum = quantum;
+        jit_enter(context);
+        quantum = context->quantum;
+        if (context->status != EXEC_RUNNING) {
+            STOP();
+        }
+        if (quantum == 0) {
+            goto yield;
+        }
+        NEXT();
+#endif
+
+#if !DIS_THREADED_DISPATCH
+            case IN_XEND:
+                goto overrun;
+            default:
+                goto unimplemented;
+        }
+    }
+#endif
+
+unimplemented:
+    execution_error(context, "unimplemented instruction");
+    STOP();
+
+overrun:
+    execution_error(context, "program counter out of range");
+    STOP();
+
+yield:
+#if DIS_PROFILE
+    if (profiler != NULL) {
+        quantum = profile_yield(profiler, context, &rest);
+        if (quantum != 0) {
+#if DIS_THREADED_DISPATCH
+            NEXT();
+#else
+            goto resume;
+#endif
+        }
+    }
+#endif
+    context->status = EXEC_YIELDED;
+    STOP();
+}
@@ -3,8 +3,220 @@
 
 #include "types.h"
 
+// Addressing modes, as encoded in the address mode byte that follows each
+// opcode in the object code. Bits 7-6 give the mode of the middle operand,
+// bits 5-3 the mode of the source operand and bits 2-0 the mode of the
+// destination operand.
+//
+// Mode  | Source/destination operand
+// ----- | ------------------------------------------
+// 000   | offset indirect from `mp`
+// 001   | offset indirect from `fp`
+// 010   | 30-bit immediate
+// 011   | no operand
+// 100   | double indirect from `mp`
+// 101   | double indirect from `fp`
+//
+// Mode  | Middle operand
+// ----- | ------------------------------------------
+// 00    | no operand (the destination is used instead)
+// 01    | small immediate
+// 10    | small offset indirect from `fp`
+// 11    | small offset indirect from `mp`
+
+#define AMP    0x00 // offset indirect from mp
+#define AFP    0x01 // offset indirect from fp
+#define AIMM   0x02 // immediate
+#define AXXX   0x03 // no operand
+#define AIND   0x04 // double indirect, or'd with AMP or AFP
+#define AMASK  0x07
+
+#define AXNON  0x00 // no middle operand
+#define AXIMM  0x40 // small immediate middle operand
+#define AXINF  0x80 // small offset indirect from fp
+#define AXINM  0xC0 // small offset indirect from mp
+#define AXMASK 0xC0
+
+/// An operand of a decoded instruction.
+typedef struct Operand {
+    /// One of `AMP`, `AFP`, `AIMM`, `AXXX`, `AIND | AMP` or `AIND | AFP`.
+    /// Middle operands are resolved to the same modes; a missing middle
+    /// operand is a copy of the destination operand.
+    byte mode;
+    /// Offset from `mp` or `fp`, or the value of an immediate.
+    word offset;
+    /// Offset into the object addressed by a double indirect operand.
+    word indirect;
+} Operand;
+
+/// An instruction decoded from the object code by the loader.
+///
+/// Decoding happens once per module, so the interpreter never parses the
+/// variable-length operand encoding as it runs.
+typedef struct Inst {
+    /// Address of the code implementing the instruction in the threaded
+    /// interpreter, or `NULL` when it dispatches with a `switch`.
+    const void *handler;
+    /// The instruction's opcode: an `Instruction`.
+    byte opcode;
+    Operand s, m, d;
+} Inst;
+
+typedef enum ExecutionStatus {
+    /// The thread is still executing instructions.
+    EXEC_RUNNING,
+    /// The thread executed `exit`, or returned from its outermost frame.
+    EXEC_EXITED,
+    /// The thread raised an error; see `ExecutionContext::error`.
+    EXEC_ERROR,
+    /// The thread used up its quantum. Calling `execute()` again resumes it.
+    EXEC_YIELDED,
+    /// The thread is waiting to communicate on a channel. It may be resumed
+    /// once another thread has completed the communication.
+    EXEC_BLOCKED,
+} ExecutionStatus;
+
+/// A piece of a thread's stack, in which its frames are allocated.
+typedef struct StackSegment {
+    /// The segments allocated before and after this one. Segments after the
+    /// one in use are kept for the stack to grow into again.
+    struct StackSegment *prev;
+    struct StackSegment *next;
+    /// The end of the segment.
+    byte *limit;
+    /// The end of the frames in the segment, while the stack has moved on to
+    /// the next one.
+    byte *top;
+    _Alignas(16) byte base[];
+} StackSegment;
+
+/// A thread's stack. Frames are allocated by bumping `top`, and freed all at
+/// once by moving it back when the function they were made for returns.
+typedef struct Stack {
+    /// The segment frames are being allocated from, or `NULL` if none has
+    /// been allocated yet.
+    StackSegment *segment;
+    /// Where the next frame goes, and the end of its segment.
+    byte *top;
+    byte *limit;
+} Stack;
+
+/// Counts of how the stacks of every thread have grown.
+typedef struct StackStats {
+    /// The number of times a frame did not fit in the rest of its stack's
+    /// segment, and had to go in the next one.
+    uptr grows;
+    /// The number of segments that have ever been allocated.
+    uptr allocations;
+    /// The number of segments allocated now, and how many bytes they take.
+    uptr segments;
+    uptr bytes;
+} StackStats;
+
 typedef struct ExecutionContext {
+    /// Index in `code` of the next instruction to execute.
     uptr program_counter;
+    /// Decoded instructions of the module being executed.
+    const Inst *code;
+    /// Frame pointer.
+    byte *fp;
+    /// Module data pointer.
+    byte *mp;
+    /// Module link register: the module being executed. The context holds a
+    /// reference to it.
+    ModuleLink *ml;
+    /// Effective addresses of the source, middle and destination operands of
+    /// the instruction being executed.
+    byte *s, *m, *d;
+    ExecutionStatus status;
+    /// Description of the error that stopped the thread, if `status` is
+    /// `EXEC_ERROR`.
+    const char *error;
+    /// The number of instructions the thread may dispatch before `execute()`
+    /// yields, counting down. `EXEC_UNLIMITED` runs the thread until it
+    /// stops.
+    uptr quantum;
+    /// The stack the thread's frames are allocated on.
+    Stack stack;
 } ExecutionContext;
 
+/// A quantum long enough to run any thread until it stops.
+#define EXEC_UNLIMITED UINTPTR_MAX
+
+/// Prepare `context` to run the entry point of a module.
+///
+/// A frame of the module's entry type is allocated for the call, on a new
+/// stack that `execution_free()` frees once the thread has stopped; the
+/// thread exits when the entry function returns. The quantum is unlimited.
+///
+/// \param context The execution context.
+/// \param ml The module to run, which the context takes a reference to.
+/// \return `false` if the module has no entry point, its code is invalid, or
+/// there is no memory for the entry function's frame.
+bool execution_init(ExecutionContext *context, ModuleLink *ml);
+
+/// Free a context's stack, and drop its references.
+///
+/// \param context The execution context of a thread that has stopped.
+void execution_free(ExecutionContext *context);
+
+/// Allocate a frame for a call on the thread's stack.
+///
+/// The frame is zero-filled, so every pointer in it is `H`, and its header's
+/// type is set to `t`.
+///
+/// \param context The execution context of the thread making the call.
+/// \param t Type descriptor of the frame.
+/// \return The new frame, or `NULL`, having stopped the thread with an
+/// error, if there is no memory for it.
+Frame *frame_alloc(ExecutionContext *context, TypeDescriptor *t);
+
+/// Free a frame allocated by `frame_alloc()`, along with every frame the
+/// thread has allocated since, dropping the references in them.
+///
+/// \param context The execution context of the thread that allocated it.
+/// \param f The frame to free.
+void frame_release(ExecutionContext *context, Frame *f);
+
+/// Free every frame on a stack, dropping the references in them and the
+/// module links saved by their calls, and keep its first segment to allocate
+/// from again.
+///
+/// \param stack The stack.
+void stack_reset(Stack *stack);
+
+/// Free a stack's segments, leaving it empty.
+///
+/// \param stack The stack.
+void stack_free(Stack *stack);
+
+/// Read the counts of how stacks have grown.
+///
+/// \param stats Where to put the counts.
+void stack_stats(StackStats *stats);
+
+/// Run the thread described by `context` until it exits, raises an error,
+/// uses up its quantum or blocks.
+///
+/// Instructions are dispatched with computed gotos when the library is built
+/// with `DIS_THREADED_DISPATCH`, and with a `switch` otherwise.
+///
+/// \param context The execution context.
+/// \return The status the thread stopped with.
+ExecutionStatus execute(ExecutionContext *context);
+
+/// Look up the address of the code implementing an opcode in the threaded
+/// interpreter, for `Inst::handler`.
+///
+/// \param opcode An `Instruction`.
+/// \return The handler address, or `NULL` if the interpreter dispatches with
+/// a `switch`.
+const void *execution_handler(byte opcode);
+
+/// Stop the thread described by `context` with an error.
+///
+/// \param context The execution context.
+/// \param message Description of the error.
+void execution_error(ExecutionContext *context, const char *message);
+
 #endif //DIS_EXECUTION_H
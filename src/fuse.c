@@ -0,0 +1,64 @@
+#include "instructions.h"
+#include "module.h"
+
+/// Instruction pairs the interpreter has a superinstruction for.
+static const struct {
+    byte first;
+    byte second;
+    byte fused;
+} superinstructions[] = {
+    {IN_MOVW, IN_ADDW, IN_XMOVW_ADDW},
+    {IN_ADDW, IN_BLTW, IN_XADDW_BLTW},
+    {IN_LENA, IN_BGEW, IN_XLENA_BGEW},
+    {IN_INDW, IN_MOVW, IN_XINDW_MOVW},
+};
+
+void module_fuse(Module *module)
+{
+    Inst *code = module->code;
+    // A superinstruction leaves its second half in place, so pairs may
+    // overlap: in `movw; addw; bltw` both the `movw` and the `addw` are fused.
+    for (word i = 0; i + 1 < module->ninstructions; i++) {
+        for (uptr j = 0; j < sizeof superinstructions / sizeof *superinstructions; j++) {
+            if (code[i].opcode == superinstructions[j].first &&
+                code[i + 1].opcode == superinstructions[j].second) {
+                code[i].opcode = superinstructions[j].fused;
+                code[i].handler = execution_handler(code[i].opcode);
+                break;
+            }
+        }
+    }
+}
+
+/// Instructions the interpreter quickens, and what it quickens them to.
+static const struct {
+    byte quick;
+    byte generic;
+} quickened[] = {
+    {IN_XMNEWZ, IN_MNEWZ},
+    {IN_XMNEWZP, IN_MNEWZ},
+    {IN_XMOVM, IN_MOVM},
+    {IN_XHEADM, IN_HEADM},
+    {IN_XCONSM, IN_CONSM},
+};
+
+byte module_unfused(byte opcode)
+{
+    if (opcode == IN_XCASE) {
+        return IN_CASE;
+    }
+    if (opcode == IN_XCASEC) {
+        return IN_CASEC;
+    }
+    for (uptr j = 0; j < sizeof quickened / sizeof *quickened; j++) {
+        if (opcode == quickened[j].quick) {
+            return quickened[j].generic;
+        }
+    }
+    for (uptr j = 0; j < sizeof superinstructions / sizeof *superinstructions; j++) {
+        if (opcode == superinstructions[j].fused) {
+            return superinstructions[j].first;
+        }
+    }
+    return opcode;
+}
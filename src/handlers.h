@@ -0,0 +1,395 @@
+#ifndef DIS_HANDLERS_H
+#define DIS_HANDLERS_H
+
+// Bodies of the instructions that the interpreter loop in `execute()` expands
+// inline. The public functions declared in `instructions.h` are thin wrappers
+// around these, so that each instruction is only implemented once.
+//
+// Every handler reads its operands through the effective addresses `s`, `m`
+// and `d` stored in the execution context.
+//
+// Handlers that quicken their instruction rewrite it as they run it, so the
+// next execution dispatches straight to the specialised variant.
+
+#include <math.h>
+#include <string.h>
+
+#include "execution.h"
+#include "heap.h"
+#include "instructions.h"
+#include "module.h"
+#include "str.h"
+
+#define B(operand) (*(byte *) context->operand)
+#define W(operand) (*(word *) context->operand)
+#define F(operand) (*(real *) context->operand)
+#define V(operand) (*(big *) context->operand)
+#define P(operand) (*(pointer *) context->operand)
+#define SH(operand) (*(int16_t *) context->operand)
+#define SR(operand) (*(float *) context->operand)
+#define A(operand) (*(Array **) context->operand)
+#define S(operand) (*(String **) context->operand)
+
+// Word and big arithmetic wraps on overflow, as on the machines Dis was
+// designed for. Do it in unsigned arithmetic to keep it defined in C.
+#define WRAPW(x) ((word) (uint32_t) (x))
+#define WRAPV(x) ((big) (uint64_t) (x))
+
+/// The largest size in bytes that `movm`, `headm` and `consm` are quickened
+/// for. Larger copies are as quick through `memmove()`.
+#define QUICK_COPY_MAX 32
+
+/// The instruction the interpreter fetched as `inst`, in its module's code,
+/// where it can be rewritten.
+static inline Inst *quick_site(ExecutionContext *context, const Inst *inst)
+{
+    return &context->ml->module->code[inst - context->code];
+}
+
+/// Rewrite an instruction to `quick`, which must do what it does. Only
+/// instructions from object code are quickened, and only in modules decoded
+/// with fusion enabled.
+///
+/// Other threads may be running the instruction, or the JIT installing
+/// compiled code at it, so the handler and then the opcode are each replaced
+/// only if nothing else has replaced them first: compiled code always wins.
+///
+/// \param fetched The instruction, as the interpreter dispatched it, or
+/// `NULL` if it was not, which leaves it as it is.
+static inline void quicken(ExecutionContext *context, const Inst *fetched, byte quick)
+{
+    if (fetched == NULL || !context->ml->module->quicken) {
+        return;
+    }
+    Inst *inst = quick_site(context, fetched);
+    byte opcode = __atomic_load_n(&inst->opcode, __ATOMIC_ACQUIRE);
+    if (opcode > IN_NEWAZ) {
+        return;
+    }
+    const void *handler = execution_handler(opcode);
+    if (__atomic_compare_exchange_n(&inst->handler, &handler, execution_handler(quick), false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        __atomic_compare_exchange_n(&inst->opcode, &opcode, quick, false, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED);
+    }
+}
+
+/// Whether an instruction the interpreter dispatched copies `size` bytes,
+/// with the size in an immediate middle operand, and the size is small enough
+/// to quicken.
+static inline bool quick_copy(const Inst *inst, word size)
+{
+    return inst != NULL && size > 0 && size <= QUICK_COPY_MAX && inst->m.mode == AIMM;
+}
+
+/// Copy between 1 and `QUICK_COPY_MAX` bytes, which may overlap, inline.
+/// Everything is loaded before anything is stored, and sizes between powers
+/// of two are copied as two overlapping halves.
+static inline void copy_small(byte *d, const byte *s, uptr n)
+{
+    if (n >= 16) {
+        byte head[16], tail[16];
+        memcpy(head, s, 16);
+        memcpy(tail, s + n - 16, 16);
+        memcpy(d, head, 16);
+        memcpy(d + n - 16, tail, 16);
+    } else if (n >= 8) {
+        uint64_t head, tail;
+        memcpy(&head, s, 8);
+        memcpy(&tail, s + n - 8, 8);
+        memcpy(d, &head, 8);
+        memcpy(d + n - 8, &tail, 8);
+    } else if (n >= 4) {
+        uint32_t head, tail;
+        memcpy(&head, s, 4);
+        memcpy(&tail, s + n - 4, 4);
+        memcpy(d, &head, 4);
+        memcpy(d + n - 4, &tail, 4);
+    } else {
+        byte first = s[0], middle = s[n / 2], last = s[n - 1];
+        d[0] = first;
+        d[n / 2] = middle;
+        d[n - 1] = last;
+    }
+}
+
+/// Transfer control to the instruction numbered `target`.
+static inline void jump(ExecutionContext *context, word target)
+{
+    context->program_counter = target;
+}
+
+/// Jump to a target read from a table in memory, which the loader has not
+/// checked, stopping the thread with an error if it is not an instruction of
+/// the module.
+static inline void computed_jump(ExecutionContext *context, word target)
+{
+    if ((uint32_t) target >= (uint32_t) context->ml->module->ninstructions) {
+        execution_error(context, "invalid branch target");
+        return;
+    }
+    jump(context, target);
+}
+
+static inline void op_jmp(ExecutionContext *context) { jump(context, W(d)); }
+
+static inline void op_goto(ExecutionContext *context)
+{
+    computed_jump(context, ((word *) context->d)[W(s)]);
+}
+
+static inline void op_case(ExecutionContext *context)
+{
+    // The table is a count `n`, followed by `n` sorted (low, high, pc)
+    // triples with an exclusive upper bound, followed by the default pc.
+    word v = W(s);
+    word *table = (word *) context->d + 1;
+    word n = table[-1];
+    word target = table[n * 3];
+    while (n > 0) {
+        word half = n >> 1;
+        word *entry = table + half * 3;
+        if (v < entry[0]) {
+            n = half;
+        } else if (v >= entry[1]) {
+            table = entry + 3;
+            n -= half + 1;
+        } else {
+            target = entry[2];
+            break;
+        }
+    }
+    computed_jump(context, target);
+}
+
+static inline void op_lea(ExecutionContext *context) { P(d) = context->s; }
+
+// Program counters are instruction numbers, so they fit in a word.
+static inline void op_movpc(ExecutionContext *context) { W(d) = W(s); }
+
+static inline void op_movb(ExecutionContext *context) { B(d) = B(s); }
+static inline void op_movw(ExecutionContext *context) { W(d) = W(s); }
+static inline void op_movf(ExecutionContext *context) { F(d) = F(s); }
+static inline void op_movl(ExecutionContext *context) { V(d) = V(s); }
+
+static inline void op_movp(ExecutionContext *context)
+{
+    pointer p = P(s);
+    heap_retain(p);
+    pointer old = P(d);
+    P(d) = p;
+    heap_release(old);
+}
+
+static inline void op_movm(ExecutionContext *context, const Inst *inst)
+{
+    word size = W(m);
+    if (size < 0) {
+        execution_error(context, "negative size");
+        return;
+    }
+    memmove(context->d, context->s, (uptr) size);
+    if (quick_copy(inst, size)) {
+        quicken(context, inst, IN_XMOVM);
+    }
+}
+
+static inline void op_xmovm(ExecutionContext *context)
+{
+    copy_small(context->d, context->s, (uptr) W(m));
+}
+
+static inline void op_cvtbw(ExecutionContext *context) { W(d) = B(s); }
+static inline void op_cvtwb(ExecutionContext *context) { B(d) = (byte) W(s); }
+static inline void op_cvtwf(ExecutionContext *context) { F(d) = W(s); }
+static inline void op_cvtlf(ExecutionContext *context) { F(d) = (real) V(s); }
+static inline void op_cvtlw(ExecutionContext *context) { W(d) = (word) V(s); }
+static inline void op_cvtwl(ExecutionContext *context) { V(d) = W(s); }
+static inline void op_cvtrf(ExecutionContext *context) { F(d) = SR(s); }
+static inline void op_cvtfr(ExecutionContext *context) { SR(d) = (float) F(s); }
+static inline void op_cvtws(ExecutionContext *context) { SH(d) = (int16_t) W(s); }
+static inline void op_cvtsw(ExecutionContext *context) { W(d) = SH(s); }
+
+// Conversions from real round to the nearest integer, away from zero.
+static inline void op_cvtfw(ExecutionContext *context) { W(d) = (word) round(F(s)); }
+static inline void op_cvtfl(ExecutionContext *context) { V(d) = (big) round(F(s)); }
+
+static inline void op_addb(ExecutionContext *context) { B(d) = B(m) + B(s); }
+static inline void op_addw(ExecutionContext *context) { W(d) = WRAPW((uint32_t) W(m) + (uint32_t) W(s)); }
+static inline void op_addf(ExecutionContext *context) { F(d) = F(m) + F(s); }
+static inline void op_addl(ExecutionContext *context) { V(d) = WRAPV((uint64_t) V(m) + (uint64_t) V(s)); }
+static inline void op_subb(ExecutionContext *context) { B(d) = B(m) - B(s); }
+static inline void op_subw(ExecutionContext *context) { W(d) = WRAPW((uint32_t) W(m) - (uint32_t) W(s)); }
+static inline void op_subf(ExecutionContext *context) { F(d) = F(m) - F(s); }
+static inline void op_subl(ExecutionContext *context) { V(d) = WRAPV((uint64_t) V(m) - (uint64_t) V(s)); }
+static inline void op_mulb(ExecutionContext *context) { B(d) = B(m) * B(s); }
+static inline void op_mulw(ExecutionContext *context) { W(d) = WRAPW((uint32_t) W(m) * (uint32_t) W(s)); }
+static inline void op_mulf(ExecutionContext *context) { F(d) = F(m) * F(s); }
+static inline void op_mull(ExecutionContext *context) { V(d) = WRAPV((uint64_t) V(m) * (uint64_t) V(s)); }
+static inline void op_divf(ExecutionContext *context) { F(d) = F(m) / F(s); }
+static inline void op_negf(ExecutionContext *context) { F(d) = -F(s); }
+
+static inline void op_divb(ExecutionContext *context)
+{
+    if (B(s) == 0) {
+        execution_error(context, "zero divide");
+        return;
+    }
+    B(d) = B(m) / B(s);
+}
+
+static inline void op_modb(ExecutionContext *context)
+{
+    if (B(s) == 0) {
+        execution_error(context, "zero divide");
+        return;
+    }
+    B(d) = B(m) % B(s);
+}
+
+static inline void op_divw(ExecutionContext *context)
+{
+    if (W(s) == 0) {
+        execution_error(context, "zero divide");
+        return;
+    }
+    // INT32_MIN / -1 overflows; it wraps like the other arithmetic.
+    W(d) = W(s) == -1 ? WRAPW(-(uint32_t) W(m)) : W(m) / W(s);
+}
+
+static inline void op_modw(ExecutionContext *context)
+{
+    if (W(s) == 0) {
+        execution_error(context, "zero divide");
+        return;
+    }
+    W(d) = W(s) == -1 ? 0 : W(m) % W(s);
+}
+
+static inline void op_divl(ExecutionContext *context)
+{
+    if (V(s) == 0) {
+        execution_error(context, "zero divide");
+        return;
+    }
+    V(d) = V(s) == -1 ? WRAPV(-(uint64_t) V(m)) : V(m) / V(s);
+}
+
+static inline void op_modl(ExecutionContext *context)
+{
+    if (V(s) == 0) {
+        execution_error(context, "zero divide");
+        return;
+    }
+    V(d) = V(s) == -1 ? 0 : V(m) % V(s);
+}
+
+static inline void op_andb(ExecutionContext *context) { B(d) = B(m) & B(s); }
+static inline void op_andw(ExecutionContext *context) { W(d) = W(m) & W(s); }
+static inline void op_andl(ExecutionContext *context) { V(d) = V(m) & V(s); }
+static inline void op_orb(ExecutionContext *context) { B(d) = B(m) | B(s); }
+static inline void op_orw(ExecutionContext *context) { W(d) = W(m) | W(s); }
+static inline void op_orl(ExecutionContext *context) { V(d) = V(m) | V(s); }
+static inline void op_xorb(ExecutionContext *context) { B(d) = B(m) ^ B(s); }
+static inline void op_xorw(ExecutionContext *context) { W(d) = W(m) ^ W(s); }
+static inline void op_xorl(ExecutionContext *context) { V(d) = V(m) ^ V(s); }
+
+// The shift count is always a word, whatever the type of the shifted value.
+// It is taken modulo the width of a word, or of a big for bigs, as the
+// processors Dis runs on do, so that no count is undefined in C. Bytes are
+// shifted as words, and the result truncated.
+#define SHIFTW (W(s) & 31)
+#define SHIFTL (W(s) & 63)
+
+static inline void op_shlb(ExecutionContext *context) { B(d) = (byte) ((uint32_t) B(m) << SHIFTW); }
+static inline void op_shlw(ExecutionContext *context) { W(d) = WRAPW((uint32_t) W(m) << SHIFTW); }
+static inline void op_shll(ExecutionContext *context) { V(d) = WRAPV((uint64_t) V(m) << SHIFTL); }
+static inline void op_shrb(ExecutionContext *context) { B(d) = (byte) (B(m) >> SHIFTW); }
+static inline void op_shrw(ExecutionContext *context) { W(d) = W(m) >> SHIFTW; }
+static inline void op_shrl(ExecutionContext *context) { V(d) = V(m) >> SHIFTL; }
+static inline void op_lsrw(ExecutionContext *context) { W(d) = (word) ((uint32_t) W(m) >> SHIFTW); }
+static inline void op_lsrl(ExecutionContext *context) { V(d) = (big) ((uint64_t) V(m) >> SHIFTL); }
+
+static inline void op_lena(ExecutionContext *context)
+{
+    Array *a = A(s);
+    W(d) = a == H ? 0 : a->len;
+}
+
+static inline void op_lenc(ExecutionContext *context)
+{
+    String *s = S(s);
+    W(d) = s == H ? 0 : s->len;
+}
+
+static inline void op_lenl(ExecutionContext *context)
+{
+    word len = 0;
+    for (List *l = P(s); l != H; l = l->tail) {
+        len++;
+    }
+    W(d) = len;
+}
+
+/// Store the address of element `W(d)` of array `A(s)` in `P(m)`.
+static inline void index_array(ExecutionContext *context, uptr size)
+{
+    Array *a = A(s);
+    word i = W(d);
+    if (a == H || (uint32_t) i >= (uint32_t) a->len) {
+        execution_error(context, "array bounds error");
+        return;
+    }
+    P(m) = a->data + i * size;
+}
+
+static inline void op_indb(ExecutionContext *context) { index_array(context, sizeof(byte)); }
+static inline void op_indw(ExecutionContext *context) { index_array(context, sizeof(word)); }
+static inline void op_indf(ExecutionContext *context) { index_array(context, sizeof(real)); }
+static inline void op_indl(ExecutionContext *context) { index_array(context, sizeof(big)); }
+
+// `indx` is not quickened for its element size: an array of another type
+// could turn up at the same instruction, so the size would have to be read
+// from the array to check it anyway, which is all `indx` does with it.
+static inline void op_indx(ExecutionContext *context)
+{
+    Array *a = A(s);
+    index_array(context, a == H ? 0 : a->t->size);
+}
+
+#define BRANCH(name, type, cmp) \
+    static inline void op_##name(ExecutionContext *context) \
+    { \
+        if (type(s) cmp type(m)) jump(context, W(d)); \
+    }
+
+BRANCH(beqb, B, ==)
+BRANCH(bneb, B, !=)
+BRANCH(bltb, B, <)
+BRANCH(bleb, B, <=)
+BRANCH(bgtb, B, >)
+BRANCH(bgeb, B, >=)
+BRANCH(beqw, W, ==)
+BRANCH(bnew, W, !=)
+BRANCH(bltw, W, <)
+BRANCH(blew, W, <=)
+BRANCH(bgtw, W, >)
+BRANCH(bgew, W, >=)
+BRANCH(beqf, F, ==)
+BRANCH(bnef, F, !=)
+BRANCH(bltf, F, <)
+BRANCH(blef, F, <=)
+BRANCH(bgtf, F, >)
+BRANCH(bgef, F, >=)
+BRANCH(beql, V, ==)
+BRANCH(bnel, V, !=)
+BRANCH(bltl, V, <)
+BRANCH(blel, V, <=)
+BRANCH(bgtl, V, >)
+BRANCH(bgel, V, >=)
+
+#undef BRANCH
+
+static inline void op_exit(ExecutionContext *context) { context->status = EXEC_EXITED; }
+
+#endif //DIS_HANDLERS_H
@@ -0,0 +1,1133 @@
+#define _DEFAULT_SOURCE // clock_gettime
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heap.h"
+#include "channel.h"
+#include "module.h"
+#include "str.h"
+
+// An object's reference word: the count in the low 31 bits, whether the
+// object is a candidate in the next, and the version in the high half. Every
+// change to the count also adds to the version.
+#define REF_COUNT(ref) ((uint32_t) (ref) & 0x7fffffff)
+#define REF_BUFFERED ((uint64_t) 1 << 31)
+#define REF_VERSION ((uint64_t) 1 << 32)
+#define REF_RETAIN (REF_VERSION + 1)
+#define REF_RELEASE (REF_VERSION - 1)
+
+/// Channels are aligned so that their head and tail have cache lines of
+/// their own; their header goes at the end of the first line.
+#define CHANNEL_ALIGN 64
+
+/// The number of candidates that wakes the collector before its interval is
+/// up, and the interval in milliseconds.
+#define COLLECT_THRESHOLD 4096
+#define COLLECT_INTERVAL 50
+
+/// Objects that may be garbage cycles, each holding a reference handed over
+/// by the thread that dropped it, and how many there are.
+static _Atomic(Heap *) candidates;
+static _Atomic uptr ncandidates;
+
+/// Whether a collection is under way, so that dead objects must be kept until
+/// it is over, and the objects that died meanwhile.
+static _Atomic bool collecting;
+static _Atomic(Heap *) limbo;
+
+static void push(_Atomic(Heap *) *stack, Heap *h)
+{
+    Heap *top = atomic_load_explicit(stack, memory_order_relaxed);
+    do {
+        h->next = top;
+    } while (!atomic_compare_exchange_weak_explicit(stack, &top, h, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+bool type_has_pointers(const TypeDescriptor *t)
+{
+    if (t == NULL) {
+        return false;
+    }
+    for (word i = 0; i < t->np; i++) {
+        if (t->map[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void type_release(TypeDescriptor *t)
+{
+    if (atomic_fetch_sub_explicit(&t->references, 1, memory_order_acq_rel) == 1) {
+        free(t);
+    }
+}
+
+/// A function called with each pointer slot of an object.
+typedef void (*Visit)(pointer *slot, void *arg);
+
+/// Call `visit` with every pointer slot in a block of memory.
+static void visit_block(byte *p, TypeDescriptor *t, Visit visit, void *arg)
+{
+    for (word i = 0; i < t->np; i++) {
+        for (byte bits = t->map[i]; bits != 0; bits &= bits - 1) {
+            word slot = 8 * i + 7 - __builtin_ctz(bits);
+            visit((pointer *) p + slot, arg);
+        }
+    }
+}
+
+/// Call `visit` with every pointer slot in a heap object.
+static void visit_object(Heap *h, Visit visit, void *arg)
+{
+    byte *p = (byte *) (h + 1);
+    switch ((HeapKind) h->kind) {
+    case HEAP_RECORD:
+        if (h->cyclic) {
+            visit_block(p, h->t, visit, arg);
+        }
+        break;
+    case HEAP_ARRAY: {
+        Array *a = (Array *) p;
+        if (a->root != H) {
+            // A slice's elements belong to the array it was sliced from.
+            visit((pointer *) &a->root, arg);
+        } else if (h->cyclic) {
+            for (word i = 0; i < a->len; i++) {
+                visit_block(a->data + (uptr) i * h->t->size, h->t, visit, arg);
+            }
+        }
+        break;
+    }
+    case HEAP_LIST: {
+        List *l = (List *) p;
+        visit((pointer *) &l->tail, arg);
+        if (h->cyclic) {
+            visit_block(l->data, h->t, visit, arg);
+        }
+        break;
+    }
+    case HEAP_CHANNEL: {
+        Channel *c = (Channel *) p;
+        if (h->cyclic) {
+            for (word i = 0; i < c->capacity; i++) {
+                visit_block(((Cell *) (c->cells + i * c->stride))->val, c->t, visit, arg);
+            }
+        }
+        break;
+    }
+    case HEAP_MODULE: {
+        ModuleLink *ml = (ModuleLink *) p;
+        // Shared module data belongs to the module.
+        if (h->cyclic && ml->mp != ml->module->shared_mp) {
+            visit_block(ml->mp, h->t, visit, arg);
+        }
+        break;
+    }
+    case HEAP_STRING: {
+        // Strings cannot be part of a cycle, so only their deaths get here.
+        String *s = (String *) p;
+        if (s->rope) {
+            visit((pointer *) &s->left, arg);
+            visit((pointer *) &s->right, arg);
+            visit((pointer *) &s->flat, arg);
+        } else {
+            visit((pointer *) &s->root, arg);
+        }
+        break;
+    }
+    }
+}
+
+/// Allocate a zero-filled heap object, with one reference to it.
+///
+/// \param cyclic Whether the object can hold pointers, and so be part of a
+/// cycle.
+/// \return The object, or `NULL` if there is no memory for it.
+static inline void *allocate(HeapKind kind, TypeDescriptor *t, uptr size, bool cyclic)
+{
+    Heap *h;
+    if (kind == HEAP_CHANNEL) {
+        uptr bytes = (CHANNEL_ALIGN + size + CHANNEL_ALIGN - 1) & ~(uptr) (CHANNEL_ALIGN - 1);
+        byte *block = aligned_alloc(CHANNEL_ALIGN, bytes);
+        if (block == NULL) {
+            return NULL;
+        }
+        memset(block, 0, bytes);
+        h = (Heap *) (block + CHANNEL_ALIGN) - 1;
+    } else {
+        h = calloc(1, sizeof(Heap) + size);
+        if (h == NULL) {
+            return NULL;
+        }
+    }
+    atomic_init(&h->ref, 1);
+    h->t = t;
+    h->next = NULL;
+    h->kind = (byte) kind;
+    h->cyclic = cyclic;
+    h->size = size < UINT32_MAX ? (uint32_t) size : UINT32_MAX;
+    if (t != NULL) {
+        atomic_fetch_add_explicit(&t->references, 1, memory_order_relaxed);
+    }
+    return h + 1;
+}
+
+void *heap_alloc(HeapKind kind, TypeDescriptor *t, uptr size)
+{
+    return allocate(kind, t, size, type_has_pointers(t));
+}
+
+void *heap_record(TypeDescriptor *t, bool pointers)
+{
+    return allocate(HEAP_RECORD, t, (uptr) t->size, pointers);
+}
+
+Array *heap_array(TypeDescriptor *t, word len)
+{
+    Array *a = heap_alloc(HEAP_ARRAY, t, sizeof(Array) + (uptr) len * (uptr) t->size);
+    if (a == NULL) {
+        return NULL;
+    }
+    a->len = len;
+    a->t = t;
+    a->root = H;
+    a->data = (byte *) (a + 1);
+    return a;
+}
+
+Array *heap_slice(Array *a, word start, word end)
+{
+    // A slice of a slice shares the elements of the array they were both
+    // sliced from.
+    Array *root = a->root != H ? a->root : a;
+    Array *slice = heap_alloc(HEAP_ARRAY, a->t, sizeof(Array));
+    if (slice == NULL) {
+        return NULL;
+    }
+    slice->len = end - start;
+    slice->t = a->t;
+    heap_retain(root);
+    slice->root = root;
+    slice->data = a->data + (uptr) start * (uptr) a->t->size;
+    return slice;
+}
+
+/// Free a dead object's memory, and whatever else it owns.
+static void deallocate(Heap *h)
+{
+    if (h->kind == HEAP_MODULE) {
+        module_link_destroy((ModuleLink *) (h + 1));
+    }
+    if (h->t != NULL) {
+        type_release(h->t);
+    }
+    if (h->kind == HEAP_CHANNEL) {
+        free((byte *) (h + 1) - CHANNEL_ALIGN);
+    } else {
+        free(h);
+    }
+}
+
+/// Free a dead object, or keep it until the collection under way is over.
+static void bury(Heap *h)
+{
+    // Pairs with the fence in `heap_collect()`: either the collector sees
+    // the pointers to the object gone, or this sees the collection.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&collecting, memory_order_relaxed)) {
+        push(&limbo, h);
+    } else {
+        deallocate(h);
+    }
+}
+
+static pthread_once_t collector_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static void collector_start(void);
+
+/// Hand a reference to an object to the candidates.
+static void buffer(Heap *h)
+{
+    push(&candidates, h);
+    uptr n = atomic_fetch_add_explicit(&ncandidates, 1, memory_order_relaxed) + 1;
+    if (n == 1) {
+        pthread_once(&collector_once, collector_start);
+    } else if (n == COLLECT_THRESHOLD) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+/// Drop a reference to an object.
+///
+/// \return Whether it was the last, so that the object is dead.
+static bool drop(Heap *h)
+{
+    if (h->cyclic) {
+        // The object lives on, perhaps only in a cycle: unless it already is
+        // one, the reference goes to the candidates instead. Whether it is
+        // one is decided together with the count, so that the collector sees
+        // every reference dropped while it was.
+        uint64_t ref = atomic_load_explicit(&h->ref, memory_order_relaxed);
+        while (REF_COUNT(ref) > 1 && !(ref & REF_BUFFERED)) {
+            if (atomic_compare_exchange_weak_explicit(&h->ref, &ref,
+                                                      ref + REF_VERSION + REF_BUFFERED,
+                                                      memory_order_release,
+                                                      memory_order_relaxed)) {
+                buffer(h);
+                return false;
+            }
+        }
+    }
+    uint64_t ref = atomic_fetch_add_explicit(&h->ref, REF_RELEASE, memory_order_acq_rel);
+    return REF_COUNT(ref) == 1;
+}
+
+static void drop_slot(pointer *slot, void *arg)
+{
+    Heap **dead = arg;
+    if (*slot != H) {
+        Heap *h = heap_header(*slot);
+        if (drop(h)) {
+            h->next = *dead;
+            *dead = h;
+        }
+    }
+}
+
+/// Free a dead object and drop its references, freeing whatever else dies
+/// with it. Long lists die one cell at a time, without recursion.
+static void destroy(Heap *h)
+{
+    h->next = NULL;
+    Heap *dead = h;
+    while (dead != NULL) {
+        h = dead;
+        dead = h->next;
+        visit_object(h, drop_slot, &dead);
+        bury(h);
+    }
+}
+
+/// The number of references a reader drops before handing them over to be
+/// dropped once every reader has passed a quiescent point.
+#define DEFER_BATCH 256
+
+/// References dropped by a reader, which are dropped for real once every
+/// reader online has passed a quiescent point since `epoch`.
+typedef struct Deferred {
+    uint64_t epoch;
+    struct Deferred *next;
+    uptr n;
+    pointer p[DEFER_BATCH];
+} Deferred;
+
+/// The epoch, which moves on whenever a reader hands over its references.
+static _Atomic uint64_t epoch = 1;
+
+/// The readers, and how many there are. Only changed while none is online.
+static HeapReader *readers;
+static _Atomic word nreaders;
+
+/// The reader the calling thread is, while it is online.
+static _Thread_local HeapReader *current;
+
+/// The references handed over by readers, oldest first.
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static Deferred *deferred;
+static Deferred *deferred_tail;
+
+/// Drop a reference to an object at once.
+static void release_now(pointer p)
+{
+    if (p != H && drop(heap_header(p))) {
+        destroy(heap_header(p));
+    }
+}
+
+/// Hand over the references a reader has dropped, in a new epoch.
+static void seal(HeapReader *r)
+{
+    Deferred *batch = r->deferred;
+    if (batch == NULL) {
+        return;
+    }
+    r->deferred = NULL;
+    batch->next = NULL;
+    pthread_mutex_lock(&deferred_lock);
+    // Every pointer the batch was dropped for has been overwritten before the
+    // epoch moves on, so a reader that sees the new epoch has not read it.
+    batch->epoch = atomic_fetch_add(&epoch, 1) + 1;
+    if (deferred_tail != NULL) {
+        deferred_tail->next = batch;
+    } else {
+        deferred = batch;
+    }
+    deferred_tail = batch;
+    pthread_mutex_unlock(&deferred_lock);
+}
+
+/// Note a reference the calling reader has dropped, to be dropped later.
+static void defer(pointer p)
+{
+    HeapReader *r = current;
+    if (r->deferred != NULL && r->deferred->n == DEFER_BATCH) {
+        seal(r);
+    }
+    if (r->deferred == NULL) {
+        r->deferred = malloc(sizeof(Deferred));
+        if (r->deferred == NULL) {
+            // The object is kept for good rather than freed under a reader.
+            return;
+        }
+        r->deferred->n = 0;
+    }
+    r->deferred->p[r->deferred->n++] = p;
+}
+
+/// Drop the references handed over in epochs every reader online has passed
+/// a quiescent point since.
+static void reclaim(void)
+{
+    if (pthread_mutex_trylock(&deferred_lock) != 0) {
+        return;
+    }
+    Deferred *ready = NULL;
+    if (deferred != NULL) {
+        // Pairs with the fence in `heap_reader_online()`: either a reader
+        // coming online is seen here, or it sees the pointers overwritten.
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t safe = UINT64_MAX;
+        for (HeapReader *r = readers; r != NULL; r = r->next) {
+            uint64_t seen = atomic_load(&r->seen);
+            if (seen != 0 && seen < safe) {
+                safe = seen;
+            }
+        }
+        Deferred **last = &ready;
+        while (deferred != NULL && deferred->epoch <= safe) {
+            *last = deferred;
+            last = &deferred->next;
+            deferred = deferred->next;
+        }
+        *last = NULL;
+        if (deferred == NULL) {
+            deferred_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&deferred_lock);
+
+    while (ready != NULL) {
+        Deferred *next = ready->next;
+        for (uptr i = 0; i < ready->n; i++) {
+            release_now(ready->p[i]);
+        }
+        free(ready);
+        ready = next;
+    }
+}
+
+/// Whether the references the calling thread drops must wait for the other
+/// readers to pass a quiescent point.
+static inline bool deferring(void)
+{
+    return current != NULL && atomic_load_explicit(&nreaders, memory_order_relaxed) > 1;
+}
+
+void heap_reader_add(HeapReader *r)
+{
+    atomic_init(&r->seen, 0);
+    r->deferred = NULL;
+    r->next = readers;
+    readers = r;
+    atomic_fetch_add(&nreaders, 1);
+}
+
+void heap_reader_remove(HeapReader *r)
+{
+    seal(r);
+    for (HeapReader **p = &readers; *p != NULL; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    atomic_fetch_sub(&nreaders, 1);
+    reclaim();
+}
+
+void heap_reader_online(HeapReader *r)
+{
+    atomic_store(&r->seen, atomic_load(&epoch));
+    // Pairs with the fence in `reclaim()`.
+    atomic_thread_fence(memory_order_seq_cst);
+    current = r;
+}
+
+void heap_reader_offline(HeapReader *r)
+{
+    current = NULL;
+    seal(r);
+    atomic_store(&r->seen, 0);
+    reclaim();
+}
+
+void heap_quiescent(HeapReader *r)
+{
+    // Whatever the reader read before goes before the epoch it announces, and
+    // it sees the pointers overwritten before the epoch it reads.
+    atomic_store_explicit(&r->seen, atomic_load_explicit(&epoch, memory_order_acquire),
+                          memory_order_release);
+    reclaim();
+}
+
+void heap_retain(pointer p)
+{
+    if (p != H) {
+        atomic_fetch_add_explicit(&heap_header(p)->ref, REF_RETAIN, memory_order_relaxed);
+    }
+}
+
+bool heap_unique(pointer p)
+{
+    return REF_COUNT(atomic_load_explicit(&heap_header(p)->ref, memory_order_acquire)) == 1;
+}
+
+void heap_release(pointer p)
+{
+    if (p != H && deferring()) {
+        defer(p);
+    } else {
+        release_now(p);
+    }
+}
+
+/// References to the same object, found one after another among the pointers
+/// being copied or overwritten, to be taken or dropped with one atomic
+/// operation.
+typedef struct Run {
+    pointer p;
+    uint64_t n;
+} Run;
+
+static void retain_run(const Run *run)
+{
+    if (run->p != H) {
+        atomic_fetch_add_explicit(&heap_header(run->p)->ref, run->n * REF_RETAIN,
+                                  memory_order_relaxed);
+    }
+}
+
+static void release_run(const Run *run)
+{
+    if (run->p == H) {
+        return;
+    }
+    // All but the last reference can go at once, as the last keeps the
+    // object alive; the last goes as any other would.
+    Heap *h = heap_header(run->p);
+    if (run->n > 1) {
+        atomic_fetch_add_explicit(&h->ref, (run->n - 1) * REF_RELEASE, memory_order_release);
+    }
+    heap_release(run->p);
+}
+
+/// Add a reference to a run, taking or dropping the references in the run
+/// before it if it is to a different object.
+static void add_to_run(Run *run, pointer p, void (*flush)(const Run *))
+{
+    if (p == run->p) {
+        run->n++;
+    } else {
+        flush(run);
+        *run = (Run) {p, 1};
+    }
+}
+
+static void retain_slot(pointer *slot, void *arg)
+{
+    add_to_run(arg, *slot, retain_run);
+}
+
+static void clear_slot(pointer *slot, void *arg)
+{
+    pointer p = *slot;
+    *slot = H;
+    add_to_run(arg, p, release_run);
+}
+
+void heap_retain_block(const byte *p, TypeDescriptor *t)
+{
+    Run run = {H, 0};
+    visit_block((byte *) p, t, retain_slot, &run);
+    retain_run(&run);
+}
+
+void heap_clear(byte *p, TypeDescriptor *t)
+{
+    Run run = {H, 0};
+    visit_block(p, t, clear_slot, &run);
+    release_run(&run);
+}
+
+/// The most pointers a piece of a block being moved holds.
+#define PIECE_POINTERS 64
+
+/// A piece of a block of memory being moved or transferred: every reference
+/// the piece needs is taken, and every pointer it overwrites noted, before it
+/// moves, so that the move is right however the two blocks overlap. The
+/// overwritten references are only dropped once nothing points to them, so
+/// that nothing can see a pointer to a freed object. Pieces are moved in the
+/// order `memmove()` would copy them, so that each one's source is still
+/// there when it moves.
+typedef struct Piece {
+    byte *dst;
+    byte *src;
+    /// Whether the pointers in the source are handed over rather than copied.
+    bool transfer;
+    /// Whether pieces are moved from the end of the block to its start.
+    bool backward;
+    /// Where in the block the piece starts, or ends if `backward`.
+    uptr bound;
+    Run run;
+    /// The pointers overwritten, and where in the block they are.
+    uptr nold;
+    pointer old[PIECE_POINTERS];
+    uptr slots[PIECE_POINTERS];
+} Piece;
+
+/// Move a piece, which runs from `bound` to `at`, and start the next one at
+/// `at`.
+static void move_piece(Piece *piece, uptr at)
+{
+    uptr from = piece->backward ? at : piece->bound;
+    uptr to = piece->backward ? piece->bound : at;
+    retain_run(&piece->run);
+    memmove(piece->dst + from, piece->src + from, to - from);
+    if (piece->transfer) {
+        for (uptr i = 0; i < piece->nold; i++) {
+            *(pointer *) (piece->src + piece->slots[i]) = H;
+        }
+    }
+    Run run = {H, 0};
+    for (uptr i = 0; i < piece->nold; i++) {
+        add_to_run(&run, piece->old[i], release_run);
+    }
+    release_run(&run);
+    piece->bound = at;
+    piece->run = (Run) {H, 0};
+    piece->nold = 0;
+}
+
+/// Add the pointer `offset` bytes into the block to the piece, moving the
+/// piece first if it is full. A pointer copied over itself needs nothing.
+static void piece_slot(Piece *piece, uptr offset)
+{
+    pointer s = *(pointer *) (piece->src + offset);
+    pointer d = *(pointer *) (piece->dst + offset);
+    if (s == d && !piece->transfer) {
+        return;
+    }
+    if (piece->nold == PIECE_POINTERS) {
+        move_piece(piece, piece->backward ? offset + sizeof(pointer) : offset);
+    }
+    if (!piece->transfer) {
+        add_to_run(&piece->run, s, retain_run);
+    }
+    piece->old[piece->nold] = d;
+    piece->slots[piece->nold++] = offset;
+}
+
+/// Move or transfer a block of `n` elements, a piece at a time.
+static void move_pieces(Piece *piece, TypeDescriptor *t, word n)
+{
+    uptr size = (uptr) t->size;
+    piece->backward = piece->dst > piece->src;
+    piece->bound = piece->backward ? (uptr) n * size : 0;
+    piece->run = (Run) {H, 0};
+    piece->nold = 0;
+    for (word e = 0; e < n; e++) {
+        uptr base = (uptr) (piece->backward ? n - 1 - e : e) * size;
+        if (piece->backward) {
+            for (word j = t->np - 1; j >= 0; j--) {
+                for (unsigned bits = t->map[j]; bits != 0; bits &= bits - 1) {
+                    word slot = 8 * j + 7 - __builtin_ctz(bits);
+                    piece_slot(piece, base + (uptr) slot * sizeof(pointer));
+                }
+            }
+        } else {
+            for (word j = 0; j < t->np; j++) {
+                for (unsigned bits = t->map[j]; bits != 0;) {
+                    word k = __builtin_clz(bits) - 24;
+                    bits &= 0x7Fu >> k;
+                    piece_slot(piece, base + (uptr) (8 * j + k) * sizeof(pointer));
+                }
+            }
+        }
+    }
+    move_piece(piece, piece->backward ? 0 : (uptr) n * size);
+}
+
+void heap_move(byte *dst, const byte *src, TypeDescriptor *t, word n)
+{
+    if (!type_has_pointers(t) || n == 0) {
+        memmove(dst, src, (uptr) n * (uptr) t->size);
+        return;
+    }
+    // Left uninitialised but for what `move_pieces()` reads.
+    Piece piece;
+    piece.dst = dst;
+    piece.src = (byte *) src;
+    piece.transfer = false;
+    move_pieces(&piece, t, n);
+}
+
+void heap_copy(byte *dst, const byte *src, TypeDescriptor *t)
+{
+    heap_move(dst, src, t, 1);
+}
+
+void heap_transfer(byte *dst, byte *src, TypeDescriptor *t)
+{
+    if (!type_has_pointers(t)) {
+        memcpy(dst, src, (uptr) t->size);
+        return;
+    }
+    Piece piece;
+    piece.dst = dst;
+    piece.src = src;
+    piece.transfer = true;
+    move_pieces(&piece, t, 1);
+}
+
+// The collector finds garbage cycles by trial deletion (Bacon and Rajan's
+// synchronous algorithm), on a snapshot it takes while the threads running
+// Dis code carry on. It keeps everything it works out in tables of its own,
+// rather than in the objects.
+//
+// Starting from the candidates, it visits every object reachable from them
+// that may be part of a cycle, noting its reference word and the pointers in
+// it, and subtracting the references those pointers hold from the counts of
+// the objects they point to. Whatever is left with a count above 0 has a
+// reference from elsewhere, and is live, as is everything reachable from it;
+// the rest is garbage, as long as it was looked at consistently. That is
+// checked by reading the pointers in the garbage and then their reference
+// words again: as the garbage was unreachable from anywhere else when it was
+// first looked at, anything that has made it reachable since has changed one
+// of them.
+
+typedef enum Color {
+    /// Reachable from outside the objects visited, or not to be traversed.
+    BLACK,
+    /// Visited, and perhaps garbage.
+    GRAY,
+    /// Garbage.
+    WHITE,
+} Color;
+
+/// An object visited by the collector.
+typedef struct Node {
+    Heap *h;
+    /// The reference word as the collector first read it.
+    uint64_t ref;
+    /// The object's count, less the references found among the objects
+    /// visited.
+    int64_t count;
+    byte color;
+    /// The object's pointers, in `Collector::edges`.
+    uptr edges;
+    uptr nedges;
+} Node;
+
+/// A pointer between objects visited by the collector.
+typedef struct Edge {
+    pointer value;
+    /// The object the pointer points to, in `Collector::nodes`.
+    uptr node;
+} Edge;
+
+static struct Collector {
+    /// Serialises collections.
+    pthread_mutex_t lock;
+    Node *nodes;
+    uptr nnodes;
+    uptr nodes_size;
+    Edge *edges;
+    uptr nedges;
+    uptr edges_size;
+    /// Open-addressed table from objects to their nodes, holding one more
+    /// than the node's index, or 0 where it is empty.
+    uptr *table;
+    uptr table_size;
+    /// Nodes still to be traversed.
+    uptr *work;
+    uptr nwork;
+    uptr work_size;
+    /// The roots, and whether the checks of the garbage have failed.
+    uptr nroots;
+    bool failed;
+    /// Whether there was no memory for the tables, so that the collection
+    /// has to be given up.
+    bool exhausted;
+    uptr validated;
+    HeapStats stats;
+} collector = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// Make room for one more element in one of the collector's arrays, or set
+/// `exhausted` if there is no memory for it.
+#define RESERVE(array, n, size) \
+    do { \
+        if ((n) == (size)) { \
+            uptr grown = (size) ? 2 * (size) : 256; \
+            void *p = realloc((array), grown * sizeof *(array)); \
+            if (p == NULL) { \
+                collector.exhausted = true; \
+            } else { \
+                (array) = p; \
+                (size) = grown; \
+            } \
+        } \
+    } while (0)
+
+static void work_push(uptr node)
+{
+    RESERVE(collector.work, collector.nwork, collector.work_size);
+    if (!collector.exhausted) {
+        collector.work[collector.nwork++] = node;
+    }
+}
+
+static uptr hash(const Heap *h)
+{
+    uptr x = (uptr) h >> 4;
+    x ^= x >> 17;
+    x *= (uptr) 0xed5ad4bbu;
+    return x ^ (x >> 11);
+}
+
+static void table_grow(void)
+{
+    uptr size = collector.table_size ? 2 * collector.table_size : 1024;
+    uptr *table = calloc(size, sizeof(uptr));
+    if (table == NULL) {
+        collector.exhausted = true;
+        return;
+    }
+    free(collector.table);
+    collector.table = table;
+    collector.table_size = size;
+    uptr mask = collector.table_size - 1;
+    for (uptr n = 0; n < collector.nnodes; n++) {
+        uptr i = hash(collector.nodes[n].h) & mask;
+        while (collector.table[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        collector.table[i] = n + 1;
+    }
+}
+
+/// Find an object's node, visiting it for the first time if there is none.
+/// Not to be used if that sets `exhausted`.
+static uptr node(Heap *h)
+{
+    if (2 * (collector.nnodes + 1) > collector.table_size) {
+        table_grow();
+        if (collector.exhausted) {
+            return 0;
+        }
+    }
+    uptr mask = collector.table_size - 1;
+    uptr i = hash(h) & mask;
+    for (; collector.table[i] != 0; i = (i + 1) & mask) {
+        if (collector.nodes[collector.table[i] - 1].h == h) {
+            return collector.table[i] - 1;
+        }
+    }
+    RESERVE(collector.nodes, collector.nnodes, collector.nodes_size);
+    if (collector.exhausted) {
+        return 0;
+    }
+    uptr n = collector.nnodes++;
+    collector.table[i] = n + 1;
+    uint64_t ref = atomic_load_explicit(&h->ref, memory_order_acquire);
+    Node *v = &collector.nodes[n];
+    *v = (Node) {.h = h, .ref = ref, .count = REF_COUNT(ref), .color = BLACK};
+    // Objects that cannot be part of a cycle, and ones dying as the
+    // collector looks, are left alone.
+    if (h->cyclic && REF_COUNT(ref) > 0) {
+        v->color = GRAY;
+        work_push(n);
+    }
+    return n;
+}
+
+static void record_edge(pointer *slot, void *arg)
+{
+    (void) arg;
+    pointer value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (value == H) {
+        return;
+    }
+    if (collector.exhausted) {
+        return;
+    }
+    uptr target = node(heap_header(value));
+    RESERVE(collector.edges, collector.nedges, collector.edges_size);
+    if (collector.exhausted) {
+        return;
+    }
+    collector.nodes[target].count--;
+    collector.edges[collector.nedges++] = (Edge) {.value = value, .node = target};
+}
+
+/// Visit everything reachable from the roots, subtracting the references
+/// among them from their counts.
+static void mark(void)
+{
+    while (collector.nwork > 0 && !collector.exhausted) {
+        uptr n = collector.work[--collector.nwork];
+        uptr first = collector.nedges;
+        visit_object(collector.nodes[n].h, record_edge, NULL);
+        collector.nodes[n].edges = first;
+        collector.nodes[n].nedges = collector.nedges - first;
+    }
+}
+
+/// Restore the counts of everything reachable from a live node.
+static void scan_black(uptr n)
+{
+    uptr base = collector.nwork;
+    collector.nodes[n].color = BLACK;
+    work_push(n);
+    while (collector.nwork > base) {
+        Node *v = &collector.nodes[collector.work[--collector.nwork]];
+        for (uptr e = v->edges; e < v->edges + v->nedges; e++) {
+            Node *target = &collector.nodes[collector.edges[e].node];
+            target->count++;
+            if (target->color != BLACK) {
+                target->color = BLACK;
+                work_push(collector.edges[e].node);
+            }
+        }
+    }
+}
+
+/// Decide which of the nodes reachable from a root are garbage.
+static void scan(uptr root)
+{
+    uptr base = collector.nwork;
+    work_push(root);
+    while (collector.nwork > base) {
+        uptr n = collector.work[--collector.nwork];
+        Node *v = &collector.nodes[n];
+        if (v->color != GRAY) {
+            continue;
+        }
+        if (v->count > 0) {
+            scan_black(n);
+            continue;
+        }
+        v->color = WHITE;
+        for (uptr e = v->edges; e < v->edges + v->nedges; e++) {
+            work_push(collector.edges[e].node);
+        }
+    }
+}
+
+static void check_edge(pointer *slot, void *arg)
+{
+    const Node *v = arg;
+    pointer value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (value == H) {
+        return;
+    }
+    if (collector.validated >= v->nedges ||
+        collector.edges[v->edges + collector.validated].value != value) {
+        collector.failed = true;
+    }
+    collector.validated++;
+}
+
+/// Check that the garbage has not changed since it was first looked at.
+static bool validate(void)
+{
+    collector.failed = false;
+    for (uptr n = 0; n < collector.nnodes && !collector.failed; n++) {
+        Node *v = &collector.nodes[n];
+        if (v->color == WHITE) {
+            collector.validated = 0;
+            visit_object(v->h, check_edge, v);
+            collector.failed |= collector.validated != v->nedges;
+        }
+    }
+    atomic_thread_fence(memory_order_acquire);
+    for (uptr n = 0; n < collector.nnodes && !collector.failed; n++) {
+        Node *v = &collector.nodes[n];
+        if (v->color == WHITE &&
+            atomic_load_explicit(&v->h->ref, memory_order_relaxed) != v->ref) {
+            collector.failed = true;
+        }
+    }
+    return !collector.failed;
+}
+
+/// Give up the references the candidates hold to the roots, except the
+/// garbage ones if the garbage is to be kept for the next collection, and
+/// all of them if the collection was given up.
+static void release_roots(bool keep_garbage)
+{
+    for (uptr n = 0; n < collector.nroots; n++) {
+        Node *v = &collector.nodes[n];
+        Heap *h = v->h;
+        if (v->color == WHITE || collector.exhausted) {
+            if (keep_garbage) {
+                buffer(h);
+            }
+            continue;
+        }
+        // A root whose count has not changed is live, and gives its
+        // candidate's reference up. One that has may have lost its last
+        // reference from outside a cycle while it was a candidate, so stays
+        // one unless the candidate's is its last reference.
+        uint64_t ref = v->ref;
+        for (;;) {
+            if (REF_COUNT(ref) > 1 && ref != v->ref) {
+                buffer(h);
+                break;
+            }
+            if (atomic_compare_exchange_weak_explicit(&h->ref, &ref,
+                                                      ref - REF_BUFFERED + REF_RELEASE,
+                                                      memory_order_acq_rel,
+                                                      memory_order_relaxed)) {
+                if (REF_COUNT(ref) == 1) {
+                    destroy(h);
+                }
+                break;
+            }
+        }
+    }
+}
+
+/// Free the garbage, dropping the references it holds to live objects.
+static void free_garbage(void)
+{
+    for (uptr n = 0; n < collector.nnodes; n++) {
+        Node *v = &collector.nodes[n];
+        if (v->color != WHITE) {
+            continue;
+        }
+        for (uptr e = v->edges; e < v->edges + v->nedges; e++) {
+            if (collector.nodes[collector.edges[e].node].color != WHITE) {
+                heap_release(collector.edges[e].value);
+            }
+        }
+    }
+    for (uptr n = 0; n < collector.nnodes; n++) {
+        if (collector.nodes[n].color == WHITE) {
+            deallocate(collector.nodes[n].h);
+            collector.stats.collected++;
+        }
+    }
+}
+
+void heap_collect(void)
+{
+    pthread_mutex_lock(&collector.lock);
+    if (atomic_load_explicit(&candidates, memory_order_relaxed) != NULL) {
+        atomic_store_explicit(&collecting, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        Heap *h = atomic_exchange_explicit(&candidates, NULL, memory_order_acquire);
+        atomic_store_explicit(&ncandidates, 0, memory_order_relaxed);
+
+        collector.nnodes = 0;
+        collector.nedges = 0;
+        collector.nwork = 0;
+        collector.exhausted = false;
+        if (collector.table != NULL) {
+            memset(collector.table, 0, collector.table_size * sizeof(uptr));
+        }
+        // The roots are the first nodes. An object is only a candidate once
+        // at a time, so each gets a node of its own.
+        for (; h != NULL; h = h->next) {
+            uptr n = node(h);
+            if (collector.exhausted) {
+                break;
+            }
+            collector.nodes[n].count--;
+        }
+        collector.nroots = collector.nnodes;
+        collector.stats.candidates += collector.nroots;
+        mark();
+        for (uptr n = 0; n < collector.nroots; n++) {
+            scan(n);
+        }
+        // Without the memory to look at everything, nothing can be known to
+        // be garbage, and every candidate waits for the next collection.
+        bool valid = !collector.exhausted && validate();
+        if (valid) {
+            free_garbage();
+        }
+        release_roots(!valid);
+        while (h != NULL) {
+            Heap *next = h->next;
+            buffer(h);
+            h = next;
+        }
+        collector.stats.collections++;
+        collector.stats.aborted += !valid;
+        atomic_store_explicit(&collecting, false, memory_order_release);
+    }
+    Heap *dead = atomic_exchange_explicit(&limbo, NULL, memory_order_acquire);
+    while (dead != NULL) {
+        Heap *next = dead->next;
+        deallocate(dead);
+        dead = next;
+    }
+    pthread_mutex_unlock(&collector.lock);
+}
+
+static void *collector_main(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += COLLECT_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&wake_lock);
+        if (atomic_load_explicit(&ncandidates, memory_order_relaxed) < COLLECT_THRESHOLD) {
+            pthread_cond_timedwait(&wake, &wake_lock, &deadline);
+        }
+        pthread_mutex_unlock(&wake_lock);
+        heap_collect();
+    }
+    return NULL;
+}
+
+static void collector_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, collector_main, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+void heap_stats(HeapStats *stats)
+{
+    pthread_mutex_lock(&collector.lock);
+    *stats = collector.stats;
+    pthread_mutex_unlock(&collector.lock);
+}
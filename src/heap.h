@@ -0,0 +1,253 @@
+#ifndef DIS_HEAP_H
+#define DIS_HEAP_H
+
+// The heap holds everything a Dis pointer can refer to: records, arrays,
+// lists, channels, module links and strings.
+//
+// Every object is reference counted, and freed as soon as the last
+// reference to it goes. Every instruction that stores a pointer takes a
+// reference to the new value before it is stored and drops the reference to
+// the old one after it is overwritten, so an object's count is never lower
+// than the number of pointers to it.
+//
+// Reference counting cannot free a cycle of objects that point to each
+// other, so a collector thread looks for garbage cycles, by trial deletion.
+// When a reference to an object that may be part of a cycle is dropped and
+// the object is still referred to, the reference is handed to a buffer of
+// candidates instead. The collector subtracts the references that
+// candidates and the objects reachable from them hold to each other from
+// their counts; objects left with no references from outside are garbage.
+//
+// The collector never stops the threads running Dis code. Each count is
+// kept together with a version, which changes whenever the count does. The
+// objects found to be garbage are only freed if, once the collector has
+// looked at all of them, neither their counts and versions nor the pointers
+// between them have changed. Otherwise the candidates are kept for the next
+// collection. Objects freed while the collector is working are kept until
+// it has finished, so that it never reads freed memory.
+//
+// A thread running Dis code reads a pointer before it takes a reference to
+// what it points to, and another may overwrite the pointer and drop the last
+// reference in between. So while more than one worker of the scheduler runs
+// Dis code, each is a reader, and the references it drops are only dropped
+// for real once every reader has passed a quiescent point, between the Dis
+// threads it runs, or gone offline: by then none can still hold a pointer it
+// read before they were dropped. Dis code run by any other thread meanwhile
+// must not share objects with the code the workers run, and two threads that
+// store to the same pointer at once must be kept apart by the program, as
+// through a channel.
+
+#include "types.h"
+
+/// What a heap object is, which says where the pointers in it are.
+typedef enum HeapKind {
+    /// A record of the object's type, as created by `new`.
+    HEAP_RECORD,
+    /// An `Array`, followed by its elements if it is not a slice.
+    HEAP_ARRAY,
+    /// A `List` cell.
+    HEAP_LIST,
+    /// A `Channel`.
+    HEAP_CHANNEL,
+    /// A `ModuleLink`.
+    HEAP_MODULE,
+    /// A `String`.
+    HEAP_STRING,
+} HeapKind;
+
+/// The header that precedes every heap object. Dis pointers point just past
+/// it, to the object itself.
+typedef struct Heap {
+    /// The number of references to the object in the low 31 bits, whether
+    /// it is in the buffer of candidates in the next, and a version that
+    /// changes whenever the count does in the high 32 bits.
+    _Atomic uint64_t ref;
+    /// The type of the pointers in the object: the record's type, the
+    /// elements' of an array, a list cell's head, a channel's values or a
+    /// module's data. `NULL` if there are none.
+    TypeDescriptor *t;
+    /// Next object in the buffer of candidates, or on a list of dead ones.
+    struct Heap *next;
+    /// A `HeapKind`.
+    byte kind;
+    /// Whether `t` has pointers in it, so that the object may be part of a
+    /// cycle.
+    bool cyclic;
+    /// Size of the object in bytes, or `UINT32_MAX` if it is bigger. Nothing
+    /// else records how big the head of a list cell without pointers is.
+    uint32_t size;
+} Heap;
+
+/// The header of the heap object `p` points to.
+#define heap_header(p) ((Heap *) (p) - 1)
+
+/// Counts of the work done by the cycle collector.
+typedef struct HeapStats {
+    /// The number of collections, and of those which found that objects had
+    /// changed under them and kept their candidates for the next one.
+    uptr collections;
+    uptr aborted;
+    /// The number of candidates examined.
+    uptr candidates;
+    /// The number of objects freed as parts of garbage cycles.
+    uptr collected;
+} HeapStats;
+
+/// A thread running Dis code alongside others, which may hold pointers it has
+/// read without taking references to them except at its quiescent points
+/// and while it is offline.
+typedef struct HeapReader {
+    /// The epoch the reader saw at its last quiescent point, or 0 while it is
+    /// offline.
+    _Atomic uint64_t seen;
+    /// The references it has dropped since it last handed them over.
+    struct Deferred *deferred;
+    struct HeapReader *next;
+} HeapReader;
+
+/// Allocate a zero-filled heap object, with one reference to it.
+///
+/// \param kind A `HeapKind`.
+/// \param t The type of the pointers in the object, or `NULL`.
+/// \param size Size of the object in bytes.
+/// \return The object, or `NULL` if there is no memory for it.
+void *heap_alloc(HeapKind kind, TypeDescriptor *t, uptr size);
+
+/// Allocate a zero-filled record, with one reference to it, without looking
+/// through its type for pointers.
+///
+/// \param t Type of the record.
+/// \param pointers Whether `type_has_pointers(t)`.
+/// \return The record, or `NULL` if there is no memory for it.
+void *heap_record(TypeDescriptor *t, bool pointers);
+
+/// Allocate a zero-filled array, with one reference to it.
+///
+/// \param t Type of the elements.
+/// \param len The number of elements.
+/// \return The array, or `NULL` if there is no memory for it.
+Array *heap_array(TypeDescriptor *t, word len);
+
+/// Make a slice of an array, which shares its elements, with one reference to
+/// it.
+///
+/// \param a The array. Must not be `H`.
+/// \param start Index of the first element.
+/// \param end Index after the last element.
+/// \return The slice, or `NULL` if there is no memory for it.
+Array *heap_slice(Array *a, word start, word end);
+
+/// Take a reference to a heap object.
+///
+/// \param p The object, or `H`.
+void heap_retain(pointer p);
+
+/// Drop a reference to a heap object, freeing it if it was the last one.
+///
+/// \param p The object, or `H`.
+void heap_release(pointer p);
+
+/// Whether the caller holds the only reference to a heap object, so that it
+/// may change the object without anything else seeing it change, as long as
+/// no other thread can read the pointer the reference is held in.
+///
+/// \param p The object. Must not be `H`.
+/// \return `true` if it does.
+bool heap_unique(pointer p);
+
+/// Copy memory containing pointers over memory that also does, taking
+/// references to the pointers copied and dropping those to the pointers
+/// overwritten.
+///
+/// \param dst Where to copy to.
+/// \param src What to copy.
+/// \param t Type of the memory.
+void heap_copy(byte *dst, const byte *src, TypeDescriptor *t);
+
+/// Move memory containing pointers over memory that also does, handing the
+/// references the source held over to the destination: the pointers
+/// overwritten are dropped, and those in the source are set to `H`, so that
+/// no reference to a pointer moved is taken or dropped.
+///
+/// \param dst Where to move to.
+/// \param src What to move. Must not overlap `dst`.
+/// \param t Type of the memory.
+void heap_transfer(byte *dst, byte *src, TypeDescriptor *t);
+
+/// Copy elements containing pointers over others, as `memmove()` would,
+/// taking references to the pointers copied and dropping those to the
+/// pointers overwritten. References to the same object that follow each other
+/// are taken or dropped together.
+///
+/// \param dst Where to copy to.
+/// \param src What to copy. May overlap `dst`.
+/// \param t Type of the elements.
+/// \param n The number of elements.
+void heap_move(byte *dst, const byte *src, TypeDescriptor *t, word n);
+
+/// Take references to the pointers in memory copied from elsewhere.
+/// References to the same object that follow each other are taken together.
+///
+/// \param p The memory.
+/// \param t Type of the memory.
+void heap_retain_block(const byte *p, TypeDescriptor *t);
+
+/// Set the pointers in memory to `H`, dropping the references they held.
+/// References to the same object that follow each other are dropped
+/// together.
+///
+/// \param p The memory.
+/// \param t Type of the memory.
+void heap_clear(byte *p, TypeDescriptor *t);
+
+/// Whether a type descriptor has any pointers in it.
+///
+/// \param t The type descriptor, or `NULL`.
+/// \return `true` if it has.
+bool type_has_pointers(const TypeDescriptor *t);
+
+/// Drop a reference to a type descriptor, freeing it if it was the last.
+///
+/// \param t The type descriptor.
+void type_release(TypeDescriptor *t);
+
+/// Add a reader, which starts offline. Only while no reader is online.
+///
+/// \param r The reader.
+void heap_reader_add(HeapReader *r);
+
+/// Remove a reader, dropping the references it and the others have dropped
+/// if none is online. Only while no reader is online.
+///
+/// \param r The reader.
+void heap_reader_remove(HeapReader *r);
+
+/// Make the calling thread a reader online, before it runs Dis code.
+///
+/// \param r The reader.
+void heap_reader_online(HeapReader *r);
+
+/// Take the calling thread's reader offline, holding no pointers it has not
+/// taken references to until it comes online again.
+///
+/// \param r The reader.
+void heap_reader_offline(HeapReader *r);
+
+/// Announce that the calling thread's reader holds no pointers it has not
+/// taken references to, and drop the references every reader has passed a
+/// quiescent point since.
+///
+/// \param r The reader.
+void heap_quiescent(HeapReader *r);
+
+/// Look for garbage cycles among the candidates buffered so far, and free
+/// them. The collector thread does this by itself; calling it only makes it
+/// happen sooner.
+void heap_collect(void);
+
+/// Read the counts of the cycle collector's work.
+///
+/// \param stats Where to put the counts.
+void heap_stats(HeapStats *stats);
+
+#endif //DIS_HEAP_H
@@ -1 +1,1153 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "instructions.h"
+#include "channel.h"
+#include "handlers.h"
+#include "heap.h"
+#include "module.h"
+#include "scheduler.h"
+#include "str.h"
+#if DIS_JIT
+#include "jit.h"
+#endif
+#if DIS_PROFILE
+#include "profile.h"
+#endif
+
+/// Mnemonics of the opcodes. The loader's own opcodes are named after their
+/// enumerators.
+static const char *const instruction_names[256] = {
+    [IN_NOP] = "nop",
+    [IN_ALT] = "alt",
+    [IN_NBALT] = "nbalt",
+    [IN_GOTO] = "goto",
+    [IN_CALL] = "call",
+    [IN_FRAME] = "frame",
+    [IN_SPAWN] = "spawn",
+    [IN_RUNT] = "runt",
+    [IN_LOAD] = "load",
+    [IN_MCALL] = "mcall",
+    [IN_MSPAWN] = "mspawn",
+    [IN_MFRAME] = "mframe",
+    [IN_RET] = "ret",
+    [IN_JMP] = "jmp",
+    [IN_CASE] = "case",
+    [IN_EXIT] = "exit",
+    [IN_NEW] = "new",
+    [IN_NEWA] = "newa",
+    [IN_NEWCB] = "newcb",
+    [IN_NEWCW] = "newcw",
+    [IN_NEWCF] = "newcf",
+    [IN_NEWCP] = "newcp",
+    [IN_NEWCM] = "newcm",
+    [IN_NEWCMP] = "newcmp",
+    [IN_SEND] = "send",
+    [IN_RECV] = "recv",
+    [IN_CONSB] = "consb",
+    [IN_CONSW] = "consw",
+    [IN_CONSP] = "consp",
+    [IN_CONSF] = "consf",
+    [IN_CONSM] = "consm",
+    [IN_CONSMP] = "consmp",
+    [IN_HEADB] = "headb",
+    [IN_HEADW] = "headw",
+    [IN_HEADP] = "headp",
+    [IN_HEADF] = "headf",
+    [IN_HEADM] = "headm",
+    [IN_HEADMP] = "headmp",
+    [IN_TAIL] = "tail",
+    [IN_LEA] = "lea",
+    [IN_INDX] = "indx",
+    [IN_MOVP] = "movp",
+    [IN_MOVM] = "movm",
+    [IN_MOVMP] = "movmp",
+    [IN_MOVB] = "movb",
+    [IN_MOVW] = "movw",
+    [IN_MOVF] = "movf",
+    [IN_CVTBW] = "cvtbw",
+    [IN_CVTWB] = "cvtwb",
+    [IN_CVTFW] = "cvtfw",
+    [IN_CVTWF] = "cvtwf",
+    [IN_CVTCA] = "cvtca",
+    [IN_CVTAC] = "cvtac",
+    [IN_CVTWC] = "cvtwc",
+    [IN_CVTCW] = "cvtcw",
+    [IN_CVTFC] = "cvtfc",
+    [IN_CVTCF] = "cvtcf",
+    [IN_ADDB] = "addb",
+    [IN_ADDW] = "addw",
+    [IN_ADDF] = "addf",
+    [IN_SUBB] = "subb",
+    [IN_SUBW] = "subw",
+    [IN_SUBF] = "subf",
+    [IN_MULB] = "mulb",
+    [IN_MULW] = "mulw",
+    [IN_MULF] = "mulf",
+    [IN_DIVB] = "divb",
+    [IN_DIVW] = "divw",
+    [IN_DIVF] = "divf",
+    [IN_MODW] = "modw",
+    [IN_MODB] = "modb",
+    [IN_ANDB] = "andb",
+    [IN_ANDW] = "andw",
+    [IN_ORB] = "orb",
+    [IN_ORW] = "orw",
+    [IN_XORB] = "xorb",
+    [IN_XORW] = "xorw",
+    [IN_SHLB] = "shlb",
+    [IN_SHLW] = "shlw",
+    [IN_SHRB] = "shrb",
+    [IN_SHRW] = "shrw",
+    [IN_INSC] = "insc",
+    [IN_INDC] = "indc",
+    [IN_ADDC] = "addc",
+    [IN_LENC] = "lenc",
+    [IN_LENA] = "lena",
+    [IN_LENL] = "lenl",
+    [IN_BEQB] = "beqb",
+    [IN_BNEB] = "bneb",
+    [IN_BLTB] = "bltb",
+    [IN_BLEB] = "bleb",
+    [IN_BGTB] = "bgtb",
+    [IN_BGEB] = "bgeb",
+    [IN_BEQW] = "beqw",
+    [IN_BNEW] = "bnew",
+    [IN_BLTW] = "bltw",
+    [IN_BLEW] = "blew",
+    [IN_BGTW] = "bgtw",
+    [IN_BGEW] = "bgew",
+    [IN_BEQF] = "beqf",
+    [IN_BNEF] = "bnef",
+    [IN_BLTF] = "bltf",
+    [IN_BLEF] = "blef",
+    [IN_BGTF] = "bgtf",
+    [IN_BGEF] = "bgef",
+    [IN_BEQC] = "beqc",
+    [IN_BNEC] = "bnec",
+    [IN_BLTC] = "bltc",
+    [IN_BLEC] = "blec",
+    [IN_BGTC] = "bgtc",
+    [IN_BGEC] = "bgec",
+    [IN_SLICEA] = "slicea",
+    [IN_SLICELA] = "slicela",
+    [IN_SLICEC] = "slicec",
+    [IN_INDW] = "indw",
+    [IN_INDF] = "indf",
+    [IN_INDB] = "indb",
+    [IN_NEGF] = "negf",
+    [IN_MOVL] = "movl",
+    [IN_ADDL] = "addl",
+    [IN_SUBL] = "subl",
+    [IN_DIVL] = "divl",
+    [IN_MODL] = "modl",
+    [IN_MULL] = "mull",
+    [IN_ANDL] = "andl",
+    [IN_ORL] = "orl",
+    [IN_XORL] = "xorl",
+    [IN_SHLL] = "shll",
+    [IN_SHRL] = "shrl",
+    [IN_BNEL] = "bnel",
+    [IN_BLTL] = "bltl",
+    [IN_BLEL] = "blel",
+    [IN_BGTL] = "bgtl",
+    [IN_BGEL] = "bgel",
+    [IN_BEQL] = "beql",
+    [IN_CVTLF] = "cvtlf",
+    [IN_CVTFL] = "cvtfl",
+    [IN_CVTLW] = "cvtlw",
+    [IN_CVTWL] = "cvtwl",
+    [IN_CVTLC] = "cvtlc",
+    [IN_CVTCL] = "cvtcl",
+    [IN_HEADL] = "headl",
+    [IN_CONSL] = "consl",
+    [IN_NEWCL] = "newcl",
+    [IN_CASEC] = "casec",
+    [IN_INDL] = "indl",
+    [IN_MOVPC] = "movpc",
+    [IN_TCMP] = "tcmp",
+    [IN_MNEWZ] = "mnewz",
+    [IN_CVTRF] = "cvtrf",
+    [IN_CVTFR] = "cvtfr",
+    [IN_CVTWS] = "cvtws",
+    [IN_CVTSW] = "cvtsw",
+    [IN_LSRW] = "lsrw",
+    [IN_LSRL] = "lsrl",
+    [IN_ECLR] = "eclr",
+    [IN_NEWZ] = "newz",
+    [IN_NEWAZ] = "newaz",
+    [IN_XMOVW_ADDW] = "xmovw_addw",
+    [IN_XADDW_BLTW] = "xaddw_bltw",
+    [IN_XLENA_BGEW] = "xlena_bgew",
+    [IN_XINDW_MOVW] = "xindw_movw",
+    [IN_XCASE] = "xcase",
+    [IN_XCASEC] = "xcasec",
+    [IN_XJIT] = "xjit",
+    [IN_XMNEWZ] = "xmnewz",
+    [IN_XMNEWZP] = "xmnewzp",
+    [IN_XMOVM] = "xmovm",
+    [IN_XHEADM] = "xheadm",
+    [IN_XCONSM] = "xconsm",
+    [IN_XEND] = "xend",
+};
+
+const char *instruction_name(byte opcode)
+{
+    return instruction_names[opcode];
+}
+
+// The interpreter expands the handlers in `handlers.h` inline; these are the
+// out-of-line entry points for everything else.
+
+void alt(ExecutionContext *context, Alt *src, word *dst)
+{
+    channel_alt(context, src, dst, true);
+}
+
+void nbalt(ExecutionContext *context, Alt *src, word *dst)
+{
+    channel_alt(context, src, dst, false);
+}
+
+void goto_(ExecutionContext *context, word src, word *dst)
+{
+    computed_jump(context, dst[src]);
+}
+
+void call(ExecutionContext *context, Frame *src, word dst)
+{
+    src->lr = context->program_counter;
+    src->fp = (Frame *) context->fp;
+    src->ml = NULL;
+    context->fp = (byte *) src;
+#if DIS_JIT
+    jit_call(context->ml->module, dst);
+#endif
+#if DIS_PROFILE
+    if (profile_enabled()) {
+        profile_call(context->ml->module, dst);
+    }
+#endif
+    jump(context, dst);
+}
+
+void spawn(ExecutionContext *context, Frame *src, word dst)
+{
+#if DIS_JIT
+    jit_call(context->ml->module, dst);
+#endif
+#if DIS_PROFILE
+    if (profile_enabled()) {
+        profile_call(context->ml->module, dst);
+    }
+#endif
+    if (!scheduler_spawn(context->ml, dst, src)) {
+        execution_error(context, "cannot spawn thread");
+    }
+    frame_release(context, src);
+}
+
+void frame(ExecutionContext *context, TypeDescriptor *src1, Frame **src2)
+{
+    *src2 = frame_alloc(context, src1);
+}
+
+void load(ExecutionContext *context, String *src1, LinkageDescriptor *src2,
+          ModuleLink **dst)
+{
+    char *path = string_to_utf8(src1, NULL);
+    if (path == NULL) {
+        execution_error(context, "out of memory");
+        return;
+    }
+    ModuleLink *ml = module_load(path, src2, NULL);
+    free(path);
+    if (ml == NULL) {
+        ml = H;
+    }
+    ModuleLink *old = *dst;
+    *dst = ml;
+    heap_release(old);
+}
+
+/// Look up the entry point of a call in its inline cache.
+///
+/// \return Whether the cache holds the entry point for the module and index.
+static inline bool call_cache_lookup(CallCache *cache, uint64_t serial,
+                                     word index, word *pc)
+{
+    uint32_t sequence = atomic_load_explicit(&cache->sequence, memory_order_acquire);
+    bool hit = atomic_load_explicit(&cache->serial, memory_order_relaxed) == serial &&
+               atomic_load_explicit(&cache->index, memory_order_relaxed) == index;
+    *pc = atomic_load_explicit(&cache->pc, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    return hit && !(sequence & 1) &&
+           atomic_load_explicit(&cache->sequence, memory_order_relaxed) == sequence;
+}
+
+/// Remember the entry point of a call in its inline cache, unless another
+/// thread is doing the same.
+static void call_cache_update(CallCache *cache, uint64_t serial, word index,
+                              word pc)
+{
+    uint32_t sequence = atomic_load_explicit(&cache->sequence, memory_order_relaxed);
+    if (sequence & 1 ||
+        !atomic_compare_exchange_strong_explicit(&cache->sequence, &sequence,
+                                                 sequence + 1, memory_order_acquire,
+                                                 memory_order_relaxed)) {
+        return;
+    }
+    atomic_store_explicit(&cache->serial, serial, memory_order_relaxed);
+    atomic_store_explicit(&cache->index, index, memory_order_relaxed);
+    atomic_store_explicit(&cache->pc, pc, memory_order_relaxed);
+    atomic_store_explicit(&cache->sequence, sequence + 2, memory_order_release);
+}
+
+void mcall(ExecutionContext *context, Frame *src1, word src2, ModuleLink *src3)
+{
+    if (src3 == H) {
+        execution_error(context, "module not loaded");
+        return;
+    }
+    // A hit means that the module's code has been decoded and that the entry
+    // point is valid, without looking at the link's records.
+    Module *module = src3->module;
+    CallCache *cache = &context->ml->module->call_caches[context->program_counter - 1];
+    word pc;
+    if (!call_cache_lookup(cache, module->serial, src2, &pc)) {
+        if (src2 < 0 || src2 >= src3->nlinks) {
+            execution_error(context, "invalid mcall");
+            return;
+        }
+        if (module_code(module) == NULL) {
+            execution_error(context, module->code_error);
+            return;
+        }
+        pc = src3->links[src2].pc;
+        call_cache_update(cache, module->serial, src2, pc);
+    }
+#if DIS_PROFILE
+    if (profile_enabled()) {
+        profile_mcall(context->ml->module, (word) context->program_counter - 1,
+                      module, pc);
+    }
+#endif
+    src1->lr = context->program_counter;
+    src1->fp = (Frame *) context->fp;
+    // The frame keeps the caller's reference to its module until the call
+    // returns.
+    src1->ml = context->ml;
+    context->fp = (byte *) src1;
+    heap_retain(src3);
+    context->ml = src3;
+    context->mp = src3->mp;
+    context->code = module->code;
+#if DIS_JIT
+    jit_call(module, pc);
+#endif
+    jump(context, pc);
+}
+
+void mspawn(ExecutionContext *context, Frame *src1, word src2, ModuleLink *src3)
+{
+    if (src3 == H) {
+        execution_error(context, "module not loaded");
+        return;
+    }
+    if (src2 < 0 || src2 >= src3->nlinks) {
+        execution_error(context, "invalid mspawn");
+        return;
+    }
+    if (module_code(src3->module) == NULL) {
+        execution_error(context, src3->module->code_error);
+        return;
+    }
+    word pc = src3->links[src2].pc;
+#if DIS_JIT
+    jit_call(src3->module, pc);
+#endif
+#if DIS_PROFILE
+    if (profile_enabled()) {
+        profile_call(src3->module, pc);
+    }
+#endif
+    if (!scheduler_spawn(src3, pc, src1)) {
+        execution_error(context, "cannot spawn thread");
+    }
+    frame_release(context, src1);
+}
+
+void mframe(ExecutionContext *context, ModuleLink *src1, word src2,
+            Frame **dst)
+{
+    if (src1 == H) {
+        execution_error(context, "module not loaded");
+        return;
+    }
+    if (src2 < 0 || src2 >= src1->nlinks || src1->links[src2].frame == NULL) {
+        execution_error(context, "invalid mframe");
+        return;
+    }
+    *dst = frame_alloc(context, src1->links[src2].frame);
+}
+
+void ret(ExecutionContext *context)
+{
+    Frame *f = (Frame *) context->fp;
+    Frame *caller = f->fp;
+    ModuleLink *ml = f->ml;
+    jump(context, (word) f->lr);
+    frame_release(context, f);
+    if (caller == NULL) {
+        context->fp = NULL;
+        context->status = EXEC_EXITED;
+        return;
+    }
+    context->fp = (byte *) caller;
+    if (ml != NULL) {
+        ModuleLink *callee = context->ml;
+        context->ml = ml;
+        context->mp = ml->mp;
+        context->code = ml->module->code;
+        heap_release(callee);
+    }
+}
+
+/// The type of a pointer, for channels and lists of pointers. No module
+/// defines it, so it holds a reference to itself and is never freed.
+static TypeDescriptor pointer_type = {
+    .size = sizeof(pointer),
+    .np = 1,
+    .references = 1,
+    .map = {0x80},
+};
+
+/// Store a pointer the thread holds a reference to in the destination
+/// operand, dropping the reference to the pointer it replaces.
+static void store_pointer(ExecutionContext *context, pointer p)
+{
+    pointer old = P(d);
+    P(d) = p;
+    heap_release(old);
+}
+
+/// Store a new object in the destination operand, or stop the thread with
+/// an error if there was no memory for it.
+///
+/// \return Whether it was stored.
+static bool store_new(ExecutionContext *context, pointer p)
+{
+    if (p == NULL) {
+        execution_error(context, "out of memory");
+        return false;
+    }
+    store_pointer(context, p);
+    return true;
+}
+
+/// Whether an operand is in the current frame, where no other thread can
+/// read it, so that a string only it refers to may be changed in place.
+static bool in_frame(const ExecutionContext *context, const byte *p)
+{
+    const Frame *f = (const Frame *) context->fp;
+    return p >= context->fp && p < context->fp + f->t->size;
+}
+
+void new_(ExecutionContext *context)
+{
+    TypeDescriptor *t = context->ml->module->types[W(s)];
+    store_new(context, heap_alloc(HEAP_RECORD, t, (uptr) t->size));
+}
+
+// The heap zero-fills every object, so there is nothing more to `newz` and
+// `newaz` than `new` and `newa`.
+void newz(ExecutionContext *context) { new_(context); }
+
+void mnewz(ExecutionContext *context, const Inst *inst)
+{
+    ModuleLink *ml = P(s);
+    if (ml == H) {
+        execution_error(context, "module not loaded");
+        return;
+    }
+    word type = W(m);
+    if (type < 0 || type >= ml->module->ntypes || ml->module->types[type] == NULL) {
+        execution_error(context, "invalid type descriptor");
+        return;
+    }
+    TypeDescriptor *t = ml->module->types[type];
+    if (!store_new(context, heap_alloc(HEAP_RECORD, t, (uptr) t->size))) {
+        return;
+    }
+
+    // The first module to claim the instruction is the one it is quickened
+    // for. Serial numbers start at 1, so an unclaimed instruction has 0.
+    if (inst == NULL || !context->ml->module->quicken) {
+        return;
+    }
+    Inst *site = quick_site(context, inst);
+    word serial = (word) (uint32_t) ml->module->serial;
+    word unclaimed = 0;
+    if (site->m.mode == AIMM && ml->module->serial <= UINT32_MAX &&
+        __atomic_compare_exchange_n(&site->m.indirect, &unclaimed, serial, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        quicken(context, inst, type_has_pointers(t) ? IN_XMNEWZP : IN_XMNEWZ);
+    }
+}
+
+/// Allocate for a quickened `mnewz`, from the module it was quickened for,
+/// or as `mnewz` does from any other.
+static void quick_mnewz(ExecutionContext *context, const Inst *inst, bool pointers)
+{
+    ModuleLink *ml = P(s);
+    if (inst == NULL || ml == H ||
+        ml->module->serial != (uint32_t) __atomic_load_n(&inst->m.indirect, __ATOMIC_RELAXED)) {
+        mnewz(context, inst);
+        return;
+    }
+    store_new(context, heap_record(ml->module->types[W(m)], pointers));
+}
+
+void xmnewz(ExecutionContext *context, const Inst *inst) { quick_mnewz(context, inst, false); }
+void xmnewzp(ExecutionContext *context, const Inst *inst) { quick_mnewz(context, inst, true); }
+
+void newa(ExecutionContext *context)
+{
+    word len = W(s);
+    if (len < 0) {
+        execution_error(context, "negative array size");
+        return;
+    }
+    store_new(context, heap_array(context->ml->module->types[W(m)], len));
+}
+
+void newaz(ExecutionContext *context) { newa(context); }
+
+void slicea(ExecutionContext *context)
+{
+    Array *a = A(d);
+    word start = W(s);
+    word end = W(m);
+    if (start < 0 || end < start || end > (a == H ? 0 : a->len)) {
+        execution_error(context, "array bounds error");
+        return;
+    }
+    if (start == end) {
+        store_pointer(context, H);
+        return;
+    }
+    store_new(context, heap_slice(a, start, end));
+}
+
+void slicela(ExecutionContext *context)
+{
+    // The elements of `src` are copied over those of `dst`, from the index
+    // in the middle operand on.
+    Array *src = A(s);
+    Array *dst = A(d);
+    word start = W(m);
+    if (src == H) {
+        return;
+    }
+    if (dst == H || start < 0 || start > dst->len - src->len) {
+        execution_error(context, "array bounds error");
+        return;
+    }
+    heap_move(dst->data + (uptr) start * (uptr) dst->t->size, src->data, dst->t, src->len);
+}
+
+/// Put a new cell on the front of the list in the destination operand.
+///
+/// \param t Type of the head, or `NULL` if it has no pointers.
+/// \param size Size of the head in bytes.
+/// \return Where the head goes, or `NULL` having stopped the thread with an
+/// error if there is no memory for the cell.
+static byte *cons(ExecutionContext *context, TypeDescriptor *t, uptr size)
+{
+    List *l = heap_alloc(HEAP_LIST, t, sizeof(List) + size);
+    if (l == NULL) {
+        execution_error(context, "out of memory");
+        return NULL;
+    }
+    // The operand's reference to the list moves to the new cell.
+    l->tail = P(d);
+    P(d) = l;
+    return l->data;
+}
+
+void consb(ExecutionContext *context)
+{
+    byte b = B(s);
+    byte *head = cons(context, NULL, sizeof b);
+    if (head != NULL) {
+        *head = b;
+    }
+}
+
+void consw(ExecutionContext *context)
+{
+    word w = W(s);
+    word *head = (word *) cons(context, NULL, sizeof w);
+    if (head != NULL) {
+        *head = w;
+    }
+}
+
+void consf(ExecutionContext *context)
+{
+    real f = F(s);
+    real *head = (real *) cons(context, NULL, sizeof f);
+    if (head != NULL) {
+        *head = f;
+    }
+}
+
+void consl(ExecutionContext *context)
+{
+    big v = V(s);
+    big *head = (big *) cons(context, NULL, sizeof v);
+    if (head != NULL) {
+        *head = v;
+    }
+}
+
+void consp(ExecutionContext *context)
+{
+    pointer p = P(s);
+    pointer *head = (pointer *) cons(context, &pointer_type, sizeof p);
+    if (head != NULL) {
+        heap_retain(p);
+        *head = p;
+    }
+}
+
+void consm(ExecutionContext *context, const Inst *inst)
+{
+    word size = W(m);
+    if (size < 0) {
+        execution_error(context, "negative size");
+        return;
+    }
+    byte *head = cons(context, NULL, (uptr) size);
+    if (head == NULL) {
+        return;
+    }
+    memcpy(head, context->s, (uptr) size);
+    if (quick_copy(inst, size)) {
+        quicken(context, inst, IN_XCONSM);
+    }
+}
+
+void xconsm(ExecutionContext *context)
+{
+    uptr size = (uptr) W(m);
+    byte *head = cons(context, NULL, size);
+    if (head != NULL) {
+        copy_small(head, context->s, size);
+    }
+}
+
+void consmp(ExecutionContext *context)
+{
+    TypeDescriptor *t = context->ml->module->types[W(m)];
+    byte *head = cons(context, t, (uptr) t->size);
+    if (head == NULL) {
+        return;
+    }
+    memcpy(head, context->s, (uptr) t->size);
+    heap_retain_block(head, t);
+}
+
+/// The list in the source operand, or `H` having stopped the thread with an
+/// error if it is nil.
+static List *list(ExecutionContext *context)
+{
+    List *l = P(s);
+    if (l == H) {
+        execution_error(context, "dereference of nil");
+    }
+    return l;
+}
+
+void headb(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        B(d) = *l->data;
+    }
+}
+
+void headw(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        W(d) = *(word *) l->data;
+    }
+}
+
+void headf(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        F(d) = *(real *) l->data;
+    }
+}
+
+void headl(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        V(d) = *(big *) l->data;
+    }
+}
+
+void headp(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        pointer p = *(pointer *) l->data;
+        heap_retain(p);
+        store_pointer(context, p);
+    }
+}
+
+void headm(ExecutionContext *context, const Inst *inst)
+{
+    List *l = list(context);
+    if (l != H) {
+        word size = W(m);
+        if (size < 0) {
+            execution_error(context, "negative size");
+            return;
+        }
+        memmove(context->d, l->data, (uptr) size);
+        if (quick_copy(inst, size)) {
+            quicken(context, inst, IN_XHEADM);
+        }
+    }
+}
+
+void xheadm(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        copy_small(context->d, l->data, (uptr) W(m));
+    }
+}
+
+void headmp(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        heap_copy(context->d, l->data, context->ml->module->types[W(m)]);
+    }
+}
+
+void tail(ExecutionContext *context)
+{
+    List *l = list(context);
+    if (l != H) {
+        heap_retain(l->tail);
+        store_pointer(context, l->tail);
+    }
+}
+
+void movmp(ExecutionContext *context)
+{
+    heap_copy(context->d, context->s, context->ml->module->types[W(m)]);
+}
+
+void tcmp(ExecutionContext *context)
+{
+    // Comparing the two objects' type descriptors is all an inline cache
+    // would save, so there is none.
+    pointer s = *(pointer *) context->s;
+    pointer d = *(pointer *) context->d;
+    if (s != H && (d == H || heap_header(s)->t != heap_header(d)->t)) {
+        execution_error(context, "type check");
+    }
+}
+
+/// Create a channel of values of `size` bytes, with a buffer as long as the
+/// middle operand if there is one.
+static void newc(ExecutionContext *context, word size, TypeDescriptor *t)
+{
+    word capacity = 0;
+    if (context->m != context->d) {
+        capacity = W(m);
+        if (capacity < 0) {
+            execution_error(context, "negative buffer size");
+            return;
+        }
+    }
+    store_new(context, channel_new(size, t, capacity));
+}
+
+void newcb(ExecutionContext *context) { newc(context, sizeof(byte), NULL); }
+void newcw(ExecutionContext *context) { newc(context, sizeof(word), NULL); }
+void newcf(ExecutionContext *context) { newc(context, sizeof(real), NULL); }
+void newcl(ExecutionContext *context) { newc(context, sizeof(big), NULL); }
+void newcp(ExecutionContext *context) { newc(context, sizeof(pointer), &pointer_type); }
+void newcm(ExecutionContext *context) { newc(context, W(s), NULL); }
+
+void newcmp(ExecutionContext *context)
+{
+    TypeDescriptor *t = context->ml->module->types[W(s)];
+    newc(context, t->size, t);
+}
+
+void send(ExecutionContext *context)
+{
+    Channel *c = *(Channel **) context->d;
+    if (c == H) {
+        execution_error(context, "dereference of nil");
+        return;
+    }
+    channel_send(context, c, context->s);
+}
+
+void recv(ExecutionContext *context)
+{
+    Channel *c = *(Channel **) context->s;
+    if (c == H) {
+        execution_error(context, "dereference of nil");
+        return;
+    }
+    channel_recv(context, c, context->d);
+}
+
+/// The type of the elements of the byte arrays `cvtca` makes.
+static TypeDescriptor byte_type = {
+    .size = sizeof(byte),
+    .np = 0,
+    .references = 1,
+};
+
+void indc(ExecutionContext *context)
+{
+    String *s = S(s);
+    word i = W(m);
+    if (s == H || (uint32_t) i >= (uint32_t) s->len) {
+        execution_error(context, "string bounds error");
+        return;
+    }
+    String *flat = string_flat(s);
+    if (flat == NULL) {
+        execution_error(context, "out of memory");
+        return;
+    }
+    W(d) = (word) string_char(flat, i);
+}
+
+void insc(ExecutionContext *context)
+{
+    word c = W(s);
+    word i = W(m);
+    String *s = S(d);
+    if (c < 0 || c > RUNE_MAX) {
+        execution_error(context, "invalid character");
+        return;
+    }
+    if ((uint32_t) i > (uint32_t) (s == H ? 0 : s->len)) {
+        execution_error(context, "string bounds error");
+        return;
+    }
+    if (i == INT32_MAX) {
+        execution_error(context, "string too long");
+        return;
+    }
+    if (in_frame(context, context->d)) {
+        // The string takes over the reference in `dst`, and gives it back.
+        String *t = string_insert(s, i, (Rune) c);
+        if (t == NULL) {
+            execution_error(context, "out of memory");
+            return;
+        }
+        S(d) = t;
+        return;
+    }
+    // With a reference of its own, the string is copied rather than changed.
+    heap_retain(s);
+    String *t = string_insert(s, i, (Rune) c);
+    if (t == NULL) {
+        heap_release(s);
+        execution_error(context, "out of memory");
+        return;
+    }
+    store_pointer(context, t);
+}
+
+void addc(ExecutionContext *context)
+{
+    word alen = S(m) == H ? 0 : S(m)->len;
+    word slen = S(s) == H ? 0 : S(s)->len;
+    if ((uptr) alen + (uptr) slen > INT32_MAX) {
+        execution_error(context, "string too long");
+        return;
+    }
+    // Only a result with no characters may be `H`.
+    String *s;
+    if (context->m == context->d && in_frame(context, context->d)) {
+        // `addc s, d` appends to the string in `dst`, taking over its
+        // reference and giving it back.
+        s = string_append(S(d), S(s));
+        if (s == H && alen + slen > 0) {
+            execution_error(context, "out of memory");
+            return;
+        }
+        S(d) = s;
+        return;
+    }
+    s = string_concat(S(m), S(s));
+    if (s == H && alen + slen > 0) {
+        execution_error(context, "out of memory");
+        return;
+    }
+    store_pointer(context, s);
+}
+
+void slicec(ExecutionContext *context)
+{
+    String *s = S(d);
+    word start = W(s);
+    word end = W(m);
+    if (start < 0 || end < start || end > (s == H ? 0 : s->len)) {
+        execution_error(context, "string bounds error");
+        return;
+    }
+    if (start == end) {
+        store_pointer(context, H);
+        return;
+    }
+    store_new(context, string_slice(s, start, end));
+}
+
+#define STRING_BRANCH(name, test) \
+    void name(ExecutionContext *context) \
+    { \
+        if (test) jump(context, W(d)); \
+    }
+
+STRING_BRANCH(beqc, string_equal(S(s), S(m)))
+STRING_BRANCH(bnec, !string_equal(S(s), S(m)))
+STRING_BRANCH(bltc, string_compare(S(s), S(m)) < 0)
+STRING_BRANCH(blec, string_compare(S(s), S(m)) <= 0)
+STRING_BRANCH(bgtc, string_compare(S(s), S(m)) > 0)
+STRING_BRANCH(bgec, string_compare(S(s), S(m)) >= 0)
+
+void casec(ExecutionContext *context)
+{
+    String *v = S(s);
+    word n = W(d);
+    const StringCase *table = (const StringCase *) ((byte *) context->d + sizeof(pointer));
+    word target = *(const word *) (table + n);
+    while (n > 0) {
+        word half = n >> 1;
+        const StringCase *e = table + half;
+        int c = string_compare(v, e->low);
+        if (c < 0) {
+            n = half;
+        } else if (c > 0 && (e->high == H || string_compare(v, e->high) > 0)) {
+            table = e + 1;
+            n -= half + 1;
+        } else {
+            target = e->pc;
+            break;
+        }
+    }
+    computed_jump(context, target);
+}
+
+void xcase(ExecutionContext *context)
+{
+    const CaseTable *table = &context->ml->module->cases[W(m)];
+    uint32_t i = (uint32_t) W(s) - (uint32_t) table->low;
+    jump(context, i < (uint32_t) table->size ? table->pcs[i] : table->default_pc);
+}
+
+void xcasec(ExecutionContext *context)
+{
+    const CaseTable *table = &context->ml->module->cases[W(m)];
+    String *v = S(s);
+    word target = table->default_pc;
+    if (v == H || v->len == 0) {
+        target = table->empty_pc;
+    } else {
+        uint32_t slot = case_slot(table, string_hash(v));
+        String *key = table->keys[slot];
+        if (key == v || (key != H && string_equal(key, v))) {
+            target = table->pcs[slot];
+        }
+    }
+    jump(context, target);
+}
+
+void cvtca(ExecutionContext *context)
+{
+    String *s = S(s);
+    uptr size = string_encode(s, NULL);
+    Array *a = H;
+    if (size > 0) {
+        a = heap_array(&byte_type, (word) size);
+        if (a == NULL) {
+            execution_error(context, "out of memory");
+            return;
+        }
+        string_encode(s, a->data);
+    }
+    store_pointer(context, a);
+}
+
+void cvtac(ExecutionContext *context)
+{
+    Array *a = A(s);
+    if (a == H || a->len == 0) {
+        store_pointer(context, H);
+        return;
+    }
+    store_new(context, string_utf8((const char *) a->data, (uptr) a->len));
+}
+
+/// Store the string form of a number in `P(d)`.
+static void store_number(ExecutionContext *context, const char *format, ...)
+{
+    char buffer[32];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof buffer, format, args);
+    va_end(args);
+    store_new(context, string_utf8(buffer, (uptr) n));
+}
+
+void cvtwc(ExecutionContext *context) { store_number(context, "%d", W(s)); }
+void cvtlc(ExecutionContext *context) { store_number(context, "%lld", (long long) V(s)); }
+void cvtfc(ExecutionContext *context) { store_number(context, "%g", F(s)); }
+
+// Strings that do not start with a number convert to 0, as with `strtol()`.
+void cvtcw(ExecutionContext *context)
+{
+    char *utf8 = string_to_utf8(S(s), NULL);
+    if (utf8 == NULL) {
+        execution_error(context, "out of memory");
+        return;
+    }
+    W(d) = (word) strtol(utf8, NULL, 10);
+    free(utf8);
+}
+
+void cvtcl(ExecutionContext *context)
+{
+    char *utf8 = string_to_utf8(S(s), NULL);
+    if (utf8 == NULL) {
+        execution_error(context, "out of memory");
+        return;
+    }
+    V(d) = (big) strtoll(utf8, NULL, 10);
+    free(utf8);
+}
+
+void cvtcf(ExecutionContext *context)
+{
+    char *utf8 = string_to_utf8(S(s), NULL);
+    if (utf8 == NULL) {
+        execution_error(context, "out of memory");
+        return;
+    }
+    F(d) = strtod(utf8, NULL);
+    free(utf8);
+}
+
+void jmp(ExecutionContext *context) { op_jmp(context); }
+void case_(ExecutionContext *context) { op_case(context); }
+void lea(ExecutionContext *context) { op_lea(context); }
+void lena(ExecutionContext *context) { op_lena(context); }
+void indb(ExecutionContext *context) { op_indb(context); }
+void indw(ExecutionContext *context) { op_indw(context); }
+void indf(ExecutionContext *context) { op_indf(context); }
+void indl(ExecutionContext *context) { op_indl(context); }
+void indx(ExecutionContext *context) { op_indx(context); }
+void movpc(ExecutionContext *context) { op_movpc(context); }
+void movb(ExecutionContext *context) { op_movb(context); }
+void movw(ExecutionContext *context) { op_movw(context); }
+void movf(ExecutionContext *context) { op_movf(context); }
+void movl(ExecutionContext *context) { op_movl(context); }
+void movp(ExecutionContext *context) { op_movp(context); }
+void movm(ExecutionContext *context, const Inst *inst) { op_movm(context, inst); }
+void xmovm(ExecutionContext *context) { op_xmovm(context); }
+void lenl(ExecutionContext *context) { op_lenl(context); }
+void lenc(ExecutionContext *context) { op_lenc(context); }
+void cvtbw(ExecutionContext *context) { op_cvtbw(context); }
+void cvtwb(ExecutionContext *context) { op_cvtwb(context); }
+void cvtwf(ExecutionContext *context) { op_cvtwf(context); }
+void cvtlf(ExecutionContext *context) { op_cvtlf(context); }
+void cvtlw(ExecutionContext *context) { op_cvtlw(context); }
+void cvtwl(ExecutionContext *context) { op_cvtwl(context); }
+void cvtrf(ExecutionContext *context) { op_cvtrf(context); }
+void cvtfr(ExecutionContext *context) { op_cvtfr(context); }
+void cvtws(ExecutionContext *context) { op_cvtws(context); }
+void cvtsw(ExecutionContext *context) { op_cvtsw(context); }
+void cvtfw(ExecutionContext *context) { op_cvtfw(context); }
+void cvtfl(ExecutionContext *context) { op_cvtfl(context); }
+void addb(ExecutionContext *context) { op_addb(context); }
+void addw(ExecutionContext *context) { op_addw(context); }
+void addf(ExecutionContext *context) { op_addf(context); }
+void addl(ExecutionContext *context) { op_addl(context); }
+void subb(ExecutionContext *context) { op_subb(context); }
+void subw(ExecutionContext *context) { op_subw(context); }
+void subf(ExecutionContext *context) { op_subf(context); }
+void subl(ExecutionContext *context) { op_subl(context); }
+void mulb(ExecutionContext *context) { op_mulb(context); }
+void mulw(ExecutionContext *context) { op_mulw(context); }
+void mulf(ExecutionContext *context) { op_mulf(context); }
+void mull(ExecutionContext *context) { op_mull(context); }
+void divf(ExecutionContext *context) { op_divf(context); }
+void negf(ExecutionContext *context) { op_negf(context); }
+void divb(ExecutionContext *context) { op_divb(context); }
+void modb(ExecutionContext *context) { op_modb(context); }
+void divw(ExecutionContext *context) { op_divw(context); }
+void modw(ExecutionContext *context) { op_modw(context); }
+void divl(ExecutionContext *context) { op_divl(context); }
+void modl(ExecutionContext *context) { op_modl(context); }
+void andb(ExecutionContext *context) { op_andb(context); }
+void andw(ExecutionContext *context) { op_andw(context); }
+void andl(ExecutionContext *context) { op_andl(context); }
+void orb(ExecutionContext *context) { op_orb(context); }
+void orw(ExecutionContext *context) { op_orw(context); }
+void orl(ExecutionContext *context) { op_orl(context); }
+void xorb(ExecutionContext *context) { op_xorb(context); }
+void xorw(ExecutionContext *context) { op_xorw(context); }
+void xorl(ExecutionContext *context) { op_xorl(context); }
+void shlb(ExecutionContext *context) { op_shlb(context); }
+void shlw(ExecutionContext *context) { op_shlw(context); }
+void shll(ExecutionContext *context) { op_shll(context); }
+void shrb(ExecutionContext *context) { op_shrb(context); }
+void shrw(ExecutionContext *context) { op_shrw(context); }
+void shrl(ExecutionContext *context) { op_shrl(context); }
+void lsrw(ExecutionContext *context) { op_lsrw(context); }
+void lsrl(ExecutionContext *context) { op_lsrl(context); }
+void exit_(ExecutionContext *context) { op_exit(context); }
+void beqb(ExecutionContext *context) { op_beqb(context); }
+void bneb(ExecutionContext *context) { op_bneb(context); }
+void bltb(ExecutionContext *context) { op_bltb(context); }
+void bleb(ExecutionContext *context) { op_bleb(context); }
+void bgtb(ExecutionContext *context) { op_bgtb(context); }
+void bgeb(ExecutionContext *context) { op_bgeb(context); }
+void beqw(ExecutionContext *context) { op_beqw(context); }
+void bnew(ExecutionContext *context) { op_bnew(context); }
+void bltw(ExecutionContext *context) { op_bltw(context); }
+void blew(ExecutionContext *context) { op_blew(context); }
+void bgtw(ExecutionContext *context) { op_bgtw(context); }
+void bgew(ExecutionContext *context) { op_bgew(context); }
+void beqf(ExecutionContext *context) { op_beqf(context); }
+void bnef(ExecutionContext *context) { op_bnef(context); }
+void bltf(ExecutionContext *context) { op_bltf(context); }
+void blef(ExecutionContext *context) { op_blef(context); }
+void bgtf(ExecutionContext *context) { op_bgtf(context); }
+void bgef(ExecutionContext *context) { op_bgef(context); }
+void beql(ExecutionContext *context) { op_beql(context); }
+void bnel(ExecutionContext *context) { op_bnel(context); }
+void bltl(ExecutionContext *context) { op_bltl(context); }
+void blel(ExecutionContext *context) { op_blel(context); }
+void bgtl(ExecutionContext *context) { op_bgtl(context); }
+void bgel(ExecutionContext *context) { op_bgel(context); }
@@ -188,6 +188,66 @@ typedef enum Instruction {
     IN_NEWAZ   = 0x9D, // allocate array, zero fill non-pointers
 } Instruction;
 
+/// Opcodes that the loader synthesises. They never appear in object code, and
+/// are numbered above the last `Instruction`.
+///
+/// A superinstruction replaces the first instruction of a pair and executes
+/// both with a single dispatch, taking the second instruction's operands from
+/// the instruction that follows it. That instruction is left in place, so
+/// branches to it still work.
+///
+/// A `case` or `casec` whose table the loader compiled keeps its operands,
+/// and has the index of the `CaseTable` in its middle operand.
+///
+/// The JIT rewrites every instruction it compiles to `IN_XJIT`, which runs the
+/// compiled code from that instruction on.
+///
+/// The interpreter quickens some instructions the first time it executes
+/// them, rewriting them to a variant specialised for what it found: an
+/// `mnewz` for the module it allocates from, and a `movm`, `headm` or `consm`
+/// for a small constant size. A quickened instruction keeps its operands, and
+/// does exactly what the instruction it was quickened from does. An `mnewz`
+/// allocates from whichever module link its source operand holds, so its
+/// variants guard on the module, whose serial number the first execution
+/// stores in the middle operand's unused `indirect`, and fall back to the
+/// generic instruction for any other. The functions for these instructions
+/// take the instruction the interpreter dispatched, and called with `NULL`
+/// neither quicken nor guard.
+typedef enum InternalInstruction {
+    IN_XMOVW_ADDW = 0xA0, // movw, then addw
+    IN_XADDW_BLTW = 0xA1, // addw, then bltw: loop increment and test
+    IN_XLENA_BGEW = 0xA2, // lena, then bgew: loop header over an array
+    IN_XINDW_MOVW = 0xA3, // indw, then movw: load from a word array
+    IN_XCASE      = 0xA8, // case through a jump table
+    IN_XCASEC     = 0xA9, // casec through a perfect hash table
+    IN_XJIT       = 0xB0, // enter compiled code
+    IN_XMNEWZ     = 0xBA, // mnewz of one module's type without pointers
+    IN_XMNEWZP    = 0xBB, // mnewz of one module's type with pointers
+    IN_XMOVM      = 0xBC, // movm of a small constant size
+    IN_XHEADM     = 0xBD, // headm of a small constant size
+    IN_XCONSM     = 0xBE, // consm of a small constant size
+    IN_XEND       = 0xFF, // sentinel after the last instruction of a module
+} InternalInstruction;
+
+/// An entry of a `casec` table: a range of strings, and where to go for the
+/// strings in it.
+///
+/// The table is a count `n`, padded to the size of a pointer, followed by
+/// `n` entries sorted by `low`, followed by the default pc.
+typedef struct StringCase {
+    String *low;
+    /// The last string in the range, or `H` if the range is only `low`.
+    String *high;
+    word pc;
+} StringCase;
+
+/// Find the mnemonic of an opcode, as it is written in assembly language.
+///
+/// \param opcode The opcode.
+/// \return The mnemonic, or `NULL` if `opcode` is not an `Instruction` or
+/// an `InternalInstruction`.
+const char *instruction_name(byte opcode);
+
 /// `alt` - Alternate between communications
 ///
 /// The `alt` instruction selects between a set of channels ready to communicate.
@@ -210,31 +270,33 @@ typedef enum Instruction {
 ///
 /// \param context The execution context.
 /// \param src Address to a collection of channels to select from.
-/// \param ptr The numeric index of the selected channel.
-void alt(ExecutionContext *context, Alt *src, uptr *ptr);
+/// \param dst The numeric index of the selected channel.
+void alt(ExecutionContext *context, Alt *src, word *dst);
 
 /// `nbalt` - Non blocking alternate
 ///
 /// The `nbalt` instruction has the same operands and function as `alt()`, except
 /// that if no channel is ready to communicate, the instruction does not block.
-/// When no channels are ready, control is transferred to the PC in the last
-/// element of the table addressed by `dst`.
+/// When no channels are ready, `nsend + nrecv` is placed in `dst`, which
+/// selects the last element of the table of the `goto` that follows.
 ///
 /// \param context The execution context.
 /// \param src Address to a collection of channels to select from.
-/// \param ptr The numeric index of the selected channel.
-void nbalt(ExecutionContext *context, Alt *src, uptr *ptr);
+/// \param dst The numeric index of the selected channel.
+void nbalt(ExecutionContext *context, Alt *src, word *dst);
 
 /// `goto` - Computed goto
 ///
 /// The `goto` instruction performs a computed goto. The `src` operand must be
 /// an integer index into a table of PC values specified by the `dst` operand.
+/// A PC value that is not an instruction of the module stops the thread with
+/// an error.
 ///
 /// \param context The execution context.
 /// \param src An integer index into a table of program counter values provided
 /// by `dst`.
 /// \param dst A table of program counter values.
-void goto_(ExecutionContext *context, uptr src, uptr *dst);
+void goto_(ExecutionContext *context, word src, word *dst);
 
 /// `call` - Call local function
 ///
@@ -248,7 +310,7 @@ void goto_(ExecutionContext *context, uptr src, uptr *dst);
 /// \param context The execution context.
 /// \param src A frame created by `\ref new` to use for the called routine.
 /// \param dst The program counter to transfer control to.
-void call(ExecutionContext *context, Frame *src, uptr *dst);
+void call(ExecutionContext *context, Frame *src, word dst);
 
 /// `frame` - Allocate frame for local call
 ///
@@ -260,7 +322,7 @@ void call(ExecutionContext *context, Frame *src, uptr *dst);
 /// \param context The execution context.
 /// \param src1 Type descriptor to initialse the frame with.
 /// \param src2 Location to store the newly created frame in.
-void frame(ExecutionContext *context, TypeDescriptor src1, Frame *src2);
+void frame(ExecutionContext *context, TypeDescriptor *src1, Frame **src2);
 
 /// `spawn` - Spawn function
 ///
@@ -272,7 +334,7 @@ void frame(ExecutionContext *context, TypeDescriptor src1, Frame *src2);
 /// \param context The execution context.
 /// \param src The frame to use for the new function.
 /// \param dst The program counter to transfer control to in the new thread.
-void spawn(ExecutionContext *context, Frame *src, uptr *dst);
+void spawn(ExecutionContext *context, Frame *src, word dst);
 
 /// UNKNOWN
 void runt(ExecutionContext *context);
@@ -307,8 +369,8 @@ void runt(ExecutionContext *context);
 /// \param src1 Pathname to the file containinbg object code for the module.
 /// \param src2 Address of a linkage descriptor for the module.
 /// \param dst Location to store a reference to the newly-loaded module.
-void load(ExecutionContext *context, char *src1, LinkageDescriptor *src2,
-          Module *dst);
+void load(ExecutionContext *context, String *src1, LinkageDescriptor *src2,
+          ModuleLink **dst);
 
 /// `mcall` - Inter-module call
 ///
@@ -323,7 +385,7 @@ void load(ExecutionContext *context, char *src1, LinkageDescriptor *src2,
 /// \param src1 The frame to use for the new function.
 /// \param src2 The index of the called function in the array of linkage records.
 /// \param src3 The module reference generated by `load()`.
-void mcall(ExecutionContext *context, Frame *src1, uptr src2, Module *src3);
+void mcall(ExecutionContext *context, Frame *src1, word src2, ModuleLink *src3);
 
 /// `mspawn` - Module spawn function
 ///
@@ -334,11 +396,12 @@ void mcall(ExecutionContext *context, Frame *src1, uptr src2, Module *src3);
 /// instruction. The `src2` operand specifies the index for the called function
 /// in the array of linkage records associated with that module reference
 /// (see the `load()` instruction).
+///
 /// \param context The execution context.
 /// \param src1 The frame to use for the new function.
 /// \param src2 The index of the called function in the array of linkage records.
 /// \param src3 The module reference generated by `load()`.
-void mspawn(ExecutionContext *context, Frame *src1, uptr src2, Module *src3);
+void mspawn(ExecutionContext *context, Frame *src1, word src2, ModuleLink *src3);
 
 /// `mframe` - Allocate inter-module frame
 ///
@@ -354,14 +417,26 @@ void mspawn(ExecutionContext *context, Frame *src1, uptr src2, Module *src3);
 /// \param src1 The module reference generated by `load()`.
 /// \param src2 The index of the called function in the array of linkage records.
 /// \param dst Location to store the initialised frame in.
-void mframe(ExecutionContext *context, Module *src1, uptr src2, Frame *dst);
+void mframe(ExecutionContext *context, ModuleLink *src1, word src2,
+            Frame **dst);
+
+/// `ret` - Return from function
+///
+/// The `ret` instruction returns control to the instruction following the
+/// `call()` or `mcall()` that created the current frame, and frees the frame.
+/// `fp` is restored to the caller's frame; after an inter-module call, the
+/// module link register and `mp` are restored to the caller's module as well.
+/// Returning from the outermost frame of a thread terminates the thread.
+///
+/// \param context The execution context.
 void ret(ExecutionContext *context);
 void jmp(ExecutionContext *context);
 void case_(ExecutionContext *context);
 void exit_(ExecutionContext *context);
 void new_(ExecutionContext *context);
 void newa(ExecutionContext *context);
-void newcv(ExecutionContext *context);
+void newcb(ExecutionContext *context);
+void newcw(ExecutionContext *context);
 void newcf(ExecutionContext *context);
 void newcp(ExecutionContext *context);
 void newcm(ExecutionContext *context);
@@ -372,21 +447,22 @@ void consb(ExecutionContext *context);
 void consw(ExecutionContext *context);
 void consp(ExecutionContext *context);
 void consf(ExecutionContext *context);
-void consm(ExecutionContext *context);
+void consm(ExecutionContext *context, const Inst *inst);
 void consmp(ExecutionContext *context);
 
 void headb(ExecutionContext *context);
 void headw(ExecutionContext *context);
 void headp(ExecutionContext *context);
 void headf(ExecutionContext *context);
-void headm(ExecutionContext *context);
+void headm(ExecutionContext *context, const Inst *inst);
 void headmp(ExecutionContext *context);
 void tail(ExecutionContext *context);
 void lea(ExecutionContext *context);
 void indx(ExecutionContext *context);
 void movp(ExecutionContext *context);
-void movm(ExecutionContext *context);
+void movm(ExecutionContext *context, const Inst *inst);
 void movmp(ExecutionContext *context);
+void xmovm(ExecutionContext *context);
 void movb(ExecutionContext *context);
 void movw(ExecutionContext *context);
 void movf(ExecutionContext *context);
@@ -404,6 +480,7 @@ void addb(ExecutionContext *context);
 void addw(ExecutionContext *context);
 void addf(ExecutionContext *context);
 void subb(ExecutionContext *context);
+void subw(ExecutionContext *context);
 void subf(ExecutionContext *context);
 void mulb(ExecutionContext *context);
 
@@ -446,6 +523,7 @@ void bgew(ExecutionContext *context);
 void beqf(ExecutionContext *context);
 void bnef(ExecutionContext *context);
 void bltf(ExecutionContext *context);
+void blef(ExecutionContext *context);
 void bgtf(ExecutionContext *context);
 void bgef(ExecutionContext *context);
 void beqc(ExecutionContext *context);
@@ -465,6 +543,7 @@ void movl(ExecutionContext *context);
 void addl(ExecutionContext *context);
 void subl(ExecutionContext *context);
 void divl(ExecutionContext *context);
+void modl(ExecutionContext *context);
 void mull(ExecutionContext *context);
 void andl(ExecutionContext *context);
 void orl(ExecutionContext *context);
@@ -488,10 +567,16 @@ void headl(ExecutionContext *context);
 void consl(ExecutionContext *context);
 void newcl(ExecutionContext *context);
 void casec(ExecutionContext *context);
+void xcase(ExecutionContext *context);
+void xcasec(ExecutionContext *context);
+void xmnewz(ExecutionContext *context, const Inst *inst);
+void xmnewzp(ExecutionContext *context, const Inst *inst);
+void xheadm(ExecutionContext *context);
+void xconsm(ExecutionContext *context);
 void indl(ExecutionContext *context);
 void movpc(ExecutionContext *context);
 void tcmp(ExecutionContext *context);
-void mnewz(ExecutionContext *context);
+void mnewz(ExecutionContext *context, const Inst *inst);
 void cvtrf(ExecutionContext *context);
 void cvtfr(ExecutionContext *context);
 void cvtws(ExecutionContext *context);
@@ -0,0 +1,105 @@
+#ifndef DIS_JIT_H
+#define DIS_JIT_H
+
+// A template compiler from decoded Dis instructions to x86-64 machine code.
+//
+// The compiler works on the region of a function reachable from its entry
+// point. Word, big and real arithmetic, moves and branches are compiled;
+// every other instruction is left to the interpreter, with the machine code
+// returning to it just before the instruction and the interpreter re-entering
+// the machine code after it. Compiled instructions are rewritten to `IN_XJIT`,
+// which enters the machine code, so any path into a region runs natively.
+//
+// A module can also be compiled ahead of time, by `dis_aot`, into a compiled
+// image next to its object file. When the module is next loaded, the image's
+// code is mapped straight in, so the module runs natively from its first
+// instruction, without waiting for its functions to get hot. An image is only
+// used if it was compiled from an object file with the same hash as the one
+// loaded, by a build that lays out the execution context the same way; any
+// other is ignored, and the module is interpreted and compiled as usual. An
+// image is machine code that is run as it is, so it must be trusted as much
+// as the object file beside it.
+//
+// The compiler is only built on x86-64, when `DIS_JIT` is set.
+
+#include "module.h"
+
+/// The number of calls after which a function is compiled.
+#define JIT_THRESHOLD 100
+
+/// What is appended to the path of an object file to make the path of its
+/// compiled image: `prog.dis` has `prog.dis.aot`.
+#define JIT_IMAGE_SUFFIX ".aot"
+
+typedef enum JitMode {
+    /// Compile functions once they are hot, and modules with `MUSTCOMPILE`
+    /// set as soon as they are loaded. Modules with `DONTCOMPILE` set are
+    /// always interpreted.
+    JIT_AUTO,
+    /// Interpret every module, for debugging.
+    JIT_INTERPRET_ONLY,
+} JitMode;
+
+/// Choose whether modules loaded from now on may be compiled. Code already
+/// compiled keeps running natively.
+///
+/// The initial mode is `JIT_AUTO`, or `JIT_INTERPRET_ONLY` if the
+/// `DIS_INTERPRET_ONLY` environment variable is set.
+///
+/// \param mode The mode.
+void jit_set_mode(JitMode mode);
+
+/// Prepare a newly decoded module for compilation, according to the current
+/// mode and the module's runtime flags. The code of the module's compiled
+/// image is used if it has one that matches it, and the rest of the module
+/// is compiled straight away if it has `MUSTCOMPILE` set.
+///
+/// \param module The module.
+void jit_prepare(Module *module);
+
+/// Count a call to the function at `pc`, compiling it once it reaches
+/// `JIT_THRESHOLD` calls.
+///
+/// \param module The module containing the function.
+/// \param pc Entry point of the function.
+void jit_call(Module *module, word pc);
+
+/// Compile the function at `pc`, if it has not been compiled already.
+///
+/// \param module The module containing the function.
+/// \param pc Entry point of the function.
+void jit_compile(Module *module, word pc);
+
+/// Compile every function of a module that can be found without running it:
+/// the entry point, the exports, and the targets of `call` and `spawn`
+/// instructions.
+///
+/// \param module The module.
+void jit_compile_all(Module *module);
+
+/// Write a module's compiled code to a compiled image, which `jit_prepare()`
+/// uses if it is at the module's path followed by `JIT_IMAGE_SUFFIX`. The
+/// file is replaced in one step, so a module loaded meanwhile never finds part
+/// of an image.
+///
+/// \param module The module.
+/// \param path Path to the image.
+/// \return `false` if the module may not be compiled or the image could not
+/// be written.
+bool jit_save(Module *module, const char *path);
+
+/// Run compiled code from the instruction before the program counter, which
+/// must be an `IN_XJIT`, until it reaches an instruction the compiler left to
+/// the interpreter. The program counter is left at that instruction. If a
+/// compiled instruction fails, the thread stops with an error as it would in
+/// the interpreter.
+///
+/// \param context The execution context.
+void jit_enter(ExecutionContext *context);
+
+/// Free the compiled code of a module.
+///
+/// \param module The module.
+void jit_free(Module *module);
+
+#endif //DIS_JIT_H
@@ -0,0 +1,1276 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "instructions.h"
+#include "jit.h"
+
+// Compiled code keeps the Dis frame and module data pointers in callee-saved
+// registers and the execution context in rdi, and uses rax, rcx, rdx and xmm0
+// as scratch. It calls nothing, so it needs no stack frame of its own.
+//
+// Each compiled function starts with a prologue that loads the registers from
+// the execution context and jumps to the instruction to start at, and an
+// epilogue that returns the number of the instruction the interpreter should
+// continue at in eax. Every way out of the compiled code is a stub that loads
+// that number and jumps to the epilogue. A division by zero returns the
+// complement of its instruction's number instead.
+//
+// The code refers to nothing outside its region but the execution context,
+// the frame and the module data, so a region can be written to a file and
+// mapped back in at any address, which is what compiled images are: every
+// region of a module, each on pages of its own, and where each compiled
+// instruction's code starts.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+#define RFP RBX
+#define RMP RBP
+
+#define REXW 0x48
+
+/// Regions are mapped in whole pages.
+#define REGION_ALIGN 4096
+
+/// The first bytes of a compiled image.
+#define IMAGE_MAGIC "DISAOT\r\n"
+
+/// The version of the image format, and of the code in it. Change it with
+/// the code the compiler emits, or what it expects of the interpreter, so
+/// that older images are ignored.
+#define IMAGE_VERSION 1
+
+/// Run compiled code. The first argument is the execution context, the second
+/// the address of the compiled instruction to start at; the result is the
+/// instruction to continue interpreting at, or the complement of an
+/// instruction that divided by zero.
+typedef word (*NativeEnter)(ExecutionContext *, const void *);
+
+/// The machine code of one compiled function.
+typedef struct Region {
+    struct Region *next;
+    /// The mapping the code is in, and its size, in whole pages.
+    byte *code;
+    uptr size;
+    /// The number of bytes of code.
+    uptr length;
+} Region;
+
+/// Where the compiled code of an instruction starts.
+typedef struct NativeEntry {
+    NativeEnter enter;
+    const void *address;
+} NativeEntry;
+
+struct NativeCode {
+    /// Held while compiling, as several threads may find functions hot at
+    /// once.
+    pthread_mutex_t lock;
+    /// The number of calls to each function, indexed by entry point.
+    _Atomic uint32_t *calls;
+    /// The compiled code of each instruction, indexed by program counter.
+    NativeEntry *entries;
+    Region *regions;
+};
+
+static JitMode mode;
+static bool mode_chosen;
+
+void jit_set_mode(JitMode new_mode)
+{
+    mode = new_mode;
+    mode_chosen = true;
+}
+
+static JitMode current_mode(void)
+{
+    if (!mode_chosen) {
+        jit_set_mode(getenv("DIS_INTERPRET_ONLY") != NULL ? JIT_INTERPRET_ONLY : JIT_AUTO);
+    }
+    return mode;
+}
+
+/// A memory operand: `[base + disp]`.
+typedef struct Mem {
+    int base;
+    word disp;
+} Mem;
+
+/// What a jump to an instruction does.
+typedef enum FixupKind {
+    /// Continue at the instruction, compiled or interpreted.
+    FIXUP_JUMP,
+    /// Return to the interpreter at the instruction, even if it is compiled.
+    FIXUP_EXIT,
+    /// Stop the thread with a division by zero in the instruction.
+    FIXUP_FAULT,
+} FixupKind;
+
+/// A reference from the code to the instruction numbered `target`, to be
+/// patched once every instruction's code has been placed.
+typedef struct Fixup {
+    uptr position;
+    word target;
+    FixupKind kind;
+} Fixup;
+
+/// What the compiler decided for each instruction of a module.
+typedef enum Disposition {
+    UNSEEN,
+    QUEUED,
+    NATIVE,
+    INTERPRETED,
+} Disposition;
+
+typedef struct Compiler {
+    const Module *module;
+    byte *code;
+    uptr size;
+    uptr capacity;
+    /// `Disposition` of each instruction.
+    byte *disposition;
+    /// Offset of each compiled instruction's code.
+    uptr *labels;
+    /// Offset of the stub leaving to the interpreter at each instruction, or
+    /// 0 if there is none yet.
+    uptr *exits;
+    Fixup *fixups;
+    uptr nfixups;
+    uptr fixups_capacity;
+    /// Offset of the epilogue.
+    uptr epilogue;
+    /// Whether there was no memory to grow `code` or `fixups`, so that the
+    /// code is incomplete and must not be used.
+    bool exhausted;
+} Compiler;
+
+static void emit(Compiler *c, byte b)
+{
+    if (c->exhausted) {
+        return;
+    }
+    if (c->size == c->capacity) {
+        uptr capacity = c->capacity ? c->capacity * 2 : 4096;
+        byte *code = realloc(c->code, capacity);
+        if (code == NULL) {
+            c->exhausted = true;
+            return;
+        }
+        c->code = code;
+        c->capacity = capacity;
+    }
+    c->code[c->size++] = b;
+}
+
+static void emit32(Compiler *c, word v)
+{
+    uint32_t u = (uint32_t) v;
+    for (int i = 0; i < 4; i++) {
+        emit(c, (byte) (u >> (8 * i)));
+    }
+}
+
+/// Emit an instruction with a register and a memory operand: an optional
+/// legacy prefix, REX.W if `wide`, the opcode (two bytes if it does not fit
+/// in one, for the 0x0F escape), then ModRM with a 32-bit displacement.
+static void emit_rm(Compiler *c, byte prefix, bool wide, int opcode, int reg,
+                    Mem mem)
+{
+    if (prefix != 0) {
+        emit(c, prefix);
+    }
+    if (wide) {
+        emit(c, REXW);
+    }
+    if (opcode > 0xFF) {
+        emit(c, (byte) (opcode >> 8));
+    }
+    emit(c, (byte) opcode);
+    emit(c, (byte) (0x80 | reg << 3 | mem.base));
+    emit32(c, mem.disp);
+}
+
+/// Emit a jump, or a conditional jump if `cc` is not 0, to an instruction.
+///
+/// \param cc The second byte of a `jcc rel32`, or 0 for `jmp rel32`.
+/// \param target The instruction to jump to.
+/// \param kind What the jump does.
+static void emit_jump(Compiler *c, byte cc, word target, FixupKind kind)
+{
+    if (cc == 0) {
+        emit(c, 0xE9);
+    } else {
+        emit(c, 0x0F);
+        emit(c, cc);
+    }
+    if (c->nfixups == c->fixups_capacity && !c->exhausted) {
+        uptr capacity = c->fixups_capacity ? c->fixups_capacity * 2 : 64;
+        Fixup *fixups = realloc(c->fixups, capacity * sizeof(Fixup));
+        if (fixups == NULL) {
+            c->exhausted = true;
+        } else {
+            c->fixups = fixups;
+            c->fixups_capacity = capacity;
+        }
+    }
+    if (c->exhausted) {
+        return;
+    }
+    c->fixups[c->nfixups++] = (Fixup) {c->size, target, kind};
+    emit32(c, 0);
+}
+
+/// Emit a short jump, or a conditional one if `cc` is not 0, to be aimed by
+/// `land()`.
+///
+/// \param cc The second byte of the corresponding `jcc rel32`, or 0.
+/// \return The position of the displacement.
+static uptr emit_short_jump(Compiler *c, byte cc)
+{
+    emit(c, cc == 0 ? 0xEB : (byte) (cc - 0x10));
+    emit(c, 0);
+    return c->size - 1;
+}
+
+/// Aim a short jump at the current position.
+static void land(Compiler *c, uptr position)
+{
+    c->code[position] = (byte) (c->size - (position + 1));
+}
+
+// Condition codes, as the second byte of `jcc rel32`.
+#define JAE 0x83
+#define JE  0x84
+#define JNE 0x85
+#define JA  0x87
+#define JP  0x8A
+#define JL  0x8C
+#define JGE 0x8D
+#define JLE 0x8E
+#define JG  0x8F
+
+/// Whether an operand addresses memory, rather than being an immediate or
+/// absent.
+static bool is_memory(const Operand *operand)
+{
+    return (operand->mode & ~(AIND | AFP)) == 0;
+}
+
+/// Whether an operand can be read as a word: memory or an immediate.
+static bool is_word(const Operand *operand)
+{
+    return is_memory(operand) || operand->mode == AIMM;
+}
+
+/// Make a memory operand addressable, loading the pointer of a doubly
+/// indirect operand into rcx.
+static Mem address(Compiler *c, const Operand *operand)
+{
+    int base = operand->mode & AFP ? RFP : RMP;
+    if (operand->mode & AIND) {
+        emit_rm(c, 0, true, 0x8B, RCX, (Mem) {base, operand->offset});
+        return (Mem) {RCX, operand->indirect};
+    }
+    return (Mem) {base, operand->offset};
+}
+
+/// Load a word operand, or a big one if `wide`, into a register.
+static void load_integer(Compiler *c, bool wide, int reg, const Operand *operand)
+{
+    if (operand->mode == AIMM) {
+        emit(c, (byte) (0xB8 + reg));
+        emit32(c, operand->offset);
+        return;
+    }
+    emit_rm(c, 0, wide, 0x8B, reg, address(c, operand));
+}
+
+/// Store a register, all of it if `wide` or its low word if not, into a
+/// memory operand.
+static void store_integer(Compiler *c, bool wide, int reg, const Operand *operand)
+{
+    emit_rm(c, 0, wide, 0x89, reg, address(c, operand));
+}
+
+/// Emit an ALU instruction with eax or rax as destination and an operand as
+/// source.
+///
+/// \param digit The ModRM reg field of the `81 /digit id` form.
+/// \param opcode The `op r, r/m` form.
+static void alu(Compiler *c, bool wide, int digit, int opcode,
+                const Operand *operand)
+{
+    if (operand->mode == AIMM) {
+        emit(c, 0x81);
+        emit(c, (byte) (0xC0 | digit << 3 | RAX));
+        emit32(c, operand->offset);
+        return;
+    }
+    emit_rm(c, 0, wide, opcode, RAX, address(c, operand));
+}
+
+static void load_real(Compiler *c, const Operand *operand)
+{
+    emit_rm(c, 0xF2, false, 0x0F10, 0, address(c, operand)); // movsd xmm0, m
+}
+
+static void store_real(Compiler *c, const Operand *operand)
+{
+    emit_rm(c, 0xF2, false, 0x0F11, 0, address(c, operand)); // movsd m, xmm0
+}
+
+/// Whether control can pass from an instruction to the one after it.
+static bool falls_through(byte opcode)
+{
+    switch (opcode) {
+        case IN_JMP:
+        case IN_RET:
+        case IN_EXIT:
+        case IN_GOTO:
+        case IN_CASE:
+        case IN_CASEC:
+        case IN_XJIT:
+        case IN_XEND:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/// Whether an instruction is a branch within its function, with the target
+/// in its destination operand.
+static bool is_local_branch(byte opcode)
+{
+    return opcode == IN_JMP || (opcode >= IN_BEQB && opcode <= IN_BGEC) ||
+           (opcode >= IN_BNEL && opcode <= IN_BEQL);
+}
+
+/// Whether the compiler can translate an instruction, given its opcode with
+/// any superinstruction undone.
+static bool compilable(byte opcode, const Inst *inst)
+{
+    const Operand *s = &inst->s, *m = &inst->m, *d = &inst->d;
+    switch (opcode) {
+        case IN_NOP:
+        case IN_JMP:
+            return true;
+        case IN_MOVW:
+        case IN_CVTWL:
+        case IN_CVTWF:
+            return is_word(s) && is_memory(d);
+        case IN_MOVL:
+        case IN_MOVF:
+        case IN_NEGF:
+        case IN_CVTLW:
+        case IN_CVTLF:
+            return is_memory(s) && is_memory(d);
+        case IN_ADDW:
+        case IN_SUBW:
+        case IN_MULW:
+        case IN_DIVW:
+        case IN_MODW:
+        case IN_ANDW:
+        case IN_ORW:
+        case IN_XORW:
+        case IN_SHLW:
+        case IN_SHRW:
+        case IN_LSRW:
+            return is_word(s) && is_word(m) && is_memory(d);
+        case IN_SHLL:
+        case IN_SHRL:
+        case IN_LSRL:
+            return is_word(s) && is_memory(m) && is_memory(d);
+        case IN_ADDL:
+        case IN_SUBL:
+        case IN_MULL:
+        case IN_DIVL:
+        case IN_MODL:
+        case IN_ANDL:
+        case IN_ORL:
+        case IN_XORL:
+        case IN_ADDF:
+        case IN_SUBF:
+        case IN_MULF:
+        case IN_DIVF:
+            return is_memory(s) && is_memory(m) && is_memory(d);
+        case IN_BEQW:
+        case IN_BNEW:
+        case IN_BLTW:
+        case IN_BLEW:
+        case IN_BGTW:
+        case IN_BGEW:
+            return is_word(s) && is_word(m);
+        case IN_BEQL:
+        case IN_BNEL:
+        case IN_BLTL:
+        case IN_BLEL:
+        case IN_BGTL:
+        case IN_BGEL:
+        case IN_BEQF:
+        case IN_BNEF:
+        case IN_BLTF:
+        case IN_BLEF:
+        case IN_BGTF:
+        case IN_BGEF:
+            return is_memory(s) && is_memory(m);
+        default:
+            return false;
+    }
+}
+
+/// `d = m op s` for the word and big ALU instructions.
+static void compile_alu(Compiler *c, const Inst *inst, bool wide, int digit,
+                        int opcode)
+{
+    load_integer(c, wide, RAX, &inst->m);
+    alu(c, wide, digit, opcode, &inst->s);
+    store_integer(c, wide, RAX, &inst->d);
+}
+
+/// Word and big division and modulus. The processor faults on overflow, so a
+/// divisor of -1 is handled separately, wrapping as the interpreter does.
+static void compile_divide(Compiler *c, word pc, const Inst *inst, bool wide,
+                           bool modulus)
+{
+    load_integer(c, wide, RAX, &inst->m);
+    load_integer(c, wide, RCX, &inst->s);
+    if (wide) {
+        emit(c, REXW);
+    }
+    emit(c, 0x85); // test ecx, ecx
+    emit(c, 0xC9);
+    emit_jump(c, JE, pc, FIXUP_FAULT);
+    if (wide) {
+        emit(c, REXW);
+    }
+    emit(c, 0x83); // cmp ecx, -1
+    emit(c, 0xF9);
+    emit(c, 0xFF);
+    uptr divide = emit_short_jump(c, JNE);
+    if (modulus) {
+        emit(c, 0x31); // xor edx, edx
+        emit(c, 0xD2);
+    } else {
+        if (wide) {
+            emit(c, REXW);
+        }
+        emit(c, 0xF7); // neg eax
+        emit(c, 0xD8);
+    }
+    uptr done = emit_short_jump(c, 0);
+    land(c, divide);
+    if (wide) {
+        emit(c, REXW);
+    }
+    emit(c, 0x99); // cdq
+    if (wide) {
+        emit(c, REXW);
+    }
+    emit(c, 0xF7); // idiv ecx
+    emit(c, 0xF9);
+    land(c, done);
+    store_integer(c, wide, modulus ? RDX : RAX, &inst->d);
+}
+
+/// Shift `m` by the word `s`. The processor takes the count modulo the width
+/// of the operand, as the interpreter does.
+///
+/// \param digit The ModRM reg field of `d3 /digit`.
+static void compile_shift(Compiler *c, const Inst *inst, bool wide, int digit)
+{
+    load_integer(c, wide, RAX, &inst->m);
+    load_integer(c, false, RCX, &inst->s);
+    if (wide) {
+        emit(c, REXW);
+    }
+    emit(c, 0xD3);
+    emit(c, (byte) (0xC0 | digit << 3 | RAX));
+    store_integer(c, wide, RAX, &inst->d);
+}
+
+/// `d = m op s` for the real arithmetic instructions.
+static void compile_real(Compiler *c, const Inst *inst, int opcode)
+{
+    load_real(c, &inst->m);
+    emit_rm(c, 0xF2, false, opcode, 0, address(c, &inst->s));
+    store_real(c, &inst->d);
+}
+
+static void compile_branch(Compiler *c, const Inst *inst, bool wide, byte cc)
+{
+    load_integer(c, wide, RAX, &inst->s);
+    alu(c, wide, 7, 0x3B, &inst->m); // cmp
+    emit_jump(c, cc, inst->d.offset, FIXUP_JUMP);
+}
+
+/// Real comparisons set the flags as an unsigned comparison would, with an
+/// unordered result setting ZF, PF and CF. Comparing the larger side against
+/// the smaller makes the ordered-only conditions `ja` and `jae` express `<`
+/// and `<=` without testing PF.
+static void compile_real_branch(Compiler *c, const Inst *inst, byte opcode)
+{
+    bool swap = opcode == IN_BLTF || opcode == IN_BLEF;
+    load_real(c, swap ? &inst->m : &inst->s);
+    emit_rm(c, 0x66, false, 0x0F2E, 0, address(c, swap ? &inst->s : &inst->m)); // ucomisd
+    word target = inst->d.offset;
+    switch (opcode) {
+        case IN_BEQF:
+            emit(c, 0x7A); // jp over the following je
+            emit(c, 6);
+            emit_jump(c, JE, target, FIXUP_JUMP);
+            break;
+        case IN_BNEF:
+            emit_jump(c, JP, target, FIXUP_JUMP);
+            emit_jump(c, JNE, target, FIXUP_JUMP);
+            break;
+        case IN_BLTF:
+        case IN_BGTF:
+            emit_jump(c, JA, target, FIXUP_JUMP);
+            break;
+        default:
+            emit_jump(c, JAE, target, FIXUP_JUMP);
+            break;
+    }
+}
+
+static void compile_instruction(Compiler *c, word pc, byte opcode,
+                                const Inst *inst)
+{
+    const Operand *s = &inst->s, *d = &inst->d;
+    if (is_local_branch(opcode) && d->offset <= pc) {
+        // Loops count down the quantum once per iteration, returning to the
+        // interpreter to yield at this instruction when it runs out:
+        // sub qword [rdi + quantum], 1.
+        emit(c, REXW);
+        emit(c, 0x83);
+        emit(c, (byte) (0x80 | 5 << 3 | RDI));
+        emit32(c, offsetof(ExecutionContext, quantum));
+        emit(c, 1);
+        emit_jump(c, JE, pc, FIXUP_EXIT);
+    }
+    switch (opcode) {
+        case IN_NOP:
+            break;
+        case IN_JMP:
+            emit_jump(c, 0, d->offset, FIXUP_JUMP);
+            break;
+        case IN_MOVW:
+        case IN_CVTLW:
+            load_integer(c, false, RAX, s);
+            store_integer(c, false, RAX, d);
+            break;
+        case IN_MOVL:
+        case IN_MOVF:
+            load_integer(c, true, RAX, s);
+            store_integer(c, true, RAX, d);
+            break;
+        case IN_NEGF:
+            load_integer(c, true, RAX, s);
+            emit(c, REXW); // btc rax, 63
+            emit(c, 0x0F);
+            emit(c, 0xBA);
+            emit(c, 0xF8);
+            emit(c, 63);
+            store_integer(c, true, RAX, d);
+            break;
+        case IN_CVTWL:
+            load_integer(c, false, RAX, s);
+            emit(c, REXW); // movsxd rax, eax
+            emit(c, 0x63);
+            emit(c, 0xC0);
+            store_integer(c, true, RAX, d);
+            break;
+        case IN_CVTWF:
+            load_integer(c, false, RAX, s);
+            emit(c, 0xF2); // cvtsi2sd xmm0, eax
+            emit(c, 0x0F);
+            emit(c, 0x2A);
+            emit(c, 0xC0);
+            store_real(c, d);
+            break;
+        case IN_CVTLF:
+            emit_rm(c, 0xF2, true, 0x0F2A, 0, address(c, s)); // cvtsi2sd xmm0, m64
+            store_real(c, d);
+            break;
+
+        case IN_ADDW: compile_alu(c, inst, false, 0, 0x03); break;
+        case IN_ORW: compile_alu(c, inst, false, 1, 0x0B); break;
+        case IN_ANDW: compile_alu(c, inst, false, 4, 0x23); break;
+        case IN_SUBW: compile_alu(c, inst, false, 5, 0x2B); break;
+        case IN_XORW: compile_alu(c, inst, false, 6, 0x33); break;
+        case IN_ADDL: compile_alu(c, inst, true, 0, 0x03); break;
+        case IN_ORL: compile_alu(c, inst, true, 1, 0x0B); break;
+        case IN_ANDL: compile_alu(c, inst, true, 4, 0x23); break;
+        case IN_SUBL: compile_alu(c, inst, true, 5, 0x2B); break;
+        case IN_XORL: compile_alu(c, inst, true, 6, 0x33); break;
+
+        case IN_MULW:
+            load_integer(c, false, RAX, &inst->m);
+            if (s->mode == AIMM) {
+                emit(c, 0x69); // imul eax, eax, imm32
+                emit(c, 0xC0);
+                emit32(c, s->offset);
+            } else {
+                emit_rm(c, 0, false, 0x0FAF, RAX, address(c, s));
+            }
+            store_integer(c, false, RAX, d);
+            break;
+        case IN_MULL:
+            load_integer(c, true, RAX, &inst->m);
+            emit_rm(c, 0, true, 0x0FAF, RAX, address(c, s));
+            store_integer(c, true, RAX, d);
+            break;
+
+        case IN_DIVW: compile_divide(c, pc, inst, false, false); break;
+        case IN_MODW: compile_divide(c, pc, inst, false, true); break;
+        case IN_DIVL: compile_divide(c, pc, inst, true, false); break;
+        case IN_MODL: compile_divide(c, pc, inst, true, true); break;
+
+        case IN_SHLW: compile_shift(c, inst, false, 4); break;
+        case IN_LSRW: compile_shift(c, inst, false, 5); break;
+        case IN_SHRW: compile_shift(c, inst, false, 7); break;
+        case IN_SHLL: compile_shift(c, inst, true, 4); break;
+        case IN_LSRL: compile_shift(c, inst, true, 5); break;
+        case IN_SHRL: compile_shift(c, inst, true, 7); break;
+
+        case IN_ADDF: compile_real(c, inst, 0x0F58); break;
+        case IN_MULF: compile_real(c, inst, 0x0F59); break;
+        case IN_SUBF: compile_real(c, inst, 0x0F5C); break;
+        case IN_DIVF: compile_real(c, inst, 0x0F5E); break;
+
+        case IN_BEQW: compile_branch(c, inst, false, JE); break;
+        case IN_BNEW: compile_branch(c, inst, false, JNE); break;
+        case IN_BLTW: compile_branch(c, inst, false, JL); break;
+        case IN_BLEW: compile_branch(c, inst, false, JLE); break;
+        case IN_BGTW: compile_branch(c, inst, false, JG); break;
+        case IN_BGEW: compile_branch(c, inst, false, JGE); break;
+        case IN_BEQL: compile_branch(c, inst, true, JE); break;
+        case IN_BNEL: compile_branch(c, inst, true, JNE); break;
+        case IN_BLTL: compile_branch(c, inst, true, JL); break;
+        case IN_BLEL: compile_branch(c, inst, true, JLE); break;
+        case IN_BGTL: compile_branch(c, inst, true, JG); break;
+        case IN_BGEL: compile_branch(c, inst, true, JGE); break;
+
+        default:
+            compile_real_branch(c, inst, opcode);
+            break;
+    }
+}
+
+/// Find the instructions reachable from `pc` without calling, and decide
+/// which of them to compile. An instruction compiled by an earlier call ends
+/// the search: control passes to its own code.
+///
+/// \return Whether there was memory to search with.
+static bool explore(Compiler *c, word pc)
+{
+    const Module *module = c->module;
+    word *stack = malloc((module->ninstructions + 1) * sizeof(word));
+    if (stack == NULL) {
+        return false;
+    }
+    uptr depth = 0;
+    stack[depth++] = pc;
+    c->disposition[pc] = QUEUED;
+    while (depth > 0) {
+        word i = stack[--depth];
+        const Inst *inst = &module->code[i];
+        byte opcode = module_unfused(inst->opcode);
+        c->disposition[i] = compilable(opcode, inst) ? NATIVE : INTERPRETED;
+
+        word successors[2];
+        int n = 0;
+        if (falls_through(opcode)) {
+            successors[n++] = i + 1;
+        }
+        if (is_local_branch(opcode)) {
+            successors[n++] = inst->d.offset;
+        }
+        for (int j = 0; j < n; j++) {
+            word next = successors[j];
+            if (next < module->ninstructions && c->disposition[next] == UNSEEN) {
+                c->disposition[next] = QUEUED;
+                stack[depth++] = next;
+            }
+        }
+    }
+    free(stack);
+    return true;
+}
+
+/// Emit a stub returning `result` to `jit_enter()`, and return its offset.
+static uptr return_stub(Compiler *c, word result)
+{
+    uptr offset = c->size;
+    emit(c, 0xB8); // mov eax, result
+    emit32(c, result);
+    emit(c, 0xE9); // jmp epilogue
+    emit32(c, (word) (c->epilogue - (c->size + 4)));
+    return offset;
+}
+
+/// Find where a fixup should jump to, emitting a stub if it leaves the
+/// compiled code.
+static uptr resolve(Compiler *c, const Fixup *fixup)
+{
+    if (fixup->kind == FIXUP_FAULT) {
+        return return_stub(c, ~fixup->target);
+    }
+    if (fixup->kind == FIXUP_JUMP && c->disposition[fixup->target] == NATIVE) {
+        return c->labels[fixup->target];
+    }
+    if (c->exits[fixup->target] == 0) {
+        c->exits[fixup->target] = return_stub(c, fixup->target);
+    }
+    return c->exits[fixup->target];
+}
+
+/// Emit the compiled region, returning whether it contains any compiled
+/// instructions and there was memory for all of it.
+static bool generate(Compiler *c)
+{
+    const Module *module = c->module;
+    bool any = false;
+
+    // Prologue: push rbx; push rbp; mov rbx, [rdi + fp]; mov rbp, [rdi + mp];
+    // jmp rsi.
+    emit(c, 0x53);
+    emit(c, 0x55);
+    emit_rm(c, 0, true, 0x8B, RFP, (Mem) {RDI, offsetof(ExecutionContext, fp)});
+    emit_rm(c, 0, true, 0x8B, RMP, (Mem) {RDI, offsetof(ExecutionContext, mp)});
+    emit(c, 0xFF);
+    emit(c, 0xE6);
+    // Epilogue: pop rbp; pop rbx; ret.
+    c->epilogue = c->size;
+    emit(c, 0x5D);
+    emit(c, 0x5B);
+    emit(c, 0xC3);
+
+    for (word pc = 0; pc < module->ninstructions; pc++) {
+        if (c->disposition[pc] != NATIVE) {
+            continue;
+        }
+        any = true;
+        c->labels[pc] = c->size;
+        const Inst *inst = &module->code[pc];
+        byte opcode = module_unfused(inst->opcode);
+        compile_instruction(c, pc, opcode, inst);
+        if (falls_through(opcode) && c->disposition[pc + 1] != NATIVE) {
+            emit_jump(c, 0, pc + 1, FIXUP_JUMP);
+        }
+    }
+
+    if (c->exhausted) {
+        return false;
+    }
+    for (uptr i = 0; i < c->nfixups; i++) {
+        Fixup *fixup = &c->fixups[i];
+        uptr target = resolve(c, fixup);
+        word displacement = (word) (target - (fixup->position + 4));
+        memcpy(c->code + fixup->position, &displacement, sizeof displacement);
+    }
+    return any && !c->exhausted;
+}
+
+/// \return The module's call counts and compiled code, or `NULL` if there
+/// is no memory for them.
+static NativeCode *native_code(Module *module)
+{
+    NativeCode *native = calloc(1, sizeof(NativeCode));
+    if (native == NULL) {
+        return NULL;
+    }
+    native->calls = calloc(module->ninstructions, sizeof(*native->calls));
+    native->entries = calloc(module->ninstructions, sizeof(NativeEntry));
+    if (native->calls == NULL || native->entries == NULL) {
+        free(native->calls);
+        free(native->entries);
+        free(native);
+        return NULL;
+    }
+    pthread_mutex_init(&native->lock, NULL);
+    return native;
+}
+
+/// Rewrite a compiled instruction to enter its code, once its entry has been
+/// filled in. Interpreters may be running the instruction, so the entry is
+/// published before the instruction that uses it.
+static void install(Module *module, word pc)
+{
+    Inst *inst = &module->code[pc];
+    __atomic_store_n(&inst->handler, execution_handler(IN_XJIT), __ATOMIC_RELEASE);
+    __atomic_store_n(&inst->opcode, IN_XJIT, __ATOMIC_RELEASE);
+}
+
+/// The start of a compiled image.
+typedef struct ImageHeader {
+    char magic[8];
+    /// `IMAGE_VERSION`, and the layout of the execution context the code
+    /// was compiled against.
+    uint32_t version;
+    uint32_t layout;
+    /// `Module::hash` of the module compiled.
+    uint64_t hash;
+    uint32_t ninstructions;
+    /// The number of `ImageRegion`s, which follow the header, and of the
+    /// `ImageEntry`s, which follow them.
+    uint32_t nregions;
+    uint32_t nentries;
+    uint32_t reserved;
+} ImageHeader;
+
+/// Where a region's code is in a compiled image. The offset is a multiple of
+/// `REGION_ALIGN`.
+typedef struct ImageRegion {
+    uint64_t offset;
+    uint64_t length;
+} ImageRegion;
+
+/// Where the code of a compiled instruction is in a compiled image.
+typedef struct ImageEntry {
+    uint32_t pc;
+    uint32_t region;
+    uint32_t offset;
+} ImageEntry;
+
+/// The offsets in the execution context the code depends on.
+static uint32_t image_layout(void)
+{
+    return offsetof(ExecutionContext, fp) |
+           offsetof(ExecutionContext, mp) << 10 |
+           offsetof(ExecutionContext, quantum) << 20;
+}
+
+static uptr align_region(uptr size)
+{
+    return (size + REGION_ALIGN - 1) / REGION_ALIGN * REGION_ALIGN;
+}
+
+/// The path of the compiled image of the module at `path`, to be freed, or
+/// `NULL` if there is no memory for it.
+static char *image_path(const char *path)
+{
+    uptr length = strlen(path);
+    char *image = malloc(length + sizeof JIT_IMAGE_SUFFIX);
+    if (image == NULL) {
+        return NULL;
+    }
+    memcpy(image, path, length);
+    memcpy(image + length, JIT_IMAGE_SUFFIX, sizeof JIT_IMAGE_SUFFIX);
+    return image;
+}
+
+/// Map the regions of a compiled image whose header matches the module, and
+/// enter their code from the instructions compiled in them.
+///
+/// \return Whether the image was valid and could be mapped.
+static bool map_image(Module *module, NativeCode *native, int fd,
+                      const ImageHeader *header, uptr file_size)
+{
+    uptr nregions = header->nregions, nentries = header->nentries;
+    uptr tables = nregions * sizeof(ImageRegion) + nentries * sizeof(ImageEntry);
+    if (nregions > header->ninstructions || nentries > header->ninstructions ||
+        sizeof *header + tables > file_size) {
+        return false;
+    }
+    ImageRegion *regions = malloc(tables);
+    if (regions == NULL) {
+        return false;
+    }
+    ImageEntry *entries = (ImageEntry *) (regions + nregions);
+    bool valid = (uptr) pread(fd, regions, tables, sizeof *header) == tables;
+    for (uptr i = 0; valid && i < nregions; i++) {
+        valid = regions[i].offset % REGION_ALIGN == 0 && regions[i].length > 0 &&
+                regions[i].offset <= file_size &&
+                regions[i].length <= file_size - regions[i].offset;
+    }
+    for (uptr i = 0; valid && i < nentries; i++) {
+        valid = entries[i].pc < header->ninstructions &&
+                entries[i].region < nregions &&
+                entries[i].offset < regions[entries[i].region].length;
+    }
+
+    Region **mapped = valid ? calloc(nregions, sizeof(Region *)) : NULL;
+    valid = valid && (mapped != NULL || nregions == 0);
+    for (uptr i = 0; valid && i < nregions; i++) {
+        uptr size = align_region(regions[i].length);
+        mapped[i] = malloc(sizeof(Region));
+        if (mapped[i] == NULL) {
+            valid = false;
+            break;
+        }
+        byte *code = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd,
+                          (off_t) regions[i].offset);
+        if (code == MAP_FAILED) {
+            free(mapped[i]);
+            mapped[i] = NULL;
+            valid = false;
+            break;
+        }
+        *mapped[i] = (Region) {NULL, code, size, regions[i].length};
+    }
+    if (valid) {
+        for (uptr i = 0; i < nregions; i++) {
+            mapped[i]->next = native->regions;
+            native->regions = mapped[i];
+        }
+        for (uptr i = 0; i < nentries; i++) {
+            const Region *region = mapped[entries[i].region];
+            native->entries[entries[i].pc] = (NativeEntry) {
+                (NativeEnter) (void *) region->code,
+                region->code + entries[i].offset,
+            };
+        }
+        for (uptr i = 0; i < nentries; i++) {
+            install(module, (word) entries[i].pc);
+        }
+    } else if (mapped != NULL) {
+        for (uptr i = 0; i < nregions && mapped[i] != NULL; i++) {
+            munmap(mapped[i]->code, mapped[i]->size);
+            free(mapped[i]);
+        }
+    }
+    free(mapped);
+    free(regions);
+    return valid;
+}
+
+/// Use the compiled image next to a module's object file, if there is one
+/// compiled from the same object file by a compatible build.
+///
+/// \return Whether the image was used.
+static bool load_image(Module *module, NativeCode *native)
+{
+    char *path = image_path(module->path);
+    if (path == NULL) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    ImageHeader header;
+    bool loaded = fstat(fd, &st) == 0 &&
+                  pread(fd, &header, sizeof header, 0) == sizeof header &&
+                  memcmp(header.magic, IMAGE_MAGIC, sizeof header.magic) == 0 &&
+                  header.version == IMAGE_VERSION &&
+                  header.layout == image_layout() &&
+                  header.hash == module->hash &&
+                  header.ninstructions == (uint32_t) module->ninstructions &&
+                  map_image(module, native, fd, &header, st.st_size);
+    close(fd);
+    return loaded;
+}
+
+void jit_prepare(Module *module)
+{
+    if (current_mode() == JIT_INTERPRET_ONLY || module->flags & DONTCOMPILE) {
+        return;
+    }
+    // Without memory for its counts, a module is only interpreted.
+    module->native = native_code(module);
+    if (module->native == NULL) {
+        return;
+    }
+    load_image(module, module->native);
+    if (module->flags & MUSTCOMPILE) {
+        if (module->entry_pc >= 0) {
+            jit_compile(module, module->entry_pc);
+        }
+        for (word i = 0; i < module->nexports; i++) {
+            jit_compile(module, module->exports[i].pc);
+        }
+    }
+}
+
+void jit_call(Module *module, word pc)
+{
+    NativeCode *native = module->native;
+    if (native == NULL) {
+        return;
+    }
+    // Counts are approximate if threads race; a plain load and store avoids
+    // a locked instruction on every call.
+    uint32_t calls = atomic_load_explicit(&native->calls[pc], memory_order_relaxed) + 1;
+    atomic_store_explicit(&native->calls[pc], calls, memory_order_relaxed);
+    if (calls == JIT_THRESHOLD) {
+        jit_compile(module, pc);
+    }
+}
+
+/// Compile the function at `pc`, with the module's compiler lock held.
+static void compile(Module *module, NativeCode *native, word pc)
+{
+    if (module->code[pc].opcode == IN_XJIT) {
+        return;
+    }
+
+    // Without memory to compile it, the function is left to the interpreter.
+    word n = module->ninstructions;
+    Compiler c = {
+        .module = module,
+        .disposition = calloc(n + 1, 1),
+        .labels = calloc(n + 1, sizeof(uptr)),
+        .exits = calloc(n + 1, sizeof(uptr)),
+    };
+    bool explored = c.disposition != NULL && c.labels != NULL && c.exits != NULL &&
+                    explore(&c, pc);
+
+    Region *region = NULL;
+    if (explored && generate(&c)) {
+        uptr size = align_region(c.size);
+        byte *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED) {
+            memcpy(code, c.code, c.size);
+            if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+                region = malloc(sizeof(Region));
+            }
+            if (region != NULL) {
+                *region = (Region) {native->regions, code, size, c.size};
+                native->regions = region;
+            } else {
+                munmap(code, size);
+            }
+        }
+    }
+
+    if (region != NULL) {
+        NativeEnter enter = (NativeEnter) (void *) region->code;
+        for (word i = 0; i < n; i++) {
+            if (c.disposition[i] == NATIVE) {
+                native->entries[i] = (NativeEntry) {enter, region->code + c.labels[i]};
+            }
+        }
+        for (word i = 0; i < n; i++) {
+            if (c.disposition[i] == NATIVE) {
+                install(module, i);
+            }
+        }
+    }
+
+    free(c.code);
+    free(c.disposition);
+    free(c.labels);
+    free(c.exits);
+    free(c.fixups);
+}
+
+void jit_compile(Module *module, word pc)
+{
+    NativeCode *native = module->native;
+    if (native == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&native->lock);
+    compile(module, native, pc);
+    pthread_mutex_unlock(&native->lock);
+}
+
+void jit_compile_all(Module *module)
+{
+    NativeCode *native = module->native;
+    if (native == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&native->lock);
+    if (module->entry_pc >= 0) {
+        compile(module, native, module->entry_pc);
+    }
+    for (word i = 0; i < module->nexports; i++) {
+        compile(module, native, module->exports[i].pc);
+    }
+    for (word pc = 0; pc < module->ninstructions; pc++) {
+        const Inst *inst = &module->code[pc];
+        byte opcode = module_unfused(inst->opcode);
+        if (opcode == IN_CALL || opcode == IN_SPAWN) {
+            compile(module, native, inst->d.offset);
+        }
+    }
+    pthread_mutex_unlock(&native->lock);
+}
+
+static int compare_regions(const void *a, const void *b)
+{
+    uptr x = (uptr) (*(Region *const *) a)->code;
+    uptr y = (uptr) (*(Region *const *) b)->code;
+    return (x > y) - (x < y);
+}
+
+/// Write a compiled image to a file, padding each region to whole pages.
+static bool write_image(FILE *file, const ImageHeader *header,
+                        const ImageRegion *regions, Region *const *mapped,
+                        const ImageEntry *entries)
+{
+    static const byte zeros[REGION_ALIGN];
+    bool written = fwrite(header, sizeof *header, 1, file) == 1 &&
+                   fwrite(regions, sizeof *regions, header->nregions, file) == header->nregions &&
+                   fwrite(entries, sizeof *entries, header->nentries, file) == header->nentries;
+    uptr position = sizeof *header + header->nregions * sizeof *regions +
+                    header->nentries * sizeof *entries;
+    for (uptr i = 0; written && i < header->nregions; i++) {
+        uptr padding = regions[i].offset - position;
+        uptr length = mapped[i]->length;
+        uptr tail = align_region(length) - length;
+        written = fwrite(zeros, 1, padding, file) == padding &&
+                  fwrite(mapped[i]->code, 1, length, file) == length &&
+                  fwrite(zeros, 1, tail, file) == tail;
+        position = regions[i].offset + align_region(length);
+    }
+    return written;
+}
+
+bool jit_save(Module *module, const char *path)
+{
+    NativeCode *native = module->native;
+    if (native == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&native->lock);
+
+    uptr nregions = 0, nentries = 0;
+    for (Region *region = native->regions; region != NULL; region = region->next) {
+        nregions++;
+    }
+    for (word pc = 0; pc < module->ninstructions; pc++) {
+        nentries += native->entries[pc].enter != NULL;
+    }
+    // Regions are found by the address they start at, which is also the
+    // entry point of all their instructions, and numbered in the order of
+    // their first instructions, so that the same module always makes the same
+    // image.
+    Region **mapped = malloc((nregions + 1) * sizeof(Region *));
+    Region **ordered = malloc((nregions + 1) * sizeof(Region *));
+    word *numbers = malloc((nregions + 1) * sizeof(word));
+    ImageEntry *entries = malloc((nentries + 1) * sizeof(ImageEntry));
+    if (mapped == NULL || ordered == NULL || numbers == NULL || entries == NULL) {
+        pthread_mutex_unlock(&native->lock);
+        free(entries);
+        free(numbers);
+        free(ordered);
+        free(mapped);
+        return false;
+    }
+    nregions = 0;
+    for (Region *region = native->regions; region != NULL; region = region->next) {
+        numbers[nregions] = -1;
+        mapped[nregions++] = region;
+    }
+    qsort(mapped, nregions, sizeof *mapped, compare_regions);
+
+    uptr numbered = 0;
+    nentries = 0;
+    for (word pc = 0; pc < module->ninstructions; pc++) {
+        const NativeEntry *entry = &native->entries[pc];
+        if (entry->enter == NULL) {
+            continue;
+        }
+        Region key = {.code = (byte *) (void *) entry->enter}, *k = &key;
+        Region **found = bsearch(&k, mapped, nregions, sizeof *mapped, compare_regions);
+        word *number = &numbers[found - mapped];
+        if (*number < 0) {
+            *number = numbered;
+            ordered[numbered++] = *found;
+        }
+        entries[nentries++] = (ImageEntry) {
+            pc,
+            *number,
+            (const byte *) entry->address - (*found)->code,
+        };
+    }
+
+    ImageHeader header = {
+        .version = IMAGE_VERSION,
+        .layout = image_layout(),
+        .hash = module->hash,
+        .ninstructions = module->ninstructions,
+        .nregions = numbered,
+        .nentries = nentries,
+    };
+    memcpy(header.magic, IMAGE_MAGIC, sizeof header.magic);
+    ImageRegion *regions = malloc((numbered + 1) * sizeof(ImageRegion));
+    uptr offset = align_region(sizeof header + numbered * sizeof *regions +
+                               nentries * sizeof *entries);
+    for (uptr i = 0; regions != NULL && i < numbered; i++) {
+        regions[i] = (ImageRegion) {offset, ordered[i]->length};
+        offset += align_region(ordered[i]->length);
+    }
+
+    // Write to a temporary file and rename it, so that a module loaded
+    // meanwhile finds the old image or the new one, never part of one.
+    uptr length = strlen(path);
+    char *temporary = regions != NULL ? malloc(length + sizeof ".XXXXXX") : NULL;
+    int fd = -1;
+    if (temporary != NULL) {
+        memcpy(temporary, path, length);
+        memcpy(temporary + length, ".XXXXXX", sizeof ".XXXXXX");
+        fd = mkstemp(temporary);
+    }
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool written = file != NULL && fchmod(fd, 0644) == 0 &&
+                   write_image(file, &header, regions, ordered, entries);
+    if (file != NULL) {
+        written &= fclose(file) == 0;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (fd >= 0) {
+        written = written && rename(temporary, path) == 0;
+        if (!written) {
+            remove(temporary);
+        }
+    }
+    pthread_mutex_unlock(&native->lock);
+    free(temporary);
+    free(entries);
+    free(regions);
+    free(numbers);
+    free(ordered);
+    free(mapped);
+    return written;
+}
+
+void jit_enter(ExecutionContext *context)
+{
+    const NativeEntry *entry =
+        &context->ml->module->native->entries[context->program_counter - 1];
+    word pc = entry->enter(context, entry->address);
+    if (pc < 0) {
+        // Leave the program counter after the instruction, as the interpreter
+        // does when an instruction fails.
+        context->program_counter = ~pc + 1;
+        execution_error(context, "zero divide");
+        return;
+    }
+    context->program_counter = pc;
+}
+
+void jit_free(Module *module)
+{
+    NativeCode *native = module->native;
+    if (native == NULL) {
+        return;
+    }
+    for (Region *region = native->regions, *next; region != NULL; region = next) {
+        next = region->next;
+        munmap(region->code, region->size);
+        free(region);
+    }
+    pthread_mutex_destroy(&native->lock);
+    free(native->calls);
+    free(native->entries);
+    free(native);
+    module->native = NULL;
+}
@@ -0,0 +1,1400 @@
+#define _DEFAULT_SOURCE // st_mtim
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "instructions.h"
+#include "module.h"
+#include "str.h"
+#if DIS_JIT
+#include "jit.h"
+#endif
+#if DIS_PROFILE
+#include "profile.h"
+#endif
+
+// Types of the items in the data section, from the top four bits of the
+// item's first byte.
+#define DEFZ  0 // end of the data section
+#define DEFB  1 // bytes
+#define DEFW  2 // words
+#define DEFS  3 // UTF-8 string
+#define DEFF  4 // reals
+#define DEFA  5 // array
+#define DIND  6 // set array address
+#define DAPOP 7 // restore address
+#define DEFL  8 // bigs
+
+static bool fusion = true;
+
+/// The serial number of the last module read.
+static _Atomic uint64_t serials;
+
+/// FNV-1a hash of a 0-terminated string, continuing from `seed`, or from the
+/// usual offset basis if it is 0.
+static uptr hash_string(const char *string, uint64_t seed)
+{
+    uint64_t h = seed ? seed : 0xCBF29CE484222325;
+    for (const byte *p = (const byte *) string; *p != 0; p++) {
+        h = (h ^ *p) * 0x100000001B3;
+    }
+    return (uptr) h;
+}
+
+/// Hash an export's name and signature.
+static uptr hash_export(const char *name, word sig)
+{
+    return hash_string(name, 0xCBF29CE484222325 ^ (uint32_t) sig);
+}
+
+uint64_t module_hash(const byte *image, uptr size)
+{
+    uint64_t h = 0xCBF29CE484222325 ^ size;
+    uptr i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, image + i, sizeof v);
+        h = (h ^ v) * 0x9E3779B97F4A7C15;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ image[i]) * 0x100000001B3;
+    }
+    return h ^ h >> 32;
+}
+
+void module_set_fusion(bool enabled)
+{
+    fusion = enabled;
+}
+
+/// The linkage records a linkage descriptor was resolved to, followed by a
+/// copy of the descriptor. Each module that imports from a module brings its
+/// own descriptor, so there is one of these for each importer, however many
+/// times it is loaded.
+typedef struct LinkageCache {
+    struct LinkageCache *next;
+    /// Size of the descriptor in bytes.
+    uptr size;
+    word nlinks;
+    Link links[];
+} LinkageCache;
+
+/// A cursor over an object file being decoded. Reading past the end sets
+/// `error`; every later read returns zero, so callers only need to check for
+/// an error once per section.
+typedef struct Reader {
+    const byte *p;
+    const byte *end;
+    const char *error;
+} Reader;
+
+static bool available(Reader *reader, uptr n)
+{
+    if (reader->error != NULL) {
+        return false;
+    }
+    if ((uptr) (reader->end - reader->p) < n) {
+        reader->error = "truncated object file";
+        return false;
+    }
+    return true;
+}
+
+static byte read_byte(Reader *reader)
+{
+    if (!available(reader, 1)) {
+        return 0;
+    }
+    return *reader->p++;
+}
+
+/// Read a variable-length operand.
+///
+/// The top two bits of the first byte give the length of the encoding: `0x`
+/// is a 7-bit value in one byte, `10` a 14-bit value in two bytes and `11` a
+/// 30-bit value in four bytes. All values are signed and big-endian.
+static word read_operand(Reader *reader)
+{
+    if (!available(reader, 1)) {
+        return 0;
+    }
+    const byte *p = reader->p;
+    word c = p[0];
+    switch (c & 0xC0) {
+        case 0x00:
+            reader->p += 1;
+            return c;
+        case 0x40:
+            reader->p += 1;
+            return c | ~0x7F;
+        case 0x80:
+            if (!available(reader, 2)) {
+                return 0;
+            }
+            reader->p += 2;
+            c = c & 0x20 ? c | ~0x3F : c & 0x3F;
+            return (word) ((uint32_t) c << 8 | p[1]);
+        default:
+            if (!available(reader, 4)) {
+                return 0;
+            }
+            reader->p += 4;
+            c = c & 0x20 ? c | ~0x3F : c & 0x3F;
+            return (word) ((uint32_t) c << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+    }
+}
+
+/// Read a 4-byte big-endian word.
+static word read_word(Reader *reader)
+{
+    if (!available(reader, 4)) {
+        return 0;
+    }
+    const byte *p = reader->p;
+    reader->p += 4;
+    return (word) ((uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+}
+
+/// Read an 8-byte big-endian value.
+static uint64_t read_big(Reader *reader)
+{
+    uint64_t high = (uint32_t) read_word(reader);
+    return high << 32 | (uint32_t) read_word(reader);
+}
+
+/// Read a 0-terminated string and return a copy of it.
+static char *read_string(Reader *reader)
+{
+    if (!available(reader, 1)) {
+        return NULL;
+    }
+    const byte *nul = memchr(reader->p, 0, reader->end - reader->p);
+    if (nul == NULL) {
+        reader->error = "unterminated string";
+        return NULL;
+    }
+    uptr length = nul - reader->p;
+    char *string = malloc(length + 1);
+    if (string == NULL) {
+        reader->error = "out of memory";
+        return NULL;
+    }
+    memcpy(string, reader->p, length + 1);
+    reader->p = nul + 1;
+    return string;
+}
+
+static void decode_operand(Reader *reader, byte mode, Operand *operand)
+{
+    operand->mode = mode;
+    operand->offset = 0;
+    operand->indirect = 0;
+    switch (mode) {
+        case AMP:
+        case AFP:
+        case AIMM:
+            operand->offset = read_operand(reader);
+            break;
+        case AXXX:
+            break;
+        case AIND | AMP:
+        case AIND | AFP:
+            operand->offset = read_operand(reader);
+            operand->indirect = read_operand(reader);
+            break;
+        default:
+            reader->error = "invalid addressing mode";
+            break;
+    }
+}
+
+/// Whether an instruction's destination operand is an immediate program
+/// counter that must lie within the module's code.
+static bool is_branch(byte opcode)
+{
+    return opcode == IN_JMP || opcode == IN_CALL || opcode == IN_SPAWN ||
+           (opcode >= IN_BEQB && opcode <= IN_BGEC) ||
+           (opcode >= IN_BNEL && opcode <= IN_BEQL);
+}
+
+static void decode_instruction(Reader *reader, Inst *inst)
+{
+    inst->opcode = read_byte(reader);
+    byte mode = read_byte(reader);
+    if (reader->error == NULL && inst->opcode > IN_NEWAZ) {
+        reader->error = "invalid opcode";
+        return;
+    }
+
+    // Middle operands are always small, so only three modes exist for them;
+    // resolve those to the equivalent source/destination modes.
+    switch (mode & AXMASK) {
+        case AXIMM:
+            decode_operand(reader, AIMM, &inst->m);
+            break;
+        case AXINF:
+            decode_operand(reader, AFP, &inst->m);
+            break;
+        case AXINM:
+            decode_operand(reader, AMP, &inst->m);
+            break;
+        default:
+            break;
+    }
+    decode_operand(reader, (mode >> 3) & AMASK, &inst->s);
+    decode_operand(reader, mode & AMASK, &inst->d);
+    // Two-operand forms of three-operand instructions use the destination as
+    // the middle operand: `addw s, d` is `addw s, d, d`.
+    if ((mode & AXMASK) == AXNON) {
+        inst->m = inst->d;
+    }
+    inst->handler = execution_handler(inst->opcode);
+}
+
+/// Check the operands of decoded instructions that refer to other parts of
+/// the module, so that the interpreter can use them unchecked.
+static const char *verify_instruction(const Module *module, const Inst *inst)
+{
+    if (is_branch(inst->opcode)) {
+        if (inst->d.mode != AIMM || inst->d.offset < 0 ||
+            inst->d.offset >= module->ninstructions) {
+            return "invalid branch target";
+        }
+    }
+
+    const Operand *type = NULL;
+    switch (inst->opcode) {
+        case IN_FRAME:
+        case IN_NEW:
+        case IN_NEWZ:
+        case IN_NEWCMP:
+            type = &inst->s;
+            break;
+        case IN_NEWA:
+        case IN_NEWAZ:
+        case IN_CONSMP:
+        case IN_HEADMP:
+        case IN_MOVMP:
+            type = &inst->m;
+            break;
+        default:
+            break;
+    }
+    if (type != NULL && type->mode == AIMM &&
+        (type->offset < 0 || type->offset >= module->ntypes ||
+         module->types[type->offset] == NULL)) {
+        return "invalid type descriptor";
+    }
+    return NULL;
+}
+
+static void decode_types(Reader *reader, Module *module)
+{
+    for (word i = 0; i < module->ntypes && reader->error == NULL; i++) {
+        word number = read_operand(reader);
+        word size = read_operand(reader);
+        word np = read_operand(reader);
+        if (reader->error != NULL) {
+            return;
+        }
+        if (number < 0 || number >= module->ntypes ||
+            module->types[number] != NULL || size < 0 || np < 0 ||
+            !available(reader, np)) {
+            reader->error = reader->error ? reader->error : "invalid type";
+            return;
+        }
+        // Pointers the map marks past the end of an object would be retained
+        // and released in memory that is not the object's, and in arrays of
+        // objects whose size is not a multiple of a pointer's they would not
+        // be aligned.
+        bool pointers = false;
+        for (uptr b = 0; b < (uptr) np * 8; b++) {
+            if (reader->p[b / 8] & (0x80 >> b % 8)) {
+                pointers = true;
+                if (b >= (uptr) size / sizeof(pointer)) {
+                    reader->error = "invalid type";
+                    return;
+                }
+            }
+        }
+        if (pointers && size % sizeof(pointer) != 0) {
+            reader->error = "invalid type";
+            return;
+        }
+        TypeDescriptor *t = malloc(sizeof(TypeDescriptor) + np);
+        if (t == NULL) {
+            reader->error = "out of memory";
+            return;
+        }
+        t->size = size;
+        t->np = np;
+        atomic_init(&t->references, 1);
+        memcpy(t->map, reader->p, np);
+        reader->p += np;
+        module->types[number] = t;
+    }
+}
+
+/// The most arrays in the module data that items can be put in at once.
+#define DATA_DEPTH 32
+
+/// Memory that the items of the data section are put in: the module data, or
+/// the elements of an array in it, from the one a `DIND` item chose to the
+/// end.
+typedef struct DataBase {
+    byte *p;
+    /// The number of bytes from `p` on.
+    uptr size;
+    /// The type of the memory, which repeats every `t->size` bytes, or `NULL`
+    /// if it has no pointers.
+    const TypeDescriptor *t;
+} DataBase;
+
+/// Whether `offset` bytes into a base is a pointer slot.
+static bool pointer_slot(const DataBase *base, word offset)
+{
+    const TypeDescriptor *t = base->t;
+    if (offset < 0 || (uptr) offset + sizeof(pointer) > base->size || t == NULL ||
+        t->size <= 0) {
+        return false;
+    }
+    word within = offset % t->size;
+    word slot = within / (word) sizeof(pointer);
+    return within % sizeof(pointer) == 0 && within + (word) sizeof(pointer) <= t->size &&
+           slot / 8 < t->np && t->map[slot / 8] & 0x80 >> slot % 8;
+}
+
+/// Whether `length` bytes from `offset` into a base overlap no pointer slot,
+/// so that values other than pointers can be put there.
+static bool pointer_free(const DataBase *base, word offset, uptr length)
+{
+    uptr first = (uptr) offset & ~(sizeof(pointer) - 1);
+    for (uptr o = first; o < (uptr) offset + length; o += sizeof(pointer)) {
+        if (pointer_slot(base, (word) o)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Decode a string literal, which is interned, into a pointer slot.
+static void decode_string(Reader *reader, const DataBase *base, word size, word offset)
+{
+    if (size < 0 || !pointer_slot(base, offset)) {
+        reader->error = "invalid string item";
+        return;
+    }
+    if (!available(reader, size)) {
+        return;
+    }
+    String *s = string_intern((const char *) reader->p, size);
+    if (s == NULL) {
+        reader->error = "out of memory";
+        return;
+    }
+    String **p = (String **) (base->p + offset);
+    heap_release(*p);
+    *p = s;
+    reader->p += size;
+}
+
+/// Decode an array, whose elements are zero until items are put in them, into
+/// a pointer slot.
+static void decode_array(Reader *reader, Module *module, const DataBase *base,
+                         word offset)
+{
+    word type = read_word(reader);
+    word len = read_word(reader);
+    if (reader->error != NULL) {
+        return;
+    }
+    if (!pointer_slot(base, offset) || type < 0 || type >= module->ntypes ||
+        module->types[type] == NULL || len < 0) {
+        reader->error = "invalid array item";
+        return;
+    }
+    Array *a = heap_array(module->types[type], len);
+    if (a == NULL) {
+        reader->error = "out of memory";
+        return;
+    }
+    Array **p = (Array **) (base->p + offset);
+    heap_release(*p);
+    *p = a;
+}
+
+/// Decode the data section into the module data. Items are put in the module
+/// data until a `DIND` item says to put them in an array's elements, from a
+/// given one on, and a `DAPOP` item goes back to where they were put before.
+static void decode_data(Reader *reader, Module *module)
+{
+    DataBase bases[DATA_DEPTH];
+    word depth = 0;
+    bases[0] = (DataBase) {
+        .p = module->data,
+        .size = (uptr) module->data_size,
+        .t = module->data_type,
+    };
+    for (;;) {
+        byte item = read_byte(reader);
+        if (reader->error != NULL || item >> 4 == DEFZ) {
+            return;
+        }
+        word count = item & 0x0F;
+        if (count == 0) {
+            count = read_operand(reader);
+        }
+        word offset = read_operand(reader);
+        const DataBase *base = &bases[depth];
+
+        uptr width;
+        switch (item >> 4) {
+            case DEFS:
+                decode_string(reader, base, count, offset);
+                continue;
+            case DEFA:
+                decode_array(reader, module, base, offset);
+                continue;
+            case DIND: {
+                word index = read_word(reader);
+                if (reader->error != NULL) {
+                    return;
+                }
+                Array *a = pointer_slot(base, offset) ? *(Array **) (base->p + offset) : H;
+                if (a == H || heap_header(a)->kind != HEAP_ARRAY || index < 0 ||
+                    index > a->len || depth == DATA_DEPTH - 1) {
+                    reader->error = "invalid array index";
+                    return;
+                }
+                uptr size = (uptr) a->t->size;
+                bases[++depth] = (DataBase) {
+                    .p = a->data + (uptr) index * size,
+                    .size = (uptr) (a->len - index) * size,
+                    .t = type_has_pointers(a->t) ? a->t : NULL,
+                };
+                continue;
+            }
+            case DAPOP:
+                if (depth == 0) {
+                    reader->error = "invalid data item";
+                    return;
+                }
+                depth--;
+                continue;
+            case DEFB:
+                width = 1;
+                break;
+            case DEFW:
+                width = sizeof(word);
+                break;
+            case DEFF:
+                width = sizeof(real);
+                break;
+            case DEFL:
+                width = sizeof(big);
+                break;
+            default:
+                reader->error = "invalid data item";
+                return;
+        }
+        if (count < 0 || offset < 0 || (uptr) offset + count * width > base->size ||
+            !pointer_free(base, offset, count * width)) {
+            reader->error = "data item out of range";
+            return;
+        }
+
+        byte *p = base->p + offset;
+        for (word i = 0; i < count; i++, p += width) {
+            switch (item >> 4) {
+                case DEFB: {
+                    byte b = read_byte(reader);
+                    memcpy(p, &b, width);
+                    break;
+                }
+                case DEFW: {
+                    word w = read_word(reader);
+                    memcpy(p, &w, width);
+                    break;
+                }
+                default: {
+                    // Reals are stored in canonical big-endian IEEE format,
+                    // so share the reading of bigs.
+                    uint64_t v = read_big(reader);
+                    memcpy(p, &v, width);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void decode_exports(Reader *reader, Module *module, word nexports)
+{
+    module->exports = calloc(nexports, sizeof(Export));
+    if (module->exports == NULL && nexports > 0) {
+        reader->error = "out of memory";
+        return;
+    }
+    for (word i = 0; i < nexports && reader->error == NULL; i++) {
+        Export *e = &module->exports[i];
+        e->pc = read_operand(reader);
+        word type = read_operand(reader);
+        e->sig = read_word(reader);
+        e->name = read_string(reader);
+        module->nexports = i + 1;
+        if (reader->error != NULL) {
+            return;
+        }
+        if (e->pc < 0 || e->pc >= module->ninstructions || type < -1 ||
+            type >= module->ntypes) {
+            reader->error = "invalid export";
+            return;
+        }
+        e->frame = type >= 0 ? module->types[type] : NULL;
+    }
+}
+
+/// Build the hash table of a module's exports. Slots are probed linearly, so
+/// of two exports with the same name and signature the first is found, as it
+/// would be by a search of `exports`.
+///
+/// \return `false` if there is no memory for the table.
+static bool index_exports(Module *module)
+{
+    uptr slots = 8;
+    while (slots < (uptr) module->nexports * 2) {
+        slots *= 2;
+    }
+    module->export_index = malloc(slots * sizeof(word));
+    if (module->export_index == NULL) {
+        return false;
+    }
+    module->export_mask = slots - 1;
+    for (uptr i = 0; i < slots; i++) {
+        module->export_index[i] = -1;
+    }
+    for (word i = 0; i < module->nexports; i++) {
+        const Export *e = &module->exports[i];
+        uptr slot = hash_export(e->name, e->sig) & module->export_mask;
+        while (module->export_index[slot] >= 0) {
+            slot = (slot + 1) & module->export_mask;
+        }
+        module->export_index[slot] = i;
+    }
+    return true;
+}
+
+/// Decode a module's code, which starts where `reader` is in the object file
+/// `image`, and prepare it to be run.
+///
+/// \return A description of the problem if the code is invalid, or `NULL`.
+static const char *decode_code(Reader *reader, Module *module,
+                               const byte *image, uptr size)
+{
+    // Decoding reads most of the file, so hashing it costs little more.
+    module->hash = module_hash(image, size);
+    word code_size = module->ninstructions;
+    Inst *code = calloc(code_size + 1, sizeof(Inst));
+    if (code == NULL) {
+        reader->error = "out of memory";
+        return reader->error;
+    }
+    for (word i = 0; i < code_size && reader->error == NULL; i++) {
+        decode_instruction(reader, &code[i]);
+    }
+    code[code_size].opcode = IN_XEND;
+    code[code_size].handler = execution_handler(IN_XEND);
+
+    module->code = code;
+    for (word i = 0; i < code_size && reader->error == NULL; i++) {
+        reader->error = verify_instruction(module, &code[i]);
+    }
+    if (reader->error != NULL) {
+        module->code = NULL;
+        free(code);
+        return reader->error;
+    }
+
+    for (word i = 0; i < code_size; i++) {
+        if (code[i].opcode == IN_MCALL) {
+            module->call_caches = calloc(code_size, sizeof(CallCache));
+            if (module->call_caches == NULL) {
+                module->code = NULL;
+                free(code);
+                reader->error = "out of memory";
+                return reader->error;
+            }
+            break;
+        }
+    }
+
+    if (fusion) {
+        module_compile_cases(module);
+        module_fuse(module);
+    }
+    module->quicken = fusion;
+#if DIS_JIT
+    jit_prepare(module);
+#endif
+    return NULL;
+}
+
+/// Step over an operand without decoding it.
+static void skip_operand(Reader *reader)
+{
+    if (!available(reader, 1)) {
+        return;
+    }
+    byte c = reader->p[0];
+    uptr length = c < 0x80 ? 1 : c < 0xC0 ? 2 : 4;
+    if (available(reader, length)) {
+        reader->p += length;
+    }
+}
+
+static void skip_operands(Reader *reader, byte mode)
+{
+    switch (mode) {
+        case AIND | AMP:
+        case AIND | AFP:
+            skip_operand(reader);
+            // fall through
+        case AMP:
+        case AFP:
+        case AIMM:
+            skip_operand(reader);
+            break;
+        case AXXX:
+            break;
+        default:
+            reader->error = "invalid addressing mode";
+            break;
+    }
+}
+
+/// Step over an instruction, checking only as much as is needed to find the
+/// next one.
+static void skip_instruction(Reader *reader)
+{
+    read_byte(reader);
+    byte mode = read_byte(reader);
+    if ((mode & AXMASK) != AXNON) {
+        skip_operand(reader);
+    }
+    skip_operands(reader, (mode >> 3) & AMASK);
+    skip_operands(reader, mode & AMASK);
+}
+
+/// Decode everything but the code of a module, whose code is then decoded
+/// straight away if `lazy` is false, or by `module_code()` otherwise.
+static Module *parse(const byte *image, uptr size, const char *path, bool lazy,
+                     const char **error)
+{
+    Reader reader = {.p = image, .end = image + size};
+
+    word magic = read_operand(&reader);
+    if (magic == SMAGIC) {
+        word length = read_operand(&reader);
+        if (length < 0 || !available(&reader, length)) {
+            reader.error = reader.error ? reader.error : "invalid signature";
+        } else {
+            reader.p += length;
+        }
+    } else if (reader.error == NULL && magic != XMAGIC) {
+        reader.error = "bad magic number";
+    }
+
+    word flags = read_operand(&reader);
+    word stack_extent = read_operand(&reader);
+    word code_size = read_operand(&reader);
+    word data_size = read_operand(&reader);
+    word type_size = read_operand(&reader);
+    word link_size = read_operand(&reader);
+    word entry_pc = read_operand(&reader);
+    word entry_type = read_operand(&reader);
+    // Every instruction, type and export takes at least a byte of the file,
+    // so no more of them can be in it than there are bytes left.
+    uptr left = reader.end - reader.p;
+    if (reader.error == NULL &&
+        (code_size < 0 || data_size < 0 || type_size < 0 || link_size < 0 ||
+         (uptr) code_size > left || (uptr) type_size > left ||
+         (uptr) link_size > left)) {
+        reader.error = "invalid header";
+    }
+    if (reader.error != NULL) {
+        if (error != NULL) {
+            *error = reader.error;
+        }
+        return NULL;
+    }
+
+    Module *module = calloc(1, sizeof(Module));
+    if (module == NULL) {
+        if (error != NULL) {
+            *error = "out of memory";
+        }
+        return NULL;
+    }
+    module->path = strdup(path);
+    module->flags = flags;
+    module->stack_extent = stack_extent;
+    module->ninstructions = code_size;
+    module->ntypes = type_size;
+    module->data_size = data_size;
+    module->entry_pc = -1;
+    module->image_fd = -1;
+    module->serial = atomic_fetch_add_explicit(&serials, 1, memory_order_relaxed) + 1;
+    pthread_mutex_init(&module->lock, NULL);
+
+    // The sections have no sizes, so the code has to be stepped over to find
+    // the types and data that follow it.
+    module->code_offset = reader.p - image;
+    for (word i = 0; i < code_size && reader.error == NULL; i++) {
+        skip_instruction(&reader);
+    }
+
+    module->types = calloc(type_size, sizeof(TypeDescriptor *));
+    if (module->path == NULL || (module->types == NULL && type_size > 0)) {
+        reader.error = reader.error ? reader.error : "out of memory";
+    }
+    decode_types(&reader, module);
+    // The compiler describes the module data with the first type, which is
+    // how the heap finds the pointers in it.
+    if (reader.error == NULL && type_size > 0 && module->types[0] != NULL &&
+        module->types[0]->size == data_size) {
+        module->data_type = module->types[0];
+    }
+    module->data = calloc(data_size, 1);
+    if (module->data == NULL && data_size > 0) {
+        reader.error = reader.error ? reader.error : "out of memory";
+    }
+    decode_data(&reader, module);
+    module->name = read_string(&reader);
+    decode_exports(&reader, module, link_size);
+    if (reader.error == NULL && !index_exports(module)) {
+        reader.error = "out of memory";
+    }
+    // Import and exception handler sections follow for modules with
+    // `HASLDT` or `HASEXCEPT` set; nothing uses them yet.
+
+    if (reader.error == NULL && entry_pc >= 0) {
+        if (entry_pc >= code_size || entry_type < 0 ||
+            entry_type >= type_size || module->types[entry_type] == NULL) {
+            reader.error = "invalid entry point";
+        } else {
+            module->entry_pc = entry_pc;
+            module->entry_type = module->types[entry_type];
+        }
+    }
+
+    if (reader.error == NULL && !lazy) {
+        reader.p = image + module->code_offset;
+        decode_code(&reader, module, image, size);
+        atomic_init(&module->decoded, true);
+    }
+
+    if (reader.error != NULL) {
+        if (error != NULL) {
+            *error = reader.error;
+        }
+        module_free(module);
+        return NULL;
+    }
+    return module;
+}
+
+Module *module_decode(const byte *image, uptr size, const char *path,
+                      const char **error)
+{
+    return parse(image, size, path, false, error);
+}
+
+/// Map an object file into memory and read a module from it. The module
+/// keeps `fd` until its code has been decoded; it is closed on failure.
+static Module *map_module(int fd, const struct stat *st, const char *path,
+                          const char **error)
+{
+    uptr size = st->st_size;
+    void *image = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                           : MAP_FAILED;
+    if (image == MAP_FAILED) {
+        close(fd);
+        if (error != NULL) {
+            *error = "cannot read object file";
+        }
+        return NULL;
+    }
+    Module *module = parse(image, size, path, true, error);
+    munmap(image, size);
+    if (module == NULL) {
+        close(fd);
+        return NULL;
+    }
+    module->image_fd = fd;
+    module->image_stat = *st;
+    return module;
+}
+
+/// Whether an object file is still as it was when a module was read from it.
+static bool image_unchanged(const Module *module)
+{
+    const struct stat *old = &module->image_stat;
+    struct stat st;
+    return fstat(module->image_fd, &st) == 0 &&
+           st.st_mtim.tv_sec == old->st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == old->st_mtim.tv_nsec &&
+           st.st_size == old->st_size && st.st_dev == old->st_dev &&
+           st.st_ino == old->st_ino;
+}
+
+/// Read the object file a module was read from into memory of its own, to
+/// decode the code from. The code is not decoded from a mapping, whose pages
+/// come from the file as it is when they are first touched: code from a file
+/// rewritten in place since would not match the rest of the module, and a
+/// file truncated while it was decoded would fault.
+///
+/// \return The contents of the file, or `NULL` if they are not those the
+/// module was read from or there is no memory for them, having set
+/// `module->code_error`.
+static byte *read_image(Module *module)
+{
+    if (!image_unchanged(module)) {
+        module->code_error = "object file changed";
+        return NULL;
+    }
+    uptr size = (uptr) module->image_stat.st_size;
+    byte *image = malloc(size);
+    if (image == NULL) {
+        module->code_error = "out of memory";
+        return NULL;
+    }
+    uptr done = 0;
+    while (done < size) {
+        ssize_t n = pread(module->image_fd, image + done, size - done, (off_t) done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    // A change made while the file was read shows in its modification time.
+    if (done != size || !image_unchanged(module)) {
+        free(image);
+        module->code_error = "object file changed";
+        return NULL;
+    }
+    return image;
+}
+
+/// Open an object file and find out what is needed to map it and to tell
+/// whether it has changed.
+static int open_module(const char *path, struct stat *st, const char **error)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (error != NULL) {
+            *error = "cannot open object file";
+        }
+        return -1;
+    }
+    if (fstat(fd, st) != 0) {
+        close(fd);
+        if (error != NULL) {
+            *error = "cannot read object file";
+        }
+        return -1;
+    }
+    return fd;
+}
+
+Module *module_read(const char *path, const char **error)
+{
+    struct stat st;
+    int fd = open_module(path, &st, error);
+    if (fd < 0) {
+        return NULL;
+    }
+    return map_module(fd, &st, path, error);
+}
+
+Inst *module_code(Module *module)
+{
+    if (atomic_load_explicit(&module->decoded, memory_order_acquire)) {
+        return module->code;
+    }
+    pthread_mutex_lock(&module->lock);
+    if (!atomic_load_explicit(&module->decoded, memory_order_relaxed)) {
+        uptr size = (uptr) module->image_stat.st_size;
+        byte *image = read_image(module);
+        if (image != NULL) {
+            Reader reader = {.p = image + module->code_offset, .end = image + size};
+            module->code_error = decode_code(&reader, module, image, size);
+            free(image);
+        }
+        close(module->image_fd);
+        module->image_fd = -1;
+        atomic_store_explicit(&module->decoded, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&module->lock);
+    return module->code;
+}
+
+void module_free(Module *module)
+{
+#if DIS_JIT
+    jit_free(module);
+#endif
+#if DIS_PROFILE
+    profile_module_free(module);
+#endif
+    if (module->image_fd >= 0) {
+        close(module->image_fd);
+    }
+    pthread_mutex_destroy(&module->lock);
+    free(module->name);
+    free(module->path);
+    free(module->code);
+    free(module->call_caches);
+    for (word i = 0; i < module->ncases; i++) {
+        CaseTable *table = &module->cases[i];
+        if (table->keys != NULL) {
+            for (uint32_t slot = 0; slot <= UINT32_MAX >> table->shift; slot++) {
+                heap_release(table->keys[slot]);
+            }
+        }
+        free(table->keys);
+        free(table->displacements);
+        free(table->pcs);
+    }
+    free(module->cases);
+    if (module->data_type != NULL) {
+        if (module->shared_mp != NULL) {
+            heap_clear(module->shared_mp, module->data_type);
+        }
+        if (module->data != NULL) {
+            heap_clear(module->data, module->data_type);
+        }
+    }
+    if (module->types != NULL) {
+        for (word i = 0; i < module->ntypes; i++) {
+            if (module->types[i] != NULL) {
+                type_release(module->types[i]);
+            }
+        }
+    }
+    free(module->types);
+    free(module->data);
+    for (word i = 0; i < module->nexports; i++) {
+        free(module->exports[i].name);
+    }
+    free(module->exports);
+    free(module->export_index);
+    for (LinkageCache *c = atomic_load_explicit(&module->linkages, memory_order_relaxed), *next;
+         c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(module->shared_mp);
+    free(module);
+}
+
+/// Step to the entry of a linkage descriptor following `entry`. Each entry is
+/// a signature followed by a 0-terminated name, padded to a word boundary.
+static const byte *next_linkage_entry(const byte *entry)
+{
+    const char *name = (const char *) entry + sizeof(int);
+    uptr end = (uptr) (name + strlen(name) + 1);
+    return (const byte *) ((end + sizeof(int) - 1) & ~(sizeof(int) - 1));
+}
+
+static const Export *find_export(const Module *module, const char *name,
+                                 word sig)
+{
+    if (module->export_index == NULL) {
+        return NULL;
+    }
+    uptr slot = hash_export(name, sig) & module->export_mask;
+    for (word i; (i = module->export_index[slot]) >= 0;
+         slot = (slot + 1) & module->export_mask) {
+        const Export *e = &module->exports[i];
+        if (e->sig == sig && strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/// Find the export each entry of a linkage descriptor names.
+///
+/// \param links Where to store the linkage records.
+/// \return Whether every entry matches an export by name and signature.
+static bool resolve_linkage(const Module *module, const LinkageDescriptor *linkage,
+                            Link *links)
+{
+    const byte *entry = (const byte *) linkage->entry;
+    for (word i = 0; i < linkage->nentries; i++) {
+        int sig;
+        memcpy(&sig, entry, sizeof sig);
+        const Export *e = find_export(module, (const char *) entry + sizeof sig,
+                                      sig);
+        if (e == NULL) {
+            return false;
+        }
+        links[i] = (Link) {.pc = e->pc, .frame = e->frame};
+        entry = next_linkage_entry(entry);
+    }
+    return true;
+}
+
+static const byte *cached_descriptor(const LinkageCache *c)
+{
+    return (const byte *) (c->links + c->nlinks);
+}
+
+/// Find the linkage records for a linkage descriptor, resolving it and
+/// remembering the result the first time it is seen. Cached records are
+/// never removed until the module is freed, so they are read without a lock.
+///
+/// \param error Where to store why the linkage cannot be resolved.
+/// \return The linkage records, or `NULL` if an entry of `linkage` does not
+/// match an export or there is no memory for the records.
+static const Link *module_linkage(Module *module, const LinkageDescriptor *linkage,
+                                  const char **error)
+{
+    const byte *entry = (const byte *) linkage->entry;
+    for (word i = 0; i < linkage->nentries; i++) {
+        entry = next_linkage_entry(entry);
+    }
+    uptr size = entry - (const byte *) linkage;
+
+    LinkageCache *head = atomic_load_explicit(&module->linkages, memory_order_acquire);
+    for (LinkageCache *c = head; c != NULL; c = c->next) {
+        if (c->size == size && memcmp(cached_descriptor(c), linkage, size) == 0) {
+            return c->links;
+        }
+    }
+
+    LinkageCache *c = malloc(sizeof(LinkageCache) +
+                             linkage->nentries * sizeof(Link) + size);
+    if (c == NULL) {
+        *error = "out of memory";
+        return NULL;
+    }
+    c->size = size;
+    c->nlinks = linkage->nentries;
+    if (!resolve_linkage(module, linkage, c->links)) {
+        free(c);
+        *error = "missing export";
+        return NULL;
+    }
+    memcpy(c->links + c->nlinks, linkage, size);
+    // Another thread may have added the same descriptor meanwhile, which
+    // wastes an entry but is otherwise harmless.
+    c->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&module->linkages, &c->next, c,
+                                                  memory_order_release,
+                                                  memory_order_acquire)) {
+    }
+    return c->links;
+}
+
+/// Make a copy of the initial module data, with references to the string
+/// literals in it.
+///
+/// \return The copy, or `NULL` if there is no memory for it.
+static byte *copy_data(const Module *module)
+{
+    byte *mp = malloc(module->data_size ? module->data_size : 1);
+    if (mp == NULL) {
+        return NULL;
+    }
+    memcpy(mp, module->data, module->data_size);
+    if (module->data_type != NULL) {
+        heap_retain_block(mp, module->data_type);
+    }
+    return mp;
+}
+
+/// Create a link to a module, as `module_link()` does.
+///
+/// \param error Where to store why the link cannot be made.
+static ModuleLink *link_module(Module *module, LinkageDescriptor *linkage,
+                               const char **error)
+{
+    // Resolve the linkage before allocating the link, so that a module that
+    // nothing links to is left for the caller to free.
+    word nlinks = linkage != NULL ? linkage->nentries : 0;
+    const Link *links = nlinks > 0 ? module_linkage(module, linkage, error) : NULL;
+    if (nlinks > 0 && links == NULL) {
+        return NULL;
+    }
+    ModuleLink *ml = module_link_records(module, nlinks, links);
+    if (ml == NULL) {
+        *error = "out of memory";
+    }
+    return ml;
+}
+
+ModuleLink *module_link(Module *module, LinkageDescriptor *linkage)
+{
+    const char *error;
+    return link_module(module, linkage, &error);
+}
+
+ModuleLink *module_link_records(Module *module, word nlinks, const Link *links)
+{
+    // The data is copied first, so that a link that cannot be made leaves
+    // nothing to undo but the copy.
+    bool shared = module->flags & SHAREMP;
+    byte *mp;
+    if (shared) {
+        // Cached modules can be linked to by several threads at once.
+        pthread_mutex_lock(&module->lock);
+        if (module->shared_mp == NULL) {
+            module->shared_mp = copy_data(module);
+        }
+        mp = module->shared_mp;
+        pthread_mutex_unlock(&module->lock);
+    } else {
+        mp = copy_data(module);
+    }
+    if (mp == NULL) {
+        return NULL;
+    }
+
+    // Shared module data belongs to the module, so the link has no pointers
+    // of its own.
+    ModuleLink *ml = heap_alloc(HEAP_MODULE, shared ? NULL : module->data_type,
+                                sizeof(ModuleLink) + nlinks * sizeof(Link));
+    if (ml == NULL) {
+        if (!shared) {
+            if (module->data_type != NULL) {
+                heap_clear(mp, module->data_type);
+            }
+            free(mp);
+        }
+        return NULL;
+    }
+    ml->module = module;
+    ml->nlinks = nlinks;
+    if (nlinks > 0) {
+        memcpy(ml->links, links, nlinks * sizeof(Link));
+    }
+    ml->mp = mp;
+    atomic_fetch_add_explicit(&module->references, 1, memory_order_relaxed);
+    return ml;
+}
+
+void module_unlink(ModuleLink *ml)
+{
+    heap_release(ml);
+}
+
+void module_retain(Module *module)
+{
+    atomic_fetch_add_explicit(&module->references, 1, memory_order_relaxed);
+}
+
+void module_release(Module *module)
+{
+    if (atomic_fetch_sub_explicit(&module->references, 1, memory_order_acq_rel) == 1) {
+        module_free(module);
+    }
+}
+
+void module_link_destroy(ModuleLink *ml)
+{
+    Module *module = ml->module;
+    if (ml->mp != module->shared_mp) {
+        free(ml->mp);
+    }
+    module_release(module);
+}
+
+/// A module in the module cache, with what identifies the version of the
+/// object file it was read from.
+typedef struct CacheEntry {
+    struct CacheEntry *next;
+    uptr hash;
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    Module *module;
+} CacheEntry;
+
+/// Modules read by `module_load()`, in a hash table of chains keyed by path.
+/// Each holds a reference to its module.
+static struct {
+    pthread_rwlock_t lock;
+    CacheEntry **buckets;
+    uptr nbuckets;
+    uptr count;
+} cache = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static CacheEntry *cache_find(const char *path, uptr hash)
+{
+    if (cache.nbuckets == 0) {
+        return NULL;
+    }
+    for (CacheEntry *e = cache.buckets[hash & (cache.nbuckets - 1)]; e != NULL;
+         e = e->next) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/// Whether a cache entry was read from the file as it is now.
+static bool cache_fresh(const CacheEntry *e, const struct stat *st)
+{
+    return e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec && e->size == st->st_size &&
+           e->dev == st->st_dev && e->ino == st->st_ino;
+}
+
+static void cache_set(CacheEntry *e, const struct stat *st, Module *module)
+{
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->module = module;
+    atomic_fetch_add_explicit(&module->references, 1, memory_order_relaxed);
+}
+
+/// Make room in the cache for one more entry.
+///
+/// \return `false` if there is no memory for it.
+static bool cache_reserve(void)
+{
+    if (cache.count >= cache.nbuckets) {
+        uptr nbuckets = cache.nbuckets ? cache.nbuckets * 2 : 16;
+        CacheEntry **buckets = calloc(nbuckets, sizeof(CacheEntry *));
+        if (buckets == NULL) {
+            // Chains in a full table only get longer.
+            return cache.nbuckets > 0;
+        }
+        for (uptr i = 0; i < cache.nbuckets; i++) {
+            for (CacheEntry *old = cache.buckets[i], *next; old != NULL; old = next) {
+                next = old->next;
+                old->next = buckets[old->hash & (nbuckets - 1)];
+                buckets[old->hash & (nbuckets - 1)] = old;
+            }
+        }
+        free(cache.buckets);
+        cache.buckets = buckets;
+        cache.nbuckets = nbuckets;
+    }
+    return true;
+}
+
+static void cache_insert(CacheEntry *e)
+{
+    CacheEntry **bucket = &cache.buckets[e->hash & (cache.nbuckets - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    cache.count++;
+}
+
+ModuleLink *module_load(const char *path, LinkageDescriptor *linkage,
+                        const char **error)
+{
+    struct stat st;
+    int fd = open_module(path, &st, error);
+    if (fd < 0) {
+        return NULL;
+    }
+    uptr hash = hash_string(path, 0);
+
+    // Links are made with the lock held, so that the module cannot be
+    // replaced and freed in between.
+    pthread_rwlock_rdlock(&cache.lock);
+    CacheEntry *e = cache_find(path, hash);
+    if (e != NULL && cache_fresh(e, &st)) {
+        close(fd);
+        const char *problem = NULL;
+        ModuleLink *ml = link_module(e->module, linkage, &problem);
+        pthread_rwlock_unlock(&cache.lock);
+        if (ml == NULL && error != NULL) {
+            *error = problem;
+        }
+        return ml;
+    }
+    pthread_rwlock_unlock(&cache.lock);
+
+    Module *module = map_module(fd, &st, path, error);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    Module *stale = NULL;
+    Module *uncached = NULL;
+    pthread_rwlock_wrlock(&cache.lock);
+    e = cache_find(path, hash);
+    if (e != NULL && cache_fresh(e, &st)) {
+        // Another thread read the same file first.
+        module_free(module);
+        module = e->module;
+    } else if (e != NULL) {
+        stale = e->module;
+        cache_set(e, &st, module);
+    } else {
+        e = malloc(sizeof(CacheEntry));
+        char *copy = strdup(path);
+        if (e != NULL && copy != NULL && cache_reserve()) {
+            e->hash = hash;
+            e->path = copy;
+            cache_set(e, &st, module);
+            cache_insert(e);
+        } else {
+            // The module is loaded all the same, but read again next time.
+            free(e);
+            free(copy);
+            uncached = module;
+        }
+    }
+    const char *problem = NULL;
+    ModuleLink *ml = link_module(module, linkage, &problem);
+    pthread_rwlock_unlock(&cache.lock);
+
+    // Links to the old version keep it until they go.
+    if (stale != NULL) {
+        module_release(stale);
+    }
+    if (ml == NULL && uncached != NULL) {
+        module_free(uncached);
+    }
+    if (ml == NULL && error != NULL) {
+        *error = problem;
+    }
+    return ml;
+}
+
+void module_cache_flush(void)
+{
+    pthread_rwlock_wrlock(&cache.lock);
+    CacheEntry **buckets = cache.buckets;
+    uptr nbuckets = cache.nbuckets;
+    cache.buckets = NULL;
+    cache.nbuckets = 0;
+    cache.count = 0;
+    pthread_rwlock_unlock(&cache.lock);
+
+    for (uptr i = 0; i < nbuckets; i++) {
+        for (CacheEntry *e = buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            module_release(e->module);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(buckets);
+}
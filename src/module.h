@@ -0,0 +1,328 @@
+#ifndef DIS_MODULE_H
+#define DIS_MODULE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "execution.h"
+
+#define XMAGIC 819248 // magic number of an unsigned object file
+#define SMAGIC 923426 // magic number of a signed object file
+
+// Runtime flags in the object file header.
+#define MUSTCOMPILE (1 << 0) // the module must be compiled to machine code
+#define DONTCOMPILE (1 << 1) // the module must not be compiled
+#define SHAREMP     (1 << 2) // every load of the module shares one `mp`
+#define DYNMOD      (1 << 3) // the module is dynamically loaded
+#define HASLDT0     (1 << 4) // obsolete
+#define HASEXCEPT   (1 << 5) // the object file has an exception handler section
+#define HASLDT      (1 << 6) // the object file has an import section
+
+/// Machine code compiled from a module by the JIT.
+typedef struct NativeCode NativeCode;
+
+/// A function exported by a module, from the object file's link section.
+typedef struct Export {
+    /// Entry point of the function.
+    word pc;
+    /// Type of the function's frame.
+    TypeDescriptor *frame;
+    /// MD5 hash of the function's type signature.
+    word sig;
+    /// UTF-8 encoded name, 0-terminated.
+    char *name;
+} Export;
+
+/// An inline cache for an `mcall` instruction: the entry point the call went
+/// to the last time it was made, and the module and linkage index it was
+/// resolved from. Threads update it under a sequence lock.
+typedef struct CallCache {
+    /// Even when the other fields are consistent, odd while they are being
+    /// written.
+    _Atomic uint32_t sequence;
+    /// The serial number of the module called, or 0 if none has been.
+    _Atomic uint64_t serial;
+    _Atomic word index;
+    _Atomic word pc;
+} CallCache;
+
+/// A `case` or `casec` table compiled by the loader into a form that finds
+/// the target of a value without searching.
+///
+/// A dense `case` table becomes a jump table, with an entry for every value
+/// from the lowest in the table to the highest. A `casec` table of single
+/// strings becomes a perfect hash table of them: each string's hash selects
+/// a bucket, whose displacement selects the one slot the string can be in.
+typedef struct CaseTable {
+    /// Where to go for values not in the table.
+    word default_pc;
+    /// Where to go for the empty string, which has no hash.
+    word empty_pc;
+    /// For a jump table, the value of the first entry and the number of
+    /// entries in `pcs`.
+    word low;
+    word size;
+    /// For a hash table, `buckets - 1`, the shift that scales a hash down to
+    /// a slot, the displacement of each bucket, and the string in each slot,
+    /// or `H`.
+    uint32_t bucket_mask;
+    uint32_t shift;
+    uint32_t *displacements;
+    String **keys;
+    /// The target of each entry or slot.
+    word *pcs;
+} CaseTable;
+
+/// Find the slot of a hash table compiled from a `casec` table that a
+/// string's hash leads to.
+///
+/// \param table The table.
+/// \param hash The hash of the string.
+/// \return The index of the slot.
+static inline uint32_t case_slot(const CaseTable *table, uint32_t hash)
+{
+    uint32_t displacement = table->displacements[hash & table->bucket_mask];
+    return (hash + displacement * 0x85EBCA77u) * 0x9E3779B1u >> table->shift;
+}
+
+/// A loaded module: the decoded contents of an object file, shared by every
+/// link to it.
+struct Module {
+    /// Name of the module from the object file.
+    char *name;
+    /// Path the module was loaded from.
+    char *path;
+    /// A number no other module read by the process has, unlike its address.
+    uint64_t serial;
+    /// A hash of the whole object file, set as the code is decoded, which a
+    /// compiled image of the module must match to be used.
+    uint64_t hash;
+    /// The runtime flags from the object file header.
+    word flags;
+    /// Number of bytes of stack the module's threads should be created with.
+    word stack_extent;
+    /// The number of instructions in `code`.
+    word ninstructions;
+    /// Decoded instructions, followed by a sentinel that stops the thread if
+    /// it runs off the end of the code. Only valid once `module_code()` has
+    /// returned them.
+    Inst *code;
+    /// Whether the code has been decoded, or found to be invalid, and the
+    /// lock held while decoding it.
+    _Atomic bool decoded;
+    pthread_mutex_t lock;
+    /// The object file, kept open until the code has been decoded from it,
+    /// or -1, what it looked like when it was read, and where in it the code
+    /// starts.
+    int image_fd;
+    struct stat image_stat;
+    uptr code_offset;
+    /// Why the code could not be decoded, if it could not.
+    const char *code_error;
+    /// The number of entries in `types`.
+    word ntypes;
+    TypeDescriptor **types;
+    /// Size of the module data in bytes.
+    word data_size;
+    /// The initial contents of the module data.
+    byte *data;
+    /// The number of entries in `exports`.
+    word nexports;
+    Export *exports;
+    /// Hash table of the exports, keyed by name and signature, with
+    /// `export_mask + 1` slots. Each slot is an index into `exports`, or -1
+    /// if it is empty.
+    word *export_index;
+    uptr export_mask;
+    /// Linkage descriptors already resolved against the module's exports,
+    /// most recently resolved first.
+    _Atomic(struct LinkageCache *) linkages;
+    /// Entry point of the module, or -1 if it has none.
+    word entry_pc;
+    /// Type of the entry point's frame.
+    TypeDescriptor *entry_type;
+    /// Module data shared by every link, if the module has `SHAREMP` set.
+    byte *shared_mp;
+    /// The type of the module data, or `NULL` if the module has no type
+    /// that describes it.
+    TypeDescriptor *data_type;
+    /// The number of module links referring to this module, plus one while
+    /// it is in the module cache.
+    _Atomic word references;
+    /// Call counts and compiled code, or `NULL` if the module is only ever
+    /// interpreted.
+    NativeCode *native;
+    /// An inline cache for each instruction, used by the `mcall`s among them,
+    /// or `NULL` if the module makes no `mcall`s.
+    CallCache *call_caches;
+    /// The tables of the `case` and `casec` instructions the loader
+    /// compiled, and the number of them.
+    CaseTable *cases;
+    word ncases;
+    /// Whether the interpreter may quicken the module's instructions as it
+    /// runs them, which it may if fusion was enabled when they were decoded.
+    bool quicken;
+#if DIS_PROFILE
+    /// What the profiler has counted in the module, or `NULL` if it has not
+    /// seen the module run.
+    _Atomic(struct ModuleProfile *) profile;
+#endif
+};
+
+/// An entry in a module link's array of linkage records.
+typedef struct Link {
+    /// Entry point of the function.
+    word pc;
+    /// Type of the function's frame.
+    TypeDescriptor *frame;
+} Link;
+
+/// A reference to a loaded module, as produced by `load()`: the module
+/// together with its data and the linkage records for the importing module's
+/// linkage descriptor. Module links are heap objects.
+struct ModuleLink {
+    Module *module;
+    /// Module data pointer.
+    byte *mp;
+    /// The number of entries in `links`.
+    word nlinks;
+    /// Linkage records, in the order of the linkage descriptor's entries.
+    Link links[];
+};
+
+/// Hash an object file, as `Module::hash` is.
+///
+/// \param image Contents of the object file.
+/// \param size Size of `image` in bytes.
+/// \return The hash.
+uint64_t module_hash(const byte *image, uptr size);
+
+/// Decode a module from a Dis object file held in memory.
+///
+/// \param image Contents of the object file.
+/// \param size Size of `image` in bytes.
+/// \param path Path the object file was read from.
+/// \param error Location to store a description of the problem in if the
+/// module cannot be decoded. May be `NULL`.
+/// \return The module, or `NULL` on failure.
+Module *module_decode(const byte *image, uptr size, const char *path,
+                      const char **error);
+
+/// Choose whether modules decoded from now on have common instruction pairs
+/// fused into superinstructions by `module_fuse()`, their case tables
+/// compiled by `module_compile_cases()`, and their instructions quickened as
+/// they run. All are enabled by default.
+///
+/// \param enabled Whether to rewrite instructions.
+void module_set_fusion(bool enabled);
+
+/// Replace common pairs of instructions in a decoded module with
+/// superinstructions, which execute both instructions with one dispatch.
+///
+/// \param module The module to rewrite.
+void module_fuse(Module *module);
+
+/// Find the instruction a superinstruction, a compiled case or a quickened
+/// instruction stands in for.
+///
+/// \param opcode An opcode from decoded code.
+/// \return The opcode of the first instruction of the pair `opcode` fuses,
+/// the `case` or `casec` it was compiled from, the instruction it was
+/// quickened from, or `opcode` itself if it is none of these. A quickened
+/// `newz` is taken for `new`, which does the same.
+byte module_unfused(byte opcode);
+
+/// Compile the tables of a decoded module's `case` and `casec` instructions
+/// whose shapes allow it, and whose targets are all instructions of the
+/// module, into `CaseTable`s, and rewrite those instructions to use them.
+/// Other tables are left to the binary search of the original instructions,
+/// which stops the thread if it finds a target outside the code.
+///
+/// \param module The module to rewrite. Its data must have been decoded.
+void module_compile_cases(Module *module);
+
+/// Read a module from a Dis object file.
+///
+/// The file is mapped into memory while its header, types, data and exports
+/// are decoded; the code is read again and decoded by `module_code()` when it
+/// is first called.
+///
+/// \param path Path to the object file.
+/// \param error Location to store a description of the problem in if the
+/// module cannot be read. May be `NULL`.
+/// \return The module, or `NULL` on failure.
+Module *module_read(const char *path, const char **error);
+
+/// Decode a module's code, if that has not been done yet.
+///
+/// \param module The module.
+/// \return The decoded instructions, or `NULL` if the code is invalid or the
+/// object file has changed since it was read, in which case
+/// `module->code_error` says why.
+Inst *module_code(Module *module);
+
+/// Load a module and link to it, as `load` does.
+///
+/// Modules read from files are kept in a cache, keyed by the file's path and
+/// modification time, so that loading a module again only links to it.
+///
+/// \param path Path to the object file.
+/// \param linkage The importing module's linkage descriptor, or `NULL`.
+/// \param error Location to store a description of the problem in if the
+/// module cannot be loaded. May be `NULL`.
+/// \return The module link, with one reference to it, or `NULL` on failure.
+ModuleLink *module_load(const char *path, LinkageDescriptor *linkage,
+                        const char **error);
+
+/// Empty the module cache, freeing the modules no link refers to.
+void module_cache_flush(void);
+
+/// Add a reference to a module, keeping it from being freed while it is
+/// not linked to.
+///
+/// \param module The module.
+void module_retain(Module *module);
+
+/// Drop a reference to a module, freeing it if it was the last one.
+///
+/// \param module The module.
+void module_release(Module *module);
+
+/// Free a module that no module link refers to.
+///
+/// \param module The module to free.
+void module_free(Module *module);
+
+/// Create a link to a module, resolving the entries of a linkage descriptor
+/// against the module's exports.
+///
+/// \param module The module to link to.
+/// \param linkage The importing module's linkage descriptor, or `NULL` to
+/// link without importing any functions.
+/// \return The module link, with one reference to it, or `NULL` if an entry
+/// of `linkage` does not match an export by name and signature, or there is
+/// no memory for the link.
+ModuleLink *module_link(Module *module, LinkageDescriptor *linkage);
+
+/// Create a link to a module from linkage records that have already been
+/// resolved, as restoring a snapshot does.
+///
+/// \param module The module to link to.
+/// \param nlinks The number of linkage records.
+/// \param links The linkage records, which are copied.
+/// \return The module link, with one reference to it, or `NULL` if there is
+/// no memory for it.
+ModuleLink *module_link_records(Module *module, word nlinks, const Link *links);
+
+/// Drop a reference to a module link.
+///
+/// \param ml The module link.
+void module_unlink(ModuleLink *ml);
+
+/// Free a module link's data once nothing refers to the link, freeing the
+/// module too if no other link refers to it. Only the heap calls this.
+///
+/// \param ml The module link.
+void module_link_destroy(ModuleLink *ml);
+
+#endif //DIS_MODULE_H
@@ -0,0 +1,1007 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "instructions.h"
+#include "profile.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#endif
+
+/// The most frames of a call stack a sample records, from the innermost.
+#define PROFILE_DEPTH 64
+
+/// The number of buckets a thread's table of call stacks starts with.
+#define STACK_BUCKETS 256
+
+/// What a thread does when it next counts down to zero. After each sample
+/// the instruction about to run is timed on its own, and then no instruction
+/// at all, to find the cost of timing.
+typedef enum ProfilePhase {
+    PHASE_SAMPLE,
+    PHASE_INSTRUCTION,
+    PHASE_NOTHING,
+} ProfilePhase;
+
+/// A function active when a sample was taken: the instruction it was
+/// executing, or the call it was waiting on.
+typedef struct ProfileFrame {
+    Module *module;
+    word pc;
+} ProfileFrame;
+
+/// A distinct call stack, and the samples that found it.
+typedef struct ProfileStack {
+    struct ProfileStack *next;
+    uint64_t hash;
+    uint64_t samples;
+    uint64_t cycles;
+    word depth;
+    /// The frames, innermost first.
+    ProfileFrame frames[];
+} ProfileStack;
+
+/// Calls made from an `mcall` instruction, keyed by the serial number of the
+/// module called and the entry point, or 0 in slots not yet claimed.
+typedef struct ProfileSite {
+    _Atomic uint64_t keys[PROFILE_SITE_TARGETS];
+    _Atomic uint64_t calls[PROFILE_SITE_TARGETS];
+    _Atomic uint64_t other;
+} ProfileSite;
+
+struct ModuleProfile {
+    /// Whether the module is in the registry, which holds a reference to it.
+    _Atomic bool registered;
+    /// The calls to each instruction, as an entry point.
+    _Atomic uint64_t *calls;
+    /// For each instruction, its index in `sites` if it is an `mcall`, or
+    /// `NULL` if the module makes none.
+    word *site_index;
+    ProfileSite *sites;
+    word nsites;
+    /// The module's place in the tables built while reporting.
+    word report_index;
+};
+
+struct ProfileThread {
+    /// The next thread in `threads`.
+    ProfileThread *next;
+    /// Held by the thread while it records a sample, and by whatever reads
+    /// or clears its samples.
+    pthread_mutex_t lock;
+    /// For each opcode, the instructions the samples that found it stand
+    /// for, and the ticks and number of the times it was timed.
+    uint64_t counts[256];
+    uint64_t cycles[256];
+    uint64_t timed[256];
+    /// The ticks and number of the times nothing was timed.
+    uint64_t overhead;
+    uint64_t calibrations;
+    /// Hash table of call stacks, with `mask + 1` buckets.
+    ProfileStack **buckets;
+    uptr mask;
+    uptr nstacks;
+
+    // The rest is only used by the thread itself.
+
+    /// Instructions to count down before the next sample, the number of
+    /// instructions the next sample stands for, and the number `execute()`
+    /// was last told to count down.
+    uptr countdown;
+    uptr interval;
+    uptr armed;
+    /// What is being timed, the opcode of the instruction being timed, and
+    /// when timing started.
+    ProfilePhase phase;
+    byte timed_opcode;
+    uint64_t timed_start;
+    /// When the thread started running code since the last sample, and for
+    /// how long it had run before then.
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t random;
+};
+
+_Atomic bool profile_on;
+
+/// The mean interval between samples.
+static _Atomic uptr sample_interval = PROFILE_INTERVAL;
+
+/// The calling OS thread's state, created by its first call to `execute()`
+/// with profiling on, and merged into `retired` as the thread exits.
+static _Thread_local ProfileThread *self;
+static pthread_key_t self_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/// Every OS thread's state, and the samples of the threads that have exited.
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProfileThread *threads;
+static ProfileThread retired = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/// The modules the profiler has seen run, each with a reference.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Module **registry;
+static uptr nregistered;
+static uptr registry_size;
+
+/// Held while reporting and resetting, so that neither sees the other's
+/// work half done.
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Where to write the results as the process exits, from the environment.
+static const char *exit_path;
+
+/// Read the timestamp counter, or the time in nanoseconds where there is
+/// none.
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+/// Add one to a counter. Counters are only ever read for reports, so two
+/// threads counting at the same instant may lose one of their counts rather
+/// than both paying for a locked instruction.
+static inline void count(_Atomic uint64_t *counter)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+static void dump_at_exit(void)
+{
+    if (!profile_dump(exit_path)) {
+        fprintf(stderr, "cannot write profile to %s\n", exit_path);
+    }
+}
+
+static void retire(void *thread);
+
+static void profile_init(void)
+{
+    pthread_key_create(&self_key, retire);
+    exit_path = getenv("DIS_PROFILE");
+    if (exit_path != NULL && *exit_path != '\0') {
+        atexit(dump_at_exit);
+        atomic_store_explicit(&profile_on, true, memory_order_relaxed);
+    }
+}
+
+void profile_enable(bool enabled)
+{
+    pthread_once(&init_once, profile_init);
+    atomic_store_explicit(&profile_on, enabled, memory_order_relaxed);
+}
+
+void profile_set_interval(uptr interval)
+{
+    atomic_store_explicit(&sample_interval, interval < 16 ? 16 : interval,
+                          memory_order_relaxed);
+}
+
+/// Start the interval to the next sample. Intervals vary at random around
+/// the mean, so that samples do not fall in step with a loop.
+static void schedule(ProfileThread *t)
+{
+    uptr mean = atomic_load_explicit(&sample_interval, memory_order_relaxed);
+    t->random ^= t->random << 13;
+    t->random ^= t->random >> 7;
+    t->random ^= t->random << 17;
+    t->interval = mean / 2 + (uptr) (t->random % mean);
+    t->countdown = t->interval;
+}
+
+/// Find a call stack in a thread's table.
+///
+/// \return The stack, or `NULL` if the table does not have it.
+static ProfileStack *stack_find(const ProfileThread *t, uint64_t hash,
+                                const ProfileFrame *frames, word depth)
+{
+    if (t->buckets == NULL) {
+        return NULL;
+    }
+    for (ProfileStack *s = t->buckets[hash & t->mask]; s != NULL; s = s->next) {
+        bool equal = s->hash == hash && s->depth == depth;
+        for (word i = 0; i < depth && equal; i++) {
+            equal = s->frames[i].module == frames[i].module && s->frames[i].pc == frames[i].pc;
+        }
+        if (equal) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/// Put a call stack in a thread's table, adding its samples to those of the
+/// same stack if the table has it already.
+static void stack_insert(ProfileThread *t, ProfileStack *stack)
+{
+    ProfileStack *s = stack_find(t, stack->hash, stack->frames, stack->depth);
+    if (s != NULL) {
+        s->samples += stack->samples;
+        s->cycles += stack->cycles;
+        free(stack);
+        return;
+    }
+    if (t->buckets == NULL) {
+        t->mask = STACK_BUCKETS - 1;
+        t->buckets = calloc(STACK_BUCKETS, sizeof(ProfileStack *));
+    }
+    if (t->nstacks > t->mask) {
+        uptr mask = 2 * t->mask + 1;
+        ProfileStack **buckets = calloc(mask + 1, sizeof(ProfileStack *));
+        for (uptr i = 0; i <= t->mask; i++) {
+            for (ProfileStack *s = t->buckets[i], *next; s != NULL; s = next) {
+                next = s->next;
+                s->next = buckets[s->hash & mask];
+                buckets[s->hash & mask] = s;
+            }
+        }
+        free(t->buckets);
+        t->buckets = buckets;
+        t->mask = mask;
+    }
+    stack->next = t->buckets[stack->hash & t->mask];
+    t->buckets[stack->hash & t->mask] = stack;
+    t->nstacks++;
+}
+
+static void stacks_free(ProfileThread *t)
+{
+    for (uptr i = 0; t->buckets != NULL && i <= t->mask; i++) {
+        for (ProfileStack *s = t->buckets[i], *next; s != NULL; s = next) {
+            next = s->next;
+            free(s);
+        }
+    }
+    free(t->buckets);
+    t->buckets = NULL;
+    t->mask = 0;
+    t->nstacks = 0;
+}
+
+/// Merge the samples of an exiting OS thread into `retired`.
+static void retire(void *thread)
+{
+    ProfileThread *t = thread;
+    pthread_mutex_lock(&threads_lock);
+    ProfileThread **link = &threads;
+    while (*link != t) {
+        link = &(*link)->next;
+    }
+    *link = t->next;
+    pthread_mutex_lock(&retired.lock);
+    for (int i = 0; i < 256; i++) {
+        retired.counts[i] += t->counts[i];
+        retired.cycles[i] += t->cycles[i];
+        retired.timed[i] += t->timed[i];
+    }
+    retired.overhead += t->overhead;
+    retired.calibrations += t->calibrations;
+    for (uptr i = 0; t->buckets != NULL && i <= t->mask; i++) {
+        for (ProfileStack *s = t->buckets[i], *next; s != NULL; s = next) {
+            next = s->next;
+            stack_insert(&retired, s);
+        }
+    }
+    pthread_mutex_unlock(&retired.lock);
+    pthread_mutex_unlock(&threads_lock);
+    free(t->buckets);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    self = NULL;
+}
+
+ProfileThread *profile_begin(void)
+{
+    pthread_once(&init_once, profile_init);
+    if (!profile_enabled()) {
+        return NULL;
+    }
+    ProfileThread *t = self;
+    if (t == NULL) {
+        t = calloc(1, sizeof(ProfileThread));
+        pthread_mutex_init(&t->lock, NULL);
+        t->random = ((uint64_t) (uptr) t ^ ticks()) | 1;
+        schedule(t);
+        self = t;
+        pthread_setspecific(self_key, t);
+        pthread_mutex_lock(&threads_lock);
+        t->next = threads;
+        threads = t;
+        pthread_mutex_unlock(&threads_lock);
+    }
+    t->start = ticks();
+    return t;
+}
+
+uptr profile_arm(ProfileThread *t, uptr quantum, uptr *rest)
+{
+    uptr n = t->countdown < quantum ? t->countdown : quantum;
+    *rest = quantum - n;
+    t->armed = n;
+    return n;
+}
+
+/// Count instructions towards the next sample.
+static void consume(ProfileThread *t, uptr n)
+{
+    t->countdown = n < t->countdown ? t->countdown - n : 0;
+}
+
+static ModuleProfile *module_profile_slow(Module *module);
+
+/// Find a module's counts, registering the module if it is not registered.
+static inline ModuleProfile *module_profile(Module *module)
+{
+    ModuleProfile *p = atomic_load_explicit(&module->profile, memory_order_acquire);
+    if (p != NULL && atomic_load_explicit(&p->registered, memory_order_relaxed)) {
+        return p;
+    }
+    return module_profile_slow(module);
+}
+
+/// Record the call stack of the Dis thread being run.
+static void record_stack(ProfileThread *t, ExecutionContext *context, uint64_t cycles)
+{
+    ProfileFrame frames[PROFILE_DEPTH];
+    Module *module = context->ml->module;
+    frames[0] = (ProfileFrame) {module, (word) context->program_counter};
+    word depth = 1;
+    // Each frame holds where its caller is to return to, just after the call,
+    // and the caller's module if it is not the callee's.
+    for (Frame *f = (Frame *) context->fp; f != NULL && f->fp != NULL && depth < PROFILE_DEPTH;
+         f = f->fp) {
+        if (f->ml != NULL) {
+            module = f->ml->module;
+        }
+        frames[depth++] = (ProfileFrame) {module, (word) f->lr - 1};
+    }
+
+    uint64_t hash = 0xCBF29CE484222325u;
+    for (word i = 0; i < depth; i++) {
+        module_profile(frames[i].module);
+        hash = (hash ^ frames[i].module->serial) * 0x100000001B3u;
+        hash = (hash ^ (uint32_t) frames[i].pc) * 0x100000001B3u;
+    }
+    ProfileStack *stack = stack_find(t, hash, frames, depth);
+    if (stack != NULL) {
+        stack->samples++;
+        stack->cycles += cycles;
+        return;
+    }
+    stack = malloc(sizeof(ProfileStack) + (uptr) depth * sizeof(ProfileFrame));
+    stack->hash = hash;
+    stack->samples = 1;
+    stack->cycles = cycles;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, (uptr) depth * sizeof(ProfileFrame));
+    stack_insert(t, stack);
+}
+
+/// Take a sample, or finish timing what ran after the last one.
+static void sample(ProfileThread *t, ExecutionContext *context)
+{
+    uint64_t now = ticks();
+    t->elapsed += now - t->start;
+    pthread_mutex_lock(&t->lock);
+    if (t->phase == PHASE_INSTRUCTION) {
+        t->cycles[t->timed_opcode] += now - t->timed_start;
+        t->timed[t->timed_opcode]++;
+        // Counting down from one runs nothing.
+        t->phase = PHASE_NOTHING;
+        t->countdown = 1;
+    } else if (t->phase == PHASE_NOTHING) {
+        t->overhead += now - t->timed_start;
+        t->calibrations++;
+        t->phase = PHASE_SAMPLE;
+        schedule(t);
+    } else if (profile_enabled()) {
+        // The sample stands for the instructions since the last one, which
+        // are counted as the opcode about to run.
+        byte opcode = context->code[context->program_counter].opcode;
+        t->counts[opcode] += t->interval;
+        record_stack(t, context, t->elapsed);
+        t->elapsed = 0;
+        t->phase = PHASE_INSTRUCTION;
+        t->timed_opcode = opcode;
+        // Counting down to the next sample and back to zero again runs one
+        // instruction.
+        t->countdown = 2;
+    } else {
+        schedule(t);
+    }
+    pthread_mutex_unlock(&t->lock);
+    // Time spent sampling is charged to nothing.
+    t->start = ticks();
+    t->timed_start = t->start;
+}
+
+uptr profile_yield(ProfileThread *t, ExecutionContext *context, uptr *rest)
+{
+    consume(t, t->armed);
+    t->armed = 0;
+    if (t->countdown == 0) {
+        sample(t, context);
+    }
+    return *rest == 0 ? 0 : profile_arm(t, *rest, rest);
+}
+
+void profile_end(ProfileThread *t, uptr quantum)
+{
+    consume(t, t->armed - quantum);
+    t->armed = 0;
+    t->elapsed += ticks() - t->start;
+    // What was being timed may have been interrupted; start again.
+    if (t->phase != PHASE_SAMPLE) {
+        t->phase = PHASE_SAMPLE;
+        schedule(t);
+    }
+}
+
+static ModuleProfile *module_profile_slow(Module *module)
+{
+    pthread_mutex_lock(&registry_lock);
+    ModuleProfile *p = atomic_load_explicit(&module->profile, memory_order_relaxed);
+    if (p == NULL) {
+        p = calloc(1, sizeof(ModuleProfile));
+        p->calls = calloc((uptr) module->ninstructions + 1, sizeof(uint64_t));
+        for (word i = 0; i < module->ninstructions; i++) {
+            p->nsites += module->code[i].opcode == IN_MCALL;
+        }
+        if (p->nsites > 0) {
+            p->site_index = malloc((uptr) module->ninstructions * sizeof(word));
+            p->sites = calloc((uptr) p->nsites, sizeof(ProfileSite));
+            word n = 0;
+            for (word i = 0; i < module->ninstructions; i++) {
+                p->site_index[i] = module->code[i].opcode == IN_MCALL ? n++ : -1;
+            }
+        }
+        atomic_store_explicit(&module->profile, p, memory_order_release);
+    }
+    if (!atomic_load_explicit(&p->registered, memory_order_relaxed)) {
+        if (nregistered == registry_size) {
+            registry_size = registry_size ? 2 * registry_size : 16;
+            registry = realloc(registry, registry_size * sizeof(Module *));
+        }
+        registry[nregistered++] = module;
+        module_retain(module);
+        atomic_store_explicit(&p->registered, true, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return p;
+}
+
+void profile_call(Module *module, word pc)
+{
+    // Calls through a frame's pointer to a function are not checked.
+    if (pc >= 0 && pc < module->ninstructions) {
+        count(&module_profile(module)->calls[pc]);
+    }
+}
+
+void profile_mcall(Module *caller, word site, Module *callee, word pc)
+{
+    ModuleProfile *p = module_profile(caller);
+    profile_call(callee, pc);
+    if (p->site_index == NULL || p->site_index[site] < 0) {
+        return;
+    }
+    ProfileSite *s = &p->sites[p->site_index[site]];
+    uint64_t key = callee->serial << 32 | (uint32_t) pc;
+    for (int i = 0; i < PROFILE_SITE_TARGETS; i++) {
+        uint64_t k = atomic_load_explicit(&s->keys[i], memory_order_relaxed);
+        if (k == 0 && atomic_compare_exchange_strong_explicit(&s->keys[i], &k, key,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+            k = key;
+        }
+        if (k == key) {
+            count(&s->calls[i]);
+            return;
+        }
+    }
+    count(&s->other);
+}
+
+void profile_module_free(Module *module)
+{
+    ModuleProfile *p = atomic_load_explicit(&module->profile, memory_order_relaxed);
+    if (p != NULL) {
+        free(p->calls);
+        free(p->site_index);
+        free(p->sites);
+        free(p);
+    }
+}
+
+/// Clear the samples of an OS thread.
+static void thread_clear(ProfileThread *t)
+{
+    pthread_mutex_lock(&t->lock);
+    memset(t->counts, 0, sizeof t->counts);
+    memset(t->cycles, 0, sizeof t->cycles);
+    memset(t->timed, 0, sizeof t->timed);
+    t->overhead = 0;
+    t->calibrations = 0;
+    stacks_free(t);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void profile_reset(void)
+{
+    pthread_mutex_lock(&report_lock);
+    // Modules are dropped from the registry first, so that samples recorded
+    // from now on register the modules in them again, and released last,
+    // once no sample refers to them.
+    pthread_mutex_lock(&registry_lock);
+    Module **modules = registry;
+    uptr n = nregistered;
+    registry = NULL;
+    nregistered = 0;
+    registry_size = 0;
+    for (uptr i = 0; i < n; i++) {
+        ModuleProfile *p = atomic_load_explicit(&modules[i]->profile, memory_order_relaxed);
+        atomic_store_explicit(&p->registered, false, memory_order_relaxed);
+        memset(p->calls, 0, ((uptr) modules[i]->ninstructions + 1) * sizeof(uint64_t));
+        if (p->sites != NULL) {
+            memset(p->sites, 0, (uptr) p->nsites * sizeof(ProfileSite));
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_lock(&threads_lock);
+    for (ProfileThread *t = threads; t != NULL; t = t->next) {
+        thread_clear(t);
+    }
+    thread_clear(&retired);
+    pthread_mutex_unlock(&threads_lock);
+
+    for (uptr i = 0; i < n; i++) {
+        module_release(modules[i]);
+    }
+    free(modules);
+    pthread_mutex_unlock(&report_lock);
+}
+
+/// Call a function with the lock of every OS thread's samples held in turn.
+static void each_thread(void (*fn)(ProfileThread *t, void *arg), void *arg)
+{
+    pthread_mutex_lock(&threads_lock);
+    for (ProfileThread *t = threads; t != NULL; t = t->next) {
+        pthread_mutex_lock(&t->lock);
+        fn(t, arg);
+        pthread_mutex_unlock(&t->lock);
+    }
+    pthread_mutex_lock(&retired.lock);
+    fn(&retired, arg);
+    pthread_mutex_unlock(&retired.lock);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/// The opcode counts and timings of every OS thread.
+typedef struct OpcodeTotals {
+    uint64_t counts[256];
+    uint64_t cycles[256];
+    uint64_t timed[256];
+    uint64_t overhead;
+    uint64_t calibrations;
+} OpcodeTotals;
+
+static void add_opcodes(ProfileThread *t, void *arg)
+{
+    OpcodeTotals *totals = arg;
+    for (int i = 0; i < 256; i++) {
+        totals->counts[i] += t->counts[i];
+        totals->cycles[i] += t->cycles[i];
+        totals->timed[i] += t->timed[i];
+    }
+    totals->overhead += t->overhead;
+    totals->calibrations += t->calibrations;
+}
+
+void profile_opcodes(ProfileOpcode opcodes[256])
+{
+    OpcodeTotals totals = {0};
+    pthread_mutex_lock(&report_lock);
+    each_thread(add_opcodes, &totals);
+    pthread_mutex_unlock(&report_lock);
+    double overhead = totals.calibrations == 0
+                          ? 0
+                          : (double) totals.overhead / (double) totals.calibrations;
+    for (int i = 0; i < 256; i++) {
+        // Each opcode's time is its count at the mean of its timings, less
+        // the mean cost of timing.
+        double each = totals.timed[i] == 0
+                          ? 0
+                          : (double) totals.cycles[i] / (double) totals.timed[i] - overhead;
+        opcodes[i].count = totals.counts[i];
+        opcodes[i].cycles = each > 0 ? (uint64_t) (each * (double) totals.counts[i]) : 0;
+    }
+}
+
+/// The functions of a registered module, as found while reporting.
+typedef struct ModuleFunctions {
+    Module *module;
+    /// The sorted entry points of the functions, and what was counted for
+    /// each.
+    word *starts;
+    word n;
+    ProfileFunction *functions;
+} ModuleFunctions;
+
+/// The functions of every registered module, built with `report_lock` held.
+typedef struct Report {
+    ModuleFunctions *modules;
+    uptr nmodules;
+} Report;
+
+static int compare_words(const void *a, const void *b)
+{
+    word x = *(const word *) a, y = *(const word *) b;
+    return (x > y) - (x < y);
+}
+
+/// Find the entry points of a module's functions: its entry point, its
+/// exports, the targets of its calls and spawns, and anything else that has
+/// been called.
+static void find_functions(ModuleFunctions *m)
+{
+    Module *module = m->module;
+    ModuleProfile *p = atomic_load_explicit(&module->profile, memory_order_relaxed);
+    uptr size = 2 + (uptr) module->nexports;
+    for (word i = 0; i < module->ninstructions; i++) {
+        const Inst *inst = &module->code[i];
+        size += ((inst->opcode == IN_CALL || inst->opcode == IN_SPAWN) && inst->d.mode == AIMM) ||
+                atomic_load_explicit(&p->calls[i], memory_order_relaxed) != 0;
+    }
+    word *starts = malloc(size * sizeof(word));
+    word n = 0;
+    // Code before the first function is attributed to a function at 0.
+    starts[n++] = 0;
+    starts[n++] = module->entry_pc >= 0 ? module->entry_pc : 0;
+    for (word i = 0; i < module->nexports; i++) {
+        starts[n++] = module->exports[i].pc;
+    }
+    for (word i = 0; i < module->ninstructions; i++) {
+        const Inst *inst = &module->code[i];
+        if ((inst->opcode == IN_CALL || inst->opcode == IN_SPAWN) && inst->d.mode == AIMM) {
+            starts[n++] = inst->d.offset;
+        } else if (atomic_load_explicit(&p->calls[i], memory_order_relaxed) != 0) {
+            starts[n++] = i;
+        }
+    }
+    qsort(starts, (uptr) n, sizeof(word), compare_words);
+    word unique = 0;
+    for (word i = 0; i < n; i++) {
+        if (unique == 0 || starts[i] != starts[unique - 1]) {
+            starts[unique++] = starts[i];
+        }
+    }
+
+    m->starts = starts;
+    m->n = unique;
+    m->functions = calloc((uptr) unique, sizeof(ProfileFunction));
+    for (word i = 0; i < unique; i++) {
+        ProfileFunction *f = &m->functions[i];
+        f->module = module;
+        f->pc = starts[i];
+        f->calls = atomic_load_explicit(&p->calls[starts[i]], memory_order_relaxed);
+    }
+}
+
+/// Find the function containing an instruction.
+///
+/// \return The function, or `NULL` if its module was registered after the
+/// report was started.
+static ProfileFunction *function_at(const Report *report, ProfileFrame frame)
+{
+    ModuleProfile *p = atomic_load_explicit(&frame.module->profile, memory_order_relaxed);
+    if ((uptr) p->report_index >= report->nmodules ||
+        report->modules[p->report_index].module != frame.module) {
+        return NULL;
+    }
+    const ModuleFunctions *m = &report->modules[p->report_index];
+    word low = 0, high = m->n;
+    while (high - low > 1) {
+        word mid = low + (high - low) / 2;
+        if (m->starts[mid] <= frame.pc) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return &m->functions[low];
+}
+
+static void add_stacks(ProfileThread *t, void *arg)
+{
+    const Report *report = arg;
+    for (uptr i = 0; t->buckets != NULL && i <= t->mask; i++) {
+        for (const ProfileStack *s = t->buckets[i]; s != NULL; s = s->next) {
+            ProfileFunction *leaf = function_at(report, s->frames[0]);
+            if (leaf == NULL) {
+                continue;
+            }
+            leaf->samples += s->samples;
+            leaf->self_cycles += s->cycles;
+            // A function recursing counts the time only once.
+            for (word j = 0; j < s->depth; j++) {
+                ProfileFunction *f = function_at(report, s->frames[j]);
+                bool seen = f == NULL;
+                for (word k = 0; k < j && !seen; k++) {
+                    seen = function_at(report, s->frames[k]) == f;
+                }
+                if (!seen) {
+                    f->total_cycles += s->cycles;
+                }
+            }
+        }
+    }
+}
+
+/// Find the functions of every registered module and share out the samples
+/// among them.
+static void report_build(Report *report)
+{
+    pthread_mutex_lock(&registry_lock);
+    report->nmodules = nregistered;
+    report->modules = calloc(nregistered ? nregistered : 1, sizeof(ModuleFunctions));
+    for (uptr i = 0; i < nregistered; i++) {
+        ModuleProfile *p = atomic_load_explicit(&registry[i]->profile, memory_order_relaxed);
+        p->report_index = (word) i;
+        report->modules[i].module = registry[i];
+    }
+    pthread_mutex_unlock(&registry_lock);
+    for (uptr i = 0; i < report->nmodules; i++) {
+        find_functions(&report->modules[i]);
+    }
+    each_thread(add_stacks, report);
+}
+
+static void report_free(Report *report)
+{
+    for (uptr i = 0; i < report->nmodules; i++) {
+        free(report->modules[i].starts);
+        free(report->modules[i].functions);
+    }
+    free(report->modules);
+}
+
+/// Write the name of a function, as `profile_functions()` gives it.
+static int function_name(char *buffer, uptr size, const ProfileFunction *f)
+{
+    const Module *module = f->module;
+    const char *name = module->name != NULL ? module->name : "?";
+    for (word i = 0; i < module->nexports; i++) {
+        if (module->exports[i].pc == f->pc) {
+            return snprintf(buffer, size, "%s.%s", name, module->exports[i].name);
+        }
+    }
+    return snprintf(buffer, size, "%s@%d", name, (int) f->pc);
+}
+
+static int compare_functions(const void *a, const void *b)
+{
+    const ProfileFunction *x = a, *y = b;
+    if (x->self_cycles != y->self_cycles) {
+        return x->self_cycles < y->self_cycles ? 1 : -1;
+    }
+    return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+/// List the functions with anything counted, without names.
+static ProfileFunction *report_functions(const Report *report, uptr *n)
+{
+    uptr count = 0;
+    for (uptr i = 0; i < report->nmodules; i++) {
+        for (word j = 0; j < report->modules[i].n; j++) {
+            const ProfileFunction *f = &report->modules[i].functions[j];
+            count += f->calls != 0 || f->samples != 0;
+        }
+    }
+    ProfileFunction *functions = malloc((count ? count : 1) * sizeof(ProfileFunction));
+    *n = 0;
+    for (uptr i = 0; i < report->nmodules; i++) {
+        for (word j = 0; j < report->modules[i].n; j++) {
+            const ProfileFunction *f = &report->modules[i].functions[j];
+            if (f->calls != 0 || f->samples != 0) {
+                functions[(*n)++] = *f;
+            }
+        }
+    }
+    qsort(functions, *n, sizeof(ProfileFunction), compare_functions);
+    return functions;
+}
+
+ProfileFunction *profile_functions(uptr *n)
+{
+    pthread_mutex_lock(&report_lock);
+    Report report;
+    report_build(&report);
+    uptr count;
+    ProfileFunction *functions = report_functions(&report, &count);
+    report_free(&report);
+    pthread_mutex_unlock(&report_lock);
+
+    // The names go after the array, in the same block.
+    uptr names = 0;
+    for (uptr i = 0; i < count; i++) {
+        names += (uptr) function_name(NULL, 0, &functions[i]) + 1;
+    }
+    ProfileFunction *result = NULL;
+    if (count > 0) {
+        result = malloc(count * sizeof(ProfileFunction) + names);
+        char *name = (char *) (result + count);
+        for (uptr i = 0; i < count; i++) {
+            result[i] = functions[i];
+            result[i].name = name;
+            int length = function_name(name, names, &functions[i]) + 1;
+            name += length;
+            names -= (uptr) length;
+        }
+    }
+    free(functions);
+    *n = count;
+    return result;
+}
+
+/// Find a registered module by its serial number.
+static Module *registered_module(uint64_t serial)
+{
+    for (uptr i = 0; i < nregistered; i++) {
+        if (registry[i]->serial == serial) {
+            return registry[i];
+        }
+    }
+    return NULL;
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const ProfileCallSite *x = a, *y = b;
+    uint64_t xs = x->other, ys = y->other;
+    for (word i = 0; i < x->ntargets; i++) {
+        xs += x->targets[i].calls;
+    }
+    for (word i = 0; i < y->ntargets; i++) {
+        ys += y->targets[i].calls;
+    }
+    return (xs < ys) - (xs > ys);
+}
+
+ProfileCallSite *profile_call_sites(uptr *n)
+{
+    pthread_mutex_lock(&report_lock);
+    pthread_mutex_lock(&registry_lock);
+    uptr size = 0;
+    for (uptr i = 0; i < nregistered; i++) {
+        ModuleProfile *p = atomic_load_explicit(&registry[i]->profile, memory_order_relaxed);
+        size += (uptr) p->nsites;
+    }
+    ProfileCallSite *sites = malloc((size ? size : 1) * sizeof(ProfileCallSite));
+    uptr count = 0;
+    for (uptr i = 0; i < nregistered; i++) {
+        Module *module = registry[i];
+        ModuleProfile *p = atomic_load_explicit(&module->profile, memory_order_relaxed);
+        for (word pc = 0; p->site_index != NULL && pc < module->ninstructions; pc++) {
+            if (p->site_index[pc] < 0) {
+                continue;
+            }
+            ProfileSite *s = &p->sites[p->site_index[pc]];
+            ProfileCallSite *site = &sites[count];
+            *site = (ProfileCallSite) {
+                .module = module,
+                .pc = pc,
+                .other = atomic_load_explicit(&s->other, memory_order_relaxed),
+            };
+            for (int j = 0; j < PROFILE_SITE_TARGETS; j++) {
+                uint64_t key = atomic_load_explicit(&s->keys[j], memory_order_relaxed);
+                uint64_t calls = atomic_load_explicit(&s->calls[j], memory_order_relaxed);
+                // A module called just as the profiler was reset may not be
+                // registered.
+                Module *target = key != 0 ? registered_module(key >> 32) : NULL;
+                if (target != NULL) {
+                    site->targets[site->ntargets++] =
+                        (ProfileTarget) {target, (word) (uint32_t) key, calls};
+                } else {
+                    site->other += calls;
+                }
+            }
+            count += site->ntargets > 0 || site->other > 0;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    pthread_mutex_unlock(&report_lock);
+    qsort(sites, count, sizeof(ProfileCallSite), compare_sites);
+    *n = count;
+    if (count == 0) {
+        free(sites);
+        return NULL;
+    }
+    return sites;
+}
+
+static void write_stacks(ProfileThread *t, void *arg)
+{
+    const Report *report = ((void **) arg)[0];
+    FILE *file = ((void **) arg)[1];
+    char name[256];
+    for (uptr i = 0; t->buckets != NULL && i <= t->mask; i++) {
+        for (const ProfileStack *s = t->buckets[i]; s != NULL; s = s->next) {
+            for (word j = s->depth - 1; j >= 0; j--) {
+                const ProfileFunction *f = function_at(report, s->frames[j]);
+                if (f != NULL) {
+                    function_name(name, sizeof name, f);
+                } else {
+                    snprintf(name, sizeof name, "?");
+                }
+                fprintf(file, "%s%c", name, j > 0 ? ';' : ' ');
+            }
+            fprintf(file, "%llu\n", (unsigned long long) s->cycles);
+        }
+    }
+}
+
+bool profile_dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    ProfileOpcode opcodes[256];
+    profile_opcodes(opcodes);
+    fprintf(file, "# opcodes: name count cycles\n");
+    for (int i = 0; i < 256; i++) {
+        if (opcodes[i].count != 0) {
+            const char *name = instruction_name((byte) i);
+            fprintf(file, "%s %llu %llu\n", name != NULL ? name : "?",
+                    (unsigned long long) opcodes[i].count,
+                    (unsigned long long) opcodes[i].cycles);
+        }
+    }
+
+    uptr n;
+    ProfileFunction *functions = profile_functions(&n);
+    fprintf(file, "# functions: name calls samples self_cycles total_cycles\n");
+    for (uptr i = 0; i < n; i++) {
+        const ProfileFunction *f = &functions[i];
+        fprintf(file, "%s %llu %llu %llu %llu\n", f->name, (unsigned long long) f->calls,
+                (unsigned long long) f->samples, (unsigned long long) f->self_cycles,
+                (unsigned long long) f->total_cycles);
+    }
+    free(functions);
+
+    ProfileCallSite *sites = profile_call_sites(&n);
+    fprintf(file, "# sites: module@pc target=calls... other=calls\n");
+    for (uptr i = 0; i < n; i++) {
+        const ProfileCallSite *s = &sites[i];
+        fprintf(file, "%s@%d", s->module->name != NULL ? s->module->name : "?", (int) s->pc);
+        for (word j = 0; j < s->ntargets; j++) {
+            char name[256];
+            ProfileFunction target = {.module = s->targets[j].module, .pc = s->targets[j].pc};
+            function_name(name, sizeof name, &target);
+            fprintf(file, " %s=%llu", name, (unsigned long long) s->targets[j].calls);
+        }
+        fprintf(file, " other=%llu\n", (unsigned long long) s->other);
+    }
+    free(sites);
+
+    fprintf(file, "# stacks: folded, root first, weighted by cycles\n");
+    pthread_mutex_lock(&report_lock);
+    Report report;
+    report_build(&report);
+    each_thread(write_stacks, (void *[]) {&report, file});
+    report_free(&report);
+    pthread_mutex_unlock(&report_lock);
+    return fclose(file) == 0;
+}
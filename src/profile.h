@@ -0,0 +1,202 @@
+#ifndef DIS_PROFILE_H
+#define DIS_PROFILE_H
+
+// A sampling profiler for the code the interpreter runs.
+//
+// Every OS thread running `execute()` counts down the instructions to its
+// next sample in the quantum the interpreter already counts down, so the
+// interpreter does no more work per instruction with profiling on than with
+// it off. A sample records the Dis thread's call stack, weighted by the time
+// since the previous one, and the opcode of the instruction about to run,
+// which then runs alone so that its cycles can be measured. Calls through
+// `call`, `spawn`, `mcall` and `mspawn` are counted exactly, as are the
+// targets of each `mcall`.
+//
+// Counts of instructions are estimated from the samples, and have an error
+// of about one sampling interval per opcode or function. A superinstruction
+// counts as one instruction. Compiled code runs as `IN_XJIT`, and only counts
+// down at backward branches, so it is sampled less often than interpreted
+// code. An instruction timed on its own runs without the overlap it gets
+// among others, so its time is best compared with those of other opcodes.
+//
+// The profiler is only built when `DIS_PROFILE` is set. If the environment
+// variable `DIS_PROFILE` names a file when the first thread starts, profiling
+// is turned on, and the results are written to the file as the process
+// exits.
+
+#include "module.h"
+
+/// The mean number of instructions between samples, unless
+/// `profile_set_interval()` says otherwise.
+#define PROFILE_INTERVAL 16384
+
+/// The number of targets of an `mcall` counted separately; calls to any
+/// others are counted together.
+#define PROFILE_SITE_TARGETS 4
+
+/// What the profiler estimates for an opcode.
+typedef struct ProfileOpcode {
+    /// The number of times instructions with the opcode were executed.
+    uint64_t count;
+    /// The time spent executing them, dispatch included, in timestamp counter
+    /// ticks on x86-64 and nanoseconds elsewhere.
+    uint64_t cycles;
+} ProfileOpcode;
+
+/// What the profiler counted for a function.
+typedef struct ProfileFunction {
+    /// The module containing the function, which the profiler keeps a
+    /// reference to until `profile_reset()`.
+    Module *module;
+    /// Entry point of the function.
+    word pc;
+    /// The name of the function: `Module.name` for an export, otherwise
+    /// `Module@pc`.
+    const char *name;
+    /// The number of calls to the function, and of spawns of threads running
+    /// it.
+    uint64_t calls;
+    /// The number of samples taken in the function, and the time they stand
+    /// for, excluding and including the functions it called.
+    uint64_t samples;
+    uint64_t self_cycles;
+    uint64_t total_cycles;
+} ProfileFunction;
+
+/// A function an `mcall` called.
+typedef struct ProfileTarget {
+    Module *module;
+    word pc;
+    uint64_t calls;
+} ProfileTarget;
+
+/// The functions an `mcall` instruction called.
+typedef struct ProfileCallSite {
+    /// The module containing the instruction, and its index.
+    Module *module;
+    word pc;
+    /// The first functions called from the instruction, and the calls to
+    /// each.
+    word ntargets;
+    ProfileTarget targets[PROFILE_SITE_TARGETS];
+    /// The number of calls to any other functions.
+    uint64_t other;
+} ProfileCallSite;
+
+/// Per-module counts, owned by the module.
+typedef struct ModuleProfile ModuleProfile;
+
+/// Per-OS-thread samples, owned by the profiler.
+typedef struct ProfileThread ProfileThread;
+
+/// Turn profiling on or off. Threads already in `execute()` notice at their
+/// next sample, or when they next call it.
+///
+/// \param enabled Whether to profile.
+void profile_enable(bool enabled);
+
+/// Set the mean number of instructions between samples. Fewer make the
+/// results more precise and the profiled code slower.
+///
+/// \param interval The number of instructions, at least 16.
+void profile_set_interval(uptr interval);
+
+/// Throw away everything counted so far, and drop the profiler's references
+/// to modules. Counts made by threads while this runs may be kept or lost.
+void profile_reset(void);
+
+/// Estimate how often each opcode has been executed, and for how long.
+///
+/// \param opcodes Where to store the estimates, indexed by opcode.
+void profile_opcodes(ProfileOpcode opcodes[256]);
+
+/// List the functions that have been called or sampled.
+///
+/// \param n Location to store the number of functions in.
+/// \return The functions, most time first, in one block to be freed with
+/// `free()`, or `NULL` if there are none.
+ProfileFunction *profile_functions(uptr *n);
+
+/// List the `mcall` instructions that have been executed.
+///
+/// \param n Location to store the number of instructions in.
+/// \return The call sites, most calls first, to be freed with `free()`, or
+/// `NULL` if there are none.
+ProfileCallSite *profile_call_sites(uptr *n);
+
+/// Write everything counted so far to a file, as text.
+///
+/// The file has sections for opcodes, functions, call sites and call stacks,
+/// each starting with a line beginning `#`. The call stacks come last, in
+/// the folded format of `flamegraph.pl`, with the root first and a weight in
+/// cycles, so a flame graph can be made with:
+///
+///     sed '1,/^# stacks/d' dis.prof | flamegraph.pl > dis.svg
+///
+/// \param path Path to the file.
+/// \return `false` if the file could not be written.
+bool profile_dump(const char *path);
+
+/// Find the calling OS thread's profiler state as `execute()` starts, and
+/// start timing the run.
+///
+/// \return The state, or `NULL` if profiling is off.
+ProfileThread *profile_begin(void);
+
+/// Decide how many instructions `execute()` should count down to before it
+/// next calls `profile_yield()`.
+///
+/// \param thread The calling OS thread's state.
+/// \param quantum What is left of the Dis thread's quantum.
+/// \param rest Location to store the part of the quantum left over.
+/// \return The number of instructions to count down.
+uptr profile_arm(ProfileThread *thread, uptr quantum, uptr *rest);
+
+/// Take a sample if one is due, once `execute()` has counted down the
+/// instructions `profile_arm()` or this returned.
+///
+/// \param thread The calling OS thread's state.
+/// \param context The Dis thread being run.
+/// \param rest The rest of the Dis thread's quantum, updated to what is left
+/// over after the return value.
+/// \return The number of instructions to count down next, or 0 if the Dis
+/// thread's quantum is used up.
+uptr profile_yield(ProfileThread *thread, ExecutionContext *context, uptr *rest);
+
+/// Stop timing the run as `execute()` returns.
+///
+/// \param thread The calling OS thread's state.
+/// \param quantum The instructions `execute()` had left to count down.
+void profile_end(ProfileThread *thread, uptr quantum);
+
+/// Whether profiling is on; use `profile_enabled()`.
+extern _Atomic bool profile_on;
+
+/// Whether profiling is on, for the instructions that count calls to check
+/// before they do.
+static inline bool profile_enabled(void)
+{
+    return atomic_load_explicit(&profile_on, memory_order_relaxed);
+}
+
+/// Count a call to a function, or a spawn of a thread running it.
+///
+/// \param module The module containing the function.
+/// \param pc Entry point of the function.
+void profile_call(Module *module, word pc);
+
+/// Count a call made by an `mcall` instruction, both to the function called
+/// and from the instruction.
+///
+/// \param caller The module containing the instruction.
+/// \param site The index of the instruction.
+/// \param callee The module called.
+/// \param pc Entry point of the function called.
+void profile_mcall(Module *caller, word site, Module *callee, word pc);
+
+/// Free what the profiler counted in a module as the module is freed.
+///
+/// \param module The module.
+void profile_module_free(Module *module);
+
+#endif //DIS_PROFILE_H
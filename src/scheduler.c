@@ -0,0 +1,845 @@
+#define _GNU_SOURCE // sysconf, CPU sets
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "heap.h"
+
+/// The number of stopped threads a worker keeps for reuse.
+#define FREE_THREADS 64
+
+/// The initial number of slots in a deque.
+#define DEQUE_SIZE 64
+
+/// How many more of its communications a thread has to make on the channels
+/// of another NUMA node than on those of all other nodes before it moves
+/// there.
+#define AFFINITY 256
+
+/// The most NUMA nodes looked for.
+#define MAX_NODES 64
+
+/// The slots of a deque: a circular buffer with a power of two size.
+typedef struct DequeArray {
+    intptr_t size;
+    /// The array this one replaced. Thieves may still be reading it, so it is
+    /// only freed with the deque.
+    struct DequeArray *older;
+    _Atomic(Thread *) slots[];
+} DequeArray;
+
+/// A Chase-Lev work-stealing deque, with the memory orderings of Lê et al.,
+/// "Correct and Efficient Work-Stealing for Weak Memory Models".
+///
+/// Only the owning worker pushes, at the bottom. Everyone, including the
+/// owner, takes from the top, so the owner runs its threads round-robin.
+typedef struct Deque {
+    _Alignas(64) _Atomic intptr_t top;
+    _Alignas(64) _Atomic intptr_t bottom;
+    _Atomic(DequeArray *) array;
+} Deque;
+
+/// A queue of runnable threads that any OS thread may add to, linked through
+/// `Thread::next`.
+typedef struct ThreadQueue {
+    pthread_mutex_t lock;
+    Thread *head;
+    Thread *tail;
+    _Atomic word length;
+} ThreadQueue;
+
+typedef struct Worker {
+    Deque deque;
+    /// Threads other workers have moved to this one, for it to push onto its
+    /// deque.
+    ThreadQueue inbox;
+    /// The NUMA node of the processors the worker runs on.
+    word node;
+    pthread_t os_thread;
+    bool created;
+    /// Stopped threads kept for reuse, and how many there are.
+    Thread *free;
+    word nfree;
+    /// State of the generator choosing which worker to steal from.
+    uint32_t random;
+    /// The thread being run.
+    Thread *current;
+    /// A thread readied by `current`, to run after it.
+    Thread *next;
+    /// The worker as a reader of the heap.
+    HeapReader reader;
+} Worker;
+
+static struct {
+    /// Protects starting and stopping the workers, and waiting on the
+    /// condition variables.
+    pthread_mutex_t lock;
+    /// Signalled when a thread becomes runnable, or the workers should stop.
+    pthread_cond_t work;
+    /// Signalled when the last thread stops.
+    pthread_cond_t stopped;
+    Worker *workers;
+    word nworkers;
+    /// The number of NUMA nodes the workers are spread over, or 1 if they
+    /// are not kept to nodes.
+    word nnodes;
+    SchedulerPlacement placement;
+    bool placement_chosen;
+    _Atomic bool running;
+    _Atomic bool stopping;
+    /// The number of threads that have not stopped.
+    _Atomic word nthreads;
+    /// The number of workers waiting for `work`.
+    _Atomic word nidle;
+
+    /// Threads made runnable from outside the pool.
+    ThreadQueue shared;
+} scheduler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .stopped = PTHREAD_COND_INITIALIZER,
+    .shared = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/// The worker running on this OS thread, if it is one.
+static _Thread_local Worker *self;
+
+/// \return The array, or `NULL` if there is no memory for it.
+static DequeArray *deque_array(intptr_t size)
+{
+    DequeArray *array = calloc(1, sizeof(DequeArray) + size * sizeof(Thread *));
+    if (array != NULL) {
+        array->size = size;
+    }
+    return array;
+}
+
+/// \return `false` if there is no memory for the deque.
+static bool deque_init(Deque *deque)
+{
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, deque_array(DEQUE_SIZE));
+    return atomic_load_explicit(&deque->array, memory_order_relaxed) != NULL;
+}
+
+static void deque_free(Deque *deque)
+{
+    DequeArray *array = atomic_load(&deque->array);
+    while (array != NULL) {
+        DequeArray *older = array->older;
+        free(array);
+        array = older;
+    }
+}
+
+/// Add a thread at the bottom of a deque. Only the owner may push.
+///
+/// \return `false` if the deque is full and there is no memory to grow it.
+static bool deque_push(Deque *deque, Thread *thread)
+{
+    intptr_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    intptr_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top >= array->size) {
+        DequeArray *bigger = deque_array(array->size * 2);
+        if (bigger == NULL) {
+            return false;
+        }
+        for (intptr_t i = top; i < bottom; i++) {
+            Thread *t = atomic_load_explicit(&array->slots[i & (array->size - 1)],
+                                             memory_order_relaxed);
+            atomic_store_explicit(&bigger->slots[i & (bigger->size - 1)], t,
+                                  memory_order_relaxed);
+        }
+        bigger->older = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+    atomic_store_explicit(&array->slots[bottom & (array->size - 1)], thread,
+                          memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+/// Take the thread at the top of a deque.
+///
+/// \return The thread, or `NULL` if the deque is empty.
+static Thread *deque_steal(Deque *deque)
+{
+    for (;;) {
+        intptr_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        intptr_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+        if (top >= bottom) {
+            return NULL;
+        }
+        DequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+        Thread *thread = atomic_load_explicit(&array->slots[top & (array->size - 1)],
+                                              memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                    memory_order_seq_cst,
+                                                    memory_order_relaxed)) {
+            return thread;
+        }
+    }
+}
+
+/// The number of threads in a deque, which may be out of date by the time it
+/// is returned.
+static intptr_t deque_length(Deque *deque)
+{
+    intptr_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    intptr_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    return bottom - top;
+}
+
+/// Wake an idle worker, if there is one, to look for a runnable thread.
+static void wake_worker(void)
+{
+    // Pairs with the fence in `deque_steal()` as an idle worker looks for
+    // work after counting itself idle: either it sees the new thread, or this
+    // sees it idle.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&scheduler.nidle, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&scheduler.lock);
+        pthread_cond_signal(&scheduler.work);
+        pthread_mutex_unlock(&scheduler.lock);
+    }
+}
+
+static void queue_push(ThreadQueue *q, Thread *thread)
+{
+    pthread_mutex_lock(&q->lock);
+    thread->next = NULL;
+    if (q->tail == NULL) {
+        q->head = thread;
+    } else {
+        q->tail->next = thread;
+    }
+    q->tail = thread;
+    atomic_fetch_add(&q->length, 1);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static Thread *queue_take(ThreadQueue *q)
+{
+    if (atomic_load_explicit(&q->length, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&q->lock);
+    Thread *thread = q->head;
+    if (thread != NULL) {
+        q->head = thread->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        atomic_fetch_sub(&q->length, 1);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return thread;
+}
+
+/// Push a thread onto a worker's deque or, if the deque cannot grow, onto the
+/// shared queue, which every worker takes from.
+static void push(Worker *worker, Thread *thread)
+{
+    if (!deque_push(&worker->deque, thread)) {
+        queue_push(&scheduler.shared, thread);
+    }
+}
+
+/// Start the workers with the default number of them, unless they are
+/// running, so that a thread made runnable is run.
+///
+/// \return `false` if no worker could be created.
+static bool ensure_started(void)
+{
+    return self != NULL || atomic_load(&scheduler.running) || scheduler_start(0);
+}
+
+/// Make a thread runnable: on the current worker's deque if a worker is
+/// running it, and on the shared queue otherwise. The workers must be
+/// running.
+static void make_runnable(Thread *thread)
+{
+    if (self != NULL) {
+        push(self, thread);
+    } else {
+        queue_push(&scheduler.shared, thread);
+    }
+    wake_worker();
+}
+
+/// Steal a thread from another worker, starting from a random one so that
+/// thieves spread out, and from workers on the same NUMA node before others.
+/// Only threads waiting behind others are stolen from other nodes: a thread
+/// that is next in line is likely to communicate with the one running, and
+/// is left on its node.
+static Thread *steal(Worker *worker)
+{
+    uint32_t x = worker->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    worker->random = x;
+
+    word n = scheduler.nworkers;
+    for (int near = 1; near >= 0; near--) {
+        for (word i = 0; i < n; i++) {
+            Worker *victim = &scheduler.workers[(x + i) % n];
+            if (victim == worker || (victim->node == worker->node) != near) {
+                continue;
+            }
+            // A thread moved to a worker that is waiting for work would
+            // otherwise wait until that worker is woken.
+            Thread *thread = NULL;
+            if (near || deque_length(&victim->deque) > 1) {
+                thread = deque_steal(&victim->deque);
+            }
+            if (thread == NULL) {
+                thread = queue_take(&victim->inbox);
+            }
+            if (thread != NULL) {
+                return thread;
+            }
+        }
+        if (scheduler.nnodes == 1) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static Thread *find_thread(Worker *worker)
+{
+    // Threads moved here take their turn with the others.
+    Thread *moved;
+    while ((moved = queue_take(&worker->inbox)) != NULL) {
+        push(worker, moved);
+    }
+    Thread *thread = deque_steal(&worker->deque);
+    if (thread == NULL) {
+        thread = queue_take(&scheduler.shared);
+    }
+    if (thread == NULL) {
+        thread = steal(worker);
+    }
+    return thread;
+}
+
+/// Find a thread to run, waiting for one if there is none.
+///
+/// \return The thread, or `NULL` if the workers are stopping.
+static Thread *next_thread(Worker *worker)
+{
+    Thread *thread = find_thread(worker);
+    if (thread != NULL) {
+        return thread;
+    }
+    // An idle worker holds no pointers, and need not hold up the others.
+    heap_reader_offline(&worker->reader);
+    pthread_mutex_lock(&scheduler.lock);
+    atomic_fetch_add(&scheduler.nidle, 1);
+    while ((thread = find_thread(worker)) == NULL && !atomic_load(&scheduler.stopping)) {
+        pthread_cond_wait(&scheduler.work, &scheduler.lock);
+    }
+    atomic_fetch_sub(&scheduler.nidle, 1);
+    pthread_mutex_unlock(&scheduler.lock);
+    if (thread != NULL) {
+        heap_reader_online(&worker->reader);
+    }
+    return thread;
+}
+
+/// Take a stopped thread for reuse, or allocate one.
+///
+/// \return The thread, or `NULL` if there is no memory for one.
+static Thread *thread_alloc(void)
+{
+    Worker *worker = self;
+    Thread *thread;
+    if (worker != NULL && worker->free != NULL) {
+        thread = worker->free;
+        worker->free = thread->next;
+        worker->nfree--;
+    } else {
+        thread = malloc(sizeof(Thread));
+        if (thread == NULL) {
+            return NULL;
+        }
+        thread->alts = NULL;
+        thread->nalts = 0;
+        thread->nqueued = 0;
+        thread->context.stack = (Stack) {0};
+        thread->node = worker != NULL ? worker->node : -1;
+    }
+    thread->affinity = 0;
+    thread->migrate = 0;
+    return thread;
+}
+
+/// Give a thread's memory back to the system.
+static void thread_destroy(Thread *thread)
+{
+    stack_free(&thread->context.stack);
+    free(thread->alts);
+    free(thread);
+}
+
+/// Free a stopped thread, with any frames it still holds.
+static void thread_free(Worker *worker, Thread *thread)
+{
+    stack_reset(&thread->context.stack);
+    heap_release(thread->context.ml);
+    thread->context.ml = NULL;
+
+    // A thread that has moved between nodes has its stack on the wrong one.
+    if (worker->nfree < FREE_THREADS
+        && (thread->node == worker->node || scheduler.nnodes == 1)) {
+        thread->next = worker->free;
+        worker->free = thread;
+        worker->nfree++;
+    } else {
+        thread_destroy(thread);
+    }
+
+    if (atomic_fetch_sub(&scheduler.nthreads, 1) == 1) {
+        pthread_mutex_lock(&scheduler.lock);
+        pthread_cond_broadcast(&scheduler.stopped);
+        pthread_mutex_unlock(&scheduler.lock);
+    }
+}
+
+/// Put a thread that is still runnable back on a worker's deque, or move it
+/// to the worker it is drawn to.
+static void requeue(Worker *worker, Thread *thread)
+{
+    if (thread->migrate != 0) {
+        Worker *home = &scheduler.workers[thread->migrate - 1];
+        thread->migrate = 0;
+        if (home != worker && deque_length(&home->deque) <= deque_length(&worker->deque)) {
+            queue_push(&home->inbox, thread);
+            wake_worker();
+            return;
+        }
+    }
+    push(worker, thread);
+    // Let an idle worker take the others.
+    if (deque_length(&worker->deque) > 1) {
+        wake_worker();
+    }
+}
+
+/// Run a thread for one quantum, followed by any threads it readies while
+/// the quantum lasts.
+static void run(Worker *worker, Thread *thread)
+{
+    uptr quantum = SCHEDULER_QUANTUM;
+    while (thread != NULL) {
+        worker->current = thread;
+        atomic_store_explicit(&thread->state, THREAD_RUNNING, memory_order_relaxed);
+        thread->context.quantum = quantum;
+        ExecutionStatus status = execute(&thread->context);
+        quantum = thread->context.quantum;
+        worker->current = NULL;
+        heap_quiescent(&worker->reader);
+
+        switch (status) {
+            case EXEC_YIELDED:
+                requeue(worker, thread);
+                break;
+            case EXEC_BLOCKED:
+                // Whoever completes the communication readies the thread, and
+                // may have done so already.
+                if (atomic_exchange(&thread->state, THREAD_BLOCKED) == THREAD_READY) {
+                    requeue(worker, thread);
+                }
+                break;
+            case EXEC_ERROR:
+                fprintf(stderr, "dis: thread stopped: %s\n", thread->context.error);
+                thread_free(worker, thread);
+                break;
+            default:
+                thread_free(worker, thread);
+                break;
+        }
+
+        thread = worker->next;
+        worker->next = NULL;
+        if (thread != NULL && quantum == 0) {
+            requeue(worker, thread);
+            thread = NULL;
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    self = worker;
+    heap_reader_online(&worker->reader);
+    Thread *thread;
+    while ((thread = next_thread(worker)) != NULL) {
+        run(worker, thread);
+    }
+    return NULL;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+/// Find the processors the process may run on, in order of NUMA node, from
+/// what Linux shows of the nodes in sysfs. Processors of no node shown are
+/// put on the first.
+///
+/// \param cpus Where to store the processors, which has room for
+/// `CPU_SETSIZE`.
+/// \param nodes Where to store the node of each processor, numbered from 0.
+/// \param nnodes Where to store the number of nodes.
+/// \return The number of processors, or 0 if they cannot be found.
+static word processors(int *cpus, word *nodes, word *nnodes)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+        return 0;
+    }
+    int ids[MAX_NODES];
+    word nids = 0;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != NULL) {
+        struct dirent *entry;
+        while (nids < MAX_NODES && (entry = readdir(dir)) != NULL) {
+            int id;
+            char rest;
+            if (sscanf(entry->d_name, "node%d%c", &id, &rest) == 1 && id >= 0) {
+                ids[nids++] = id;
+            }
+        }
+        closedir(dir);
+    }
+    qsort(ids, nids, sizeof *ids, compare_ints);
+
+    cpu_set_t placed;
+    CPU_ZERO(&placed);
+    word n = 0;
+    *nnodes = 0;
+    for (word i = 0; i < nids; i++) {
+        char path[64];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        // A list of ranges, such as "0-3,8-11".
+        word found = 0;
+        int first, last;
+        while (fscanf(file, "%d", &first) == 1) {
+            last = first;
+            int c = fgetc(file);
+            if (c == '-' && fscanf(file, "%d", &last) == 1) {
+                c = fgetc(file);
+            }
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                if (cpu >= 0 && CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &placed)) {
+                    CPU_SET(cpu, &placed);
+                    cpus[n] = cpu;
+                    nodes[n++] = *nnodes;
+                    found++;
+                }
+            }
+            if (c != ',') {
+                break;
+            }
+        }
+        fclose(file);
+        *nnodes += found > 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &placed)) {
+            cpus[n] = cpu;
+            nodes[n++] = 0;
+        }
+    }
+    if (*nnodes == 0) {
+        *nnodes = 1;
+    }
+    return n;
+}
+
+void scheduler_set_placement(SchedulerPlacement placement)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.placement = placement;
+    scheduler.placement_chosen = true;
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+/// Create the OS thread of a worker, kept to some of the processors.
+///
+/// \return Whether the thread was created.
+static bool create_worker(Worker *worker, const cpu_set_t *set)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    // The worker is on its processors before it allocates anything, so that
+    // its memory is on its node.
+    if (set != NULL) {
+        pthread_attr_setaffinity_np(&attr, sizeof *set, set);
+    }
+    bool created = pthread_create(&worker->os_thread, &attr, worker_main, worker) == 0;
+    pthread_attr_destroy(&attr);
+    if (!created && set != NULL) {
+        created = pthread_create(&worker->os_thread, NULL, worker_main, worker) == 0;
+    }
+    return created;
+}
+
+bool scheduler_start(word nworkers)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    if (atomic_load(&scheduler.running)) {
+        pthread_mutex_unlock(&scheduler.lock);
+        return true;
+    }
+    if (!scheduler.placement_chosen) {
+        const char *pin = getenv("DIS_PIN");
+        scheduler.placement = pin == NULL                    ? SCHEDULER_PIN_NODE
+                              : strcmp(pin, "processor") == 0 ? SCHEDULER_PIN_PROCESSOR
+                              : strcmp(pin, "none") == 0      ? SCHEDULER_UNPINNED
+                                                              : SCHEDULER_PIN_NODE;
+        scheduler.placement_chosen = true;
+    }
+    // Only used with the lock held.
+    static int cpus[CPU_SETSIZE];
+    static word nodes[CPU_SETSIZE];
+    word ncpus = 0;
+    scheduler.nnodes = 1;
+    if (scheduler.placement != SCHEDULER_UNPINNED) {
+        ncpus = processors(cpus, nodes, &scheduler.nnodes);
+    }
+    if (nworkers <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpus > 0 ? ncpus : online > 0 ? (word) online : 1;
+    }
+
+    // Every deque exists before any worker might steal from it. The workers
+    // are spread over the processors in order, so each node gets its share.
+    scheduler.workers = aligned_alloc(_Alignof(Worker), nworkers * sizeof(Worker));
+    if (scheduler.workers == NULL) {
+        pthread_mutex_unlock(&scheduler.lock);
+        return false;
+    }
+    memset(scheduler.workers, 0, nworkers * sizeof(Worker));
+    for (word i = 0; i < nworkers; i++) {
+        if (!deque_init(&scheduler.workers[i].deque)) {
+            for (word j = 0; j < i; j++) {
+                deque_free(&scheduler.workers[j].deque);
+            }
+            free(scheduler.workers);
+            scheduler.workers = NULL;
+            pthread_mutex_unlock(&scheduler.lock);
+            return false;
+        }
+    }
+    scheduler.nworkers = nworkers;
+    for (word i = 0; i < nworkers; i++) {
+        Worker *worker = &scheduler.workers[i];
+        pthread_mutex_init(&worker->inbox.lock, NULL);
+        worker->node = ncpus > 0 ? nodes[(int64_t) i * ncpus / nworkers] : 0;
+        worker->random = 2654435761u * (uint32_t) (i + 1);
+        heap_reader_add(&worker->reader);
+    }
+    bool pin = ncpus > 0 && (scheduler.placement == SCHEDULER_PIN_PROCESSOR || scheduler.nnodes > 1);
+    bool any = false;
+    for (word i = 0; i < nworkers; i++) {
+        Worker *worker = &scheduler.workers[i];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (pin && scheduler.placement == SCHEDULER_PIN_PROCESSOR) {
+            CPU_SET(cpus[(int64_t) i * ncpus / nworkers], &set);
+        } else if (pin) {
+            for (word j = 0; j < ncpus; j++) {
+                if (nodes[j] == worker->node) {
+                    CPU_SET(cpus[j], &set);
+                }
+            }
+        }
+        worker->created = create_worker(worker, pin ? &set : NULL);
+        any |= worker->created;
+    }
+    if (!any) {
+        for (word i = 0; i < nworkers; i++) {
+            heap_reader_remove(&scheduler.workers[i].reader);
+        }
+    }
+    atomic_store(&scheduler.running, any);
+    pthread_mutex_unlock(&scheduler.lock);
+    return any;
+}
+
+Thread *scheduler_thread(ExecutionContext *context)
+{
+    if (self == NULL || self->current == NULL || &self->current->context != context) {
+        return NULL;
+    }
+    return self->current;
+}
+
+word scheduler_worker(void)
+{
+    return self != NULL ? (word) (self - scheduler.workers) + 1 : 0;
+}
+
+void scheduler_communicated(ExecutionContext *context, Channel *c)
+{
+    Worker *worker = self;
+    // A channel can outlive the workers that allocated it.
+    if (worker == NULL || scheduler.nnodes == 1 || c->home == 0
+        || c->home > scheduler.nworkers) {
+        return;
+    }
+    Thread *thread = scheduler_thread(context);
+    if (thread == NULL) {
+        return;
+    }
+    // Count the communications on the node that has most of them lately,
+    // against those on the others.
+    word node = scheduler.workers[c->home - 1].node;
+    if (thread->affinity == 0) {
+        thread->affinity_node = node;
+    }
+    thread->affinity += thread->affinity_node == node ? 1 : -1;
+    if (thread->affinity == AFFINITY) {
+        thread->affinity = 0;
+        if (node != worker->node) {
+            thread->migrate = c->home;
+        }
+    }
+}
+
+void scheduler_ready(Thread *thread)
+{
+    if (atomic_exchange(&thread->state, THREAD_READY) != THREAD_BLOCKED) {
+        // Its worker has yet to let go of it, and will requeue it.
+        return;
+    }
+    if (self == NULL) {
+        make_runnable(thread);
+        return;
+    }
+    if (self->next != NULL) {
+        requeue(self, self->next);
+    }
+    self->next = thread;
+}
+
+bool scheduler_spawn(ModuleLink *ml, word pc, Frame *frame)
+{
+    if (!ensure_started()) {
+        return false;
+    }
+    Thread *thread = thread_alloc();
+    if (thread == NULL) {
+        return false;
+    }
+    // A thread taken from a free list keeps its stack.
+    thread->context = (ExecutionContext) {
+        .program_counter = pc,
+        .code = ml->module->code,
+        .mp = ml->mp,
+        .ml = ml,
+        .stack = thread->context.stack,
+    };
+    heap_retain(ml);
+    Frame *f = frame_alloc(&thread->context, frame->t);
+    if (f == NULL) {
+        heap_release(ml);
+        thread_destroy(thread);
+        return false;
+    }
+    memcpy(f + 1, frame + 1, (uptr) (thread->context.stack.top - (byte *) (f + 1)));
+    // The spawning thread drops its references when it frees the frame.
+    heap_retain_block((byte *) f, f->t);
+    // The new thread exits when the function returns.
+    thread->context.fp = (byte *) f;
+    atomic_fetch_add(&scheduler.nthreads, 1);
+    make_runnable(thread);
+    return true;
+}
+
+bool scheduler_spawn_module(ModuleLink *ml)
+{
+    if (!ensure_started()) {
+        return false;
+    }
+    Thread *thread = thread_alloc();
+    if (thread == NULL) {
+        return false;
+    }
+    stack_free(&thread->context.stack);
+    if (!execution_init(&thread->context, ml)) {
+        thread_destroy(thread);
+        return false;
+    }
+    atomic_fetch_add(&scheduler.nthreads, 1);
+    make_runnable(thread);
+    return true;
+}
+
+void scheduler_wait(void)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    while (atomic_load(&scheduler.nthreads) > 0) {
+        pthread_cond_wait(&scheduler.stopped, &scheduler.lock);
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+void scheduler_stop(void)
+{
+    scheduler_wait();
+    pthread_mutex_lock(&scheduler.lock);
+    if (!atomic_load(&scheduler.running)) {
+        pthread_mutex_unlock(&scheduler.lock);
+        return;
+    }
+    atomic_store(&scheduler.stopping, true);
+    pthread_cond_broadcast(&scheduler.work);
+    pthread_mutex_unlock(&scheduler.lock);
+
+    for (word i = 0; i < scheduler.nworkers; i++) {
+        Worker *worker = &scheduler.workers[i];
+        if (worker->created) {
+            pthread_join(worker->os_thread, NULL);
+        }
+        deque_free(&worker->deque);
+        pthread_mutex_destroy(&worker->inbox.lock);
+        while (worker->free != NULL) {
+            Thread *next = worker->free->next;
+            thread_destroy(worker->free);
+            worker->free = next;
+        }
+    }
+    // Only once no worker is left to read the list of readers.
+    for (word i = 0; i < scheduler.nworkers; i++) {
+        heap_reader_remove(&scheduler.workers[i].reader);
+    }
+    free(scheduler.workers);
+    scheduler.workers = NULL;
+    scheduler.nworkers = 0;
+    atomic_store(&scheduler.stopping, false);
+    atomic_store(&scheduler.running, false);
+}
@@ -0,0 +1,153 @@
+#ifndef DIS_SCHEDULER_H
+#define DIS_SCHEDULER_H
+
+// The scheduler multiplexes Dis threads onto a pool of OS worker threads.
+//
+// Each worker owns a work-stealing deque of runnable threads. A worker runs
+// threads from its own deque for a quantum at a time, putting each back at
+// the far end when its quantum runs out, and steals from the other workers'
+// deques when its own is empty. Threads spawned by a Dis thread go on the
+// deque of the worker running it; threads made runnable from outside the
+// pool go on a shared queue that idle workers check before stealing.
+//
+// A thread that blocks on a channel belongs to the channel until another
+// thread completes its communication and readies it. A thread readied by
+// the one a worker is running runs next on that worker, for what is left of
+// the quantum, so that threads passing messages back and forth stay on one
+// worker without going through its deque.
+//
+// On a machine with several NUMA nodes, each worker is kept to the
+// processors of one node, so the stacks and heap objects a worker allocates
+// for its threads are in that node's memory. Workers steal from others on
+// their node before they steal from other nodes. A channel belongs to the
+// node of the worker that allocated it, and a thread that communicates
+// mostly on the channels of another node moves there, to a worker that is
+// no busier than its own, so that senders and receivers do not pull the
+// channel's memory back and forth between nodes.
+
+#include "channel.h"
+#include "module.h"
+
+/// The number of instructions a thread dispatches before it yields to others.
+#define SCHEDULER_QUANTUM 2048
+
+/// A Dis thread.
+typedef struct Thread {
+    ExecutionContext context;
+    /// The thread's place in a channel's queue while it is blocked in `send`
+    /// or `recv`.
+    Waiter waiter;
+    /// Its places in the queues of the channels of an `alt`, and how many of
+    /// them there are, if it has ever executed one.
+    Waiter *alts;
+    word nalts;
+    /// The number of `alts` the thread has queued while blocking in an
+    /// `alt`, and still has to take back.
+    word nqueued;
+    /// The alternative the thread was selected for while blocked, or one of
+    /// `SELECT_WAITING` and `SELECT_BUSY`.
+    _Atomic word selected;
+    /// A `ThreadState`, which settles the race between the worker parking a
+    /// blocked thread and another thread readying it.
+    _Atomic int state;
+    /// The NUMA node the thread's stack was allocated on, or -1 if it is not
+    /// known.
+    word node;
+    /// The node whose channels the thread has mostly communicated on lately,
+    /// and by how many communications more than on others'.
+    word affinity_node;
+    word affinity;
+    /// The worker to move the thread to when it is next put back on a deque,
+    /// plus one, or 0 to leave it where it is.
+    word migrate;
+    /// Next thread in a queue of runnable threads, or on a worker's list of
+    /// free threads.
+    struct Thread *next;
+} Thread;
+
+typedef enum ThreadState {
+    /// The thread is running, or runnable.
+    THREAD_RUNNING,
+    /// The thread has blocked, and its worker has let go of it.
+    THREAD_BLOCKED,
+    /// The thread was readied before its worker let go of it.
+    THREAD_READY,
+} ThreadState;
+
+typedef enum SchedulerPlacement {
+    /// Keep each worker to the processors of one NUMA node, if there is more
+    /// than one node.
+    SCHEDULER_PIN_NODE,
+    /// Keep each worker to a processor of its own.
+    SCHEDULER_PIN_PROCESSOR,
+    /// Let the workers run on any processor, and ignore NUMA nodes.
+    SCHEDULER_UNPINNED,
+} SchedulerPlacement;
+
+/// Choose where the workers run the next time they are started.
+///
+/// The initial placement is `SCHEDULER_PIN_NODE`, unless the `DIS_PIN`
+/// environment variable is set to `processor` or `none`.
+///
+/// \param placement The placement.
+void scheduler_set_placement(SchedulerPlacement placement);
+
+/// Start the worker threads, unless they are running already. Spawning a
+/// thread starts them with the default number of workers if need be.
+///
+/// \param nworkers The number of workers, or 0 for one per processor.
+/// \return `false` if no worker could be created.
+bool scheduler_start(word nworkers);
+
+/// Create a thread that calls a function, and make it runnable.
+///
+/// \param ml The module containing the function.
+/// \param pc Entry point of the function.
+/// \param frame The function's frame, which is copied to the new thread's
+/// stack.
+/// \return `false` if there is no memory for the thread, or no worker could
+/// be created to run it.
+bool scheduler_spawn(ModuleLink *ml, word pc, Frame *frame);
+
+/// Create a thread that runs the entry point of a module, and make it
+/// runnable.
+///
+/// \param ml The module to run.
+/// \return `false` if the module has no entry point, there is no memory for
+/// the thread, or no worker could be created to run it.
+bool scheduler_spawn_module(ModuleLink *ml);
+
+/// Find the Dis thread running in an execution context.
+///
+/// \param context The execution context.
+/// \return The thread, or `NULL` if `context` is not being run by the
+/// scheduler on the calling OS thread, in which case it cannot block.
+Thread *scheduler_thread(ExecutionContext *context);
+
+/// The worker running on the calling OS thread, as the owner of memory it
+/// allocates.
+///
+/// \return The worker's number plus one, or 0 if the calling OS thread is not
+/// a worker.
+word scheduler_worker(void);
+
+/// Note that a thread has communicated on a channel, which draws it towards
+/// the channel's NUMA node.
+///
+/// \param context The execution context of the thread.
+/// \param c The channel.
+void scheduler_communicated(ExecutionContext *context, Channel *c);
+
+/// Make a thread that stopped with `EXEC_BLOCKED` runnable again. Each time
+/// a thread blocks, exactly one other thread must ready it.
+///
+/// \param thread The blocked thread.
+void scheduler_ready(Thread *thread);
+
+/// Wait until every Dis thread has stopped.
+void scheduler_wait(void);
+
+/// Stop the worker threads, once every Dis thread has stopped.
+void scheduler_stop(void);
+
+#endif //DIS_SCHEDULER_H
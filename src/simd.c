@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/// The high bit of every byte of a word.
+#define HIGH_BITS 0x8080808080808080u
+
+/// Read a word of bytes from anywhere.
+static inline uint64_t load_word(const byte *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof w);
+    return w;
+}
+
+static uptr ascii_prefix_scalar(const byte *p, uptr n)
+{
+    uptr i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t high = load_word(p + i) & HIGH_BITS;
+        if (high != 0) {
+            // Bytes are in memory order from the least significant end on a
+            // little-endian machine, and from the most significant on a
+            // big-endian one.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return i + (uptr) __builtin_clzll(high) / 8;
+#else
+            return i + (uptr) __builtin_ctzll(high) / 8;
+#endif
+        }
+    }
+    while (i < n && p[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+static uptr count_high_scalar(const byte *p, uptr n)
+{
+    uptr count = 0;
+    uptr i = 0;
+    for (; i + 8 <= n; i += 8) {
+        count += (uptr) __builtin_popcountll(load_word(p + i) & HIGH_BITS);
+    }
+    for (; i < n; i++) {
+        count += p[i] >> 7;
+    }
+    return count;
+}
+
+static void widen_scalar(uint32_t *dst, const byte *src, uptr n)
+{
+    for (uptr i = 0; i < n; i++) {
+        dst[i] = src[i];
+    }
+}
+
+#if SIMD_X86
+static uptr ascii_prefix_sse2(const byte *p, uptr n)
+{
+    uptr i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (p + i)));
+        if (mask != 0) {
+            return i + (uptr) __builtin_ctz(mask);
+        }
+    }
+    return i + ascii_prefix_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static uptr ascii_prefix_avx2(const byte *p, uptr n)
+{
+    uptr i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (p + i)));
+        if (mask != 0) {
+            return i + (uptr) __builtin_ctz(mask);
+        }
+    }
+    return i + ascii_prefix_sse2(p + i, n - i);
+}
+
+static uptr count_high_sse2(const byte *p, uptr n)
+{
+    uptr count = 0;
+    uptr i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (p + i)));
+        count += (uptr) __builtin_popcount(mask);
+    }
+    return count + count_high_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uptr count_high_avx2(const byte *p, uptr n)
+{
+    uptr count = 0;
+    uptr i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (p + i)));
+        count += (uptr) __builtin_popcount(mask);
+    }
+    return count + count_high_sse2(p + i, n - i);
+}
+
+static void widen_sse2(uint32_t *dst, const byte *src, uptr n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uptr i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi16(low, zero));
+        _mm_storeu_si128((__m128i *) (dst + i + 4), _mm_unpackhi_epi16(low, zero));
+        _mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpacklo_epi16(high, zero));
+        _mm_storeu_si128((__m128i *) (dst + i + 12), _mm_unpackhi_epi16(high, zero));
+    }
+    widen_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void widen_avx2(uint32_t *dst, const byte *src, uptr n)
+{
+    uptr i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i bytes = _mm_loadl_epi64((const __m128i *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_cvtepu8_epi32(bytes));
+    }
+    widen_scalar(dst + i, src + i, n - i);
+}
+
+/// Whether the processor has AVX2. The answer is read from what the
+/// compiler's runtime found out at startup, which is only a load.
+static inline bool have_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+uptr simd_ascii_prefix(const byte *p, uptr n)
+{
+#if SIMD_X86
+    return have_avx2() ? ascii_prefix_avx2(p, n) : ascii_prefix_sse2(p, n);
+#else
+    return ascii_prefix_scalar(p, n);
+#endif
+}
+
+uptr simd_count_high(const byte *p, uptr n)
+{
+#if SIMD_X86
+    return have_avx2() ? count_high_avx2(p, n) : count_high_sse2(p, n);
+#else
+    return count_high_scalar(p, n);
+#endif
+}
+
+void simd_widen(uint32_t *dst, const byte *src, uptr n)
+{
+#if SIMD_X86
+    if (have_avx2()) {
+        widen_avx2(dst, src, n);
+    } else {
+        widen_sse2(dst, src, n);
+    }
+#else
+    widen_scalar(dst, src, n);
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef DIS_SIMD_H
+#define DIS_SIMD_H
+
+// Kernels for the loops over bytes that converting between strings and byte
+// arrays spends its time in.
+//
+// On x86-64 each kernel has an AVX2 version, used if the processor has AVX2,
+// and an SSE2 version, which every x86-64 processor has. Elsewhere they work
+// on a word of bytes at a time.
+
+#include "types.h"
+
+/// Count the bytes at the start of a block that are ASCII, below 0x80.
+///
+/// \param p The bytes.
+/// \param n The number of bytes.
+/// \return The number of bytes before the first one that is not ASCII, or
+/// `n` if they all are.
+uptr simd_ascii_prefix(const byte *p, uptr n);
+
+/// Count the bytes in a block that are not ASCII.
+///
+/// \param p The bytes.
+/// \param n The number of bytes.
+/// \return The number of bytes that are 0x80 or above.
+uptr simd_count_high(const byte *p, uptr n);
+
+/// Widen bytes to 32-bit characters.
+///
+/// \param dst Where to put the characters. Must not overlap `src`.
+/// \param src The bytes.
+/// \param n The number of bytes.
+void simd_widen(uint32_t *dst, const byte *src, uptr n);
+
+#endif //DIS_SIMD_H
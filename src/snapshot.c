@@ -0,0 +1,1010 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "heap.h"
+#include "snapshot.h"
+#include "str.h"
+
+// A snapshot is a header followed by three sections: the modules, each as
+// its path and object code; the type descriptors, each as the number of a
+// module and of one of its types, or spelled out; and the heap objects, in
+// the order they were reached from the module link, which comes first. In
+// memory copied from objects and module data, each pointer is replaced by a
+// reference: 0 for `H`, or one more than the number of the object it points
+// to. Numbers are in the byte order of the machine.
+
+#define SNAPSHOT_MAGIC "DISSNAP\n"
+
+/// The version of the snapshot format.
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nmodules;
+    uint32_t ntypes;
+    uint32_t nobjects;
+} SnapshotHeader;
+
+/// How a type descriptor is recorded.
+enum {
+    /// As the numbers of a module and of the type in it.
+    TYPE_MODULE,
+    /// As its size and pointer map.
+    TYPE_VALUE,
+};
+
+/// Whether pointer slot `i` of memory of type `t` holds a pointer.
+static bool is_pointer(const TypeDescriptor *t, uptr i)
+{
+    return t->map[i / 8] & 0x80 >> i % 8;
+}
+
+/// The number of pointer slots of memory of type `t` that lie within `size`
+/// bytes.
+static uptr pointer_slots(const TypeDescriptor *t, uptr size)
+{
+    uptr slots = (uptr) t->np * 8;
+    return slots < size / sizeof(pointer) ? slots : size / sizeof(pointer);
+}
+
+/// Numbers given to pointers in the order they were first seen, with a hash
+/// table to find them by.
+typedef struct Numbering {
+    const void **items;
+    uptr n;
+    uptr capacity;
+    /// Each slot is one more than the number of a pointer, or 0 if it is
+    /// empty. There are `mask + 1` of them.
+    uint32_t *slots;
+    uptr mask;
+} Numbering;
+
+static uptr hash_pointer(const void *p)
+{
+    return (uptr) (((uint64_t) (uptr) p * 0x9E3779B97F4A7C15) >> 32);
+}
+
+/// Find the number of a pointer.
+///
+/// \param added Location to store whether the pointer has been numbered by
+/// this call, or `NULL` only to look for it.
+/// \return The number, or -1 if the pointer has none and `added` is `NULL`.
+static int64_t number(Numbering *numbering, const void *p, bool *added)
+{
+    if (numbering->slots == NULL) {
+        if (added == NULL) {
+            return -1;
+        }
+        numbering->mask = 63;
+        numbering->slots = calloc(numbering->mask + 1, sizeof(uint32_t));
+    }
+    uptr i = hash_pointer(p) & numbering->mask;
+    for (; numbering->slots[i] != 0; i = (i + 1) & numbering->mask) {
+        uint32_t n = numbering->slots[i] - 1;
+        if (numbering->items[n] == p) {
+            if (added != NULL) {
+                *added = false;
+            }
+            return n;
+        }
+    }
+    if (added == NULL) {
+        return -1;
+    }
+    *added = true;
+
+    if (numbering->n == numbering->capacity) {
+        numbering->capacity = numbering->capacity ? numbering->capacity * 2 : 64;
+        numbering->items = realloc(numbering->items,
+                                   numbering->capacity * sizeof(const void *));
+    }
+    uptr n = numbering->n++;
+    numbering->items[n] = p;
+    numbering->slots[i] = (uint32_t) n + 1;
+
+    // Keep the table at most half full.
+    if (numbering->n * 2 > numbering->mask + 1) {
+        free(numbering->slots);
+        numbering->mask = numbering->mask * 2 + 1;
+        numbering->slots = calloc(numbering->mask + 1, sizeof(uint32_t));
+        for (uptr j = 0; j < numbering->n; j++) {
+            uptr k = hash_pointer(numbering->items[j]) & numbering->mask;
+            while (numbering->slots[k] != 0) {
+                k = (k + 1) & numbering->mask;
+            }
+            numbering->slots[k] = (uint32_t) j + 1;
+        }
+    }
+    return (int64_t) n;
+}
+
+static void numbering_free(Numbering *numbering)
+{
+    free(numbering->items);
+    free(numbering->slots);
+}
+
+/// Bytes written so far.
+typedef struct Buffer {
+    byte *data;
+    uptr size;
+    uptr capacity;
+} Buffer;
+
+/// Make room for `n` more bytes at the end of a buffer.
+///
+/// \return Where they go, until the buffer next grows.
+static byte *reserve(Buffer *buffer, uptr n)
+{
+    if (buffer->capacity - buffer->size < n) {
+        uptr capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity - buffer->size < n) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    byte *p = buffer->data + buffer->size;
+    buffer->size += n;
+    return p;
+}
+
+static void put(Buffer *buffer, const void *p, uptr n)
+{
+    if (n > 0) {
+        memcpy(reserve(buffer, n), p, n);
+    }
+}
+
+static void put8(Buffer *buffer, byte v)
+{
+    put(buffer, &v, sizeof v);
+}
+
+static void put32(Buffer *buffer, uint32_t v)
+{
+    put(buffer, &v, sizeof v);
+}
+
+static void put64(Buffer *buffer, uint64_t v)
+{
+    put(buffer, &v, sizeof v);
+}
+
+/// What is known while taking a snapshot.
+typedef struct Saver {
+    Numbering objects;
+    Numbering modules;
+    Numbering types;
+    /// Modules with `SHAREMP` set whose data has been written.
+    Numbering shared;
+    /// The objects section.
+    Buffer out;
+    const char *error;
+} Saver;
+
+/// The reference that stands for a pointer, numbering the object it points
+/// to if it has not been reached before.
+static uint64_t reference(Saver *saver, pointer p)
+{
+    bool added;
+    return p == H ? 0 : (uint64_t) number(&saver->objects, p, &added) + 1;
+}
+
+/// The number that stands for a type descriptor: 0 for none, otherwise one
+/// more than the type's number.
+static uint32_t type_reference(Saver *saver, TypeDescriptor *t)
+{
+    bool added;
+    return t == NULL ? 0 : (uint32_t) number(&saver->types, t, &added) + 1;
+}
+
+/// Write `count` elements of `size` bytes of type `t`, replacing their
+/// pointers by references.
+static void put_block(Saver *saver, const byte *p, const TypeDescriptor *t,
+                      uptr count, uptr size)
+{
+    if (count == 0 || size == 0) {
+        return;
+    }
+    byte *out = reserve(&saver->out, count * size);
+    memcpy(out, p, count * size);
+    if (!type_has_pointers(t)) {
+        return;
+    }
+    uptr slots = pointer_slots(t, size);
+    for (uptr e = 0; e < count; e++) {
+        for (uptr i = 0; i < slots; i++) {
+            if (is_pointer(t, i)) {
+                uptr offset = e * size + i * sizeof(pointer);
+                pointer v;
+                memcpy(&v, p + offset, sizeof v);
+                uint64_t r = reference(saver, v);
+                memcpy(out + offset, &r, sizeof r);
+            }
+        }
+    }
+}
+
+/// Write a heap object, numbering the objects it points to.
+static void save_object(Saver *saver, pointer p)
+{
+    Heap *h = heap_header(p);
+    Buffer *out = &saver->out;
+    put8(out, h->kind);
+    switch (h->kind) {
+        case HEAP_RECORD:
+            put32(out, type_reference(saver, h->t));
+            put32(out, h->size);
+            put_block(saver, p, h->t, 1, h->size);
+            break;
+        case HEAP_ARRAY: {
+            Array *a = p;
+            put32(out, type_reference(saver, a->t));
+            put32(out, (uint32_t) a->len);
+            put64(out, reference(saver, a->root));
+            if (a->root != H) {
+                uptr size = (uptr) a->t->size;
+                put32(out, size ? (uint32_t) ((uptr) (a->data - a->root->data) / size) : 0);
+            } else {
+                put_block(saver, a->data, a->t, (uptr) a->len, (uptr) a->t->size);
+            }
+            break;
+        }
+        case HEAP_LIST: {
+            List *l = p;
+            uptr size = h->size - sizeof(List);
+            put32(out, type_reference(saver, h->t));
+            put32(out, (uint32_t) size);
+            put64(out, reference(saver, l->tail));
+            put_block(saver, l->data, h->t, 1, size);
+            break;
+        }
+        case HEAP_CHANNEL: {
+            Channel *c = p;
+            uptr head = atomic_load_explicit(&c->head, memory_order_relaxed);
+            uptr tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+            if (head != tail ||
+                atomic_load_explicit(&c->senders.head, memory_order_relaxed) != NULL ||
+                atomic_load_explicit(&c->receivers.head, memory_order_relaxed) != NULL) {
+                saver->error = "a channel has values buffered or threads waiting";
+            }
+            put32(out, type_reference(saver, c->t));
+            put32(out, (uint32_t) c->size);
+            put32(out, (uint32_t) c->capacity);
+            break;
+        }
+        case HEAP_MODULE: {
+            ModuleLink *ml = p;
+            Module *module = ml->module;
+            bool added;
+            put32(out, (uint32_t) number(&saver->modules, module, &added));
+            put32(out, (uint32_t) ml->nlinks);
+            for (word i = 0; i < ml->nlinks; i++) {
+                put32(out, (uint32_t) ml->links[i].pc);
+                put32(out, type_reference(saver, ml->links[i].frame));
+            }
+            // Shared module data is written with the first link to it.
+            bool data = true;
+            if (module->flags & SHAREMP) {
+                number(&saver->shared, module, &data);
+            }
+            put8(out, data);
+            if (data) {
+                put_block(saver, ml->mp, module->data_type, 1, (uptr) module->data_size);
+            }
+            break;
+        }
+        case HEAP_STRING: {
+            uptr size;
+            char *utf8 = string_to_utf8(p, &size);
+            put8(out, ((String *) p)->interned);
+            put64(out, size);
+            put(out, utf8, size);
+            free(utf8);
+            break;
+        }
+        default:
+            saver->error = "unknown heap object";
+            break;
+    }
+}
+
+/// Read an object file whole, if its contents are still those a module was
+/// decoded from.
+static byte *read_object_file(const Module *module, uptr *size)
+{
+    int fd = open(module->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    byte *image = NULL;
+    if (fstat(fd, &st) == 0) {
+        *size = st.st_size;
+        image = malloc(*size ? *size : 1);
+        uptr done = 0;
+        while (image != NULL && done < *size) {
+            ssize_t n = read(fd, image + done, *size - done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        if (done != *size || module_hash(image, *size) != module->hash) {
+            free(image);
+            image = NULL;
+        }
+    }
+    close(fd);
+    return image;
+}
+
+/// Write the modules section.
+static void save_modules(Saver *saver, Buffer *out)
+{
+    for (uptr i = 0; i < saver->modules.n && saver->error == NULL; i++) {
+        Module *module = (Module *) saver->modules.items[i];
+        // A module's hash is known once its code has been decoded.
+        if (module_code(module) == NULL) {
+            saver->error = "a module has invalid code";
+            break;
+        }
+        uptr size;
+        byte *image = read_object_file(module, &size);
+        if (image == NULL) {
+            saver->error = "the object file of a module cannot be read, or has changed";
+            break;
+        }
+        uptr length = strlen(module->path);
+        put32(out, (uint32_t) length);
+        put(out, module->path, length);
+        put64(out, size);
+        put(out, image, size);
+        free(image);
+    }
+}
+
+/// Write the types section, naming the types of modules in the snapshot by
+/// their numbers.
+static void save_types(Saver *saver, Buffer *out)
+{
+    uptr n = saver->types.n;
+    uint32_t *owners = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *indices = malloc((n + 1) * sizeof(uint32_t));
+    for (uptr i = 0; i < n; i++) {
+        owners[i] = UINT32_MAX;
+    }
+    for (uptr m = 0; m < saver->modules.n; m++) {
+        const Module *module = saver->modules.items[m];
+        for (word i = 0; i < module->ntypes; i++) {
+            int64_t t = module->types[i] != NULL
+                            ? number(&saver->types, module->types[i], NULL)
+                            : -1;
+            if (t >= 0 && owners[t] == UINT32_MAX) {
+                owners[t] = (uint32_t) m;
+                indices[t] = (uint32_t) i;
+            }
+        }
+    }
+    for (uptr i = 0; i < n; i++) {
+        const TypeDescriptor *t = saver->types.items[i];
+        if (owners[i] != UINT32_MAX) {
+            put8(out, TYPE_MODULE);
+            put32(out, owners[i]);
+            put32(out, indices[i]);
+        } else {
+            put8(out, TYPE_VALUE);
+            put32(out, (uint32_t) t->size);
+            put32(out, (uint32_t) t->np);
+            put(out, t->map, (uptr) t->np);
+        }
+    }
+    free(owners);
+    free(indices);
+}
+
+/// Write a file, replacing it in one step.
+static bool write_file(const char *path, const Buffer *const *parts, int nparts)
+{
+    uptr length = strlen(path);
+    char *temporary = malloc(length + sizeof ".XXXXXX");
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".XXXXXX", sizeof ".XXXXXX");
+    int fd = mkstemp(temporary);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool written = file != NULL && fchmod(fd, 0644) == 0;
+    for (int i = 0; written && i < nparts; i++) {
+        written = parts[i]->size == 0 ||
+                  fwrite(parts[i]->data, 1, parts[i]->size, file) == parts[i]->size;
+    }
+    if (file != NULL) {
+        written &= fclose(file) == 0;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (fd >= 0) {
+        written = written && rename(temporary, path) == 0;
+        if (!written) {
+            remove(temporary);
+        }
+    }
+    free(temporary);
+    return written;
+}
+
+bool snapshot_save(ModuleLink *ml, const char *path, const char **error)
+{
+    Saver saver = {0};
+    reference(&saver, ml);
+    for (uptr i = 0; i < saver.objects.n && saver.error == NULL; i++) {
+        save_object(&saver, (pointer) saver.objects.items[i]);
+    }
+
+    Buffer header = {0}, modules = {0}, types = {0};
+    save_modules(&saver, &modules);
+    save_types(&saver, &types);
+    SnapshotHeader h = {
+        .version = SNAPSHOT_VERSION,
+        .nmodules = (uint32_t) saver.modules.n,
+        .ntypes = (uint32_t) saver.types.n,
+        .nobjects = (uint32_t) saver.objects.n,
+    };
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+    put(&header, &h, sizeof h);
+
+    const Buffer *parts[] = {&header, &modules, &types, &saver.out};
+    if (saver.error == NULL && !write_file(path, parts, 4)) {
+        saver.error = "cannot write snapshot";
+    }
+    if (saver.error != NULL && error != NULL) {
+        *error = saver.error;
+    }
+    bool saved = saver.error == NULL;
+    free(header.data);
+    free(modules.data);
+    free(types.data);
+    free(saver.out.data);
+    numbering_free(&saver.objects);
+    numbering_free(&saver.modules);
+    numbering_free(&saver.types);
+    numbering_free(&saver.shared);
+    return saved;
+}
+
+/// A position in a snapshot being restored.
+typedef struct Reader {
+    const byte *p;
+    const byte *end;
+    const char *error;
+} Reader;
+
+/// Step over `n` bytes.
+///
+/// \return Where they start, or `NULL` if the snapshot ends first.
+static const byte *take(Reader *reader, uptr n)
+{
+    if (reader->error != NULL || (uptr) (reader->end - reader->p) < n) {
+        reader->error = reader->error ? reader->error : "truncated snapshot";
+        return NULL;
+    }
+    const byte *p = reader->p;
+    reader->p += n;
+    return p;
+}
+
+static byte get8(Reader *reader)
+{
+    const byte *p = take(reader, 1);
+    return p != NULL ? *p : 0;
+}
+
+static uint32_t get32(Reader *reader)
+{
+    uint32_t v = 0;
+    const byte *p = take(reader, sizeof v);
+    if (p != NULL) {
+        memcpy(&v, p, sizeof v);
+    }
+    return v;
+}
+
+static uint64_t get64(Reader *reader)
+{
+    uint64_t v = 0;
+    const byte *p = take(reader, sizeof v);
+    if (p != NULL) {
+        memcpy(&v, p, sizeof v);
+    }
+    return v;
+}
+
+/// Objects are restored in three passes over the objects section: the first
+/// creates every object but slices, the second the slices, and the third
+/// fills in the pointers between them.
+typedef enum Pass {
+    PASS_CREATE,
+    PASS_SLICE,
+    PASS_LINK,
+} Pass;
+
+/// What has been restored so far.
+typedef struct Restorer {
+    Reader reader;
+    uptr nmodules;
+    Module **modules;
+    /// Whether anything links to each module yet, so that it is freed with
+    /// its last link.
+    bool *linked;
+    uptr ntypes;
+    TypeDescriptor **types;
+    /// Whether each type was spelled out, so that the restorer holds a
+    /// reference to it.
+    bool *spelled;
+    uptr nobjects;
+    pointer *objects;
+    /// Where each object's part of the objects section starts.
+    const byte **starts;
+    /// The reference to each list cell's tail, and 0 for other objects.
+    uint64_t *tails;
+} Restorer;
+
+static void invalid(Restorer *restorer)
+{
+    if (restorer->reader.error == NULL) {
+        restorer->reader.error = "invalid snapshot";
+    }
+}
+
+/// Note that something restored is `NULL` because there is no memory for it,
+/// unless it is not.
+///
+/// \return Whether it is.
+static bool exhausted(Restorer *restorer, const void *p)
+{
+    if (p == NULL && restorer->reader.error == NULL) {
+        restorer->reader.error = "out of memory";
+    }
+    return p == NULL;
+}
+
+/// The type descriptor a type reference stands for.
+static TypeDescriptor *restore_type(Restorer *restorer, uint32_t r)
+{
+    if (r > restorer->ntypes) {
+        invalid(restorer);
+        return NULL;
+    }
+    return r == 0 ? NULL : restorer->types[r - 1];
+}
+
+/// The object a reference stands for.
+static pointer restore_pointer(Restorer *restorer, uint64_t r)
+{
+    if (r > restorer->nobjects) {
+        invalid(restorer);
+        return H;
+    }
+    return r == 0 ? H : restorer->objects[r - 1];
+}
+
+/// Restore `count` elements of `size` bytes of type `t`: their plain bytes
+/// as they are created, with their pointers `H`, and then their pointers.
+static void restore_block(Restorer *restorer, byte *dst, const TypeDescriptor *t,
+                          uptr count, uptr size, Pass pass)
+{
+    if (size != 0 && count > UINTPTR_MAX / size) {
+        invalid(restorer);
+        return;
+    }
+    const byte *src = take(&restorer->reader, count * size);
+    if (src == NULL || pass == PASS_SLICE || count * size == 0) {
+        return;
+    }
+    uptr slots = type_has_pointers(t) ? pointer_slots(t, size) : 0;
+    if (pass == PASS_CREATE) {
+        memcpy(dst, src, count * size);
+    }
+    for (uptr e = 0; e < count; e++) {
+        for (uptr i = 0; i < slots; i++) {
+            if (!is_pointer(t, i)) {
+                continue;
+            }
+            uptr offset = e * size + i * sizeof(pointer);
+            pointer p = H;
+            if (pass == PASS_LINK) {
+                uint64_t r;
+                memcpy(&r, src + offset, sizeof r);
+                p = restore_pointer(restorer, r);
+                heap_retain(p);
+            }
+            memcpy(dst + offset, &p, sizeof p);
+        }
+    }
+}
+
+/// Restore a module link, in the first pass, or the pointers in its data.
+static void restore_module_link(Restorer *restorer, uptr k, Pass pass)
+{
+    Reader *reader = &restorer->reader;
+    uint32_t m = get32(reader);
+    uint32_t nlinks = get32(reader);
+    if (reader->error != NULL || m >= restorer->nmodules ||
+        nlinks > (uptr) (reader->end - reader->p) / 8) {
+        invalid(restorer);
+        return;
+    }
+    Module *module = restorer->modules[m];
+    Link *links = NULL;
+    if (pass == PASS_CREATE) {
+        links = malloc((nlinks + 1) * sizeof(Link));
+        if (exhausted(restorer, links)) {
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < nlinks; i++) {
+        word pc = (word) get32(reader);
+        TypeDescriptor *frame = restore_type(restorer, get32(reader));
+        if (pc < 0 || pc >= module->ninstructions || frame == NULL) {
+            invalid(restorer);
+        }
+        if (links != NULL) {
+            links[i] = (Link) {pc, frame};
+        }
+    }
+    bool data = get8(reader);
+
+    ModuleLink *ml = restorer->objects[k];
+    if (pass == PASS_CREATE && reader->error == NULL) {
+        ml = module_link_records(module, (word) nlinks, links);
+        if (!exhausted(restorer, ml)) {
+            restorer->objects[k] = ml;
+            restorer->linked[m] = true;
+            if (data && module->data_type != NULL) {
+                heap_clear(ml->mp, module->data_type);
+            }
+        }
+    }
+    free(links);
+    if (data) {
+        restore_block(restorer, ml != NULL ? ml->mp : NULL, module->data_type, 1,
+                      (uptr) module->data_size, pass);
+    }
+}
+
+/// Restore an object, or what the pass does of it.
+static void restore_object(Restorer *restorer, uptr k, Pass pass)
+{
+    Reader *reader = &restorer->reader;
+    reader->p = restorer->starts[k];
+    byte kind = get8(reader);
+    pointer p = restorer->objects[k];
+    switch (kind) {
+        case HEAP_RECORD: {
+            TypeDescriptor *t = restore_type(restorer, get32(reader));
+            uint32_t size = get32(reader);
+            if (t != NULL && (uptr) t->size > size) {
+                invalid(restorer);
+            }
+            if (pass == PASS_CREATE && reader->error == NULL) {
+                p = heap_alloc(HEAP_RECORD, t, size);
+                exhausted(restorer, p);
+                restorer->objects[k] = p;
+            }
+            restore_block(restorer, p, t, 1, size, pass);
+            break;
+        }
+        case HEAP_ARRAY: {
+            TypeDescriptor *t = restore_type(restorer, get32(reader));
+            word len = (word) get32(reader);
+            uint64_t root = get64(reader);
+            if (t == NULL || len < 0 || t->size < 0) {
+                invalid(restorer);
+                break;
+            }
+            if (root != 0) {
+                word start = (word) get32(reader);
+                if (pass == PASS_SLICE && reader->error == NULL) {
+                    Array *a = restore_pointer(restorer, root);
+                    if (a == H || heap_header(a)->kind != HEAP_ARRAY || a->root != H ||
+                        a->t != t || start < 0 || start > a->len - len) {
+                        invalid(restorer);
+                        break;
+                    }
+                    restorer->objects[k] = heap_slice(a, start, start + len);
+                    exhausted(restorer, restorer->objects[k]);
+                }
+                break;
+            }
+            if (pass == PASS_CREATE && reader->error == NULL) {
+                if ((uptr) len * (uptr) t->size > (uptr) (reader->end - reader->p)) {
+                    invalid(restorer);
+                    break;
+                }
+                p = heap_array(t, len);
+                exhausted(restorer, p);
+                restorer->objects[k] = p;
+            }
+            restore_block(restorer, p != H ? ((Array *) p)->data : NULL, t, (uptr) len,
+                          (uptr) t->size, pass);
+            break;
+        }
+        case HEAP_LIST: {
+            TypeDescriptor *t = restore_type(restorer, get32(reader));
+            uint32_t size = get32(reader);
+            uint64_t tail = get64(reader);
+            if (t != NULL && (uptr) t->size > size) {
+                invalid(restorer);
+            }
+            if (pass == PASS_CREATE && reader->error == NULL) {
+                p = heap_alloc(HEAP_LIST, t, sizeof(List) + size);
+                exhausted(restorer, p);
+                restorer->objects[k] = p;
+            }
+            if (pass == PASS_LINK && reader->error == NULL) {
+                List *l = p;
+                l->tail = restore_pointer(restorer, tail);
+                if (l->tail != H && heap_header(l->tail)->kind != HEAP_LIST) {
+                    invalid(restorer);
+                    l->tail = H;
+                }
+                heap_retain(l->tail);
+                restorer->tails[k] = l->tail != H ? tail : 0;
+            }
+            restore_block(restorer, p != H ? ((List *) p)->data : NULL, t, 1, size, pass);
+            break;
+        }
+        case HEAP_CHANNEL: {
+            TypeDescriptor *t = restore_type(restorer, get32(reader));
+            word size = (word) get32(reader);
+            word capacity = (word) get32(reader);
+            if (size < 0 || capacity < 0 || (t != NULL && t->size != size)) {
+                invalid(restorer);
+            }
+            if (pass == PASS_CREATE && reader->error == NULL) {
+                restorer->objects[k] = channel_new(size, t, capacity);
+                exhausted(restorer, restorer->objects[k]);
+            }
+            break;
+        }
+        case HEAP_MODULE:
+            restore_module_link(restorer, k, pass);
+            break;
+        case HEAP_STRING: {
+            bool interned = get8(reader);
+            uint64_t size = get64(reader);
+            const byte *utf8 = take(reader, size);
+            if (pass == PASS_CREATE && utf8 != NULL) {
+                restorer->objects[k] = interned ? string_intern((const char *) utf8, size)
+                                                : string_utf8((const char *) utf8, size);
+                exhausted(restorer, restorer->objects[k]);
+            }
+            break;
+        }
+        default:
+            invalid(restorer);
+            break;
+    }
+    if (k + 1 < restorer->nobjects && pass == PASS_CREATE) {
+        restorer->starts[k + 1] = reader->p;
+    }
+}
+
+/// Whether following the tails of the lists restored leads back to where it
+/// started. No program can make such a list, and the heap does not look for
+/// cycles of lists whose heads have no pointers, so it could never free one.
+/// Also `true` if there is no memory to find out.
+static bool lists_cycle(Restorer *restorer)
+{
+    byte *state = calloc(restorer->nobjects, 1);
+    if (exhausted(restorer, state)) {
+        return true;
+    }
+    enum { UNSEEN, FOLLOWING, FINISHED };
+    bool cycle = false;
+    for (uptr k = 0; k < restorer->nobjects && !cycle; k++) {
+        uptr i = k;
+        while (restorer->tails[i] != 0 && state[i] == UNSEEN) {
+            state[i] = FOLLOWING;
+            i = restorer->tails[i] - 1;
+        }
+        cycle = state[i] == FOLLOWING;
+        for (i = k; state[i] == FOLLOWING; i = restorer->tails[i] - 1) {
+            state[i] = FINISHED;
+        }
+    }
+    free(state);
+    return cycle;
+}
+
+/// Decode the modules section.
+static void restore_modules(Restorer *restorer)
+{
+    Reader *reader = &restorer->reader;
+    for (uptr i = 0; i < restorer->nmodules && reader->error == NULL; i++) {
+        uint32_t length = get32(reader);
+        const byte *path = take(reader, length);
+        uint64_t size = get64(reader);
+        const byte *image = take(reader, size);
+        if (image == NULL) {
+            break;
+        }
+        char *name = strndup((const char *) path, length);
+        if (exhausted(restorer, name)) {
+            break;
+        }
+        const char *error = NULL;
+        restorer->modules[i] = module_decode(image, size, name, &error);
+        free(name);
+        if (restorer->modules[i] == NULL) {
+            reader->error = error;
+        }
+    }
+}
+
+/// Decode the types section.
+static void restore_types(Restorer *restorer)
+{
+    Reader *reader = &restorer->reader;
+    for (uptr i = 0; i < restorer->ntypes && reader->error == NULL; i++) {
+        if (get8(reader) == TYPE_MODULE) {
+            uint32_t m = get32(reader);
+            uint32_t index = get32(reader);
+            if (reader->error == NULL &&
+                (m >= restorer->nmodules || index >= (uint32_t) restorer->modules[m]->ntypes ||
+                 restorer->modules[m]->types[index] == NULL)) {
+                invalid(restorer);
+                break;
+            }
+            if (reader->error == NULL) {
+                restorer->types[i] = restorer->modules[m]->types[index];
+            }
+            continue;
+        }
+        word size = (word) get32(reader);
+        word np = (word) get32(reader);
+        const byte *map = np >= 0 ? take(reader, (uptr) np) : NULL;
+        if (map == NULL || size < 0) {
+            invalid(restorer);
+            break;
+        }
+        TypeDescriptor *t = calloc(1, sizeof(TypeDescriptor) + (uptr) np);
+        if (exhausted(restorer, t)) {
+            break;
+        }
+        t->size = size;
+        t->np = np;
+        atomic_init(&t->references, 1);
+        memcpy(t->map, map, (uptr) np);
+        restorer->types[i] = t;
+        restorer->spelled[i] = true;
+        // The heap takes every pointer a map marks to be inside the memory.
+        for (uptr slot = (uptr) size / sizeof(pointer); slot < (uptr) np * 8; slot++) {
+            if (is_pointer(t, slot)) {
+                invalid(restorer);
+                break;
+            }
+        }
+    }
+}
+
+ModuleLink *snapshot_restore(const char *path, const char **error)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (error != NULL) {
+            *error = "cannot open snapshot";
+        }
+        return NULL;
+    }
+    uptr file_size = st.st_size;
+    void *file = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                               : MAP_FAILED;
+    close(fd);
+    if (file == MAP_FAILED) {
+        if (error != NULL) {
+            *error = "cannot read snapshot";
+        }
+        return NULL;
+    }
+
+    Restorer restorer = {.reader = {.p = file, .end = (byte *) file + file_size}};
+    Reader *reader = &restorer.reader;
+    SnapshotHeader header;
+    const byte *h = take(reader, sizeof header);
+    if (h != NULL) {
+        memcpy(&header, h, sizeof header);
+        // Every module, type and object takes at least a byte.
+        uptr rest = (uptr) (reader->end - reader->p);
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) != 0 ||
+            header.version != SNAPSHOT_VERSION) {
+            reader->error = "not a snapshot, or from another version";
+        } else if (header.nobjects == 0 || header.nmodules > rest ||
+                   header.ntypes > rest || header.nobjects > rest) {
+            invalid(&restorer);
+        }
+    }
+    if (reader->error == NULL) {
+        restorer.nmodules = header.nmodules;
+        restorer.modules = calloc(header.nmodules + 1, sizeof(Module *));
+        restorer.linked = calloc(header.nmodules + 1, sizeof(bool));
+        restorer.ntypes = header.ntypes;
+        restorer.types = calloc(header.ntypes + 1, sizeof(TypeDescriptor *));
+        restorer.spelled = calloc(header.ntypes + 1, sizeof(bool));
+        restorer.nobjects = header.nobjects;
+        restorer.objects = calloc(header.nobjects, sizeof(pointer));
+        restorer.starts = calloc(header.nobjects, sizeof(byte *));
+        restorer.tails = calloc(header.nobjects, sizeof(uint64_t));
+        if (restorer.modules == NULL || restorer.linked == NULL || restorer.types == NULL ||
+            restorer.spelled == NULL || restorer.objects == NULL || restorer.starts == NULL ||
+            restorer.tails == NULL) {
+            exhausted(&restorer, NULL);
+            // Nothing has been restored for the cleanup to look at.
+            restorer.nmodules = restorer.ntypes = restorer.nobjects = 0;
+        }
+        restore_modules(&restorer);
+        restore_types(&restorer);
+        if (reader->error == NULL) {
+            restorer.starts[0] = reader->p;
+        }
+    }
+    for (Pass pass = PASS_CREATE; pass <= PASS_LINK; pass++) {
+        for (uptr k = 0; k < restorer.nobjects && reader->error == NULL; k++) {
+            restore_object(&restorer, k, pass);
+        }
+    }
+    if (reader->error == NULL &&
+        (restorer.objects[0] == H || heap_header(restorer.objects[0])->kind != HEAP_MODULE ||
+         lists_cycle(&restorer))) {
+        invalid(&restorer);
+    }
+
+    // The restorer's references to the objects go; the caller gets the
+    // link's, unless the snapshot could not be restored.
+    ModuleLink *ml = reader->error == NULL ? restorer.objects[0] : NULL;
+    for (uptr k = 0; ml == NULL && k < restorer.nobjects; k++) {
+        // Lists given cyclic tails go in pieces.
+        if (restorer.tails[k] != 0) {
+            List *l = restorer.objects[k];
+            List *tail = l->tail;
+            l->tail = H;
+            heap_release(tail);
+        }
+    }
+    for (uptr k = ml != NULL ? 1 : 0; k < restorer.nobjects; k++) {
+        heap_release(restorer.objects[k]);
+    }
+    for (uptr m = 0; m < restorer.nmodules; m++) {
+        if (restorer.modules[m] != NULL && !restorer.linked[m]) {
+            module_free(restorer.modules[m]);
+        }
+    }
+    for (uptr t = 0; t < restorer.ntypes; t++) {
+        if (restorer.spelled[t]) {
+            type_release(restorer.types[t]);
+        }
+    }
+    if (ml == NULL && error != NULL) {
+        *error = reader->error;
+    }
+    free(restorer.modules);
+    free(restorer.linked);
+    free(restorer.types);
+    free(restorer.spelled);
+    free(restorer.objects);
+    free(restorer.starts);
+    free(restorer.tails);
+    munmap(file, file_size);
+    return ml;
+}
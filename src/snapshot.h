@@ -0,0 +1,48 @@
+#ifndef DIS_SNAPSHOT_H
+#define DIS_SNAPSHOT_H
+
+// Snapshots of a program once it has initialised itself, so that a new
+// process can start from there rather than loading and initialising every
+// module again.
+//
+// A snapshot holds a module link and everything reachable from it: the
+// modules linked to and their linkage records, the data of every link, and
+// the records, arrays, lists, strings and channels the data points to,
+// however they point to each other. Restoring it maps the file and rebuilds
+// them all without running any Dis code or reading any other file.
+//
+// Modules are kept as their object code, and decoded again as they are
+// restored, rather than as decoded instructions: decoding is quick, while
+// decoded instructions hold addresses in the interpreter, which move between
+// processes, and are rewritten as the code runs. Restored modules use their
+// compiled images as modules read from files do, but are not in the module
+// cache. Strings are kept as UTF-8, and interned strings interned again.
+//
+// Threads are not part of a snapshot, so it has to be taken while no thread
+// can change what it holds, and any channel in it must have no values
+// buffered and no threads waiting.
+
+#include "module.h"
+
+/// Write a snapshot of a module link and everything reachable from it.
+///
+/// The object files of the modules reachable are read again, and must not
+/// have changed since the modules were read from them.
+///
+/// \param ml The module link.
+/// \param path Path to the snapshot, which is replaced in one step.
+/// \param error Location to store a description of the problem in if the
+/// snapshot cannot be written. May be `NULL`.
+/// \return Whether the snapshot was written.
+bool snapshot_save(ModuleLink *ml, const char *path, const char **error);
+
+/// Restore a snapshot written by `snapshot_save()`.
+///
+/// \param path Path to the snapshot.
+/// \param error Location to store a description of the problem in if the
+/// snapshot cannot be restored. May be `NULL`.
+/// \return The module link the snapshot was taken of, with one reference to
+/// it, or `NULL` on failure.
+ModuleLink *snapshot_restore(const char *path, const char **error);
+
+#endif //DIS_SNAPSHOT_H
@@ -0,0 +1,650 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "simd.h"
+#include "str.h"
+
+/// The longest string that concatenation copies rather than making a rope.
+#define STRING_LEAF 256
+
+#define WIDTH(wide) ((wide) ? sizeof(Rune) : sizeof(byte))
+
+/// Allocate a flat string, with room for `capacity` characters.
+///
+/// \return The string, or `NULL` if there is no memory for it.
+static String *flat_alloc(word len, bool wide, word capacity)
+{
+    String *s = heap_alloc(HEAP_STRING, NULL, sizeof(String) + (uptr) capacity * WIDTH(wide));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->len = len;
+    s->wide = wide;
+    s->data = s + 1;
+    s->capacity = capacity;
+    s->root = H;
+    return s;
+}
+
+/// Make a rope, taking over references to its halves.
+///
+/// \return The rope, or `NULL` if there is no memory for it, in which case
+/// the references to the halves are dropped.
+static String *rope_alloc(String *left, String *right)
+{
+    String *s = heap_alloc(HEAP_STRING, NULL, sizeof(String));
+    if (s == NULL) {
+        heap_release(left);
+        heap_release(right);
+        return NULL;
+    }
+    s->len = left->len + right->len;
+    s->wide = left->wide || right->wide;
+    s->rope = true;
+    s->left = left;
+    s->right = right;
+    return s;
+}
+
+static void set_char(String *s, word i, Rune c)
+{
+    if (s->wide) {
+        ((Rune *) s->data)[i] = c;
+    } else {
+        ((byte *) s->data)[i] = (byte) c;
+    }
+}
+
+/// Copy `n` characters of a flat string from index `start` into another at
+/// index `at`. The destination must be wide if the source is.
+static void copy_flat(String *dst, word at, const String *src, word start, word n)
+{
+    const byte *from = (const byte *) src->data + (uptr) start * WIDTH(src->wide);
+    if (dst->wide == src->wide) {
+        memcpy((byte *) dst->data + (uptr) at * WIDTH(dst->wide), from,
+               (uptr) n * WIDTH(src->wide));
+        return;
+    }
+    simd_widen((Rune *) dst->data + at, from, (uptr) n);
+}
+
+/// Find the flat string holding the character at index `*i` of a string by
+/// walking down its rope, and make `*i` an index into that string. This
+/// needs no memory, unlike flattening the rope, but takes time proportional
+/// to its depth for every leaf.
+static String *leaf_at(String *s, word *i)
+{
+    while (s->rope) {
+        String *flat = atomic_load_explicit(&s->flat, memory_order_acquire);
+        if (flat != H) {
+            return flat;
+        }
+        if (*i < s->left->len) {
+            s = s->left;
+        } else {
+            *i -= s->left->len;
+            s = s->right;
+        }
+    }
+    return s;
+}
+
+/// Copy the characters of any string into a flat one at index `at`. Ropes
+/// are walked with a stack of their right halves rather than by recursion,
+/// since a string built in a loop is a rope as deep as the loop is long. If
+/// there is no memory to grow the stack, the rest of the rope is copied a
+/// leaf at a time with `leaf_at()`.
+static void copy_chars(String *dst, word at, String *src)
+{
+    String *small[32];
+    String **stack = small;
+    uptr n = 0;
+    uptr size = sizeof small / sizeof *small;
+    for (;;) {
+        while (src->rope) {
+            String *flat = atomic_load_explicit(&src->flat, memory_order_acquire);
+            if (flat != H) {
+                src = flat;
+                break;
+            }
+            if (n == size) {
+                String **grown = stack == small ? malloc(2 * size * sizeof *stack)
+                                                : realloc(stack, 2 * size * sizeof *stack);
+                if (grown == NULL) {
+                    break;
+                }
+                if (stack == small) {
+                    memcpy(grown, small, sizeof small);
+                }
+                stack = grown;
+                size *= 2;
+            }
+            stack[n++] = src->right;
+            src = src->left;
+        }
+        if (src->rope) {
+            for (word i = 0; i < src->len;) {
+                word start = i;
+                String *leaf = leaf_at(src, &start);
+                copy_flat(dst, at + i, leaf, start, leaf->len - start);
+                i += leaf->len - start;
+            }
+        } else {
+            copy_flat(dst, at, src, 0, src->len);
+        }
+        at += src->len;
+        if (n == 0) {
+            break;
+        }
+        src = stack[--n];
+    }
+    if (stack != small) {
+        free(stack);
+    }
+}
+
+String *string_flat(String *s)
+{
+    if (!s->rope) {
+        return s;
+    }
+    String *flat = atomic_load_explicit(&s->flat, memory_order_acquire);
+    if (flat != H) {
+        return flat;
+    }
+    flat = flat_alloc(s->len, s->wide, s->len);
+    if (flat == NULL) {
+        return NULL;
+    }
+    copy_chars(flat, 0, s);
+    // Threads that flatten the same rope at once keep whichever was first.
+    String *first = H;
+    if (!atomic_compare_exchange_strong_explicit(&s->flat, &first, flat,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        heap_release(flat);
+        return first;
+    }
+    return flat;
+}
+
+/// Decode a character from UTF-8.
+///
+/// \return The number of bytes it took up.
+static uptr decode_rune(const byte *p, uptr n, Rune *r)
+{
+    byte c = p[0];
+    uptr length;
+    Rune v;
+    Rune min;
+    if (c < 0x80) {
+        *r = c;
+        return 1;
+    } else if (c >= 0xC0 && c < 0xE0) {
+        length = 2, v = c & 0x1F, min = 0x80;
+    } else if (c >= 0xE0 && c < 0xF0) {
+        length = 3, v = c & 0x0F, min = 0x800;
+    } else if (c >= 0xF0 && c < 0xF8) {
+        length = 4, v = c & 0x07, min = 0x10000;
+    } else {
+        *r = RUNE_ERROR;
+        return 1;
+    }
+    if (n < length) {
+        *r = RUNE_ERROR;
+        return 1;
+    }
+    for (uptr i = 1; i < length; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *r = RUNE_ERROR;
+            return 1;
+        }
+        v = v << 6 | (p[i] & 0x3F);
+    }
+    // Overlong encodings and surrogates are as invalid as bad bytes.
+    if (v < min || v > RUNE_MAX || (v >= 0xD800 && v <= 0xDFFF)) {
+        *r = RUNE_ERROR;
+        return 1;
+    }
+    *r = v;
+    return length;
+}
+
+/// Encode a character in UTF-8.
+///
+/// \param p Where to put the encoding, or `NULL` only to measure it.
+/// \return The number of bytes it takes up.
+static uptr encode_rune(Rune r, byte *p)
+{
+    if (r < 0x80) {
+        if (p != NULL) {
+            p[0] = (byte) r;
+        }
+        return 1;
+    }
+    uptr length = r < 0x800 ? 2 : r < 0x10000 ? 3 : 4;
+    if (p != NULL) {
+        static const byte lead[] = {0, 0, 0xC0, 0xE0, 0xF0};
+        for (uptr i = length - 1; i > 0; i--) {
+            p[i] = 0x80 | (r & 0x3F);
+            r >>= 6;
+        }
+        p[0] = lead[length] | (byte) r;
+    }
+    return length;
+}
+
+String *string_utf8(const char *utf8, uptr size)
+{
+    // Text is mostly ASCII, which is skipped over and copied a block at a
+    // time; only the characters between runs of it are decoded one by one.
+    const byte *p = (const byte *) utf8;
+    uptr len = 0;
+    bool wide = false;
+    for (uptr i = 0; i < size;) {
+        uptr ascii = simd_ascii_prefix(p + i, size - i);
+        len += ascii;
+        i += ascii;
+        if (i < size) {
+            Rune r;
+            i += decode_rune(p + i, size - i, &r);
+            wide |= r > 0xFF;
+            len++;
+        }
+    }
+    if (len == 0 || len > INT32_MAX) {
+        return H;
+    }
+    String *s = flat_alloc((word) len, wide, (word) len);
+    if (s == NULL) {
+        return NULL;
+    }
+    word n = 0;
+    for (uptr i = 0; i < size;) {
+        uptr ascii = simd_ascii_prefix(p + i, size - i);
+        if (wide) {
+            simd_widen((Rune *) s->data + n, p + i, ascii);
+        } else {
+            memcpy((byte *) s->data + n, p + i, ascii);
+        }
+        n += (word) ascii;
+        i += ascii;
+        if (i < size) {
+            Rune r;
+            i += decode_rune(p + i, size - i, &r);
+            set_char(s, n++, r);
+        }
+    }
+    return s;
+}
+
+/// Encode `len` characters of a flat string from index `start` in UTF-8.
+///
+/// \param utf8 Where to put the encoding, or `NULL` only to measure it.
+/// \return Size of the encoding in bytes.
+static uptr encode_flat(const String *s, word start, word len, byte *utf8)
+{
+    if (s->wide) {
+        const Rune *r = (const Rune *) s->data + start;
+        uptr n = 0;
+        for (word i = 0; i < len; i++) {
+            n += encode_rune(r[i], utf8 == NULL ? NULL : utf8 + n);
+        }
+        return n;
+    }
+    // Latin-1 above ASCII takes two bytes, and ASCII is copied as it is.
+    const byte *p = (const byte *) s->data + start;
+    if (utf8 == NULL) {
+        return (uptr) len + simd_count_high(p, (uptr) len);
+    }
+    uptr n = 0;
+    for (uptr i = 0; i < (uptr) len;) {
+        uptr ascii = simd_ascii_prefix(p + i, (uptr) len - i);
+        memcpy(utf8 + n, p + i, ascii);
+        n += ascii;
+        i += ascii;
+        if (i < (uptr) len) {
+            n += encode_rune(p[i++], utf8 + n);
+        }
+    }
+    return n;
+}
+
+uptr string_encode(String *s, byte *utf8)
+{
+    if (s == H) {
+        return 0;
+    }
+    // A rope there is no memory to flatten is encoded a leaf at a time.
+    String *flat = string_flat(s);
+    if (flat != NULL) {
+        s = flat;
+    }
+    uptr n = 0;
+    for (word i = 0; i < s->len;) {
+        word start = i;
+        String *leaf = leaf_at(s, &start);
+        n += encode_flat(leaf, start, leaf->len - start, utf8 == NULL ? NULL : utf8 + n);
+        i += leaf->len - start;
+    }
+    return n;
+}
+
+char *string_to_utf8(String *s, uptr *size)
+{
+    uptr n = string_encode(s, NULL);
+    byte *utf8 = malloc(n + 1);
+    if (utf8 == NULL) {
+        return NULL;
+    }
+    string_encode(s, utf8);
+    utf8[n] = 0;
+    if (size != NULL) {
+        *size = n;
+    }
+    return (char *) utf8;
+}
+
+String *string_concat(String *a, String *b)
+{
+    word alen = a == H ? 0 : a->len;
+    word blen = b == H ? 0 : b->len;
+    if (blen == 0 || alen == 0) {
+        String *s = blen == 0 ? a : b;
+        heap_retain(s);
+        return s;
+    }
+    // Short strings are copied, and so are short strings appended to a rope
+    // that ends with one, so that ropes built a piece at a time have leaves
+    // of a useful size. Leaves get room for `string_append()` to fill.
+    if ((uptr) alen + (uptr) blen > INT32_MAX) {
+        return NULL;
+    }
+    word len = alen + blen;
+    if (len <= STRING_LEAF) {
+        String *s = flat_alloc(len, a->wide || b->wide, STRING_LEAF);
+        if (s == NULL) {
+            return NULL;
+        }
+        copy_chars(s, 0, a);
+        copy_chars(s, alen, b);
+        return s;
+    }
+    if (a->rope && !b->rope && !a->right->rope && a->right->len + blen <= STRING_LEAF) {
+        String *right = string_concat(a->right, b);
+        if (right == NULL) {
+            return NULL;
+        }
+        heap_retain(a->left);
+        return rope_alloc(a->left, right);
+    }
+    heap_retain(a);
+    heap_retain(b);
+    return rope_alloc(a, b);
+}
+
+/// Append the characters of `b` to a flat string in place, if nothing else
+/// refers to it and it has room for them.
+static bool append_flat(String *a, String *b)
+{
+    if (a->rope || a->root != H || a->interned || (b->wide && !a->wide) ||
+        a->capacity - a->len < b->len || !heap_unique(a)) {
+        return false;
+    }
+    copy_chars(a, a->len, b);
+    a->len += b->len;
+    atomic_store_explicit(&a->hash, 0, memory_order_relaxed);
+    return true;
+}
+
+String *string_append(String *a, String *b)
+{
+    if (b == H || b->len == 0) {
+        return a;
+    }
+    if (a != H && (uptr) a->len + (uptr) b->len > INT32_MAX) {
+        return NULL;
+    }
+    // Nothing else can see a string only the caller refers to, nor a rope's
+    // last leaf only that rope refers to, so either may grow.
+    if (a != H && a != b && heap_unique(a)) {
+        if (append_flat(a, b)) {
+            return a;
+        }
+        if (a->rope && append_flat(a->right, b)) {
+            a->len += b->len;
+            a->wide |= b->wide;
+            atomic_store_explicit(&a->hash, 0, memory_order_relaxed);
+            String *flat = atomic_exchange_explicit(&a->flat, H, memory_order_relaxed);
+            heap_release(flat);
+            return a;
+        }
+    }
+    String *s = string_concat(a, b);
+    if (s == NULL) {
+        return NULL;
+    }
+    heap_release(a);
+    return s;
+}
+
+String *string_slice(String *s, word start, word end)
+{
+    if (start < 0 || end < start || end > s->len) {
+        return NULL;
+    }
+    s = string_flat(s);
+    if (s == NULL) {
+        return NULL;
+    }
+    if (start == 0 && end == s->len) {
+        heap_retain(s);
+        return s;
+    }
+    String *root = s->root != H ? s->root : s;
+    String *slice = heap_alloc(HEAP_STRING, NULL, sizeof(String));
+    if (slice == NULL) {
+        return NULL;
+    }
+    slice->len = end - start;
+    slice->wide = s->wide;
+    slice->data = (byte *) s->data + (uptr) start * WIDTH(s->wide);
+    slice->capacity = slice->len;
+    slice->root = root;
+    heap_retain(root);
+    return slice;
+}
+
+String *string_insert(String *s, word index, Rune c)
+{
+    bool wide = c > 0xFF;
+    if (s != H && !s->rope && s->root == H && !s->interned && (s->wide || !wide) &&
+        index < s->capacity && heap_unique(s)) {
+        set_char(s, index, c);
+        if (index == s->len) {
+            s->len++;
+        }
+        atomic_store_explicit(&s->hash, 0, memory_order_relaxed);
+        return s;
+    }
+    // Strings grown by appending get room to grow further, so that building
+    // one a character at a time copies it only O(log n) times.
+    word len = s == H ? 0 : s->len;
+    if (index == len && len == INT32_MAX) {
+        return NULL;
+    }
+    word capacity = index < len ? len : len < 8 ? 16 : len > INT32_MAX / 2 ? INT32_MAX : 2 * len;
+    String *t = flat_alloc(index == len ? len + 1 : len, wide || (s != H && s->wide),
+                           capacity);
+    if (t == NULL) {
+        return NULL;
+    }
+    if (s != H) {
+        copy_chars(t, 0, s);
+    }
+    set_char(t, index, c);
+    heap_release(s);
+    return t;
+}
+
+int string_compare(String *a, String *b)
+{
+    if (a == b) {
+        return 0;
+    }
+    word alen = a == H ? 0 : a->len;
+    word blen = b == H ? 0 : b->len;
+    if (alen == 0 || blen == 0) {
+        return (alen > 0) - (blen > 0);
+    }
+    String *fa = string_flat(a);
+    String *fb = string_flat(b);
+    word n = alen < blen ? alen : blen;
+    if (fa != NULL && fb != NULL && !fa->wide && !fb->wide) {
+        // Latin-1 bytes compare as their characters do.
+        int c = memcmp(fa->data, fb->data, n);
+        if (c != 0) {
+            return c;
+        }
+        return (alen > blen) - (alen < blen);
+    }
+    // Ropes there is no memory to flatten are compared a leaf at a time.
+    a = fa != NULL ? fa : a;
+    b = fb != NULL ? fb : b;
+    for (word i = 0; i < n;) {
+        word j = i;
+        word k = i;
+        const String *x = leaf_at(a, &j);
+        const String *y = leaf_at(b, &k);
+        word m = n - i;
+        m = x->len - j < m ? x->len - j : m;
+        m = y->len - k < m ? y->len - k : m;
+        for (word t = 0; t < m; t++) {
+            Rune p = string_char(x, j + t);
+            Rune q = string_char(y, k + t);
+            if (p != q) {
+                return p < q ? -1 : 1;
+            }
+        }
+        i += m;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+bool string_equal(String *a, String *b)
+{
+    if (a == b) {
+        return true;
+    }
+    word alen = a == H ? 0 : a->len;
+    word blen = b == H ? 0 : b->len;
+    if (alen != blen) {
+        return false;
+    }
+    if (alen == 0) {
+        return true;
+    }
+    uint32_t ha = atomic_load_explicit(&a->hash, memory_order_relaxed);
+    uint32_t hb = atomic_load_explicit(&b->hash, memory_order_relaxed);
+    if (ha != 0 && hb != 0 && ha != hb) {
+        return false;
+    }
+    return string_compare(a, b) == 0;
+}
+
+uint32_t string_hash(String *s)
+{
+    uint32_t h = atomic_load_explicit(&s->hash, memory_order_relaxed);
+    if (h != 0) {
+        return h;
+    }
+    // FNV-1a over the characters, so that both forms of a string agree. A
+    // rope there is no memory to flatten is hashed a leaf at a time.
+    String *flat = string_flat(s);
+    if (flat == NULL) {
+        flat = s;
+    }
+    h = 0x811C9DC5;
+    for (word i = 0; i < flat->len;) {
+        word start = i;
+        const String *leaf = leaf_at(flat, &start);
+        for (word j = start; j < leaf->len; j++) {
+            h = (h ^ string_char(leaf, j)) * 0x01000193;
+        }
+        i += leaf->len - start;
+    }
+    if (h == 0) {
+        h = 1;
+    }
+    atomic_store_explicit(&s->hash, h, memory_order_relaxed);
+    return h;
+}
+
+/// Interned strings, in an open-addressed hash table. The table holds a
+/// reference to each, and never lets go of it.
+static struct {
+    pthread_mutex_t lock;
+    String **slots;
+    uptr size;
+    uptr count;
+} interned = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void intern_insert(String *s)
+{
+    uptr mask = interned.size - 1;
+    uptr i = string_hash(s) & mask;
+    while (interned.slots[i] != H) {
+        i = (i + 1) & mask;
+    }
+    interned.slots[i] = s;
+}
+
+String *string_intern(const char *utf8, uptr size)
+{
+    String *s = string_utf8(utf8, size);
+    if (s == H) {
+        return H;
+    }
+    uint32_t h = string_hash(s);
+
+    pthread_mutex_lock(&interned.lock);
+    if (interned.size > 0) {
+        uptr mask = interned.size - 1;
+        for (uptr i = h & mask; interned.slots[i] != H; i = (i + 1) & mask) {
+            String *t = interned.slots[i];
+            if (atomic_load_explicit(&t->hash, memory_order_relaxed) == h &&
+                string_equal(t, s)) {
+                heap_retain(t);
+                pthread_mutex_unlock(&interned.lock);
+                heap_release(s);
+                return t;
+            }
+        }
+    }
+    if (2 * (interned.count + 1) > interned.size) {
+        String **old = interned.slots;
+        uptr size = interned.size;
+        String **slots = calloc(size ? 2 * size : 256, sizeof(String *));
+        if (slots == NULL) {
+            pthread_mutex_unlock(&interned.lock);
+            heap_release(s);
+            return NULL;
+        }
+        interned.slots = slots;
+        interned.size = size ? 2 * size : 256;
+        for (uptr i = 0; i < size; i++) {
+            if (old[i] != H) {
+                intern_insert(old[i]);
+            }
+        }
+        free(old);
+    }
+    s->interned = true;
+    intern_insert(s);
+    interned.count++;
+    heap_retain(s);
+    pthread_mutex_unlock(&interned.lock);
+    return s;
+}
@@ -0,0 +1,181 @@
+#ifndef DIS_STR_H
+#define DIS_STR_H
+
+// Limbo strings.
+//
+// A string is a heap object holding a sequence of Unicode characters. Flat
+// strings keep their characters as bytes when every one of them is Latin-1,
+// and as runes otherwise, so that finding a character by its index is O(1)
+// either way. Concatenation of long strings makes ropes, which refer to their
+// two halves and are only flattened when their characters are needed, so that
+// a string built by appending to it in a loop is copied once rather than at
+// every step.
+//
+// Strings are immutable once other objects can see them: `insc` changes a
+// string in place only if nothing else refers to it. String literals are
+// interned, so that equal literals are the same object, with their hashes
+// computed once.
+//
+// Functions that make strings return `NULL` if there is no memory for them,
+// or if the result would have more than `INT32_MAX` characters. Comparing,
+// hashing and encoding strings never fail: a rope there is no memory to
+// flatten is read a leaf at a time instead.
+
+#include "types.h"
+
+/// A Unicode character.
+typedef uint32_t Rune;
+
+/// The character substituted for invalid UTF-8, and the largest character.
+#define RUNE_ERROR 0xFFFD
+#define RUNE_MAX 0x10FFFF
+
+/// A string, as created from a literal or by the `C` instructions.
+struct String {
+    /// The number of characters.
+    word len;
+    /// Whether the characters are runes rather than Latin-1 bytes, or for a
+    /// rope, whether they will be once it is flattened.
+    bool wide;
+    /// Whether the string is a rope.
+    bool rope;
+    /// Whether the string is in the table of interned strings.
+    bool interned;
+    /// Hash of the characters, or 0 if it has not been computed yet.
+    _Atomic uint32_t hash;
+    union {
+        struct {
+            /// A flat string's characters: `byte`s or `Rune`s.
+            void *data;
+            /// The number of characters there is room for in `data`.
+            word capacity;
+            /// The string whose characters this one is a slice of, or `H` if
+            /// the characters are its own.
+            struct String *root;
+        };
+        struct {
+            /// A rope's halves.
+            struct String *left;
+            struct String *right;
+            /// The flattened rope, or `H` until it is needed.
+            _Atomic(struct String *) flat;
+        };
+    };
+};
+
+/// Create a string from UTF-8, replacing invalid sequences with
+/// `RUNE_ERROR`.
+///
+/// \param utf8 The encoded characters.
+/// \param size Size of `utf8` in bytes.
+/// \return The string, with one reference to it, or `H` if it is empty or
+/// cannot be made.
+String *string_utf8(const char *utf8, uptr size);
+
+/// Find the interned string with the characters encoded in UTF-8, interning
+/// a new one if there is none.
+///
+/// \param utf8 The encoded characters.
+/// \param size Size of `utf8` in bytes.
+/// \return The string, with a reference to it for the caller, or `H` if it
+/// is empty or cannot be made.
+String *string_intern(const char *utf8, uptr size);
+
+/// Encode a string in UTF-8.
+///
+/// \param s The string, or `H`.
+/// \param size Location to store the size of the encoding in, not counting
+/// the 0 that terminates it. May be `NULL`.
+/// \return The 0-terminated encoding, to be freed with `free()`, or `NULL`
+/// if there is no memory for it.
+char *string_to_utf8(String *s, uptr *size);
+
+/// Encode a string in UTF-8 into memory the caller provides.
+///
+/// \param s The string, or `H`.
+/// \param utf8 Where to put the encoding, which is not terminated, or `NULL`
+/// only to measure it.
+/// \return Size of the encoding in bytes.
+uptr string_encode(String *s, byte *utf8);
+
+/// Concatenate two strings.
+///
+/// \param a The first string, or `H`.
+/// \param b The second string, or `H`.
+/// \return The concatenation, or `H` if both are empty, with a reference to
+/// it for the caller, or `NULL` if it cannot be made.
+String *string_concat(String *a, String *b);
+
+/// Append a string to another, in place if nothing else refers to the first
+/// and it has room, and by concatenation otherwise.
+///
+/// \param a The string appended to, or `H`, for which the caller's
+/// reference is taken over unless the append fails.
+/// \param b The string to append, or `H`.
+/// \return The result, with the caller's reference to it, or `NULL` if it
+/// cannot be made.
+String *string_append(String *a, String *b);
+
+/// Take the characters of a string from `start` up to `end`. The slice
+/// shares the characters of a flat string.
+///
+/// \param s The string. Must not be `H`.
+/// \param start Index of the first character.
+/// \param end Index after the last character.
+/// \return The slice, with a reference to it for the caller, or `NULL` if
+/// the indices are out of range or there is no memory for it.
+String *string_slice(String *s, word start, word end);
+
+/// Set the character at an index of a string, or append a character if the
+/// index is the length of the string. The string is changed in place if
+/// nothing else refers to it, and copied otherwise.
+///
+/// \param s The string, or `H`, for which the caller's reference is taken
+/// over unless the insertion fails.
+/// \param index Index of the character. Must be at most the string's length.
+/// \param c The character.
+/// \return The changed string, with the caller's reference to it, or `NULL`
+/// if it cannot be made.
+String *string_insert(String *s, word index, Rune c);
+
+/// Flatten a rope.
+///
+/// \param s The string.
+/// \return A flat string with the same characters, which is `s` itself unless
+/// it is a rope, or `NULL` if there is no memory to flatten it. The rope
+/// keeps a reference to it.
+String *string_flat(String *s);
+
+/// The character at an index of a flat string.
+///
+/// \param s The string.
+/// \param i The index. Must be less than the string's length.
+/// \return The character.
+static inline Rune string_char(const String *s, word i)
+{
+    return s->wide ? ((const Rune *) s->data)[i] : ((const byte *) s->data)[i];
+}
+
+/// Compare two strings character by character.
+///
+/// \param a A string, or `H`, which compares as the empty string.
+/// \param b A string, or `H`.
+/// \return A negative number, 0 or a positive number as `a` is less than,
+/// equal to or greater than `b`.
+int string_compare(String *a, String *b);
+
+/// Hash the characters of a string.
+///
+/// \param s The string.
+/// \return The hash, which is never 0.
+uint32_t string_hash(String *s);
+
+/// Whether two strings have the same characters. Strings whose hashes have
+/// been computed and differ are told apart without comparing them.
+///
+/// \param a A string, or `H`, which is equal to the empty string.
+/// \param b A string, or `H`.
+/// \return `true` if they have.
+bool string_equal(String *a, String *b);
+
+#endif //DIS_STR_H
@@ -0,0 +1,275 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../instructions.h"
+#if DIS_JIT
+#include "../jit.h"
+#endif
+#include "../bench/asm.h"
+#include "test.h"
+
+// Each module computes one instruction on the module data: 0 the source
+// operand, 8 the middle one, 16 the destination. A value is kept as the bits
+// of a big, of which a word uses the low half.
+
+/// What an operand of an instruction holds.
+typedef enum Kind {
+    UNUSED,
+    WORD,
+    BIG,
+    REAL,
+} Kind;
+
+static const struct {
+    byte opcode;
+    Kind s, m;
+} ops[] = {
+    {IN_ADDW, WORD, WORD},
+    {IN_SUBW, WORD, WORD},
+    {IN_MULW, WORD, WORD},
+    {IN_DIVW, WORD, WORD},
+    {IN_MODW, WORD, WORD},
+    {IN_ANDW, WORD, WORD},
+    {IN_ORW, WORD, WORD},
+    {IN_XORW, WORD, WORD},
+    {IN_SHLW, WORD, WORD},
+    {IN_SHRW, WORD, WORD},
+    {IN_LSRW, WORD, WORD},
+    {IN_ADDL, BIG, BIG},
+    {IN_SUBL, BIG, BIG},
+    {IN_MULL, BIG, BIG},
+    {IN_DIVL, BIG, BIG},
+    {IN_MODL, BIG, BIG},
+    {IN_ANDL, BIG, BIG},
+    {IN_ORL, BIG, BIG},
+    {IN_XORL, BIG, BIG},
+    {IN_SHLL, WORD, BIG},
+    {IN_SHRL, WORD, BIG},
+    {IN_LSRL, WORD, BIG},
+    {IN_ADDF, REAL, REAL},
+    {IN_SUBF, REAL, REAL},
+    {IN_MULF, REAL, REAL},
+    {IN_DIVF, REAL, REAL},
+    {IN_NEGF, REAL, UNUSED},
+    {IN_MOVW, WORD, UNUSED},
+    {IN_MOVL, BIG, UNUSED},
+    {IN_CVTWL, WORD, UNUSED},
+    {IN_CVTLW, BIG, UNUSED},
+    {IN_CVTWF, WORD, UNUSED},
+    {IN_CVTLF, BIG, UNUSED},
+};
+
+static const word words[] = {
+    0, 1, -1, 2, -3, 7, 31, 32, 33, 63, 64, 100, -100, 0x12345678,
+    INT32_MAX, INT32_MIN, INT32_MIN + 1,
+};
+
+static const big bigs[] = {
+    0, 1, -1, 3, -3, 31, 32, 63, 64, 65, 0x123456789ABCDEF0, -0x1000000000,
+    INT32_MAX, (big) INT32_MAX + 1, INT32_MIN, INT64_MAX, INT64_MIN, INT64_MIN + 1,
+};
+
+static const real reals[] = {
+    0.0, -0.0, 1.0, -1.5, 3.0, 0.1, 1e300, -1e300, 5e-324, INFINITY, -INFINITY, NAN,
+};
+
+/// Shift counts and divisors worth trying as immediate operands, which
+/// compile differently from operands in memory.
+static const word immediates[] = {0, 1, -1, 5, 31, 32, 33, 63, 64, -7, 1 << 20};
+
+/// The number of values of a kind.
+static uptr count(Kind kind)
+{
+    switch (kind) {
+        case WORD:
+            return sizeof words / sizeof *words;
+        case BIG:
+            return sizeof bigs / sizeof *bigs;
+        case REAL:
+            return sizeof reals / sizeof *reals;
+        default:
+            return 1;
+    }
+}
+
+/// The bits of a value of a kind.
+static uint64_t value(Kind kind, uptr i)
+{
+    uint64_t v = 0;
+    switch (kind) {
+        case WORD:
+            memcpy(&v, &words[i], sizeof(word));
+            break;
+        case BIG:
+            memcpy(&v, &bigs[i], sizeof(big));
+            break;
+        case REAL:
+            memcpy(&v, &reals[i], sizeof(real));
+            break;
+        default:
+            break;
+    }
+    return v;
+}
+
+/// Assemble and link a module computing one instruction.
+///
+/// \param s The source operand: `MP(0)` or an immediate.
+static ModuleLink *build(byte opcode, Arg s, bool middle)
+{
+    Assembler a = {0};
+    word entry = asm_type(&a, 48, 0, NULL);
+    asm_inst(&a, opcode, s, middle ? MP(8) : NONE, MP(16));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Arith", 24, 0, entry, &size);
+    return link_image(image, size);
+}
+
+/// The outcome of running an instruction once.
+typedef struct Outcome {
+    ExecutionStatus status;
+    const char *error;
+    uint64_t d;
+} Outcome;
+
+static Outcome compute(ModuleLink *ml, uint64_t s, uint64_t m)
+{
+    // The destination starts out with a pattern no instruction computes
+    // here, so that a store of the wrong width shows.
+    memcpy(ml->mp, &s, sizeof s);
+    memcpy(ml->mp + 8, &m, sizeof m);
+    memset(ml->mp + 16, 0xA5, 8);
+    Outcome outcome;
+    outcome.status = run_entry(ml, &outcome.error);
+    memcpy(&outcome.d, ml->mp + 16, sizeof outcome.d);
+    return outcome;
+}
+
+static bool same(Outcome a, Outcome b)
+{
+    return a.status == b.status && a.d == b.d &&
+           (a.error == b.error || (a.error != NULL && b.error != NULL &&
+                                   strcmp(a.error, b.error) == 0));
+}
+
+/// Run an instruction in the interpreter.
+static Outcome interpret(byte opcode, uint64_t s, uint64_t m)
+{
+#if DIS_JIT
+    jit_set_mode(JIT_INTERPRET_ONLY);
+#endif
+    ModuleLink *ml = build(opcode, MP(0), true);
+    Outcome outcome = {EXEC_ERROR, "cannot link", 0};
+    if (ml != NULL) {
+        outcome = compute(ml, s, m);
+        module_unlink(ml);
+    }
+#if DIS_JIT
+    jit_set_mode(JIT_AUTO);
+#endif
+    return outcome;
+}
+
+/// The bits of a word, as an operand holds them.
+#define WORD_BITS(v) ((uint64_t) (uint32_t) (v))
+
+/// Check the interpreter's answers to the cases C leaves undefined.
+static void check_interpreter(void)
+{
+    Outcome o = interpret(IN_DIVW, WORD_BITS(-1), WORD_BITS(INT32_MIN));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == INT32_MIN);
+    o = interpret(IN_MODW, WORD_BITS(-1), WORD_BITS(INT32_MIN));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == 0);
+    o = interpret(IN_DIVW, WORD_BITS(0), WORD_BITS(7));
+    CHECK(o.status == EXEC_ERROR && strcmp(o.error, "zero divide") == 0);
+    o = interpret(IN_MODW, WORD_BITS(0), WORD_BITS(7));
+    CHECK(o.status == EXEC_ERROR && strcmp(o.error, "zero divide") == 0);
+    o = interpret(IN_DIVW, WORD_BITS(2), WORD_BITS(-7));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == -3);
+    o = interpret(IN_MODW, WORD_BITS(2), WORD_BITS(-7));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == -1);
+
+    // Counts are taken modulo the width of the value shifted.
+    o = interpret(IN_SHLW, WORD_BITS(33), WORD_BITS(1));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == 2);
+    o = interpret(IN_SHRW, WORD_BITS(32), WORD_BITS(-8));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == -8);
+    o = interpret(IN_LSRW, WORD_BITS(31), WORD_BITS(-1));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == 1);
+    o = interpret(IN_SHLW, WORD_BITS(1), WORD_BITS(INT32_MAX));
+    CHECK(o.status == EXEC_EXITED && (word) o.d == -2);
+
+    uint64_t minus_one = UINT64_MAX;
+    o = interpret(IN_DIVL, minus_one, (uint64_t) INT64_MIN);
+    CHECK(o.status == EXEC_EXITED && (big) o.d == INT64_MIN);
+    o = interpret(IN_MODL, minus_one, (uint64_t) INT64_MIN);
+    CHECK(o.status == EXEC_EXITED && (big) o.d == 0);
+    o = interpret(IN_DIVL, 0, 7);
+    CHECK(o.status == EXEC_ERROR && strcmp(o.error, "zero divide") == 0);
+    o = interpret(IN_MODL, 0, 7);
+    CHECK(o.status == EXEC_ERROR && strcmp(o.error, "zero divide") == 0);
+    o = interpret(IN_SHLL, 65, 1);
+    CHECK(o.status == EXEC_EXITED && (big) o.d == 2);
+    o = interpret(IN_SHRL, 64, (uint64_t) INT64_MIN);
+    CHECK(o.status == EXEC_EXITED && (big) o.d == INT64_MIN);
+    o = interpret(IN_LSRL, 63, (uint64_t) -1);
+    CHECK(o.status == EXEC_EXITED && (big) o.d == 1);
+}
+
+#if DIS_JIT
+/// Run an instruction both ways for every value of its middle operand, and of
+/// its source operand unless it is an immediate, and check that they agree.
+static void compare(uptr op, Arg s)
+{
+    jit_set_mode(JIT_INTERPRET_ONLY);
+    ModuleLink *interpreted = build(ops[op].opcode, s, ops[op].m != UNUSED);
+    jit_set_mode(JIT_AUTO);
+    ModuleLink *compiled = build(ops[op].opcode, s, ops[op].m != UNUSED);
+    if (interpreted == NULL || compiled == NULL) {
+        module_unlink(interpreted);
+        module_unlink(compiled);
+        return;
+    }
+    jit_compile_all(compiled->module);
+    if (!CHECK(compiled->module->code[0].opcode == IN_XJIT)) {
+        fprintf(stderr, "  %s was not compiled\n", instruction_name(ops[op].opcode));
+    }
+
+    uptr ns = s.mode == AIMM ? 1 : count(ops[op].s);
+    for (uptr i = 0; i < ns; i++) {
+        for (uptr j = 0; j < count(ops[op].m); j++) {
+            uint64_t sv = value(ops[op].s, i);
+            uint64_t mv = value(ops[op].m, j);
+            Outcome want = compute(interpreted, sv, mv);
+            Outcome got = compute(compiled, sv, mv);
+            if (!CHECK(same(want, got))) {
+                fprintf(stderr, "  %s s=%#llx%s m=%#llx: interpreted %d %s %#llx, "
+                        "compiled %d %s %#llx\n", instruction_name(ops[op].opcode),
+                        s.mode == AIMM ? (unsigned long long) s.offset : (unsigned long long) sv,
+                        s.mode == AIMM ? " (immediate)" : "", (unsigned long long) mv,
+                        want.status, want.error ? want.error : "-", (unsigned long long) want.d,
+                        got.status, got.error ? got.error : "-", (unsigned long long) got.d);
+            }
+        }
+    }
+    module_unlink(interpreted);
+    module_unlink(compiled);
+}
+#endif
+
+void test_arith(void)
+{
+    check_interpreter();
+#if DIS_JIT
+    for (uptr op = 0; op < sizeof ops / sizeof *ops; op++) {
+        compare(op, MP(0));
+        if (ops[op].s == WORD && ops[op].m != UNUSED) {
+            for (uptr i = 0; i < sizeof immediates / sizeof *immediates; i++) {
+                compare(op, IMM(immediates[i]));
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../heap.h"
+#include "../instructions.h"
+#include "../str.h"
+#include "../bench/asm.h"
+#include "test.h"
+
+// Each module dispatches on a value in the module data with one `case`,
+// `casec` or `goto`, to one of `TARGETS` pieces of code that store their
+// number in the module data and return. The same module is decoded with
+// case tables compiled and without, and must go the same way for every
+// value.
+
+enum { TARGETS = 8 };
+
+/// The entry point of target `k`.
+#define TARGET(k) (1 + 2 * (k))
+
+/// A small generator of repeatable pseudo-random numbers.
+static uint32_t state = 12345;
+
+static word random_below(word n)
+{
+    state = state * 1103515245 + 12345;
+    return (word) ((state >> 8) % (uint32_t) n);
+}
+
+static void assemble_targets(Assembler *a, word result)
+{
+    for (word k = 0; k < TARGETS; k++) {
+        asm_inst(a, IN_MOVW, IMM(k), NONE, MP(result));
+        asm_inst(a, IN_RET, NONE, NONE, NONE);
+    }
+}
+
+/// Decode a module with its case tables compiled or not.
+static ModuleLink *decode(const byte *image, uptr size, bool compiled)
+{
+    byte *copy = malloc(size);
+    memcpy(copy, image, size);
+    module_set_fusion(compiled);
+    ModuleLink *ml = link_image(copy, size);
+    module_set_fusion(true);
+    return ml;
+}
+
+/// Run a module, returning the target it reached, or -1 if it stopped with
+/// an error, which is stored in `error`.
+static word dispatch(ModuleLink *ml, word result, const char **error)
+{
+    *(word *) (ml->mp + result) = -1;
+    ExecutionStatus status = run_entry(ml, error);
+    return status == EXEC_EXITED ? *(word *) (ml->mp + result) : -1;
+}
+
+/// Assemble a `case` on a word, with `n` ranges from `table`, which holds
+/// the count, the triples and the default as `case` reads them.
+static byte *assemble_case(const word *table, word n, word *value, word *result,
+                           uptr *size)
+{
+    word words = 2 + 3 * n;
+    *value = (words * (word) sizeof(word) + 7) & ~7;
+    *result = *value + (word) sizeof(word);
+    Assembler a = {0};
+    word entry = asm_type(&a, 48, 0, NULL);
+    asm_inst(&a, IN_CASE, MP(*value), NONE, MP(0));
+    assemble_targets(&a, *result);
+    asm_words(&a, 0, words, table);
+    return asm_finish(&a, "Case", *result + 8, 0, entry, size);
+}
+
+/// Compare a `case` table compiled and searched for every value around its
+/// ranges.
+static void compare_case(const word *table, word n, bool compilable)
+{
+    word value, result;
+    uptr size;
+    byte *image = assemble_case(table, n, &value, &result, &size);
+    ModuleLink *search = decode(image, size, false);
+    ModuleLink *compiled = decode(image, size, true);
+    free(image);
+    if (search == NULL || compiled == NULL) {
+        module_unlink(search);
+        module_unlink(compiled);
+        return;
+    }
+    CHECK((compiled->module->code[0].opcode == IN_XCASE) == compilable);
+    CHECK(search->module->code[0].opcode == IN_CASE);
+
+    word low = table[1], high = table[3 * n - 1];
+    word extremes[] = {INT32_MIN, INT32_MIN + 1, INT32_MAX, -1, 0};
+    for (word i = -(word) (sizeof extremes / sizeof *extremes); i < high - low + 6; i++) {
+        word v = i < 0 ? extremes[-i - 1] : low - 3 + i;
+        *(word *) (search->mp + value) = v;
+        *(word *) (compiled->mp + value) = v;
+        const char *want_error, *got_error;
+        word want = dispatch(search, result, &want_error);
+        word got = dispatch(compiled, result, &got_error);
+        if (!CHECK(want == got)) {
+            fprintf(stderr, "  case %d: search went to %d, compiled to %d\n", v, want, got);
+        }
+        CHECK(want >= 0 || (want_error != NULL && got_error != NULL &&
+                            strcmp(want_error, got_error) == 0));
+    }
+    module_unlink(search);
+    module_unlink(compiled);
+}
+
+/// Make a table of `n` sorted, disjoint ranges, dense enough to compile if
+/// `dense`, with random targets.
+static void random_table(word *table, word n, bool dense)
+{
+    table[0] = n;
+    word v = random_below(400) - 200;
+    for (word i = 0; i < n; i++) {
+        v += dense ? random_below(2) : random_below(40);
+        word width = 1 + (dense ? random_below(2) : random_below(20));
+        table[1 + 3 * i] = v;
+        table[2 + 3 * i] = v + width;
+        table[3 + 3 * i] = TARGET(random_below(TARGETS));
+        v += width;
+    }
+    table[1 + 3 * n] = TARGET(random_below(TARGETS));
+}
+
+static void test_case_tables(void)
+{
+    word table[2 + 3 * 64];
+    for (int round = 0; round < 40; round++) {
+        word n = 3 + random_below(62);
+        random_table(table, n, true);
+        compare_case(table, n, true);
+        random_table(table, n, false);
+        compare_case(table, n, false);
+    }
+
+    // A target outside the code keeps the table from being compiled, and
+    // stops the thread only when it is the one taken.
+    word bad[] = {3, 0, 1, TARGET(1), 1, 2, TARGET(2) + 1000, 2, 3, TARGET(3), TARGET(0)};
+    compare_case(bad, 3, false);
+    word value, result;
+    uptr size;
+    byte *image = assemble_case(bad, 3, &value, &result, &size);
+    ModuleLink *ml = decode(image, size, true);
+    free(image);
+    if (ml != NULL) {
+        const char *error;
+        *(word *) (ml->mp + value) = 1;
+        CHECK(dispatch(ml, result, &error) == -1 && strcmp(error, "invalid branch target") == 0);
+        *(word *) (ml->mp + value) = 2;
+        CHECK(dispatch(ml, result, &error) == 3);
+        *(word *) (ml->mp + value) = 7;
+        CHECK(dispatch(ml, result, &error) == 0);
+        module_unlink(ml);
+    }
+    word bad_default[] = {3, 0, 1, TARGET(1), 1, 2, TARGET(2), 2, 3, TARGET(3), -1};
+    compare_case(bad_default, 3, false);
+}
+
+/// Assemble a `casec` on the string in the module data, with a single string
+/// or, where `highs` gives its end, a range of strings for each of `n` sorted
+/// keys. A `NULL` key is the empty string.
+static byte *assemble_casec(const char *const *keys, const char *const *highs,
+                            const word *pcs, word n, word default_pc, word *value,
+                            word *result, uptr *size)
+{
+    word entries = (word) sizeof(pointer);
+    word stride = (word) sizeof(StringCase);
+    *value = entries + n * stride + (word) sizeof(pointer);
+    *result = *value + (word) sizeof(pointer);
+    word data_size = *result + 8;
+
+    byte map[64] = {0};
+    for (word k = 0; k < n; k++) {
+        for (word half = 0; half < 2; half++) {
+            word slot = (entries + k * stride + half * (word) sizeof(pointer)) / 8;
+            map[slot / 8] |= 0x80 >> slot % 8;
+        }
+    }
+    map[*value / 8 / 8] |= 0x80 >> *value / 8 % 8;
+
+    Assembler a = {0};
+    asm_type(&a, data_size, (data_size / 8 + 7) / 8, map);
+    word entry = asm_type(&a, 48, 0, NULL);
+    asm_inst(&a, IN_CASEC, MP(*value), NONE, MP(0));
+    assemble_targets(&a, *result);
+    asm_words(&a, 0, 1, &n);
+    for (word k = 0; k < n; k++) {
+        word at = entries + k * stride;
+        if (keys[k] != NULL) {
+            asm_string(&a, at, keys[k]);
+        }
+        if (highs != NULL && highs[k] != NULL) {
+            asm_string(&a, at + (word) sizeof(pointer), highs[k]);
+        }
+        asm_words(&a, at + 2 * (word) sizeof(pointer), 1, &pcs[k]);
+    }
+    asm_words(&a, entries + n * stride, 1, &default_pc);
+    return asm_finish(&a, "Casec", data_size, 0, entry, size);
+}
+
+/// Compare a `casec` table compiled and searched for each of `probes`.
+static void compare_casec(const char *const *keys, const char *const *highs, word n,
+                          bool compilable, const char *const *probes, word nprobes)
+{
+    word pcs[64];
+    for (word k = 0; k < n; k++) {
+        pcs[k] = TARGET(random_below(TARGETS));
+    }
+    word value, result;
+    uptr size;
+    byte *image = assemble_casec(keys, highs, pcs, n, TARGET(random_below(TARGETS)),
+                                 &value, &result, &size);
+    ModuleLink *search = decode(image, size, false);
+    ModuleLink *compiled = decode(image, size, true);
+    free(image);
+    if (search == NULL || compiled == NULL) {
+        module_unlink(search);
+        module_unlink(compiled);
+        return;
+    }
+    CHECK((compiled->module->code[0].opcode == IN_XCASEC) == compilable);
+
+    for (word i = 0; i < nprobes; i++) {
+        // Values are made at run time, rather than interned, as a key read
+        // from a message would be.
+        String *probe = probes[i] == NULL ? H : string_utf8(probes[i], strlen(probes[i]));
+        String **search_value = (String **) (search->mp + value);
+        String **compiled_value = (String **) (compiled->mp + value);
+        heap_release(*search_value);
+        heap_release(*compiled_value);
+        heap_retain(probe);
+        *search_value = probe;
+        *compiled_value = probe;
+        const char *error;
+        word want = dispatch(search, result, &error);
+        word got = dispatch(compiled, result, &error);
+        if (!CHECK(want == got && want >= 0)) {
+            fprintf(stderr, "  casec \"%s\": search went to %d, compiled to %d\n",
+                    probes[i] == NULL ? "" : probes[i], want, got);
+        }
+    }
+    module_unlink(search);
+    module_unlink(compiled);
+}
+
+static void test_casec_tables(void)
+{
+    enum { KEYS = 40 };
+    char names[KEYS][8];
+    const char *keys[KEYS + 1] = {NULL};
+    for (word k = 0; k < KEYS; k++) {
+        snprintf(names[k], sizeof names[k], "k%02d\xc3\xa9", k);
+        keys[k + 1] = names[k];
+    }
+    const char *probes[2 * KEYS + 8] = {NULL, "", "k", "k0", "k00", "k00\xc3", "zzz", "k39\xc3\xa9!"};
+    word nprobes = 8;
+    for (word k = 0; k < KEYS; k++) {
+        probes[nprobes++] = names[k];
+    }
+
+    // With and without an entry for the empty string, which sorts first.
+    compare_casec(keys + 1, NULL, KEYS, true, probes, nprobes);
+    compare_casec(keys, NULL, KEYS + 1, true, probes, nprobes);
+    compare_casec(keys + 1, NULL, 1, true, probes, nprobes);
+
+    // A range is left to the search.
+    const char *highs[KEYS] = {[3] = "k05"};
+    compare_casec(keys + 1, highs, KEYS, false, probes, nprobes);
+}
+
+static void test_goto(void)
+{
+    // 0 the table, 16 the index, 20 the result.
+    word table[] = {TARGET(2), TARGET(5), 1000, -1};
+    Assembler a = {0};
+    word entry = asm_type(&a, 48, 0, NULL);
+    asm_inst(&a, IN_GOTO, MP(16), NONE, MP(0));
+    assemble_targets(&a, 20);
+    asm_words(&a, 0, 4, table);
+    uptr size;
+    byte *image = asm_finish(&a, "Goto", 24, 0, entry, &size);
+    ModuleLink *ml = link_image(image, size);
+    if (ml == NULL) {
+        return;
+    }
+    const char *error;
+    *(word *) (ml->mp + 16) = 1;
+    CHECK(dispatch(ml, 20, &error) == 5);
+    for (word i = 2; i < 4; i++) {
+        *(word *) (ml->mp + 16) = i;
+        CHECK(dispatch(ml, 20, &error) == -1 && strcmp(error, "invalid branch target") == 0);
+    }
+    module_unlink(ml);
+}
+
+void test_cases(void)
+{
+    test_case_tables();
+    test_casec_tables();
+    test_goto();
+}
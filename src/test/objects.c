@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../heap.h"
+#include "../instructions.h"
+#include "../str.h"
+#include "../bench/asm.h"
+#include "test.h"
+
+// Object files are taken apart in every way that is cheap to try, and each
+// must be rejected with the reason, or decoded into something safe to use.
+
+/// How to spoil the module `assemble()` makes.
+typedef enum Flaw {
+    SOUND,
+    /// The header claims more instructions than the file holds.
+    MORE_CODE,
+    BRANCH_OUT,
+    NO_TYPE,
+    BAD_EXPORT,
+    /// A `DIND` item on a slot that is not an array.
+    INDEX_NOT_ARRAY,
+    /// A `DIND` item past the end of the array.
+    INDEX_PAST_END,
+    /// A `DAPOP` item with no `DIND` item before it.
+    POP_TOO_FAR,
+    ARRAY_NOT_POINTER,
+    STRING_NOT_POINTER,
+    /// Words over a pointer slot.
+    WORDS_ON_POINTER,
+    WORDS_PAST_END,
+    UNKNOWN_ITEM,
+} Flaw;
+
+/// Assemble a module that uses every part of an object file, with a flaw.
+///
+/// The module data: 0 and 4 words, 8 an array of 3 strings, 16 a string.
+/// The code jumps over an instruction and stores 5 at 4.
+static byte *assemble(Flaw flaw, uptr *size)
+{
+    Assembler a = {0};
+    asm_type(&a, 24, 1, (byte[]) {0x60});
+    word element = asm_type(&a, 8, 1, (byte[]) {0x80});
+    word entry = asm_type(&a, 48, 0, NULL);
+
+    asm_inst(&a, IN_JMP, NONE, NONE, IMM(flaw == BRANCH_OUT ? 9 : 2));
+    asm_inst(&a, IN_NEW, IMM(flaw == NO_TYPE ? 7 : element), NONE, MP(16));
+    asm_inst(&a, IN_MOVW, IMM(5), NONE, MP(4));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+
+    asm_words(&a, 0, 2, (word[]) {7, 9});
+    asm_array(&a, flaw == ARRAY_NOT_POINTER ? 0 : 8, 1, 3);
+    asm_index(&a, flaw == INDEX_NOT_ARRAY ? 16 : 8, flaw == INDEX_PAST_END ? 4 : 1);
+    asm_string(&a, 0, "one");
+    asm_string(&a, 8, "two");
+    asm_pop(&a);
+    if (flaw == POP_TOO_FAR) {
+        asm_pop(&a);
+    }
+    asm_string(&a, flaw == STRING_NOT_POINTER ? 4 : 16, "top");
+    if (flaw == WORDS_ON_POINTER) {
+        asm_words(&a, 12, 1, (word[]) {1});
+    }
+    if (flaw == WORDS_PAST_END) {
+        asm_words(&a, 20, 2, (word[]) {1, 2});
+    }
+    if (flaw == UNKNOWN_ITEM) {
+        asm_pop(&a);
+        a.data.data[a.data.size - 2] = 9 << 4 | 1;
+    }
+
+    asm_export(&a, flaw == BAD_EXPORT ? 4 : 0, entry, 0x12345678, "init");
+    if (flaw == MORE_CODE) {
+        a.ninstructions = 1000;
+    }
+    return asm_finish(&a, "Objects", 24, 0, entry, size);
+}
+
+/// Decode a module, expecting it to fail with an error.
+static void rejected(const byte *image, uptr size, const char *want)
+{
+    const char *error = NULL;
+    Module *module = module_decode(image, size, "test", &error);
+    if (!CHECK(module == NULL && error != NULL && strcmp(error, want) == 0)) {
+        fprintf(stderr, "  wanted \"%s\", got \"%s\"\n", want, module == NULL ? error : "a module");
+    }
+    if (module != NULL) {
+        module_free(module);
+    }
+}
+
+static void test_sound(void)
+{
+    uptr size;
+    byte *image = assemble(SOUND, &size);
+    ModuleLink *ml = link_image(image, size);
+    if (ml == NULL) {
+        return;
+    }
+    CHECK(run_entry(ml, NULL) == EXEC_EXITED);
+    word *words = (word *) ml->mp;
+    CHECK(words[0] == 7 && words[1] == 5);
+    Array *a = *(Array **) (ml->mp + 8);
+    if (CHECK(a != H && a->len == 3)) {
+        String **elements = (String **) a->data;
+        String *one = string_utf8("one", 3);
+        String *two = string_utf8("two", 3);
+        CHECK(elements[0] == H && string_equal(elements[1], one) &&
+              string_equal(elements[2], two));
+        heap_release(one);
+        heap_release(two);
+    }
+    String *top = string_utf8("top", 3);
+    CHECK(string_equal(*(String **) (ml->mp + 16), top));
+    heap_release(top);
+    module_unlink(ml);
+}
+
+static void test_flaws(void)
+{
+    static const struct {
+        Flaw flaw;
+        const char *error;
+    } flaws[] = {
+        {MORE_CODE, "invalid header"},
+        {BRANCH_OUT, "invalid branch target"},
+        {NO_TYPE, "invalid type descriptor"},
+        {BAD_EXPORT, "invalid export"},
+        {INDEX_NOT_ARRAY, "invalid array index"},
+        {INDEX_PAST_END, "invalid array index"},
+        {POP_TOO_FAR, "invalid data item"},
+        {ARRAY_NOT_POINTER, "invalid array item"},
+        {STRING_NOT_POINTER, "invalid string item"},
+        {WORDS_ON_POINTER, "data item out of range"},
+        {WORDS_PAST_END, "data item out of range"},
+        {UNKNOWN_ITEM, "invalid data item"},
+    };
+    for (uptr i = 0; i < sizeof flaws / sizeof *flaws; i++) {
+        uptr size;
+        byte *image = assemble(flaws[i].flaw, &size);
+        rejected(image, size, flaws[i].error);
+        free(image);
+    }
+
+    uptr size;
+    byte *image = assemble(SOUND, &size);
+    image[0] ^= 0x01;
+    rejected(image, size, "bad magic number");
+    free(image);
+}
+
+/// Every part of a file that has been cut short is missed.
+static void test_truncated(void)
+{
+    uptr size;
+    byte *image = assemble(SOUND, &size);
+    for (uptr n = 0; n < size; n++) {
+        // A copy of its own, so that a read past its end shows under a
+        // sanitizer.
+        byte *part = malloc(n + 1);
+        memcpy(part, image, n);
+        const char *error = NULL;
+        Module *module = module_decode(part, n, "test", &error);
+        if (!CHECK(module == NULL && error != NULL)) {
+            fprintf(stderr, "  %zu of %zu bytes decoded\n", (size_t) n, (size_t) size);
+            module_free(module);
+        }
+        free(part);
+    }
+    free(image);
+}
+
+/// Changing bytes of a file never gets past the checks into memory it does
+/// not own. Modules that do decode are not run, as their code may not stop.
+static void test_flipped(void)
+{
+    uptr size;
+    byte *image = assemble(SOUND, &size);
+    byte *copy = malloc(size);
+    static const byte masks[] = {0x01, 0x10, 0x40, 0x80, 0xFF};
+    for (uptr i = 0; i < size; i++) {
+        for (uptr m = 0; m < sizeof masks; m++) {
+            memcpy(copy, image, size);
+            copy[i] ^= masks[m];
+            Module *module = module_decode(copy, size, "test", NULL);
+            if (module != NULL) {
+                ModuleLink *ml = module_link(module, NULL);
+                if (ml != NULL) {
+                    module_unlink(ml);
+                } else {
+                    module_free(module);
+                }
+            }
+        }
+    }
+    free(copy);
+    free(image);
+}
+
+/// A file rewritten between reading a module from it and decoding its code
+/// is not trusted.
+static void test_changed(void)
+{
+    uptr size;
+    byte *image = assemble(SOUND, &size);
+    char path[] = "/tmp/dis_testXXXXXX";
+    int fd = mkstemp(path);
+    bool written = fd >= 0 && write(fd, image, size) == (ssize_t) size;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!CHECK(written)) {
+        free(image);
+        if (fd >= 0) {
+            remove(path);
+        }
+        return;
+    }
+
+    const char *error = NULL;
+    Module *module = module_read(path, &error);
+    if (CHECK(module != NULL)) {
+        FILE *file = fopen(path, "wb");
+        CHECK(file != NULL && fwrite(image, 1, size - 1, file) == size - 1);
+        if (file != NULL) {
+            fclose(file);
+        }
+        CHECK(module_code(module) == NULL && module->code_error != NULL &&
+              strcmp(module->code_error, "object file changed") == 0);
+        module_free(module);
+    }
+
+    // Read again, the file is decoded as it now is.
+    module = module_read(path, &error);
+    CHECK(module == NULL);
+    remove(path);
+    free(image);
+}
+
+void test_objects(void)
+{
+    test_sound();
+    test_flaws();
+    test_truncated();
+    test_flipped();
+    test_changed();
+}
@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../heap.h"
+#include "../instructions.h"
+#include "../str.h"
+#include "../bench/asm.h"
+#include "test.h"
+
+// Strings are checked against arrays of the characters they should hold,
+// which are built alongside them the simple way.
+
+enum { MAX_CHARS = 20000 };
+
+/// A small generator of repeatable pseudo-random numbers.
+static uint32_t state = 54321;
+
+static word random_below(word n)
+{
+    state = state * 1103515245 + 12345;
+    return (word) ((state >> 8) % (uint32_t) n);
+}
+
+/// A character: mostly ASCII, sometimes Latin-1, and now and then wider.
+static Rune random_char(bool narrow)
+{
+    static const Rune wide[] = {0x3A9, 0x20AC, 0xFFFD, 0x1F600, RUNE_MAX};
+    word r = random_below(100);
+    if (narrow || r < 90) {
+        return r < 80 || narrow ? 'a' + (Rune) random_below(26) : 0xC0 + (Rune) random_below(64);
+    }
+    return wide[random_below(sizeof wide / sizeof *wide)];
+}
+
+/// Encode characters in UTF-8.
+static uptr encode(const Rune *chars, word n, char *out)
+{
+    uptr size = 0;
+    for (word i = 0; i < n; i++) {
+        Rune c = chars[i];
+        if (c < 0x80) {
+            out[size++] = (char) c;
+        } else if (c < 0x800) {
+            out[size++] = (char) (0xC0 | c >> 6);
+            out[size++] = (char) (0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out[size++] = (char) (0xE0 | c >> 12);
+            out[size++] = (char) (0x80 | (c >> 6 & 0x3F));
+            out[size++] = (char) (0x80 | (c & 0x3F));
+        } else {
+            out[size++] = (char) (0xF0 | c >> 18);
+            out[size++] = (char) (0x80 | (c >> 12 & 0x3F));
+            out[size++] = (char) (0x80 | (c >> 6 & 0x3F));
+            out[size++] = (char) (0x80 | (c & 0x3F));
+        }
+    }
+    return size;
+}
+
+/// Make a flat string of characters.
+static String *make(const Rune *chars, word n)
+{
+    char *utf8 = malloc(4 * (uptr) n + 1);
+    String *s = string_utf8(utf8, encode(chars, n, utf8));
+    free(utf8);
+    return s;
+}
+
+/// Check that a string holds the characters it should, and that it is equal
+/// to, compares and hashes the same as a flat string made from them.
+static bool holds(String *s, const Rune *chars, word n)
+{
+    if (!CHECK((s == H ? 0 : s->len) == n)) {
+        return false;
+    }
+    if (n == 0) {
+        return true;
+    }
+    String *flat = string_flat(s);
+    bool same = true;
+    for (word i = 0; i < n && same; i++) {
+        same = string_char(flat, i) == chars[i];
+    }
+    if (!CHECK(same)) {
+        return false;
+    }
+
+    char *want = malloc(4 * (uptr) n + 1);
+    uptr want_size = encode(chars, n, want);
+    uptr size;
+    char *got = string_to_utf8(s, &size);
+    CHECK(size == want_size && memcmp(got, want, size) == 0 && got[size] == 0);
+    CHECK(string_encode(s, NULL) == want_size);
+    free(got);
+
+    String *copy = string_utf8(want, want_size);
+    free(want);
+    CHECK(string_equal(s, copy) && string_equal(copy, s));
+    CHECK(string_compare(s, copy) == 0 && string_hash(s) == string_hash(copy));
+    heap_release(copy);
+    return true;
+}
+
+static Rune chars[2 * MAX_CHARS];
+static Rune piece[MAX_CHARS];
+
+/// Build a long string by appending pieces of it, some while something else
+/// refers to the string, as ropes are built.
+static void test_append(void)
+{
+    String *s = H;
+    word n = 0;
+    bool narrow = true;
+    while (n < MAX_CHARS - 600) {
+        word m = random_below(10) == 0 ? 300 + random_below(300) : random_below(40);
+        for (word i = 0; i < m; i++) {
+            piece[i] = random_char(narrow);
+        }
+        // The first few thousand characters are Latin-1, so that a narrow
+        // rope is widened by what is appended to it.
+        narrow = n < 3000;
+        String *p = make(piece, m);
+
+        String *alias = H;
+        if (random_below(4) == 0) {
+            alias = s;
+            heap_retain(alias);
+        }
+        String *t = string_append(s, p);
+        if (!CHECK(t != NULL)) {
+            heap_release(alias);
+            heap_release(p);
+            break;
+        }
+        s = t;
+        memcpy(chars + n, piece, (uptr) m * sizeof(Rune));
+        if (alias != H) {
+            // The string appended to is unchanged for everything else that
+            // refers to it.
+            CHECK(holds(alias, chars, n));
+            heap_release(alias);
+        }
+        n += m;
+        heap_release(p);
+        if (random_below(8) == 0) {
+            CHECK(holds(s, chars, n));
+        }
+    }
+    CHECK(s != H && s->rope);
+    CHECK(holds(s, chars, n));
+
+    // Strings that differ in one character compare as that character does,
+    // wherever it is in the rope.
+    for (int round = 0; round < 20; round++) {
+        word i = random_below(n);
+        Rune saved = chars[i];
+        if (saved == RUNE_MAX) {
+            continue;
+        }
+        chars[i] = saved + 1;
+        String *t = make(chars, n);
+        CHECK(string_compare(s, t) < 0 && string_compare(t, s) > 0);
+        CHECK(!string_equal(s, t));
+        heap_release(t);
+        chars[i] = saved;
+    }
+    String *prefix = make(chars, n - 1);
+    CHECK(string_compare(prefix, s) < 0 && string_compare(s, prefix) > 0);
+    heap_release(prefix);
+
+    // Concatenation leaves both halves as they were.
+    String *t = string_concat(s, s);
+    memcpy(chars + n, chars, (uptr) n * sizeof(Rune));
+    CHECK(t != NULL && holds(t, chars, 2 * n));
+    CHECK(holds(s, chars, n));
+    heap_release(t);
+    heap_release(s);
+}
+
+/// Slice flat strings and ropes, and slices of them.
+static void test_slice(void)
+{
+    word n = 3000;
+    String *s = H;
+    for (word i = 0; i < n; i += 100) {
+        for (word j = 0; j < 100; j++) {
+            chars[i + j] = random_char(i < 1500);
+        }
+        String *p = make(chars + i, 100);
+        s = string_append(s, p);
+        heap_release(p);
+    }
+    CHECK(s->rope);
+    String *flat = make(chars, n);
+
+    for (int round = 0; round < 200; round++) {
+        word start = random_below(n + 1);
+        word end = start + random_below(n - start + 1);
+        String *from = round % 2 ? s : flat;
+        String *slice = string_slice(from, start, end);
+        if (!CHECK(slice != NULL)) {
+            continue;
+        }
+        CHECK(holds(slice, chars + start, end - start));
+        word inner_start = start + random_below(end - start + 1);
+        word inner_end = inner_start + random_below(end - inner_start + 1);
+        String *inner = string_slice(slice, inner_start - start, inner_end - start);
+        if (CHECK(inner != NULL)) {
+            CHECK(holds(inner, chars + inner_start, inner_end - inner_start));
+            // Appending to a slice does not write over what follows it.
+            String *x = make((Rune[]) {'x'}, 1);
+            inner = string_append(inner, x);
+            heap_release(x);
+            CHECK(holds(slice, chars + start, end - start));
+            heap_release(inner);
+        }
+        heap_release(slice);
+    }
+    CHECK(holds(s, chars, n) && holds(flat, chars, n));
+
+    CHECK(string_slice(flat, -1, 1) == NULL);
+    CHECK(string_slice(flat, 2, 1) == NULL);
+    CHECK(string_slice(flat, 0, n + 1) == NULL);
+    CHECK(string_slice(s, n, n + 1) == NULL);
+    heap_release(s);
+    heap_release(flat);
+}
+
+/// Set and append characters one at a time.
+static void test_insert(void)
+{
+    String *s = H;
+    word n = 0;
+    for (; n < 1000; n++) {
+        chars[n] = random_char(n < 500);
+        String *alias = H;
+        if (random_below(10) == 0) {
+            alias = s;
+            heap_retain(alias);
+        }
+        s = string_insert(s, n, chars[n]);
+        if (!CHECK(s != NULL)) {
+            heap_release(alias);
+            return;
+        }
+        if (alias != H) {
+            CHECK(holds(alias, chars, n));
+            heap_release(alias);
+        }
+    }
+    CHECK(holds(s, chars, n));
+    for (int round = 0; round < 200; round++) {
+        word i = random_below(n);
+        Rune old = chars[i];
+        chars[i] = random_char(false);
+        String *alias = H;
+        if (round % 3 == 0) {
+            alias = s;
+            heap_retain(alias);
+        }
+        s = string_insert(s, i, chars[i]);
+        if (!CHECK(s != NULL)) {
+            heap_release(alias);
+            return;
+        }
+        if (alias != H) {
+            CHECK(alias != s && string_char(alias, i) == old);
+            heap_release(alias);
+        }
+    }
+    CHECK(holds(s, chars, n));
+    heap_release(s);
+}
+
+/// Strings are never made longer than `INT32_MAX` characters.
+static void test_overflow(void)
+{
+    // Strings that long are never made here: their lengths are only read.
+    String near = {.len = INT32_MAX - 1, .data = "", .capacity = 0};
+    String full = {.len = INT32_MAX, .data = "", .capacity = 0};
+    String *two = string_utf8("ab", 2);
+
+    CHECK(string_concat(&near, two) == NULL);
+    CHECK(string_concat(two, &near) == NULL);
+    CHECK(string_append(&near, two) == NULL);
+    CHECK(string_append(two, &near) == NULL);
+    CHECK(string_insert(&full, INT32_MAX, 'a') == NULL);
+
+    // A failed append leaves the caller's reference alone.
+    CHECK(holds(two, (Rune[]) {'a', 'b'}, 2));
+
+    // `addc` stops the thread rather than making the string: 0 `near`, 8
+    // `two`, 16 the result.
+    Assembler a = {0};
+    word entry = asm_type(&a, 48, 0, NULL);
+    asm_inst(&a, IN_ADDC, MP(8), MP(0), MP(16));
+    asm_inst(&a, IN_RET, NONE, NONE, NONE);
+    uptr size;
+    byte *image = asm_finish(&a, "Addc", 24, 0, entry, &size);
+    ModuleLink *ml = link_image(image, size);
+    if (ml != NULL) {
+        String **mp = (String **) ml->mp;
+        mp[0] = &near;
+        mp[1] = two;
+        const char *error;
+        CHECK(run_entry(ml, &error) == EXEC_ERROR && strcmp(error, "string too long") == 0);
+        CHECK(mp[2] == H);
+        mp[0] = H;
+        mp[1] = H;
+        module_unlink(ml);
+    }
+    heap_release(two);
+}
+
+void test_strings(void)
+{
+    test_append();
+    test_slice();
+    test_insert();
+    test_overflow();
+}
@@ -0,0 +1,105 @@
+// Behaviour tests for the virtual machine.
+//
+// Usage: dis_test [--list] [suite...]
+//
+// With no suites named every one is run. Each check that fails is printed
+// with where it is, and the exit status is 1 if any failed. CTest runs each
+// suite as a test of its own.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+/// The number of checks that have failed.
+static int failures;
+
+bool check(bool passed, const char *text, const char *file, int line)
+{
+    if (!passed) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+        failures++;
+    }
+    return passed;
+}
+
+ModuleLink *link_image(byte *image, uptr size)
+{
+    const char *error = NULL;
+    Module *module = module_decode(image, size, "test", &error);
+    free(image);
+    if (module == NULL) {
+        fprintf(stderr, "cannot decode test module: %s\n", error);
+        failures++;
+        return NULL;
+    }
+    ModuleLink *ml = module_link(module, NULL);
+    if (ml == NULL) {
+        fprintf(stderr, "cannot link test module\n");
+        module_free(module);
+        failures++;
+    }
+    return ml;
+}
+
+ExecutionStatus run_entry(ModuleLink *ml, const char **error)
+{
+    ExecutionContext context;
+    if (!execution_init(&context, ml)) {
+        if (error != NULL) {
+            *error = "cannot start thread";
+        }
+        return EXEC_ERROR;
+    }
+    ExecutionStatus status = execute(&context);
+    if (error != NULL) {
+        *error = status == EXEC_ERROR ? context.error : NULL;
+    }
+    execution_free(&context);
+    return status;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} suites[] = {
+    {"arith", test_arith},
+    {"cases", test_cases},
+    {"strings", test_strings},
+    {"objects", test_objects},
+};
+
+int main(int argc, char **argv)
+{
+    uptr n = sizeof suites / sizeof *suites;
+    for (int j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "--list") == 0) {
+            for (uptr i = 0; i < n; i++) {
+                printf("%s\n", suites[i].name);
+            }
+            return 0;
+        }
+        bool known = false;
+        for (uptr i = 0; i < n; i++) {
+            known |= strcmp(argv[j], suites[i].name) == 0;
+        }
+        if (!known) {
+            fprintf(stderr, "usage: %s [--list] [suite...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (uptr i = 0; i < n; i++) {
+        bool selected = argc == 1;
+        for (int j = 1; j < argc; j++) {
+            selected |= strcmp(argv[j], suites[i].name) == 0;
+        }
+        if (selected) {
+            int before = failures;
+            suites[i].run();
+            printf("%s: %s\n", suites[i].name, failures == before ? "ok" : "FAILED");
+            fflush(stdout);
+        }
+    }
+    return failures > 0;
+}
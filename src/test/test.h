@@ -0,0 +1,53 @@
+#ifndef DIS_TEST_TEST_H
+#define DIS_TEST_TEST_H
+
+// What the tests share: checking what they expect, and running
+// hand-assembled modules.
+
+#include <stdio.h>
+
+#include "../module.h"
+
+/// Check that a condition holds, reporting where it does not.
+///
+/// \param condition The condition.
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+/// Count a check, reporting it if it failed. Use `CHECK()`.
+///
+/// \param passed Whether the check passed.
+/// \param text The condition checked.
+/// \param file The file of the check.
+/// \param line The line of the check.
+/// \return `passed`.
+bool check(bool passed, const char *text, const char *file, int line);
+
+/// Decode a hand-assembled module and link to it.
+///
+/// \param image The object file, which is freed.
+/// \param size The size of the object file.
+/// \return The module link, or `NULL`, having reported why, if the module
+/// cannot be decoded.
+ModuleLink *link_image(byte *image, uptr size);
+
+/// Run a linked module's entry point to completion in the calling thread.
+///
+/// \param ml The module link.
+/// \param error Location to store the error the thread stopped with in, or
+/// `NULL` if it exited. May be `NULL`.
+/// \return The status the thread stopped with.
+ExecutionStatus run_entry(ModuleLink *ml, const char **error);
+
+/// Compare compiled word, big and real arithmetic with the interpreter's.
+void test_arith(void);
+
+/// Compare compiled `case` and `casec` tables with the binary search.
+void test_cases(void);
+
+/// Check ropes, slices, appending and the limit on the length of strings.
+void test_strings(void);
+
+/// Check that malformed object files are rejected rather than trusted.
+void test_objects(void);
+
+#endif //DIS_TEST_TEST_H
@@ -1,6 +1,9 @@
 #ifndef DIS_TYPES_H
 #define DIS_TYPES_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint8_t byte;
@@ -10,6 +13,12 @@ typedef double real;
 typedef void *pointer;
 typedef uintptr_t uptr;
 
+/// The nil reference, which Dis calls `H`. It is the null pointer, so memory
+/// that has been zero-filled holds nil in every pointer slot.
+#define H NULL
+
+typedef struct Channel Channel;
+
 typedef struct Alt {
     int nsend;
     int nrecv;
@@ -19,7 +28,52 @@ typedef struct Alt {
     } entry[];
 } Alt;
 
-typedef struct Frame Frame;
+/// Describes the layout of a block of memory - a frame, module data or a heap
+/// object - so that the pointers inside it can be found.
+typedef struct TypeDescriptor {
+    /// Size of the described memory in bytes.
+    word size;
+    /// The number of bytes in `map`.
+    word np;
+    /// The number of heap objects of this type, plus one for the module that
+    /// defines it. The descriptor is freed when the count drops to 0.
+    _Atomic word references;
+    /// Pointer map. Bit `i`, counting from the most significant bit of the
+    /// first byte, is set if the `i`th pointer-sized slot holds a pointer.
+    byte map[];
+} TypeDescriptor;
+
+/// An array, as created by `newa` or sliced by `slicea`.
+typedef struct Array {
+    /// The number of elements.
+    word len;
+    /// Type of the elements.
+    TypeDescriptor *t;
+    /// The array this one is a slice of, or `H`.
+    struct Array *root;
+    /// The first element.
+    byte *data;
+} Array;
+
+/// A cell of a list, as created by the `cons` instructions.
+typedef struct List {
+    /// The rest of the list, or `H`.
+    struct List *tail;
+    /// The head of the list.
+    _Alignas(8) byte data[];
+} List;
+
+/// The header of every stack frame. The frame's locals follow it.
+typedef struct Frame {
+    /// Link register: the instruction to return to.
+    uptr lr;
+    /// The caller's frame, or `NULL` in the outermost frame of a thread.
+    struct Frame *fp;
+    /// The caller's module link after an inter-module call, otherwise `NULL`.
+    struct ModuleLink *ml;
+    /// The type descriptor this frame was created from.
+    TypeDescriptor *t;
+} Frame;
 
 /// A table in data scape that lists the functions imported by the current
 /// module from the module to be loaded.
@@ -38,4 +92,8 @@ typedef struct LinkageDescriptor {
 
 typedef struct Module Module;
 
+typedef struct ModuleLink ModuleLink;
+
+typedef struct String String;
+
 #endif //DIS_TYPES_H